@@ -2,8 +2,34 @@
 #include <stdlib.h>
 #include <getopt.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "util_debug.h"
 #include "util_v4l2.h"
+#include "util_trace.h"
+#include "util_shm.h"
+#include "util_frame_view.h"
+#include "util_motion.h"
+#include "util_recorder.h"
+#include "util_time.h"
+#include "util_rt.h"
+#include "util_stats.h"
+#include "util_format.h"
+#include "util_m2m.h"
+#include "util_ctrl.h"
+#include "util_wcmem.h"
+#include "util_dmabuf.h"
+
+#define MAX_BATCH   16
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
 
 
 int
@@ -11,32 +37,354 @@ dump_to_img (char *lpFName, int nW, int nH, unsigned int fmt, void *lpBuf)
 {
     FILE *fp;
     char strFName[128];
-    int bpp = 1;
+    const format_info_t *fi = format_from_v4l2 (fmt);
+    size_t size;
 
-    switch (fmt)
-    {
-    default:
-    case v4l2_fourcc('G', 'R', 'E', 'Y'):
-        sprintf (strFName, "%s_I8_SIZE%dx%d.img", lpFName, nW, nH);
-        bpp = 1;
-        break;
-    case v4l2_fourcc('Y', 'U', 'Y', 'V'):
-        sprintf (strFName, "%s_YUNV422_SIZE%dx%d.img", lpFName, nW, nH);
-        bpp = 2;
-        break;
-    }
+    TRACE_BEGIN ("dump_to_img");
+
+    if (fi == NULL || fi->bpp == 0)
+        fi = format_from_v4l2 (V4L2_PIX_FMT_GREY);
+
+    sprintf (strFName, "%s_%s_SIZE%dx%d.img", lpFName, fi->tag, nW, nH);
+    size = format_frame_size (fi, nW, nH);
 
     fp = fopen (strFName, "wb");
     DBG_ASSERT (fp, "fopen failed");
 
-    fwrite (lpBuf, bpp, nW * nH, fp);
+    fwrite (lpBuf, 1, size, fp);
     fclose (fp);
 
     fprintf (stderr, "%s\n", strFName);
 
+    TRACE_END ("dump_to_img");
+    return size;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  recording: one .img file per frame, or segment files (util_recorder),
+ *  stopped once the frame / byte budget is used up.
+ * ------------------------------------------------------------------------ */
+typedef struct _record_ctx_t
+{
+    capture_dev_t   *cap_dev;
+    recorder_t      *rec;
+    int             w, h;
+    unsigned int    fmt;
+    int             stride;         /* bytes per row of plane 0 */
+    int             size;           /* bytes per frame */
+
+    int             max_frames;     /* 0: unlimited */
+    uint64_t        max_bytes;
+    int             frames;
+    uint64_t        bytes;
+} record_ctx_t;
+
+static int
+record_limit_reached (record_ctx_t *ctx)
+{
+    if (ctx->max_frames && ctx->frames >= ctx->max_frames)
+        return 1;
+    if (ctx->max_bytes && ctx->bytes >= ctx->max_bytes)
+        return 1;
     return 0;
 }
 
+static int
+record_frame (record_ctx_t *ctx, int id, uint64_t ts_ns, void *img)
+{
+    char strbuf[128];
+    int written;
+
+    if (record_limit_reached (ctx))
+        return -1;
+
+    if (ctx->rec)
+    {
+        written = recorder_write (ctx->rec, img, ctx->size, id, ts_ns);
+        if (written < 0)
+            return -1;
+    }
+    else
+    {
+        sprintf (strbuf, "cap_%05d", id);
+        written = dump_to_img (strbuf, ctx->w, ctx->h, ctx->fmt, img);
+    }
+    metrics_add_written (ctx->cap_dev->metrics, written);
+
+    ctx->frames ++;
+    ctx->bytes += written;
+    return 0;
+}
+
+
+/* hardware encoder: hand over the capture buffer itself (zero copy).
+ * the encoder holds a reference until reclaim_encoder() */
+static int
+encode_frame (record_ctx_t *ctx, m2m_enc_t *enc, capture_frame_t *frame)
+{
+    if (record_limit_reached (ctx))
+        return -1;
+
+    /* the CPU is done with it before the encoder reads it */
+    v4l2_end_cpu_access (ctx->cap_dev, frame);
+    v4l2_ref_capture_frame (frame);
+    if (m2m_enc_queue (enc, frame) < 0)
+    {
+        v4l2_unref_capture_frame (ctx->cap_dev, frame);
+        return -1;
+    }
+    return 0;
+}
+
+/* drop the references of the capture buffers the encoder is done with */
+static void
+reclaim_encoder (record_ctx_t *ctx, m2m_enc_t *enc)
+{
+    capture_frame_t *done[MAX_BATCH];
+    int num, i;
+
+    while ((num = m2m_enc_reclaim (enc, done, MAX_BATCH)) > 0)
+    {
+        for (i = 0; i < num; i ++)
+            v4l2_unref_capture_frame (ctx->cap_dev, done[i]);
+    }
+}
+
+/*
+ *  store the coded frames that are ready, waiting up to timeout_ms for
+ *  the first. returns the number of frames stored, or -1 on error.
+ */
+static int
+drain_encoder (record_ctx_t *ctx, m2m_enc_t *enc, int timeout_ms)
+{
+    m2m_bitstream_t *bs;
+    int num = 0, written;
+
+    while ((bs = m2m_enc_dequeue (enc, timeout_ms)) != NULL)
+    {
+        written = recorder_write_stream (ctx->rec, bs->vaddr, bs->bytesused, bs->sequence,
+                                         bs->ts_ns, bs->key);
+        m2m_enc_release (enc, bs);
+        if (written < 0)
+            return -1;
+
+        metrics_add_written (ctx->cap_dev->metrics, written);
+        ctx->frames ++;
+        ctx->bytes += written;
+        num ++;
+        timeout_ms = 0;
+    }
+    return num;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  loopback: re-publish the (cropped / scaled) frames on a V4L2 output
+ *  device, so tools that only read /dev/videoN share this capture.
+ * ------------------------------------------------------------------------ */
+/*
+ *  rows: of all planes together, at src_stride (h * 3 / 2 for NV12).
+ *  planes with a narrower stride (I420 chroma) need matching strides.
+ */
+static void
+loopback_frame (capture_dev_t *out_dev, const void *img, int src_stride, int row_bytes, int rows,
+                struct timeval ts)
+{
+    capture_frame_t *out_frame;
+    int dst_stride = out_dev->stream.format.fmt.pix.bytesperline;
+    int y;
+
+    /* no free buffer: the readers are behind, skip rather than stall capture */
+    out_frame = v4l2_acquire_output_frame (out_dev, 0);
+    if (out_frame == NULL)
+        return;
+
+    TRACE_BEGIN ("loopback_frame");
+    if (src_stride == dst_stride)
+        memcpy (out_frame->vaddr, img, (size_t)dst_stride * rows);
+    else
+    {
+        for (y = 0; y < rows; y ++)
+            memcpy ((char *)out_frame->vaddr + (size_t)y * dst_stride,
+                    (const char *)img + (size_t)y * src_stride, row_bytes);
+    }
+    TRACE_END ("loopback_frame");
+
+    v4l2_queue_output_frame (out_dev, out_frame, out_dev->stream.format.fmt.pix.sizeimage, ts);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  pre-roll ring: recent frames kept in memory while there is no motion.
+ * ------------------------------------------------------------------------ */
+typedef struct _preroll_t
+{
+    int     num;
+    int     head;
+    int     count;
+    int     size;
+    char    *buf;
+    int     *id;
+    uint64_t *ts;
+} preroll_t;
+
+static void
+preroll_init (preroll_t *ring, int num, int size)
+{
+    ring->num   = num;
+    ring->head  = 0;
+    ring->count = 0;
+    ring->size  = size;
+    ring->buf   = (char *)malloc ((size_t)num * size);
+    ring->id    = (int *)malloc (sizeof (int) * num);
+    ring->ts    = (uint64_t *)malloc (sizeof (uint64_t) * num);
+    DBG_ASSERT (ring->buf && ring->id && ring->ts, "alloc failed");
+}
+
+static void
+preroll_push (preroll_t *ring, int id, uint64_t ts_ns, void *img)
+{
+    int pos;
+
+    if (ring->num == 0)
+        return;
+
+    pos = (ring->head + ring->count) % ring->num;
+    if (ring->count == ring->num)
+        ring->head = (ring->head + 1) % ring->num;     /* overwrite the oldest */
+    else
+        ring->count ++;
+
+    memcpy (ring->buf + (size_t)pos * ring->size, img, ring->size);
+    ring->id[pos] = id;
+    ring->ts[pos] = ts_ns;
+}
+
+static void
+preroll_flush (preroll_t *ring, record_ctx_t *ctx)
+{
+    while (ring->count > 0)
+    {
+        record_frame (ctx, ring->id[ring->head], ring->ts[ring->head],
+                      ring->buf + (size_t)ring->head * ring->size);
+        ring->head = (ring->head + 1) % ring->num;
+        ring->count --;
+    }
+}
+
+/* ------------------------------------------------------------------------ *
+ *  auto exposure: one control steered until the mean luma hits target
+ * ------------------------------------------------------------------------ */
+typedef struct _auto_exposure_t
+{
+    capture_dev_t   *cap_dev;
+    ctrl_info_t     info;
+    int64_t         value;
+    float           target;
+    uint32_t        tag;        /* of the last batch sent */
+    int             wait;       /* no requests: frames until it has surely landed */
+} auto_exposure_t;
+
+static void
+auto_exposure_update (auto_exposure_t *ae, capture_frame_t *frame)
+{
+    ctrl_batch_t batch;
+    int64_t value;
+    int ret;
+
+    /* judge a setting only by frames captured with it */
+    if (ae->cap_dev->requests)
+    {
+        if (frame->ctrl_tag != ae->tag)
+            return;
+    }
+    else if (ae->wait > 0)
+    {
+        ae->wait --;
+        return;
+    }
+
+    float err = ae->target - frame->stats->mean;
+    if (err > -4.0f && err < 4.0f)
+        return;
+
+    value = ae->value + (int64_t)(err / 255.0f * (ae->info.maximum - ae->info.minimum) / 2);
+    ctrl_batch_init (&batch, ae->tag + 1);
+    if (ctrl_batch_add (&batch, &ae->info, value) < 0)
+        return;
+
+    /* clamped and snapped to the step by the batch */
+    value = ae->info.type == V4L2_CTRL_TYPE_INTEGER64 ? batch.ctrl[0].value64 : batch.ctrl[0].value;
+    if (value == ae->value)
+        return;
+
+    ret = ctrl_request_set (ae->cap_dev, &batch);
+    if (ret < 0)
+        return;
+
+    ae->tag   = batch.tag;
+    ae->value = value;
+    if (ret == 1)
+        ae->wait = ae->cap_dev->stream.bufcount + 1;
+}
+
+/* collect the stats of the frame submitted last time, if any, and drop
+ * the reference the stripe pool held on it */
+static void
+finish_stats (capture_dev_t *cap_dev, stats_ctx_t *ctx, capture_frame_t **pending, int cnt,
+              auto_exposure_t *ae)
+{
+    capture_frame_t *frame = *pending;
+
+    if (frame == NULL)
+        return;
+
+    frame_stats_wait (ctx);
+    frame->stats->sequence = frame->v4l_buf.sequence;
+    if (cnt % 30 == 0)
+        fprintf (stderr, "stats: seq %u mean %.1f var %.1f sharpness %.1f\n",
+                 frame->stats->sequence, frame->stats->mean,
+                 frame->stats->variance, frame->stats->sharpness);
+    if (ae)
+        auto_exposure_update (ae, frame);
+    *pending = NULL;
+    v4l2_unref_capture_frame (cap_dev, frame);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  shm subscribers: they hold a reference on every frame sent to them
+ * ------------------------------------------------------------------------ */
+#define SHARE_WAIT  0   /* slow subscribers hold capture back   */
+#define SHARE_DROP  1   /* slow subscribers miss frames instead */
+
+static void
+shm_release_frame (void *arg, capture_frame_t *frame)
+{
+    v4l2_unref_capture_frame ((capture_dev_t *)arg, frame);
+}
+
+/*
+ *  room to send one more frame and still leave the driver two buffers.
+ *  wait: until the subscribers let go (or we quit). drop: returns 0 at
+ *  once, and the frame is not sent.
+ */
+static int
+shm_make_room (shm_pub_t *pub, int policy)
+{
+    int max_inflight = pub->bufcount - 3;
+
+    if (max_inflight < 0)
+        max_inflight = 0;
+
+    do
+        shm_pub_reclaim_wait (pub, max_inflight, policy == SHARE_WAIT ? 100 : 0);
+    while (pub->inflight_num > max_inflight && policy == SHARE_WAIT && !s_quit);
+
+    return pub->inflight_num <= max_inflight;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -44,46 +392,545 @@ int main(int argc, char *argv[])
     int cap_devid = -1;
     int cap_w, cap_h;
     unsigned int cap_fmt;
+    const format_info_t *cap_fi;
+    char *trace_fname = NULL;
+    char *metrics_addr = NULL;
+    char *publish_path = NULL;
+    shm_pub_t *shm_pub = NULL;
+    capture_opt_t cap_opt = {0};
+    frame_view_spec_t view_spec = {0};
+    frame_view_t *view = NULL;
+    int out_w, out_h;
+    motion_detector_t *motion = NULL;
+    float motion_level = 0;
+    int preroll_num  = 15;
+    int postroll_num = 30;
+    int postroll_left = 0;
+    preroll_t preroll = {0};
+    record_ctx_t rec_ctx = {0};
+    recorder_opt_t rec_opt = {0};
+    int use_recorder = 0;
+    int duration_sec = 0;
+    uint64_t start_ns;
+    int frame_cnt = 0;
+    int latest = 0;
+    int do_stats = 0;
+    stripe_pool_t *stripe_pool = NULL;
+    stats_ctx_t *stats_ctx = NULL;
+    capture_frame_t *stats_pending = NULL;
+    int stats_cnt = 0;
+    int share_policy = SHARE_WAIT;
+    m2m_enc_t *enc = NULL;
+    unsigned int enc_codec = 0;
+    int enc_devid = -1;
+    int loop_devid = -1;
+    capture_dev_t *loop_dev = NULL;
+    char *ctrl_list = NULL;
+    char *ae_spec = NULL;
+    auto_exposure_t ae_ctx = {0};
+    auto_exposure_t *ae = NULL;
+    uint8_t *bounce[2] = {NULL, NULL};
+    size_t bounce_size = 0;
+    int bounce_idx = 0;
+    metrics_hist_t age_hist = {{0}};
+    int i;
+    char *capture_cpus = NULL;
+    int fifo_prio = 0;
+    int lock_mem  = 0;
+
+    int ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+
+    rec_opt.workers = ncpu - 1;
 
     const struct option long_options[] = {
         {"devid",  required_argument, NULL, 'd'},
+        {"trace",  required_argument, NULL, 't'},
+        {"metrics",required_argument, NULL, 'm'},
+        {"publish",required_argument, NULL, 'p'},
+        {"policy", required_argument, NULL, 'Y'},
+        {"crop",   required_argument, NULL, 'c'},
+        {"scale",  required_argument, NULL, 's'},
+        {"motion", required_argument, NULL, 'M'},
+        {"preroll",  required_argument, NULL, 'P'},
+        {"postroll", required_argument, NULL, 'Q'},
+        {"frames",   required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'D'},
+        {"max-mb",   required_argument, NULL, 'B'},
+        {"output",   required_argument, NULL, 'o'},
+        {"segment-sec", required_argument, NULL, 'S'},
+        {"segment-mb",  required_argument, NULL, 'Z'},
+        {"quota-mb",    required_argument, NULL, 'q'},
+        {"compress",    required_argument, NULL, 'z'},
+        {"workers",     required_argument, NULL, 'w'},
+        {"userptr",     no_argument,       NULL, 'U'},
+        {"hugepage",    no_argument,       NULL, 'H'},
+        {"cpu",         required_argument, NULL, 'C'},
+        {"writer-cpus", required_argument, NULL, 'W'},
+        {"fifo",        required_argument, NULL, 'F'},
+        {"mlock",       no_argument,       NULL, 'L'},
+        {"latest",      no_argument,       NULL, 'l'},
+        {"stats",       no_argument,       NULL, 'A'},
+        {"encode",      required_argument, NULL, 'E'},
+        {"encoder",     required_argument, NULL, 'e'},
+        {"loopback",    required_argument, NULL, 'O'},
+        {"media",       optional_argument, NULL, 'G'},
+        {"ctrl",        required_argument, NULL, 'K'},
+        {"ae",          required_argument, NULL, 'X'},
+        {"dmabuf",      no_argument,       NULL, 'b'},
+        {"cached",      no_argument,       NULL, 'k'},
         {0, 0, 0, 0},
     };
 
     int c, option_index;
-    while ((c = getopt_long (argc, argv, "d:",
+    while ((c = getopt_long (argc, argv, "d:t:m:p:Y:c:s:M:P:Q:n:D:B:o:S:Z:q:z:w:UHC:W:F:LlAE:e:O:G::K:X:bk",
                              long_options, &option_index)) != -1)
     {
         switch (c)
         {
         case 'd': cap_devid  = atoi (optarg); break;
+        case 't': trace_fname = optarg; break;
+        case 'm': metrics_addr = optarg; break;
+        case 'p': publish_path = optarg; break;
+        case 'c':
+            sscanf (optarg, "%d,%d,%u,%u", &cap_opt.crop.left, &cap_opt.crop.top,
+                                           &cap_opt.crop.width, &cap_opt.crop.height);
+            if (cap_opt.crop.left < 0 || cap_opt.crop.top < 0)
+            {
+                fprintf (stderr, "ERR: --crop x,y must not be negative\n");
+                return -1;
+            }
+            break;
+        case 's':
+            sscanf (optarg, "%dx%d", &view_spec.out_w, &view_spec.out_h);
+            break;
+        case 'M': motion_level = atof (optarg); break;
+        case 'P': preroll_num  = atoi (optarg); break;
+        case 'Y':
+            /* wait: subscribers hold capture back, drop: they miss frames */
+            share_policy = strcmp (optarg, "drop") == 0 ? SHARE_DROP : SHARE_WAIT;
+            break;
+        case 'Q': postroll_num = atoi (optarg); break;
+        case 'n': rec_ctx.max_frames = atoi (optarg); break;
+        case 'D': duration_sec       = atoi (optarg); break;
+        case 'B': rec_ctx.max_bytes  = strtoull (optarg, NULL, 10) << 20; break;
+        case 'o': rec_opt.prefix      = optarg; use_recorder = 1; break;
+        case 'S': rec_opt.seg_sec     = atoi (optarg); use_recorder = 1; break;
+        case 'Z': rec_opt.seg_bytes   = strtoull (optarg, NULL, 10) << 20; use_recorder = 1; break;
+        case 'q': rec_opt.quota_bytes = strtoull (optarg, NULL, 10) << 20; use_recorder = 1; break;
+        case 'z':
+            /* intra: every frame standalone, delta: against the previous frame */
+            rec_opt.codec  = CODEC_PACK;
+            rec_opt.keyint = strcmp (optarg, "intra") == 0 ? 1 : 30;
+            use_recorder = 1;
+            break;
+        case 'w': rec_opt.workers = atoi (optarg); break;
+        case 'U': cap_opt.memtype = V4L2_MEMORY_USERPTR; break;
+        case 'b': cap_opt.memtype = V4L2_MEMORY_DMABUF; break;
+        case 'k': cap_opt.cached  = 1; break;
+        case 'C': capture_cpus        = optarg; break;
+        case 'W': rec_opt.worker_cpus = optarg; break;
+        case 'F': fifo_prio           = atoi (optarg); break;
+        case 'L': lock_mem = 1; cap_opt.prefault = 1; break;
+        case 'l': latest = 1; break;
+        case 'A': do_stats = 1; break;
+        case 'E':
+            /* h264, jpeg or fwht (vicodec) on a V4L2 M2M encoder */
+            if      (strcmp (optarg, "h264") == 0) enc_codec = V4L2_PIX_FMT_H264;
+            else if (strcmp (optarg, "jpeg") == 0) enc_codec = V4L2_PIX_FMT_JPEG;
+            else if (strcmp (optarg, "fwht") == 0) enc_codec = V4L2_PIX_FMT_FWHT;
+            else
+            {
+                fprintf (stderr, "unknown codec: %s\n", optarg);
+                return -1;
+            }
+            use_recorder = 1;
+            break;
+        case 'e': enc_devid = atoi (optarg); break;
+        case 'O': loop_devid = atoi (optarg); break;
+        case 'G':
+            /* --media[=cache file] */
+            cap_opt.media       = 1;
+            cap_opt.media_cache = optarg ? optarg : "/var/tmp/v4l2_app_media.cache";
+            break;
+        case 'K': ctrl_list = optarg; break;
+        case 'X':
+            /* --ae control[:target mean] */
+            ae_spec  = optarg;
+            do_stats = 1;
+            break;
+        case 'H':
+            cap_opt.memtype    = V4L2_MEMORY_USERPTR;
+            cap_opt.pool_flags = MEMPOOL_HUGEPAGE;
+            break;
         case '?':
             return -1;
         }
     }
 
-    cap_dev = v4l2_open_capture_device (cap_devid);
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    if (trace_fname)
+        trace_enable (1);
+
+    /* lock before any buffer exists, so they are faulted in locked */
+    if (lock_mem)
+        rt_lock_memory ();
+
+    cap_dev = v4l2_open_capture_device_ex (cap_devid, &cap_opt);
     DBG_ASSERT (cap_dev, "failed to open V4L\n");
 
     v4l2_get_capture_wh (cap_dev, &cap_w, &cap_h);
     v4l2_get_capture_pixelformat (cap_dev, &cap_fmt);
 
+    /* one atomic VIDIOC_S_EXT_CTRLS instead of a v4l2-ctl per control */
+    if (ctrl_list)
+    {
+        ctrl_batch_t batch;
+
+        ctrl_batch_init (&batch, 0);
+        DBG_ASSERT (ctrl_batch_parse (cap_dev->v4l_fd, &batch, ctrl_list) == 0 &&
+                    ctrl_batch_apply (cap_dev->v4l_fd, &batch) == 0, "failed to set %s\n", ctrl_list);
+    }
+
+    if (ae_spec)
+    {
+        char name[64];
+        char *p;
+
+        snprintf (name, sizeof (name), "%s", ae_spec);
+        ae_ctx.target = 110;
+        if ((p = strchr (name, ':')) != NULL)
+        {
+            *p = '\0';
+            ae_ctx.target = atof (p + 1);
+        }
+        ae_ctx.cap_dev = cap_dev;
+        DBG_ASSERT (ctrl_find (cap_dev->v4l_fd, name, &ae_ctx.info) == 0 &&
+                    ctrl_get (cap_dev->v4l_fd, &ae_ctx.info, &ae_ctx.value) == 0, "no control %s\n", name);
+
+        /* with requests every frame says which setting it was exposed with */
+        if (ctrl_requests_enable (cap_dev) < 0)
+            fprintf (stderr, "ae: no request API, waiting %d frames after each change\n",
+                     cap_dev->stream.bufcount + 1);
+        ae = &ae_ctx;
+    }
+
+    /* unknown or compressed: handled as GREY, like dump_to_img does */
+    cap_fi = format_from_v4l2 (cap_fmt);
+    if (cap_fi == NULL || cap_fi->bpp == 0)
+        cap_fi = format_from_v4l2 (V4L2_PIX_FMT_GREY);
+
+    /* crop in software if the driver couldn't, then scale */
+    if (cap_opt.crop.width > 0 && cap_dev->stream.crop.width == 0)
+    {
+        view_spec.crop_x = cap_opt.crop.left;
+        view_spec.crop_y = cap_opt.crop.top;
+        view_spec.crop_w = cap_opt.crop.width;
+        view_spec.crop_h = cap_opt.crop.height;
+    }
+
+    out_w = cap_w;
+    out_h = cap_h;
+    if (view_spec.crop_w > 0 || view_spec.out_w > 0)
+    {
+        view_spec.packed = 1;
+        view = frame_view_create (cap_fmt, cap_w, cap_h,
+                                  cap_dev->stream.format.fmt.pix.bytesperline, &view_spec);
+        DBG_ASSERT (view, "failed to create frame view\n");
+        out_w = view->spec.out_w;
+        out_h = view->spec.out_h;
+    }
+
+    /* DRM buffers are write-combined: every CPU stage reads a cached copy */
+    if (cap_dev->stream.frames[0].mem == FRAME_MEM_WC)
+    {
+        bounce_size = cap_dev->stream.format.fmt.pix.sizeimage;
+        if (bounce_size > cap_dev->stream.frames[0].length)
+            bounce_size = cap_dev->stream.frames[0].length;
+        for (i = 0; i < 2; i ++)
+        {
+            bounce[i] = (uint8_t *)aligned_alloc (64, (bounce_size + 63) & ~(size_t)63);
+            DBG_ASSERT (bounce[i], "alloc failed");
+        }
+    }
+
+    /* per-frame analysis results live with the capture buffers */
+    if (do_stats)
+    {
+        for (i = 0; i < cap_dev->stream.bufcount; i ++)
+        {
+            cap_dev->stream.frames[i].stats = (frame_stats_t *)calloc (1, sizeof (frame_stats_t));
+            DBG_ASSERT (cap_dev->stream.frames[i].stats, "alloc failed");
+        }
+
+        /* the capture thread is slot 0 of the pool */
+        stripe_pool = stripe_pool_create (ncpu - 1);
+        stats_ctx = frame_stats_create (cap_fmt, cap_w, cap_h,
+                                        cap_dev->stream.format.fmt.pix.bytesperline, stripe_pool);
+        DBG_ASSERT (stats_ctx, "failed to create stats context\n");
+    }
+
+    rec_ctx.cap_dev = cap_dev;
+    rec_ctx.w       = out_w;
+    rec_ctx.h       = out_h;
+    rec_ctx.fmt     = cap_fmt;
+
+    /* the view packs its rows, the capture buffer keeps the driver's */
+    rec_ctx.stride  = cap_dev->stream.format.fmt.pix.bytesperline;
+    if (view || rec_ctx.stride < out_w * cap_fi->cpp)
+        rec_ctx.stride = out_w * cap_fi->cpp;
+    rec_ctx.size    = format_frame_size (cap_fi, rec_ctx.stride / cap_fi->cpp, out_h);
+    if (enc_codec)
+    {
+        /* the encoder reads the capture buffers in place */
+        DBG_ASSERT (view == NULL && publish_path == NULL && rec_opt.codec == CODEC_RAW,
+                    "--encode can't be combined with --crop (software), --scale, --publish or --compress\n");
+        DBG_ASSERT (cap_dev->stream.memtype == V4L2_MEMORY_MMAP, "--encode needs MMAP capture buffers\n");
+
+        for (i = 0; i < cap_dev->stream.bufcount; i ++)
+            DBG_ASSERT (v4l2_export_capture_frame (cap_dev, &cap_dev->stream.frames[i]) >= 0,
+                        "failed to export capture buffer %d\n", i);
+
+        enc = m2m_enc_open (enc_devid, cap_fmt, cap_w, cap_h, cap_dev->stream.format.fmt.pix.bytesperline,
+                            cap_dev->stream.bufcount, enc_codec);
+        DBG_ASSERT (enc, "failed to open encoder\n");
+        m2m_enc_set_keyint (enc, 30);
+
+        /* there are no raw copies to replay into the encoder */
+        preroll_num = 0;
+
+        rec_ctx.rec = recorder_open (&rec_opt, enc_codec, out_w, out_h, 0);
+        DBG_ASSERT (rec_ctx.rec, "failed to open recorder\n");
+    }
+    else if (use_recorder)
+    {
+        rec_ctx.rec = recorder_open (&rec_opt, cap_fmt, out_w, out_h, rec_ctx.stride);
+        DBG_ASSERT (rec_ctx.rec, "failed to open recorder\n");
+    }
+
+    /* record only while there is motion (plus pre/post-roll) */
+    if (motion_level > 0)
+    {
+        motion = motion_create (cap_fmt, cap_w, cap_h,
+                                cap_dev->stream.format.fmt.pix.bytesperline, 8);
+        DBG_ASSERT (motion, "failed to create motion detector\n");
+        if (preroll_num > 0)
+            preroll_init (&preroll, preroll_num, rec_ctx.size);
+    }
+
+    if (loop_devid >= 0)
+    {
+        loop_dev = v4l2_open_output_device (loop_devid, cap_fmt, out_w, out_h, V4L2_MEMORY_MMAP);
+        DBG_ASSERT (loop_dev, "failed to open loopback device\n");
+    }
+
     v4l2_show_current_capture_settings (cap_dev);
 
+    if (metrics_addr)
+        metrics_start_server (metrics_addr);
+
+    if (publish_path)
+    {
+        shm_pub = shm_pub_create (cap_dev, publish_path);
+        DBG_ASSERT (shm_pub, "failed to publish on %s\n", publish_path);
+        shm_pub->release     = shm_release_frame;
+        shm_pub->release_arg = cap_dev;
+    }
+
+    /* last, so the helper threads started above don't inherit it */
+    if (capture_cpus)
+        rt_set_affinity (pthread_self (), capture_cpus);
+    if (fifo_prio > 0)
+        rt_set_fifo (pthread_self (), fifo_prio);
+
     v4l2_start_capture (cap_dev);
+    start_ns = get_monotonic_ns ();
 
-    while (1)
+    while (!s_quit)
     {
-        capture_frame_t *frame = v4l2_acquire_capture_frame (cap_dev);
+        if (duration_sec && get_monotonic_ns () - start_ns >= duration_sec * 1000000000ULL)
+            break;
+
+        /* what the subscribers have let go of since the last round */
+        if (shm_pub)
+            shm_pub_reclaim_wait (shm_pub, shm_pub->bufcount, 0);
+
+        /* everything that piled up since the last wakeup, oldest first,
+         * or in latest mode only the newest frame */
+        capture_frame_t *batch[MAX_BATCH];
+        int num;
+        if (latest)
+        {
+            uint64_t age_ns;
+            batch[0] = v4l2_acquire_latest_frame (cap_dev, 1000, &age_ns);
+            num = batch[0] ? 1 : 0;
+            if (num && age_ns)
+                metrics_hist_observe (&age_hist, age_ns);
+        }
+        else
+        {
+            num = v4l2_acquire_capture_frames (cap_dev, batch, MAX_BATCH, 1000);
+        }
+
+        /* the last frame's stats ran on the pool while we waited in DQBUF */
+        finish_stats (cap_dev, stats_ctx, &stats_pending, stats_cnt, ae);
 
-        /* dump to file */
-        char strbuf[128];
-        static int s_ncnt = 0;
-        sprintf (strbuf, "cap_%05d", s_ncnt);
-        dump_to_img (strbuf, cap_w, cap_h, cap_fmt, frame->vaddr);
-        s_ncnt ++;
+        if (enc)
+        {
+            reclaim_encoder (&rec_ctx, enc);
+            if (drain_encoder (&rec_ctx, enc, 0) < 0)
+                s_quit = 1;
+        }
 
-        v4l2_release_capture_frame (cap_dev, frame);
+        /*
+         *  every consumer that still needs the frame after this iteration
+         *  (stats pool, shm subscribers, encoder) takes its own reference.
+         *  recorder, motion and loopback are done with it in here.
+         */
+        for (i = 0; i < num; i ++)
+        {
+            capture_frame_t *frame = batch[i];
+            capture_frame_t *cpu_frame = frame;
+            capture_frame_t cached;
+
+            /* dmabuf and cached buffers: sync the CPU cache, but only for
+             * frames the CPU reads. the access ends on release */
+            if (enc == NULL || frame->stats || motion || loop_dev)
+                v4l2_begin_cpu_access (cap_dev, frame, DMABUF_CPU_READ);
+
+            /* one bulk read out of WC memory. two copies alternate, as
+             * the stats of the previous frame may still be reading one */
+            if (bounce[0])
+            {
+                cached = *frame;
+                cached.vaddr = bounce[bounce_idx];
+                bounce_idx ^= 1;
+                wcmem_copy_from (cached.vaddr, frame->vaddr, bounce_size);
+                cpu_frame = &cached;
+            }
+
+            /* analyze while the frame is still hot in cache, in the
+             * background of publishing and recording it */
+            if (frame->stats)
+            {
+                finish_stats (cap_dev, stats_ctx, &stats_pending, stats_cnt, ae);
+                v4l2_ref_capture_frame (frame);
+                frame_stats_submit (stats_ctx, cpu_frame->vaddr, frame->stats);
+                stats_pending = frame;
+                stats_cnt     = frame_cnt;
+            }
+
+            /* subscribers read the frame while we write it to disk */
+            if (shm_pub && shm_make_room (shm_pub, share_policy))
+            {
+                v4l2_ref_capture_frame (frame);
+                shm_pub_publish (shm_pub, frame);
+            }
+
+            /* dump to file */
+            int record = 1;
+            int img_stride = cap_dev->stream.format.fmt.pix.bytesperline;
+            void *img = view ? frame_view_get (view, cpu_frame, &img_stride) : cpu_frame->vaddr;
+            uint64_t ts_ns = timeval_to_ns (frame->v4l_buf.timestamp);
+
+            if (loop_dev)
+                loopback_frame (loop_dev, img, img_stride, out_w * cap_fi->cpp,
+                                rec_ctx.size / rec_ctx.stride, frame->v4l_buf.timestamp);
+
+            if (motion)
+            {
+                int score = motion_update (motion, cpu_frame->vaddr);
+                if (score >= motion_level * MOTION_SCORE_ONE)
+                {
+                    if (postroll_left == 0)
+                        fprintf (stderr, "motion start (frame %d, score %.2f)\n", frame_cnt,
+                                 (float)score / MOTION_SCORE_ONE);
+                    preroll_flush (&preroll, &rec_ctx);
+                    if (enc)
+                        m2m_enc_force_key (enc);
+                    postroll_left = postroll_num + 1;
+                }
+
+                if (postroll_left > 0)
+                    postroll_left --;
+                else
+                {
+                    if (preroll_num > 0)
+                        preroll_push (&preroll, frame_cnt, ts_ns, img);
+                    record = 0;
+                }
+            }
+
+            if (record && enc)
+            {
+                if (encode_frame (&rec_ctx, enc, frame) < 0)
+                    s_quit = 1;
+            }
+            else if (record && record_frame (&rec_ctx, frame_cnt, ts_ns, img) < 0)
+                s_quit = 1;
+            frame_cnt ++;
+
+            /* ours: requeued here unless some consumer above still holds it */
+            v4l2_unref_capture_frame (cap_dev, frame);
+        }
+
+        if (enc && drain_encoder (&rec_ctx, enc, 0) < 0)
+            s_quit = 1;
+    }
+
+    finish_stats (cap_dev, stats_ctx, &stats_pending, stats_cnt, ae);
+    if (shm_pub)
+        shm_pub_destroy (shm_pub);
+    if (enc)
+    {
+        /* flush what is still inside the encoder */
+        if (m2m_enc_stop (enc) == 0)
+        {
+            while (!enc->eos && drain_encoder (&rec_ctx, enc, 1000) > 0)
+                ;
+        }
+        reclaim_encoder (&rec_ctx, enc);
+        fprintf (stderr, "encoded %d frames: %llu bytes raw, %llu bytes coded (%.1fx)\n", rec_ctx.frames,
+                 (unsigned long long)rec_ctx.size * rec_ctx.frames, (unsigned long long)rec_ctx.bytes,
+                 rec_ctx.bytes ? (double)rec_ctx.size * rec_ctx.frames / rec_ctx.bytes : 0.0);
+        m2m_enc_close (enc);
+    }
+    if (stats_ctx)
+        frame_stats_destroy (stats_ctx);
+    if (stripe_pool)
+        stripe_pool_destroy (stripe_pool);
+    free (bounce[0]);
+    free (bounce[1]);
+
+    fprintf (stderr, "recorded %d frames, %llu bytes\n", rec_ctx.frames,
+             (unsigned long long)rec_ctx.bytes);
+    if (cap_dev->metrics)
+    {
+        metrics_hist_t *lat = &cap_dev->metrics->dq_latency;
+        fprintf (stderr, "wakeup latency (timestamp to DQBUF): p50 %.1f us, p99 %.1f us, max %.1f us\n",
+                 metrics_hist_quantile_ns (lat, 0.50) / 1e3,
+                 metrics_hist_quantile_ns (lat, 0.99) / 1e3, lat->max_ns / 1e3);
+        if (latest)
+            fprintf (stderr, "frame age: p50 %.1f us, p99 %.1f us, max %.1f us, %llu stale frames skipped\n",
+                     metrics_hist_quantile_ns (&age_hist, 0.50) / 1e3,
+                     metrics_hist_quantile_ns (&age_hist, 0.99) / 1e3, age_hist.max_ns / 1e3,
+                     (unsigned long long)cap_dev->metrics->skipped);
+    }
+    if (rec_ctx.rec)
+        recorder_close (rec_ctx.rec);
+
+    if (loop_dev)
+        v4l2_close_capture_device (loop_dev);
+    for (i = 0; i < cap_dev->stream.bufcount; i ++)
+        free (cap_dev->stream.frames[i].stats);
+    v4l2_close_capture_device (cap_dev);
+
+    if (trace_fname)
+    {
+        trace_enable (0);
+        trace_export_json (trace_fname);
+        fprintf (stderr, "trace saved: %s\n", trace_fname);
     }
 
     return 0;
@@ -0,0 +1,139 @@
+#include <cstdio>
+#include <cstdlib>
+#include <csignal>
+#include <getopt.h>
+#include "util_v4l2.hpp"
+#include "util_format.h"
+#include "util_time.h"
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
+
+
+/* mean luma of every 4th row; packed YUV steps over the chroma */
+static double
+mean_luma (const v4l2app::Plane &y, int step, int offset)
+{
+    uint64_t sum = 0, num = 0;
+
+    for (int row = 0; row < y.rows; row += 4)
+    {
+        auto line = y.row (row);
+        for (std::size_t x = offset; x < line.size (); x += step)
+            sum += line[x];
+        num += (line.size () - offset + step - 1) / step;
+    }
+    return num ? (double)sum / num : 0;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    int devid = -1;
+    int max_frames = 0;
+    int batch = 1;
+    capture_opt_t cap_opt = {};
+
+    const struct option long_options[] = {
+        {"devid",   required_argument, NULL, 'd'},
+        {"frames",  required_argument, NULL, 'n'},
+        {"buffers", required_argument, NULL, 'b'},
+        {"batch",   required_argument, NULL, 'B'},
+        {"cached",  no_argument,       NULL, 'k'},
+        {0, 0, 0, 0},
+    };
+
+    int c, option_index;
+    while ((c = getopt_long (argc, argv, "d:n:b:B:k",
+                             long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+        case 'd': devid            = atoi (optarg); break;
+        case 'n': max_frames       = atoi (optarg); break;
+        case 'b': cap_opt.bufcount = atoi (optarg); break;
+        case 'B': batch            = atoi (optarg); break;
+        case 'k': cap_opt.cached   = 1; break;
+        case '?':
+            return -1;
+        }
+    }
+    if (batch < 1 || batch > 8)
+        batch = 1;
+
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    try
+    {
+        v4l2app::Device dev (devid, cap_opt);
+        const format_info_t *fi = format_from_v4l2 (dev.fourcc ());
+        int luma_step   = fi ? fi->luma_step : 0;
+        int luma_offset = fi ? fi->luma_offset : 0;
+
+        unsigned int fourcc = dev.fourcc ();
+        fprintf (stderr, "-------------------------------\n");
+        fprintf (stderr, " capture device : %s\n", dev.name ());
+        fprintf (stderr, " WH(%d, %d), 4CC(%.4s), bpl(%d)\n", dev.width (), dev.height (),
+                 (char *)&fourcc, dev.stride ());
+        fprintf (stderr, " buffers        : %d%s\n", dev.buffer_count (), dev.cached () ? " (cached)" : "");
+        fprintf (stderr, "-------------------------------\n");
+
+        /* destroyed in reverse: frames requeued, then stream stopped, then device closed */
+        v4l2app::Stream stream (dev);
+        v4l2app::Frame frames[8];
+        uint64_t t_report = get_monotonic_ns ();
+        int count = 0, report_count = 0;
+        double mean = 0;
+
+        while (!s_quit && (max_frames == 0 || count < max_frames))
+        {
+            /* the last batch goes back to the driver first */
+            for (auto &frame : frames)
+                frame.reset ();
+
+            int num = stream.acquire (v4l2app::Span<v4l2app::Frame> (frames, batch), 1000);
+            if (num == 0)
+            {
+                fprintf (stderr, "no frame within 1 s.\n");
+                continue;
+            }
+
+            v4l2app::Frame &frame = frames[num - 1];
+            if (luma_step > 0)
+            {
+                frame.begin_cpu_access (DMABUF_CPU_READ);
+                mean = mean_luma (frame.plane (0), luma_step, luma_offset);
+            }
+            count        += num;
+            report_count += num;
+
+            uint64_t now = get_monotonic_ns ();
+            if (now - t_report >= 1000000000ULL)
+            {
+                fprintf (stderr, "seq %u: %.1f fps", frame.sequence (),
+                         report_count * 1e9 / (now - t_report));
+                if (luma_step > 0)
+                    fprintf (stderr, ", mean %.1f", mean);
+                fprintf (stderr, "\n");
+                report_count = 0;
+                t_report     = now;
+            }
+        }
+
+        fprintf (stderr, "captured %d frames\n", count);
+    }
+    catch (const v4l2app::Error &e)
+    {
+        fprintf (stderr, "ERR: %s\n", e.what ());
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include "util_debug.h"
+#include "util_v4l2.h"
+#include "util_trace.h"
+#include "util_recorder.h"
+#include "util_time.h"
+#include "util_sync.h"
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    capture_dev_t *cap_dev[SYNC_MAX_DEVICES];
+    recorder_t *rec[SYNC_MAX_DEVICES] = {0};
+    int devid[SYNC_MAX_DEVICES];
+    int num_dev = 0;
+    char *dev_list = "0,1";
+    char *trace_fname = NULL;
+    char *prefix = NULL;
+    int window = 4;
+    int tolerance_us = 5000;
+    int duration_sec = 0;
+    int max_sets = 0;
+    capture_opt_t cap_opt = {0};
+    frame_sync_t *sync;
+    uint64_t start_ns;
+    int i;
+
+    const struct option long_options[] = {
+        {"devid",     required_argument, NULL, 'd'},
+        {"tolerance", required_argument, NULL, 'T'},
+        {"window",    required_argument, NULL, 'w'},
+        {"duration",  required_argument, NULL, 'D'},
+        {"frames",    required_argument, NULL, 'n'},
+        {"output",    required_argument, NULL, 'o'},
+        {"trace",     required_argument, NULL, 't'},
+        {0, 0, 0, 0},
+    };
+
+    int c, option_index;
+    while ((c = getopt_long (argc, argv, "d:T:w:D:n:o:t:",
+                             long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+        case 'd': dev_list     = optarg; break;
+        case 'T': tolerance_us = atoi (optarg); break;
+        case 'w': window       = atoi (optarg); break;
+        case 'D': duration_sec = atoi (optarg); break;
+        case 'n': max_sets     = atoi (optarg); break;
+        case 'o': prefix       = optarg; break;
+        case 't': trace_fname  = optarg; break;
+        case '?':
+            return -1;
+        }
+    }
+
+    /* --devid 0,2: one camera per entry, the first is the skew reference */
+    char *p = dev_list;
+    while (*p && num_dev < SYNC_MAX_DEVICES)
+    {
+        devid[num_dev ++] = strtol (p, &p, 10);
+        if (*p == ',')
+            p ++;
+        else
+            break;
+    }
+
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    if (trace_fname)
+        trace_enable (1);
+
+    /* the window holds buffers out of each driver */
+    cap_opt.bufcount = window + 3;
+
+    for (i = 0; i < num_dev; i ++)
+    {
+        int w, h;
+        unsigned int fmt;
+
+        cap_dev[i] = v4l2_open_capture_device_ex (devid[i], &cap_opt);
+        DBG_ASSERT (cap_dev[i], "failed to open V4L device %d\n", devid[i]);
+        v4l2_show_current_capture_settings (cap_dev[i]);
+
+        if (prefix)
+        {
+            char rec_prefix[128];
+            recorder_opt_t rec_opt = {0};
+
+            v4l2_get_capture_wh (cap_dev[i], &w, &h);
+            v4l2_get_capture_pixelformat (cap_dev[i], &fmt);
+
+            snprintf (rec_prefix, sizeof (rec_prefix), "%s_cam%d", prefix, i);
+            rec_opt.prefix = rec_prefix;
+            rec[i] = recorder_open (&rec_opt, fmt, w, h, cap_dev[i]->stream.format.fmt.pix.bytesperline);
+            DBG_ASSERT (rec[i], "failed to open recorder\n");
+        }
+    }
+
+    sync = frame_sync_create (cap_dev, num_dev, window, (uint64_t)tolerance_us * 1000);
+    DBG_ASSERT (sync, "failed to create frame sync\n");
+
+    for (i = 0; i < num_dev; i ++)
+        v4l2_start_capture (cap_dev[i]);
+    start_ns = get_monotonic_ns ();
+
+    while (!s_quit)
+    {
+        capture_frame_t *set[SYNC_MAX_DEVICES];
+
+        if (duration_sec && get_monotonic_ns () - start_ns >= duration_sec * 1000000000ULL)
+            break;
+        if (max_sets && sync->sets >= (uint64_t)max_sets)
+            break;
+
+        if (frame_sync_acquire (sync, set, 1000) <= 0)
+            continue;
+
+        /* every camera's frame of the set goes under the same set number */
+        for (i = 0; i < num_dev && prefix; i ++)
+        {
+            uint32_t size = set[i]->v4l_buf.bytesused;
+            if (recorder_write (rec[i], set[i]->vaddr, size, sync->sets,
+                                timeval_to_ns (set[i]->v4l_buf.timestamp)) < 0)
+                s_quit = 1;
+        }
+
+        if (sync->sets % 30 == 0)
+        {
+            fprintf (stderr, "set %llu: seq", (unsigned long long)sync->sets);
+            for (i = 0; i < num_dev; i ++)
+                fprintf (stderr, " %u", set[i]->v4l_buf.sequence);
+            for (i = 1; i < num_dev; i ++)
+                fprintf (stderr, ", skew%d %+.3f ms", i, sync->stat[i].skew_last / 1e6);
+            fprintf (stderr, "\n");
+        }
+
+        frame_sync_release (sync, set);
+    }
+
+    frame_sync_report (sync);
+    frame_sync_destroy (sync);
+
+    for (i = 0; i < num_dev; i ++)
+    {
+        if (rec[i])
+            recorder_close (rec[i]);
+    }
+
+    if (trace_fname)
+    {
+        trace_enable (0);
+        trace_export_json (trace_fname);
+        fprintf (stderr, "trace saved: %s\n", trace_fname);
+    }
+
+    return 0;
+}
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "util_codec.h"
+#include "util_debug.h"
+#include "util_trace.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define BLOCK_LEN       16
+
+
+/* ------------------------------------------------------------------------ *
+ *  prediction
+ * ------------------------------------------------------------------------ */
+static inline uint8_t
+zigzag (uint8_t d)
+{
+    return (uint8_t)((d << 1) ^ (uint8_t)((int8_t)d >> 7));
+}
+
+static inline uint8_t
+unzigzag (uint8_t z)
+{
+    return (uint8_t)((z >> 1) ^ -(z & 1));
+}
+
+/* dst[i] = zigzag (a[i] - b[i]) */
+static void
+residual (uint8_t *dst, const uint8_t *a, const uint8_t *b, int len)
+{
+    int i = 0;
+
+#if defined (__SSE2__)
+    const __m128i zero = _mm_setzero_si128 ();
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i d = _mm_sub_epi8 (_mm_loadu_si128 ((const __m128i *)(a + i)),
+                                  _mm_loadu_si128 ((const __m128i *)(b + i)));
+        __m128i s = _mm_cmpgt_epi8 (zero, d);
+        _mm_storeu_si128 ((__m128i *)(dst + i), _mm_xor_si128 (_mm_add_epi8 (d, d), s));
+    }
+#elif defined (__ARM_NEON)
+    for (; i + 16 <= len; i += 16)
+    {
+        int8x16_t d = vreinterpretq_s8_u8 (vsubq_u8 (vld1q_u8 (a + i), vld1q_u8 (b + i)));
+        int8x16_t z = veorq_s8 (vshlq_n_s8 (d, 1), vshrq_n_s8 (d, 7));
+        vst1q_u8 (dst + i, vreinterpretq_u8_s8 (z));
+    }
+#endif
+
+    for (; i < len; i ++)
+        dst[i] = zigzag (a[i] - b[i]);
+}
+
+/*
+ *  intra: predict from the same component of the previous pixel
+ *  (GREY) or macropixel (YUYV). The first one of a row is predicted
+ *  from the row above.
+ */
+static void
+predict_intra (codec_t *codec, const uint8_t *src, int stride)
+{
+    int rowlen = codec->w * codec->bpp;
+    int back   = codec->bpp == 1 ? 1 : 4;
+    uint8_t pred[4];
+    int x, y;
+
+    for (y = 0; y < codec->h; y ++)
+    {
+        const uint8_t *s = src + (size_t)y * stride;
+        uint8_t       *d = codec->resid + (size_t)y * rowlen;
+
+        for (x = 0; x < back; x ++)
+            pred[x] = (y > 0) ? s[x - stride] : 0;
+        residual (d, s, pred, back);
+        residual (d + back, s + back, s, rowlen - back);
+    }
+}
+
+static void
+to_planar (codec_t *codec)
+{
+    int n = codec->size;
+    int i;
+
+    if (codec->bpp == 1)
+    {
+        memcpy (codec->planar, codec->resid, n);
+        return;
+    }
+
+    /* Y0 U Y1 V  ->  Y plane, U plane, V plane */
+    uint8_t *py = codec->planar;
+    uint8_t *pu = py + n / 2;
+    uint8_t *pv = pu + n / 4;
+    const uint8_t *r = codec->resid;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        *py++ = r[i + 0];
+        *pu++ = r[i + 1];
+        *py++ = r[i + 2];
+        *pv++ = r[i + 3];
+    }
+}
+
+static void
+from_planar (codec_t *codec)
+{
+    int n = codec->size;
+    int i;
+
+    if (codec->bpp == 1)
+    {
+        memcpy (codec->resid, codec->planar, n);
+        return;
+    }
+
+    const uint8_t *py = codec->planar;
+    const uint8_t *pu = py + n / 2;
+    const uint8_t *pv = pu + n / 4;
+    uint8_t *r = codec->resid;
+
+    for (i = 0; i + 4 <= n; i += 4)
+    {
+        r[i + 0] = *py++;
+        r[i + 1] = *pu++;
+        r[i + 2] = *py++;
+        r[i + 3] = *pv++;
+    }
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  bit packing
+ * ------------------------------------------------------------------------ */
+static inline int
+block_width (const uint8_t *v)
+{
+    unsigned int acc = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_LEN; i ++)
+        acc |= v[i];
+
+    return acc ? 32 - __builtin_clz (acc) : 0;
+}
+
+/* 16 values of 'bits' bits -> 2 * bits bytes */
+static inline uint8_t *
+pack_block (uint8_t *dst, const uint8_t *v, int bits)
+{
+    uint64_t acc = 0;
+    int nbit = 0;
+    int i;
+
+    for (i = 0; i < BLOCK_LEN; i ++)
+    {
+        acc |= (uint64_t)v[i] << nbit;
+        nbit += bits;
+        if (nbit >= 32)
+        {
+            memcpy (dst, &acc, 4);
+            dst  += 4;
+            acc >>= 32;
+            nbit -= 32;
+        }
+    }
+    while (nbit > 0)
+    {
+        *dst++ = (uint8_t)acc;
+        acc >>= 8;
+        nbit -= 8;
+    }
+
+    return dst;
+}
+
+static inline const uint8_t *
+unpack_block (uint8_t *v, const uint8_t *src, int bits)
+{
+    uint64_t acc = 0;
+    uint32_t mask = (1u << bits) - 1;
+    int nbit = 0;
+    int i;
+
+    if (bits == 0)
+    {
+        memset (v, 0, BLOCK_LEN);
+        return src;
+    }
+
+    for (i = 0; i < BLOCK_LEN; i ++)
+    {
+        while (nbit < bits)
+        {
+            acc |= (uint64_t)(*src++) << nbit;
+            nbit += 8;
+        }
+        v[i] = acc & mask;
+        acc >>= bits;
+        nbit -= bits;
+    }
+
+    return src;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+codec_t *
+codec_create (unsigned int fourcc, int w, int h)
+{
+    codec_t *codec;
+    int padded;
+
+    codec = (codec_t *)calloc (1, sizeof (codec_t));
+    DBG_ASSERT (codec, "alloc failed");
+
+    switch (fourcc)
+    {
+    case V4L2_PIX_FMT_GREY: codec->bpp = 1; break;
+    case V4L2_PIX_FMT_YUYV: codec->bpp = 2; break;
+    default:
+        fprintf (stderr, "ERR: %s(%d): unsupported format %.4s\n", __FILE__, __LINE__, (char *)&fourcc);
+        free (codec);
+        return NULL;
+    }
+
+    codec->fourcc = fourcc;
+    codec->w      = w;
+    codec->h      = h;
+    codec->size   = w * h * codec->bpp;
+
+    /* whole block pairs, zero padded */
+    padded = (codec->size + 2 * BLOCK_LEN - 1) & ~(2 * BLOCK_LEN - 1);
+    codec->resid  = (uint8_t *)calloc (1, padded);
+    codec->planar = (uint8_t *)calloc (1, padded);
+    DBG_ASSERT (codec->resid && codec->planar, "alloc failed");
+
+    return codec;
+}
+
+void
+codec_destroy (codec_t *codec)
+{
+    free (codec->resid);
+    free (codec->planar);
+    free (codec);
+}
+
+int
+codec_max_size (codec_t *codec)
+{
+    int blocks = (codec->size + 2 * BLOCK_LEN - 1) / (2 * BLOCK_LEN);
+    return blocks * (1 + 2 * BLOCK_LEN);
+}
+
+int
+codec_encode (codec_t *codec, const uint8_t *src, const uint8_t *ref, int stride, uint8_t *dst)
+{
+    int rowlen = codec->w * codec->bpp;
+    uint8_t *p = dst;
+    int i, y;
+
+    TRACE_BEGIN ("codec_encode");
+
+    if (ref)
+    {
+        for (y = 0; y < codec->h; y ++)
+            residual (codec->resid + (size_t)y * rowlen, src + (size_t)y * stride,
+                      ref + (size_t)y * stride, rowlen);
+    }
+    else
+    {
+        predict_intra (codec, src, stride);
+    }
+    to_planar (codec);
+
+    for (i = 0; i < codec->size; i += 2 * BLOCK_LEN)
+    {
+        const uint8_t *v = codec->planar + i;
+        int b0 = block_width (v);
+        int b1 = block_width (v + BLOCK_LEN);
+
+        *p++ = b0 | (b1 << 4);
+        p = pack_block (p, v, b0);
+        p = pack_block (p, v + BLOCK_LEN, b1);
+    }
+
+    TRACE_END ("codec_encode");
+    return p - dst;
+}
+
+int
+codec_decode (codec_t *codec, const uint8_t *src, int len, const uint8_t *ref, int stride, uint8_t *dst)
+{
+    int rowlen = codec->w * codec->bpp;
+    int back   = codec->bpp == 1 ? 1 : 4;
+    const uint8_t *p   = src;
+    const uint8_t *end = src + len;
+    int i, x, y;
+
+    for (i = 0; i < codec->size; i += 2 * BLOCK_LEN)
+    {
+        int b0, b1;
+
+        if (p >= end)
+            goto err;
+        b0 = *p & 0x0f;
+        b1 = *p >> 4;
+        p ++;
+        if (b0 > 8 || b1 > 8 || p + 2 * (b0 + b1) > end)
+            goto err;
+
+        p = unpack_block (codec->planar + i, p, b0);
+        p = unpack_block (codec->planar + i + BLOCK_LEN, p, b1);
+    }
+    from_planar (codec);
+
+    for (y = 0; y < codec->h; y ++)
+    {
+        const uint8_t *r = codec->resid + (size_t)y * rowlen;
+        uint8_t       *d = dst + (size_t)y * stride;
+
+        if (ref)
+        {
+            const uint8_t *s = ref + (size_t)y * stride;
+            for (x = 0; x < rowlen; x ++)
+                d[x] = s[x] + unzigzag (r[x]);
+            continue;
+        }
+
+        for (x = 0; x < rowlen; x ++)
+        {
+            uint8_t pred;
+            if (x < back)
+                pred = (y > 0) ? d[x - stride] : 0;
+            else
+                pred = d[x - back];
+            d[x] = pred + unzigzag (r[x]);
+        }
+    }
+
+    return 0;
+
+err:
+    fprintf (stderr, "ERR: %s(%d): corrupted frame\n", __FILE__, __LINE__);
+    return -1;
+}
@@ -0,0 +1,43 @@
+#ifndef _UTIL_CODEC_H_
+#define _UTIL_CODEC_H_
+
+#include <stdint.h>
+
+/*
+ *  Fast lossless frame codec for GREY / YUYV recordings.
+ *
+ *  Each byte is predicted, either from the same component of the pixel
+ *  (GREY) or macropixel (YUYV) to its left (intra), or from the same
+ *  byte of a reference frame (inter).
+ *  The residuals are zigzag mapped, reordered to planar Y/U/V and then
+ *  bit-packed in blocks of 16 at the smallest width that holds them;
+ *  a header byte carries the widths of two blocks.
+ *
+ *  Flat or static areas cost 1/32 byte per pixel, typical camera noise
+ *  ends up at 3-5 bits per byte.
+ */
+#define CODEC_RAW           0
+#define CODEC_PACK          1
+#define CODEC_STREAM        0x80    /* coded elsewhere (hardware encoder); the
+                                     * recording's fourcc names the format */
+
+typedef struct _codec_t
+{
+    unsigned int    fourcc;
+    int             w, h;
+    int             bpp;        /* bytes per pixel */
+    int             size;       /* w * h * bpp */
+
+    uint8_t         *resid;     /* zigzag residuals, frame order */
+    uint8_t         *planar;    /* residuals in plane order      */
+} codec_t;
+
+codec_t *codec_create   (unsigned int fourcc, int w, int h);
+void     codec_destroy  (codec_t *codec);
+int      codec_max_size (codec_t *codec);
+
+/* ref == NULL: intra. src/ref/dst rows are stride bytes apart.  */
+int      codec_encode (codec_t *codec, const uint8_t *src, const uint8_t *ref, int stride, uint8_t *dst);
+int      codec_decode (codec_t *codec, const uint8_t *src, int len, const uint8_t *ref, int stride, uint8_t *dst);
+
+#endif /* _UTIL_CODEC_H_ */
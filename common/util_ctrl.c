@@ -0,0 +1,499 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/media.h>
+#include "util_ctrl.h"
+#include "util_media.h"
+#include "util_debug.h"
+#include "util_trace.h"
+
+#define ERRSTR strerror(errno)
+
+
+/* ------------------------------------------------------------------------ *
+ *  enumerate
+ * ------------------------------------------------------------------------ */
+static void
+fill_info (ctrl_info_t *info, struct v4l2_query_ext_ctrl *qc)
+{
+    memset (info, 0, sizeof (*info));
+    info->id      = qc->id;
+    info->type    = qc->type;
+    info->minimum = qc->minimum;
+    info->maximum = qc->maximum;
+    info->step    = qc->step;
+    info->def     = qc->default_value;
+    info->flags   = qc->flags;
+    info->elems   = qc->elems;
+    snprintf (info->name, sizeof (info->name), "%s", qc->name);
+}
+
+/*
+ *  fills up to max controls, returns how many the device has.
+ *  disabled controls and class headings are left out.
+ */
+int
+ctrl_enum (int v4l_fd, ctrl_info_t *ctrls, int max)
+{
+    struct v4l2_query_ext_ctrl qc = {0};
+    int num = 0;
+
+    qc.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    while (ioctl (v4l_fd, VIDIOC_QUERY_EXT_CTRL, &qc) == 0)
+    {
+        if (!(qc.flags & V4L2_CTRL_FLAG_DISABLED) && qc.type != V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            if (num < max)
+                fill_info (&ctrls[num], &qc);
+            num ++;
+        }
+        qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    }
+
+    return num;
+}
+
+/* "Exposure Time, Absolute" -> "exposure_time_absolute", as v4l2-ctl names them */
+static void
+normalize_name (const char *src, char *dst, int size)
+{
+    int len = 0;
+
+    for (; *src && len < size - 1; src ++)
+    {
+        if (isalnum ((unsigned char)*src))
+            dst[len ++] = tolower ((unsigned char)*src);
+        else if (len > 0 && dst[len - 1] != '_')
+            dst[len ++] = '_';
+    }
+    while (len > 0 && dst[len - 1] == '_')
+        len --;
+    dst[len] = '\0';
+}
+
+/* by v4l2-ctl style name, or by numeric id ("0x00980911") */
+int
+ctrl_find (int v4l_fd, const char *name, ctrl_info_t *info)
+{
+    struct v4l2_query_ext_ctrl qc = {0};
+    char want[64], have[64];
+    char *end;
+
+    qc.id = strtoul (name, &end, 0);
+    if (*name && *end == '\0')
+    {
+        if (ioctl (v4l_fd, VIDIOC_QUERY_EXT_CTRL, &qc) == 0)
+        {
+            fill_info (info, &qc);
+            return 0;
+        }
+        fprintf (stderr, "ERR: %s(%d): no control %s\n", __FILE__, __LINE__, name);
+        return -1;
+    }
+
+    normalize_name (name, want, sizeof (want));
+
+    memset (&qc, 0, sizeof (qc));
+    qc.id = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    while (ioctl (v4l_fd, VIDIOC_QUERY_EXT_CTRL, &qc) == 0)
+    {
+        normalize_name (qc.name, have, sizeof (have));
+        if (qc.type != V4L2_CTRL_TYPE_CTRL_CLASS && strcmp (want, have) == 0)
+        {
+            fill_info (info, &qc);
+            return 0;
+        }
+        qc.id |= V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    }
+
+    fprintf (stderr, "ERR: %s(%d): no control %s\n", __FILE__, __LINE__, name);
+    return -1;
+}
+
+/* plain value controls only: no strings, arrays or compound payloads */
+static int
+is_scalar (const ctrl_info_t *info)
+{
+    if (info->elems > 1 || (info->flags & V4L2_CTRL_FLAG_HAS_PAYLOAD))
+        return 0;
+
+    switch (info->type)
+    {
+    case V4L2_CTRL_TYPE_INTEGER:
+    case V4L2_CTRL_TYPE_BOOLEAN:
+    case V4L2_CTRL_TYPE_MENU:
+    case V4L2_CTRL_TYPE_INTEGER_MENU:
+    case V4L2_CTRL_TYPE_BITMASK:
+    case V4L2_CTRL_TYPE_BUTTON:
+    case V4L2_CTRL_TYPE_INTEGER64:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int
+ctrl_get (int v4l_fd, const ctrl_info_t *info, int64_t *value)
+{
+    struct v4l2_ext_control  ctrl = {0};
+    struct v4l2_ext_controls ext  = {0};
+
+    if (!is_scalar (info))
+        return -1;
+
+    ctrl.id       = info->id;
+    ext.which     = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count     = 1;
+    ext.controls  = &ctrl;
+    if (ioctl (v4l_fd, VIDIOC_G_EXT_CTRLS, &ext) < 0)
+        return -1;
+
+    *value = info->type == V4L2_CTRL_TYPE_INTEGER64 ? ctrl.value64 : ctrl.value;
+    return 0;
+}
+
+void
+ctrl_dump (int v4l_fd)
+{
+    ctrl_info_t *ctrls;
+    char name[64];
+    int64_t value;
+    int num, i;
+
+    num = ctrl_enum (v4l_fd, NULL, 0);
+    if (num <= 0)
+        return;
+
+    ctrls = (ctrl_info_t *)calloc (num, sizeof (ctrl_info_t));
+    DBG_ASSERT (ctrls, "alloc failed");
+    num = ctrl_enum (v4l_fd, ctrls, num);
+
+    fprintf (stderr, " Controls:\n");
+    for (i = 0; i < num; i ++)
+    {
+        ctrl_info_t *info = &ctrls[i];
+
+        normalize_name (info->name, name, sizeof (name));
+        fprintf (stderr, "  %-32s 0x%08x: min=%lld max=%lld step=%llu default=%lld",
+                 name, info->id, (long long)info->minimum, (long long)info->maximum,
+                 (unsigned long long)info->step, (long long)info->def);
+        if (ctrl_get (v4l_fd, info, &value) == 0)
+            fprintf (stderr, " value=%lld", (long long)value);
+        if (info->flags & V4L2_CTRL_FLAG_READ_ONLY)
+            fprintf (stderr, " (read-only)");
+        if (info->flags & V4L2_CTRL_FLAG_INACTIVE)
+            fprintf (stderr, " (inactive)");
+        fprintf (stderr, "\n");
+    }
+
+    free (ctrls);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  batches
+ * ------------------------------------------------------------------------ */
+void
+ctrl_batch_init (ctrl_batch_t *batch, uint32_t tag)
+{
+    memset (batch, 0, sizeof (*batch));
+    batch->tag = tag;
+}
+
+/* value is clamped to the control's range and snapped to its step.
+ * a control already in the batch is overwritten */
+int
+ctrl_batch_add (ctrl_batch_t *batch, const ctrl_info_t *info, int64_t value)
+{
+    struct v4l2_ext_control *ctrl;
+    int i;
+
+    if (!is_scalar (info) || (info->flags & V4L2_CTRL_FLAG_READ_ONLY))
+    {
+        fprintf (stderr, "ERR: %s(%d): control \"%s\" can't be set\n", __FILE__, __LINE__, info->name);
+        return -1;
+    }
+
+    if (info->type == V4L2_CTRL_TYPE_INTEGER || info->type == V4L2_CTRL_TYPE_INTEGER64)
+    {
+        if (value < info->minimum) value = info->minimum;
+        if (value > info->maximum) value = info->maximum;
+        if (info->step > 1)
+            value = info->minimum + (value - info->minimum + info->step / 2) / info->step * info->step;
+    }
+
+    for (i = 0; i < batch->num; i ++)
+    {
+        if (batch->ctrl[i].id == info->id)
+            break;
+    }
+    if (i == batch->num)
+    {
+        if (batch->num >= CTRL_MAX_BATCH)
+        {
+            fprintf (stderr, "ERR: %s(%d): too many controls in a batch\n", __FILE__, __LINE__);
+            return -1;
+        }
+        batch->num ++;
+    }
+
+    ctrl = &batch->ctrl[i];
+    memset (ctrl, 0, sizeof (*ctrl));
+    ctrl->id = info->id;
+    if (info->type == V4L2_CTRL_TYPE_INTEGER64)
+        ctrl->value64 = value;
+    else
+        ctrl->value   = (int32_t)value;
+
+    return 0;
+}
+
+/* "name=value,name=value" */
+int
+ctrl_batch_parse (int v4l_fd, ctrl_batch_t *batch, const char *str)
+{
+    char *buf, *tok, *save = NULL;
+    ctrl_info_t info;
+    int ret = 0;
+
+    buf = strdup (str);
+    DBG_ASSERT (buf, "alloc failed");
+
+    for (tok = strtok_r (buf, ",", &save); tok && ret == 0; tok = strtok_r (NULL, ",", &save))
+    {
+        char *val = strchr (tok, '=');
+        if (val == NULL)
+        {
+            fprintf (stderr, "ERR: %s(%d): expected name=value: %s\n", __FILE__, __LINE__, tok);
+            ret = -1;
+            break;
+        }
+        *val ++ = '\0';
+
+        if (ctrl_find (v4l_fd, tok, &info) < 0 ||
+            ctrl_batch_add (batch, &info, strtoll (val, NULL, 0)) < 0)
+            ret = -1;
+    }
+
+    free (buf);
+    return ret;
+}
+
+/* all or nothing, effective from some upcoming frame */
+int
+ctrl_batch_apply (int v4l_fd, ctrl_batch_t *batch)
+{
+    struct v4l2_ext_controls ext = {0};
+
+    if (batch->num == 0)
+        return 0;
+
+    ext.which    = V4L2_CTRL_WHICH_CUR_VAL;
+    ext.count    = batch->num;
+    ext.controls = batch->ctrl;
+
+    TRACE_BEGIN ("VIDIOC_S_EXT_CTRLS");
+    int ret = ioctl (v4l_fd, VIDIOC_S_EXT_CTRLS, &ext);
+    TRACE_END ("VIDIOC_S_EXT_CTRLS");
+    if (ret < 0)
+    {
+        /* error_idx == count: rejected before anything was applied */
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_S_EXT_CTRLS (control 0x%08x): %s\n", __FILE__, __LINE__,
+                 ext.error_idx < ext.count ? batch->ctrl[ext.error_idx].id : 0, ERRSTR);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  request API
+ * ------------------------------------------------------------------------ */
+/* CREATE_BUFS with count 0 only reports the queue capabilities */
+int
+ctrl_requests_supported (capture_dev_t *cap_dev)
+{
+    struct v4l2_create_buffers cb = {0};
+
+    cb.count  = 0;
+    cb.memory = cap_dev->stream.memtype;
+    cb.format = cap_dev->stream.format;
+    if (ioctl (cap_dev->v4l_fd, VIDIOC_CREATE_BUFS, &cb) < 0)
+        return 0;
+
+    return (cb.capabilities & V4L2_BUF_CAP_SUPPORTS_REQUESTS) ? 1 : 0;
+}
+
+/*
+ *  from here on every buffer is queued through a request: vb2 doesn't
+ *  mix the two on one queue, so this must happen before the first QBUF.
+ */
+int
+ctrl_requests_enable (capture_dev_t *cap_dev)
+{
+    ctrl_requests_t *reqs;
+    media_graph_t *graph;
+    uint32_t entity;
+    int i;
+
+    if (cap_dev->requests)
+        return 0;
+
+    if (!ctrl_requests_supported (cap_dev))
+    {
+        fprintf (stderr, "ERR: %s(%d): %s has no request API support\n", __FILE__, __LINE__,
+                 cap_dev->dev_name);
+        return -1;
+    }
+
+    graph = media_graph_find (cap_dev->v4l_fd, &entity);
+    if (graph == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): no media device for %s\n", __FILE__, __LINE__, cap_dev->dev_name);
+        return -1;
+    }
+
+    reqs = (ctrl_requests_t *)calloc (1, sizeof (ctrl_requests_t));
+    DBG_ASSERT (reqs, "alloc failed");
+    reqs->num      = cap_dev->stream.bufcount;
+    reqs->req_fd   = (int *)calloc (reqs->num, sizeof (int));
+    reqs->used     = (int *)calloc (reqs->num, sizeof (int));
+    reqs->media_fd = fcntl (graph->fd, F_DUPFD_CLOEXEC, 0);
+    DBG_ASSERT (reqs->req_fd && reqs->used, "alloc failed");
+    media_graph_close (graph);
+
+    for (i = 0; i < reqs->num; i ++)
+    {
+        if (reqs->media_fd < 0 || ioctl (reqs->media_fd, MEDIA_IOC_REQUEST_ALLOC, &reqs->req_fd[i]) < 0)
+        {
+            fprintf (stderr, "ERR: %s(%d): MEDIA_IOC_REQUEST_ALLOC: %s\n", __FILE__, __LINE__, ERRSTR);
+            while (-- i >= 0)
+                close (reqs->req_fd[i]);
+            if (reqs->media_fd >= 0)
+                close (reqs->media_fd);
+            free (reqs->req_fd);
+            free (reqs->used);
+            free (reqs);
+            return -1;
+        }
+    }
+
+    cap_dev->requests = reqs;
+    return 0;
+}
+
+/*
+ *  returns 0 when the batch is bound to the next buffer queued, 1 when
+ *  there are no requests and it was applied right away, -1 on error.
+ *  call from the thread that queues the capture buffers.
+ */
+int
+ctrl_request_set (capture_dev_t *cap_dev, ctrl_batch_t *batch)
+{
+    ctrl_requests_t *reqs = cap_dev->requests;
+    int i, j;
+
+    if (reqs == NULL)
+        return ctrl_batch_apply (cap_dev->v4l_fd, batch) == 0 ? 1 : -1;
+
+    if (!reqs->has_pending)
+    {
+        reqs->pending     = *batch;
+        reqs->has_pending = 1;
+        return 0;
+    }
+
+    /* not queued yet: merge, the newer value wins */
+    for (i = 0; i < batch->num; i ++)
+    {
+        for (j = 0; j < reqs->pending.num; j ++)
+        {
+            if (reqs->pending.ctrl[j].id == batch->ctrl[i].id)
+                break;
+        }
+        if (j == CTRL_MAX_BATCH)
+            return -1;
+        if (j == reqs->pending.num)
+            reqs->pending.num ++;
+        reqs->pending.ctrl[j] = batch->ctrl[i];
+    }
+    reqs->pending.tag = batch->tag;
+
+    return 0;
+}
+
+/* the request completes with its buffer, so it is normally idle by now */
+static int
+reinit_request (int req_fd)
+{
+    struct pollfd fds[1] = {0};
+
+    if (ioctl (req_fd, MEDIA_REQUEST_IOC_REINIT, NULL) == 0)
+        return 0;
+
+    if (errno == EBUSY)
+    {
+        fds[0].fd     = req_fd;
+        fds[0].events = POLLPRI;
+        if (poll (fds, 1, 100) > 0 && ioctl (req_fd, MEDIA_REQUEST_IOC_REINIT, NULL) == 0)
+            return 0;
+    }
+
+    fprintf (stderr, "ERR: %s(%d): MEDIA_REQUEST_IOC_REINIT: %s\n", __FILE__, __LINE__, ERRSTR);
+    return -1;
+}
+
+/* before VIDIOC_QBUF: put the pending controls in the buffer's request */
+int
+ctrl_request_attach (ctrl_requests_t *reqs, int v4l_fd, capture_frame_t *frame,
+                     struct v4l2_buffer *buf)
+{
+    int req_fd;
+
+    if (buf->index >= (unsigned int)reqs->num)
+        return -1;
+    req_fd = reqs->req_fd[buf->index];
+
+    if (reqs->used[buf->index] && reinit_request (req_fd) < 0)
+        return -1;
+    reqs->used[buf->index] = 1;
+
+    if (reqs->has_pending)
+    {
+        struct v4l2_ext_controls ext = {0};
+
+        ext.which      = V4L2_CTRL_WHICH_REQUEST_VAL;
+        ext.request_fd = req_fd;
+        ext.count      = reqs->pending.num;
+        ext.controls   = reqs->pending.ctrl;
+        if (ioctl (v4l_fd, VIDIOC_S_EXT_CTRLS, &ext) < 0)
+            fprintf (stderr, "ERR: %s(%d): VIDIOC_S_EXT_CTRLS (request): %s\n", __FILE__, __LINE__, ERRSTR);
+        else
+            reqs->tag = reqs->pending.tag;
+        reqs->has_pending = 0;
+    }
+    frame->ctrl_tag = reqs->tag;
+
+    buf->flags     |= V4L2_BUF_FLAG_REQUEST_FD;
+    buf->request_fd = req_fd;
+    return 0;
+}
+
+/* after VIDIOC_QBUF: the buffer only reaches the driver with its request */
+int
+ctrl_request_queue (ctrl_requests_t *reqs, struct v4l2_buffer *buf)
+{
+    if (ioctl (reqs->req_fd[buf->index], MEDIA_REQUEST_IOC_QUEUE, NULL) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): MEDIA_REQUEST_IOC_QUEUE: %s\n", __FILE__, __LINE__, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
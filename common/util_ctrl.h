@@ -0,0 +1,77 @@
+#ifndef _UTIL_CTRL_H_
+#define _UTIL_CTRL_H_
+
+#include <stdint.h>
+#include <linux/videodev2.h>
+#include "util_v4l2.h"
+
+/*
+ *  Camera controls (exposure, gain, white balance, ...).
+ *
+ *  ctrl_batch_apply() sets a batch of controls with one VIDIOC_S_EXT_CTRLS:
+ *  the driver validates all of them before changing any, and the new
+ *  values land on some upcoming frame.
+ *
+ *  Where the driver supports the Media Request API (vivid does), every
+ *  buffer of the stream can be queued through a request instead. The
+ *  batch handed to ctrl_request_set() then travels with the next buffer
+ *  queued, and the frame that comes back in that buffer is the first one
+ *  captured with it. capture_frame_t.ctrl_tag tells which batch a frame saw.
+ *
+ *     ctrl_request_set (tag 7) -> QBUF buf 2 + request -> DQBUF buf 2, ctrl_tag 7
+ */
+#define CTRL_MAX_BATCH      16
+
+typedef struct _ctrl_info_t
+{
+    uint32_t    id;
+    uint32_t    type;           /* V4L2_CTRL_TYPE_xxx */
+    char        name[32];
+    int64_t     minimum;
+    int64_t     maximum;
+    uint64_t    step;
+    int64_t     def;
+    uint32_t    flags;          /* V4L2_CTRL_FLAG_xxx */
+    uint32_t    elems;
+} ctrl_info_t;
+
+typedef struct _ctrl_batch_t
+{
+    uint32_t    tag;            /* caller's id for this batch. 0: none */
+    int         num;
+    struct v4l2_ext_control ctrl[CTRL_MAX_BATCH];
+} ctrl_batch_t;
+
+typedef struct _ctrl_requests_t
+{
+    int         media_fd;
+    int         num;
+    int         *req_fd;        /* one request per buffer index */
+    int         *used;          /* needs MEDIA_REQUEST_IOC_REINIT before reuse */
+
+    ctrl_batch_t pending;       /* goes with the next buffer queued */
+    int         has_pending;
+    uint32_t    tag;            /* last batch bound to a buffer */
+} ctrl_requests_t;
+
+int  ctrl_enum   (int v4l_fd, ctrl_info_t *ctrls, int max);
+int  ctrl_find   (int v4l_fd, const char *name, ctrl_info_t *info);
+int  ctrl_get    (int v4l_fd, const ctrl_info_t *info, int64_t *value);
+void ctrl_dump   (int v4l_fd);
+
+void ctrl_batch_init  (ctrl_batch_t *batch, uint32_t tag);
+int  ctrl_batch_add   (ctrl_batch_t *batch, const ctrl_info_t *info, int64_t value);
+int  ctrl_batch_parse (int v4l_fd, ctrl_batch_t *batch, const char *str);
+int  ctrl_batch_apply (int v4l_fd, ctrl_batch_t *batch);
+
+/* request API. enable before v4l2_start_capture() */
+int  ctrl_requests_supported (capture_dev_t *cap_dev);
+int  ctrl_requests_enable    (capture_dev_t *cap_dev);
+int  ctrl_request_set        (capture_dev_t *cap_dev, ctrl_batch_t *batch);
+
+/* used by util_v4l2 around VIDIOC_QBUF */
+int  ctrl_request_attach (ctrl_requests_t *reqs, int v4l_fd, capture_frame_t *frame,
+                          struct v4l2_buffer *buf);
+int  ctrl_request_queue  (ctrl_requests_t *reqs, struct v4l2_buffer *buf);
+
+#endif /* _UTIL_CTRL_H_ */
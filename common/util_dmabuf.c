@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "util_dmabuf.h"
+#include "util_trace.h"
+
+#define ERRSTR strerror(errno)
+
+
+static int
+dmabuf_sync (int fd, unsigned long long flags)
+{
+    struct dma_buf_sync sync = {0};
+    int ret;
+
+    sync.flags = flags;
+
+    /* the exporter may be interrupted while waiting for the device */
+    do {
+        ret = ioctl (fd, DMA_BUF_IOCTL_SYNC, &sync);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (ret < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): DMA_BUF_IOCTL_SYNC (fd %d, flags 0x%llx) failed: %s\n",
+                 __FILE__, __LINE__, fd, flags, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+/* access: DMABUF_CPU_READ, _WRITE or _RW */
+int
+dmabuf_begin_cpu_access (int fd, unsigned int access)
+{
+    int ret;
+
+    TRACE_BEGIN ("dmabuf_begin_cpu_access");
+    ret = dmabuf_sync (fd, DMA_BUF_SYNC_START | (access & DMA_BUF_SYNC_RW));
+    TRACE_END ("dmabuf_begin_cpu_access");
+
+    return ret;
+}
+
+int
+dmabuf_end_cpu_access (int fd, unsigned int access)
+{
+    int ret;
+
+    TRACE_BEGIN ("dmabuf_end_cpu_access");
+    ret = dmabuf_sync (fd, DMA_BUF_SYNC_END | (access & DMA_BUF_SYNC_RW));
+    TRACE_END ("dmabuf_end_cpu_access");
+
+    return ret;
+}
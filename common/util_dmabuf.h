@@ -0,0 +1,34 @@
+#ifndef _UTIL_DMABUF_H_
+#define _UTIL_DMABUF_H_
+
+#include <linux/dma-buf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  CPU access to dma-buf memory (dmabuf capture buffers, DRM dumb
+ *  buffers, exported V4L2 buffers).
+ *
+ *  On SoCs without cache coherent DMA, the CPU cache must be invalidated
+ *  before reading what a device wrote, and cleaned after writing what a
+ *  device will read. DMA_BUF_IOCTL_SYNC leaves that to the exporter, which
+ *  knows how the memory is mapped: bracketing every CPU access with
+ *  begin/end is what lets it hand out cached mappings instead of
+ *  uncached ones, and makes untouched buffers cost nothing.
+ *
+ *  begin and end must name the same access, and nest per fd.
+ */
+#define DMABUF_CPU_READ     DMA_BUF_SYNC_READ
+#define DMABUF_CPU_WRITE    DMA_BUF_SYNC_WRITE
+#define DMABUF_CPU_RW       DMA_BUF_SYNC_RW
+
+int dmabuf_begin_cpu_access (int fd, unsigned int access);
+int dmabuf_end_cpu_access   (int fd, unsigned int access);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_DMABUF_H_ */
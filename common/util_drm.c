@@ -15,6 +15,11 @@
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 #include "util_drm.h"
+#include "util_trace.h"
+#include "util_metrics.h"
+#include "util_time.h"
+#include "util_format.h"
+#include "util_dmabuf.h"
 
 #define ALIGNN(src_value, align) ((src_value + align-1) & (~(align-1)))
 
@@ -67,26 +72,14 @@ drm_alloc_fb (int fd, int width, int height, int fourcc, drm_fb_t *dfb)
         dfb->fds[i] = -1;
 
 
-    switch (dfb->fourcc) {
-    case DRM_FORMAT_NV12:     dfb->bpp = 12; dfb->plane_nums = 2; break;
-    case DRM_FORMAT_NV16:     dfb->bpp = 16; dfb->plane_nums = 2; break;
-
-    case DRM_FORMAT_RGB565:
-    case DRM_FORMAT_YUYV:
-    case DRM_FORMAT_UYVY:     dfb->bpp = 16; dfb->plane_nums = 1; break;
-
-    case DRM_FORMAT_ARGB8888: 
-    case DRM_FORMAT_XRGB8888: dfb->bpp = 32; dfb->plane_nums = 1; break;
-    case DRM_FORMAT_RGB888:
-    case DRM_FORMAT_BGR888:   dfb->bpp = 24; dfb->plane_nums = 1; break;
-
-    case DRM_FORMAT_YUV420:
-    case DRM_FORMAT_YVU420:   dfb->bpp = 12; dfb->plane_nums = 3; break;
-
-    default:
+    const format_info_t *fi = format_from_drm (dfb->fourcc);
+    if (fi == NULL || fi->bpp == 0)
+    {
         fprintf (stderr, "unsupported format 0x%08x\n",  dfb->fourcc);
         return -1;
     }
+    dfb->bpp        = fi->bpp;
+    dfb->plane_nums = fi->planes;
 
     if (dfb->plane_nums == 3) 
     {
@@ -140,6 +133,7 @@ drm_alloc_fb (int fd, int width, int height, int fourcc, drm_fb_t *dfb)
     create_arg.bpp    = 8;
     create_arg.width  = alloc_size;
     create_arg.height = 1;
+    TRACE_INSTANT ("drm_alloc_fb", alloc_size);
     ret = drmIoctl (fd, DRM_IOCTL_MODE_CREATE_DUMB, &create_arg);
     if (ret) 
     {
@@ -235,6 +229,49 @@ drm_add_fb (int fd, drm_fb_t *dfb)
     return 0;
 }
 
+/*
+ *  bracket CPU access to the planes in plane_mask (bit N: plane N) with
+ *  dma-buf syncs. planes sharing one buffer are synced once.
+ */
+static int
+sync_fb_planes (drm_fb_t *dfb, unsigned int plane_mask, unsigned int access, int begin)
+{
+    int i, j, ret = 0;
+
+    for (i = 0; i < dfb->plane_nums; i ++)
+    {
+        if (!(plane_mask & (1u << i)) || dfb->fds[i] < 0)
+            continue;
+
+        for (j = 0; j < i; j ++)
+        {
+            if ((plane_mask & (1u << j)) && dfb->fds[j] == dfb->fds[i])
+                break;
+        }
+        if (j < i)
+            continue;
+
+        if (begin)
+            ret |= dmabuf_begin_cpu_access (dfb->fds[i], access);
+        else
+            ret |= dmabuf_end_cpu_access (dfb->fds[i], access);
+    }
+
+    return ret ? -1 : 0;
+}
+
+int
+drm_fb_begin_cpu_access (drm_fb_t *dfb, unsigned int plane_mask, unsigned int access)
+{
+    return sync_fb_planes (dfb, plane_mask, access, 1);
+}
+
+int
+drm_fb_end_cpu_access (drm_fb_t *dfb, unsigned int plane_mask, unsigned int access)
+{
+    return sync_fb_planes (dfb, plane_mask, access, 0);
+}
+
 
 /* -------------------------------------------------------------------------- *
  *  DRM VideoPath Setting Operation functions.
@@ -702,7 +739,11 @@ drm_atomic_flush (drm_obj_t *dobj, int block)
     if (block == 0)
         dobj->atom_flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
 
+    TRACE_BEGIN ("drm_atomic_flush");
+    uint64_t t0 = get_monotonic_ns ();
     int ret = drmModeAtomicCommit (dobj->fd, dobj->atom, dobj->atom_flags, NULL);
+    metrics_observe_drm_commit (get_monotonic_ns () - t0);
+    TRACE_END ("drm_atomic_flush");
     if (ret < 0)
     {
         fprintf (stderr, "ERR: failed drmModeAtomicCommit: %s\n", strerror(errno));
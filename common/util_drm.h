@@ -102,6 +102,10 @@ int drm_free_fb   (int fd, drm_fb_t *dfb);
 int drm_add_fb    (int fd, drm_fb_t *dfb);
 int drm_remove_fb (int fd, drm_fb_t *dfb);
 
+/* CPU access to framebuffer memory (access: DMABUF_CPU_xxx of util_dmabuf.h) */
+int drm_fb_begin_cpu_access (drm_fb_t *dfb, unsigned int plane_mask, unsigned int access);
+int drm_fb_end_cpu_access   (drm_fb_t *dfb, unsigned int plane_mask, unsigned int access);
+
 /* DRM Atomic operation */
 int drm_atomic_set_mode  (drm_obj_t *dobj, int dpy_idx, int enable);
 int drm_atomic_set_plane (drm_obj_t *dobj, drm_fb_t *dfb, int x, int y, int dpy_idx, int plane_idx);
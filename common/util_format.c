@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <linux/videodev2.h>
+#include <drm_fourcc.h>
+#include "util_format.h"
+
+#define FMT(v, d, tag, planes, bpp, cpp, hsub, vsub, luma, loff) \
+    { V4L2_PIX_FMT_##v, d, "V4L2_PIX_FMT_" #v, tag, planes, bpp, cpp, hsub, vsub, luma, loff }
+
+static const format_info_t s_formats[] = {
+    /* RGB */
+    FMT (RGB332,  DRM_FORMAT_RGB332,   "RGB332",   1,  8, 1, 1, 1, 0, 0),
+    FMT (RGB444,  0,                   "RGB444",   1, 16, 2, 1, 1, 0, 0),
+    FMT (RGB555,  DRM_FORMAT_XRGB1555, "RGB555",   1, 16, 2, 1, 1, 0, 0),
+    FMT (RGB565,  DRM_FORMAT_RGB565,   "RGB565",   1, 16, 2, 1, 1, 0, 0),
+    FMT (RGB555X, 0,                   "RGB555X",  1, 16, 2, 1, 1, 0, 0),
+    FMT (RGB565X, 0,                   "RGB565X",  1, 16, 2, 1, 1, 0, 0),
+    FMT (BGR666,  0,                   "BGR666",   1, 32, 4, 1, 1, 0, 0),
+    FMT (BGR24,   DRM_FORMAT_RGB888,   "BGR888",   1, 24, 3, 1, 1, 0, 0),
+    FMT (RGB24,   DRM_FORMAT_BGR888,   "RGB888",   1, 24, 3, 1, 1, 0, 0),
+    FMT (ABGR32,  DRM_FORMAT_ARGB8888, "ARGB8888", 1, 32, 4, 1, 1, 0, 0),
+    FMT (XBGR32,  DRM_FORMAT_XRGB8888, "XRGB8888", 1, 32, 4, 1, 1, 0, 0),
+    FMT (BGR32,   DRM_FORMAT_XRGB8888, "BGR32",    1, 32, 4, 1, 1, 0, 0),
+    FMT (RGB32,   DRM_FORMAT_BGRX8888, "RGB32",    1, 32, 4, 1, 1, 0, 0),
+
+    /* Grey */
+    FMT (GREY,    DRM_FORMAT_R8,       "I8",       1,  8, 1, 1, 1, 1, 0),
+    FMT (Y4,      0,                   "Y4",       1,  8, 1, 1, 1, 1, 0),
+    FMT (Y6,      0,                   "Y6",       1,  8, 1, 1, 1, 1, 0),
+    FMT (Y10,     0,                   "Y10",      1, 16, 2, 1, 1, 0, 0),
+    FMT (Y12,     0,                   "Y12",      1, 16, 2, 1, 1, 0, 0),
+    FMT (Y16,     DRM_FORMAT_R16,      "Y16",      1, 16, 2, 1, 1, 0, 0),
+
+    /* YUV */
+    FMT (YUYV,    DRM_FORMAT_YUYV,     "YUNV422",  1, 16, 2, 2, 1, 2, 0),
+    FMT (UYVY,    DRM_FORMAT_UYVY,     "UYVY422",  1, 16, 2, 2, 1, 2, 1),
+    FMT (NV12,    DRM_FORMAT_NV12,     "NV12",     2, 12, 1, 2, 2, 1, 0),
+    FMT (NV16,    DRM_FORMAT_NV16,     "NV16",     2, 16, 1, 2, 1, 1, 0),
+    FMT (YUV420,  DRM_FORMAT_YUV420,   "I420",     3, 12, 1, 2, 2, 1, 0),
+    FMT (YVU420,  DRM_FORMAT_YVU420,   "YV12",     3, 12, 1, 2, 2, 1, 0),
+
+    /* compressed */
+    FMT (H264,    0,                   "H264",     1,  0, 0, 1, 1, 0, 0),
+    FMT (JPEG,    0,                   "JPEG",     1,  0, 0, 1, 1, 0, 0),
+    FMT (MJPEG,   0,                   "MJPEG",    1,  0, 0, 1, 1, 0, 0),
+    FMT (FWHT,    0,                   "FWHT",     1,  0, 0, 1, 1, 0, 0),
+};
+
+#define FORMAT_NUM  (sizeof (s_formats) / sizeof (s_formats[0]))
+
+
+const format_info_t *
+format_from_v4l2 (unsigned int fourcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < FORMAT_NUM; i ++)
+    {
+        if (s_formats[i].v4l2 == fourcc)
+            return &s_formats[i];
+    }
+    return NULL;
+}
+
+/* the first V4L2 format that maps to it */
+const format_info_t *
+format_from_drm (unsigned int fourcc)
+{
+    unsigned int i;
+
+    for (i = 0; i < FORMAT_NUM; i ++)
+    {
+        if (s_formats[i].drm == fourcc && fourcc != 0)
+            return &s_formats[i];
+    }
+    return NULL;
+}
+
+/* tightly packed size of a w x h frame. 0 for compressed formats */
+size_t
+format_frame_size (const format_info_t *fi, int w, int h)
+{
+    return (size_t)w * h * fi->bpp / 8;
+}
@@ -0,0 +1,36 @@
+#ifndef _UTIL_FORMAT_H_
+#define _UTIL_FORMAT_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Pixel format traits: one table shared by the capture, DRM and
+ *  dump code instead of a switch in each of them.
+ */
+typedef struct _format_info_t
+{
+    unsigned int    v4l2;           /* V4L2_PIX_FMT_xxx                 */
+    unsigned int    drm;            /* DRM_FORMAT_xxx. 0: no equivalent */
+    const char      *name;
+    const char      *tag;           /* file name tag of raw dumps       */
+    int             planes;         /* memory planes of a DRM buffer    */
+    int             bpp;            /* bits per pixel, all planes. 0: compressed */
+    int             cpp;            /* bytes per pixel in plane 0       */
+    int             hsub, vsub;     /* chroma subsampling               */
+    int             luma_step;      /* bytes between luma samples in plane 0. 0: no luma */
+    int             luma_offset;    /* byte of the first luma sample in plane 0 (UYVY: 1) */
+} format_info_t;
+
+const format_info_t *format_from_v4l2 (unsigned int fourcc);
+const format_info_t *format_from_drm  (unsigned int fourcc);
+size_t               format_frame_size (const format_info_t *fi, int w, int h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_FORMAT_H_ */
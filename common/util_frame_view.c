@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util_frame_view.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_format.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+/* ------------------------------------------------------------------------ *
+ *  kernels
+ * ------------------------------------------------------------------------ */
+
+/* dst[i] = (a[i] + b[i] + 1) / 2 */
+static void
+avg_rows (uint8_t *dst, const uint8_t *a, const uint8_t *b, int n)
+{
+    int i = 0;
+
+#if defined (__SSE2__)
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i va = _mm_loadu_si128 ((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128 ((const __m128i *)(b + i));
+        _mm_storeu_si128 ((__m128i *)(dst + i), _mm_avg_epu8 (va, vb));
+    }
+#elif defined (__ARM_NEON)
+    for (; i + 16 <= n; i += 16)
+        vst1q_u8 (dst + i, vrhaddq_u8 (vld1q_u8 (a + i), vld1q_u8 (b + i)));
+#endif
+
+    for (; i < n; i ++)
+        dst[i] = (a[i] + b[i] + 1) >> 1;
+}
+
+/* GREY: dst[i] = (src[2i] + src[2i+1] + 1) / 2 */
+static void
+hpair_grey (uint8_t *dst, const uint8_t *src, int out_n)
+{
+    int i = 0;
+
+#if defined (__SSE2__)
+    const __m128i mask = _mm_set1_epi16 (0x00FF);
+    const __m128i one  = _mm_set1_epi16 (1);
+    for (; i + 16 <= out_n; i += 16)
+    {
+        __m128i v0 = _mm_loadu_si128 ((const __m128i *)(src + 2 * i));
+        __m128i v1 = _mm_loadu_si128 ((const __m128i *)(src + 2 * i + 16));
+        __m128i s0 = _mm_add_epi16 (_mm_and_si128 (v0, mask), _mm_srli_epi16 (v0, 8));
+        __m128i s1 = _mm_add_epi16 (_mm_and_si128 (v1, mask), _mm_srli_epi16 (v1, 8));
+        s0 = _mm_srli_epi16 (_mm_add_epi16 (s0, one), 1);
+        s1 = _mm_srli_epi16 (_mm_add_epi16 (s1, one), 1);
+        _mm_storeu_si128 ((__m128i *)(dst + i), _mm_packus_epi16 (s0, s1));
+    }
+#elif defined (__ARM_NEON)
+    for (; i + 16 <= out_n; i += 16)
+    {
+        uint8x16x2_t v = vld2q_u8 (src + 2 * i);
+        vst1q_u8 (dst + i, vrhaddq_u8 (v.val[0], v.val[1]));
+    }
+#endif
+
+    for (; i < out_n; i ++)
+        dst[i] = (src[2 * i] + src[2 * i + 1] + 1) >> 1;
+}
+
+/* YUYV: [Y0 U0 Y1 V0 Y2 U1 Y3 V1] --> [Y01 U01 Y23 V01] */
+static void
+hpair_yuyv (uint8_t *dst, const uint8_t *src, int out_n)
+{
+    int i;
+
+    for (i = 0; i < out_n / 2; i ++, src += 8, dst += 4)
+    {
+        dst[0] = (src[0] + src[2] + 1) >> 1;
+        dst[1] = (src[1] + src[5] + 1) >> 1;
+        dst[2] = (src[4] + src[6] + 1) >> 1;
+        dst[3] = (src[3] + src[7] + 1) >> 1;
+    }
+}
+
+/* UYVY: [U0 Y0 V0 Y1 U1 Y2 V1 Y3] --> [U01 Y01 V01 Y23] */
+static void
+hpair_uyvy (uint8_t *dst, const uint8_t *src, int out_n)
+{
+    int i;
+
+    for (i = 0; i < out_n / 2; i ++, src += 8, dst += 4)
+    {
+        dst[0] = (src[0] + src[4] + 1) >> 1;
+        dst[1] = (src[1] + src[3] + 1) >> 1;
+        dst[2] = (src[2] + src[6] + 1) >> 1;
+        dst[3] = (src[5] + src[7] + 1) >> 1;
+    }
+}
+
+static void
+box2x (frame_view_t *view, uint8_t *dst, int dst_stride,
+       const uint8_t *src, int src_stride, int sw, int sh)
+{
+    int y;
+    int dw = sw / 2;
+    int dh = sh / 2;
+    uint8_t *row = view->tmp;   /* one source row */
+
+    for (y = 0; y < dh; y ++)
+    {
+        const uint8_t *s0 = src + (2 * y + 0) * src_stride;
+        const uint8_t *s1 = src + (2 * y + 1) * src_stride;
+
+        avg_rows (row, s0, s1, sw * view->bpp);
+
+        view->hpair (dst + y * dst_stride, row, dw);
+    }
+}
+
+/*
+ *  bilinear resize of one channel. samples of the channel are
+ *  src_step / dst_step bytes apart (1 for GREY, 2 for Y, 4 for U/V in YUYV).
+ */
+static void
+resize_channel (uint8_t *dst, int dst_stride, int dst_step, int dw, int dh,
+                const uint8_t *src, int src_stride, int src_step, int sw, int sh)
+{
+    int x, y;
+    int32_t xstep = (sw << 16) / dw;
+    int32_t ystep = (sh << 16) / dh;
+
+    for (y = 0; y < dh; y ++)
+    {
+        int32_t sy = y * ystep + ystep / 2 - 0x8000;
+        if (sy < 0)
+            sy = 0;
+        int y0 = sy >> 16;
+        int y1 = (y0 + 1 < sh) ? y0 + 1 : y0;
+        int fy = (sy >> 8) & 0xFF;
+
+        const uint8_t *r0 = src + y0 * src_stride;
+        const uint8_t *r1 = src + y1 * src_stride;
+        uint8_t *d = dst + y * dst_stride;
+
+        for (x = 0; x < dw; x ++)
+        {
+            int32_t sx = x * xstep + xstep / 2 - 0x8000;
+            if (sx < 0)
+                sx = 0;
+            int x0 = sx >> 16;
+            int x1 = (x0 + 1 < sw) ? x0 + 1 : x0;
+            int fx = (sx >> 8) & 0xFF;
+
+            int top = r0[x0 * src_step] * (256 - fx) + r0[x1 * src_step] * fx;
+            int bot = r1[x0 * src_step] * (256 - fx) + r1[x1 * src_step] * fx;
+            d[x * dst_step] = (top * (256 - fy) + bot * fy + 32768) >> 16;
+        }
+    }
+}
+
+static void
+resize_bilinear (frame_view_t *view, uint8_t *dst, int dst_stride,
+                 const uint8_t *src, int src_stride, int sw, int sh)
+{
+    int dw = view->spec.out_w;
+    int dh = view->spec.out_h;
+
+    if (view->bpp == 2)
+    {
+        resize_channel (dst + 0, dst_stride, 2, dw,     dh, src + 0, src_stride, 2, sw,     sh);
+        resize_channel (dst + 1, dst_stride, 4, dw / 2, dh, src + 1, src_stride, 4, sw / 2, sh);
+        resize_channel (dst + 3, dst_stride, 4, dw / 2, dh, src + 3, src_stride, 4, sw / 2, sh);
+    }
+    else
+    {
+        resize_channel (dst, dst_stride, 1, dw, dh, src, src_stride, 1, sw, sh);
+    }
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  view
+ * ------------------------------------------------------------------------ */
+frame_view_t *
+frame_view_create (unsigned int fourcc, int w, int h, int stride, frame_view_spec_t *spec)
+{
+    frame_view_t *view;
+    frame_view_spec_t *vs;
+    const format_info_t *fi = format_from_v4l2 (fourcc);
+    int align;
+
+    /* single plane, 8bit luma in every pixel (GREY) or pair (YUYV, UYVY) */
+    if (fi == NULL || fi->planes != 1 || fi->luma_step == 0 || fi->luma_step != fi->cpp)
+    {
+        fprintf (stderr, "ERR: %s(%d): unsupported format %.4s\n", __FILE__, __LINE__, (char *)&fourcc);
+        return NULL;
+    }
+    align = fi->hsub;
+
+    view = (frame_view_t *)calloc (1, sizeof (frame_view_t));
+    DBG_ASSERT (view, "alloc failed");
+
+    view->fourcc     = fourcc;
+    view->bpp        = fi->cpp;
+    view->hpair      = (fi->cpp == 1) ? hpair_grey : fi->luma_offset ? hpair_uyvy : hpair_yuyv;
+    view->src_w      = w;
+    view->src_h      = h;
+    view->src_stride = stride;
+    view->spec       = *spec;
+
+    /* clip and align the crop rectangle (YUYV needs even x/width) */
+    vs = &view->spec;
+    if (vs->crop_w <= 0 || vs->crop_h <= 0)
+    {
+        vs->crop_x = vs->crop_y = 0;
+        vs->crop_w = w;
+        vs->crop_h = h;
+    }
+    if (vs->crop_x < 0 || vs->crop_y < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): crop origin (%d, %d) outside the frame\n", __FILE__, __LINE__,
+                 vs->crop_x, vs->crop_y);
+        free (view);
+        return NULL;
+    }
+    vs->crop_x &= ~(align - 1);
+    if (vs->crop_x + vs->crop_w > w) vs->crop_w = w - vs->crop_x;
+    if (vs->crop_y + vs->crop_h > h) vs->crop_h = h - vs->crop_y;
+    vs->crop_w &= ~(align - 1);
+
+    if (vs->out_w <= 0 || vs->out_h <= 0)
+    {
+        vs->out_w = vs->crop_w;
+        vs->out_h = vs->crop_h;
+    }
+    vs->out_w &= ~(align - 1);
+
+    if (vs->crop_w <= 0 || vs->crop_h <= 0 || vs->out_w <= 0 || vs->out_h <= 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): invalid view\n", __FILE__, __LINE__);
+        free (view);
+        return NULL;
+    }
+
+    /* choose the cheapest kernel */
+    if (vs->out_w == vs->crop_w && vs->out_h == vs->crop_h)
+    {
+        if (vs->crop_w == w && vs->crop_h == h && (!vs->packed || stride == w * view->bpp))
+            view->method = VIEW_METHOD_NONE;
+        else
+            view->method = VIEW_METHOD_CROP;
+    }
+    else if (vs->out_w * 2 == vs->crop_w && vs->out_h * 2 == vs->crop_h &&
+             (vs->out_w % (2 * align)) == 0)
+        view->method = VIEW_METHOD_BOX2X;
+    else if (vs->out_w * 4 == vs->crop_w && vs->out_h * 4 == vs->crop_h &&
+             (vs->out_w % (2 * align)) == 0)
+        view->method = VIEW_METHOD_BOX4X;
+    else
+        view->method = VIEW_METHOD_BILINEAR;
+
+    view->stride = vs->out_w * view->bpp;
+    if (view->method != VIEW_METHOD_NONE && !(view->method == VIEW_METHOD_CROP && !vs->packed))
+    {
+        view->buf = (uint8_t *)malloc (view->stride * vs->out_h);
+        DBG_ASSERT (view->buf, "alloc failed");
+    }
+    if (view->method == VIEW_METHOD_BOX2X || view->method == VIEW_METHOD_BOX4X)
+    {
+        /* 4x: one source row + the half-size intermediate image */
+        int tmp_size = stride + (vs->crop_w / 2) * view->bpp * (vs->crop_h / 2);
+        view->tmp = (uint8_t *)malloc (tmp_size);
+        DBG_ASSERT (view->tmp, "alloc failed");
+    }
+
+    pthread_mutex_init (&view->mutex, NULL);
+    return view;
+}
+
+void
+frame_view_destroy (frame_view_t *view)
+{
+    pthread_mutex_destroy (&view->mutex);
+    free (view->tmp);
+    free (view->buf);
+    free (view);
+}
+
+static void *
+compute_view (frame_view_t *view, capture_frame_t *frame, int *stride)
+{
+    frame_view_spec_t *vs = &view->spec;
+    uint8_t *src = (uint8_t *)frame->vaddr + vs->crop_y * view->src_stride + vs->crop_x * view->bpp;
+    int y;
+
+    switch (view->method)
+    {
+    case VIEW_METHOD_NONE:
+        *stride = view->src_stride;
+        return frame->vaddr;
+
+    case VIEW_METHOD_CROP:
+        if (!vs->packed)
+        {
+            *stride = view->src_stride;
+            return src;
+        }
+        for (y = 0; y < vs->crop_h; y ++)
+            memcpy (view->buf + y * view->stride, src + y * view->src_stride, view->stride);
+        break;
+
+    case VIEW_METHOD_BOX2X:
+        box2x (view, view->buf, view->stride, src, view->src_stride, vs->crop_w, vs->crop_h);
+        break;
+
+    case VIEW_METHOD_BOX4X:
+    {
+        uint8_t *half = view->tmp + view->src_stride;
+        int half_stride = (vs->crop_w / 2) * view->bpp;
+        box2x (view, half, half_stride, src, view->src_stride, vs->crop_w, vs->crop_h);
+        box2x (view, view->buf, view->stride, half, half_stride, vs->crop_w / 2, vs->crop_h / 2);
+        break;
+    }
+
+    case VIEW_METHOD_BILINEAR:
+        resize_bilinear (view, view->buf, view->stride, src, view->src_stride, vs->crop_w, vs->crop_h);
+        break;
+    }
+
+    *stride = view->stride;
+    return view->buf;
+}
+
+/*
+ *  returns the derived image of the frame (and its stride).
+ *  the result stays valid until the view is asked for another frame.
+ */
+void *
+frame_view_get (frame_view_t *view, capture_frame_t *frame, int *stride)
+{
+    void *out;
+    int   out_stride;
+
+    pthread_mutex_lock (&view->mutex);
+    if (view->cached_frame == frame && view->cached_seq == frame->v4l_buf.sequence && view->cached_out)
+    {
+        out = view->cached_out;
+        out_stride = (out == view->buf) ? view->stride : view->src_stride;
+    }
+    else
+    {
+        TRACE_BEGIN ("frame_view_get");
+        out = compute_view (view, frame, &out_stride);
+        TRACE_END ("frame_view_get");
+
+        view->cached_frame = frame;
+        view->cached_seq   = frame->v4l_buf.sequence;
+        view->cached_out   = out;
+    }
+    pthread_mutex_unlock (&view->mutex);
+
+    if (stride)
+        *stride = out_stride;
+    return out;
+}
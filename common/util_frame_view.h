@@ -0,0 +1,57 @@
+#ifndef _UTIL_FRAME_VIEW_H_
+#define _UTIL_FRAME_VIEW_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "util_v4l2.h"
+
+/*
+ *  Derived outputs of a capture frame: crop, 2x/4x box downscale and
+ *  bilinear resize of GREY / YUYV frames.
+ *
+ *  A view is computed lazily, at most once per frame, on the first
+ *  frame_view_get() for that frame; later callers share the result.
+ *  A crop without scaling returns a pointer into the frame itself
+ *  (no copy) unless a packed output is requested.
+ */
+enum frame_view_method {
+    VIEW_METHOD_NONE = 0,       /* full frame, returned as is   */
+    VIEW_METHOD_CROP,
+    VIEW_METHOD_BOX2X,
+    VIEW_METHOD_BOX4X,
+    VIEW_METHOD_BILINEAR,
+};
+
+typedef struct _frame_view_spec_t
+{
+    int crop_x, crop_y;
+    int crop_w, crop_h;         /* 0: full frame          */
+    int out_w,  out_h;          /* 0: same as crop size   */
+    int packed;                 /* output stride == out_w * bytes per pixel */
+} frame_view_spec_t;
+
+typedef struct _frame_view_t
+{
+    frame_view_spec_t spec;
+    int             method;
+
+    unsigned int    fourcc;
+    int             bpp;        /* bytes per pixel */
+    void            (*hpair) (uint8_t *dst, const uint8_t *src, int out_n);
+    int             src_w, src_h, src_stride;
+
+    uint8_t         *buf;
+    uint8_t         *tmp;       /* intermediate for 4x */
+    int             stride;
+
+    capture_frame_t *cached_frame;
+    uint32_t        cached_seq;
+    void            *cached_out;
+    pthread_mutex_t mutex;
+} frame_view_t;
+
+frame_view_t *frame_view_create  (unsigned int fourcc, int w, int h, int stride, frame_view_spec_t *spec);
+void          frame_view_destroy (frame_view_t *view);
+void         *frame_view_get     (frame_view_t *view, capture_frame_t *frame, int *stride);
+
+#endif /* _UTIL_FRAME_VIEW_H_ */
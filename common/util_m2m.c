@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/videodev2.h>
+#include "util_m2m.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+
+#define ERRSTR strerror(errno)
+
+#define BITSTREAM_BUFFER_COUNT  4
+
+
+/* ------------------------------------------------------------------------ *
+ *  device discovery
+ * ------------------------------------------------------------------------ */
+/* 1: single planar M2M, 2: multi planar M2M, 0: not a mem2mem device */
+static int
+get_m2m_type (int v4l_fd)
+{
+    struct v4l2_capability caps = {0};
+    unsigned int caps_flag;
+
+    if (ioctl (v4l_fd, VIDIOC_QUERYCAP, &caps) < 0)
+        return 0;
+
+    if (caps.capabilities & V4L2_CAP_DEVICE_CAPS)
+        caps_flag = caps.device_caps;
+    else
+        caps_flag = caps.capabilities;
+
+    if (caps_flag & V4L2_CAP_VIDEO_M2M_MPLANE)
+        return 2;
+    if (caps_flag & V4L2_CAP_VIDEO_M2M)
+        return 1;
+    return 0;
+}
+
+static int
+has_format (int v4l_fd, unsigned int buftype, unsigned int fourcc)
+{
+    struct v4l2_fmtdesc fmtdesc = {0};
+
+    fmtdesc.type = buftype;
+    for (fmtdesc.index = 0; ioctl (v4l_fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index ++)
+    {
+        if (fmtdesc.pixelformat == fourcc)
+            return 1;
+    }
+    return 0;
+}
+
+/* first /dev/videoN that encodes in_fourcc to codec, or -1 */
+int
+m2m_enc_find_device (unsigned int in_fourcc, unsigned int codec)
+{
+    int i, v4l_fd, type;
+    char devname[64];
+
+    for (i = 0; i < 64; i ++)
+    {
+        snprintf (devname, 64, "/dev/video%d", i);
+        v4l_fd = open (devname, O_RDWR | O_CLOEXEC);
+        if (v4l_fd < 0)
+        {
+            if (errno == ENOENT)
+                break;
+            continue;
+        }
+
+        type = get_m2m_type (v4l_fd);
+        if (type)
+        {
+            unsigned int out_type = (type == 2) ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE  : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+            unsigned int cap_type = (type == 2) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+            if (has_format (v4l_fd, out_type, in_fourcc) && has_format (v4l_fd, cap_type, codec))
+            {
+                close (v4l_fd);
+                return i;
+            }
+        }
+        close (v4l_fd);
+    }
+    return -1;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  queue setup
+ * ------------------------------------------------------------------------ */
+static int
+set_format (m2m_enc_t *enc, unsigned int buftype, unsigned int fourcc, int bytesperline, struct v4l2_format *fmt)
+{
+    memset (fmt, 0, sizeof (*fmt));
+    fmt->type = buftype;
+
+    if (enc->mplane)
+    {
+        fmt->fmt.pix_mp.width       = enc->w;
+        fmt->fmt.pix_mp.height      = enc->h;
+        fmt->fmt.pix_mp.pixelformat = fourcc;
+        fmt->fmt.pix_mp.field       = V4L2_FIELD_NONE;
+        fmt->fmt.pix_mp.num_planes  = 1;
+        fmt->fmt.pix_mp.plane_fmt[0].bytesperline = bytesperline;
+    }
+    else
+    {
+        fmt->fmt.pix.width        = enc->w;
+        fmt->fmt.pix.height       = enc->h;
+        fmt->fmt.pix.pixelformat  = fourcc;
+        fmt->fmt.pix.field        = V4L2_FIELD_NONE;
+        fmt->fmt.pix.bytesperline = bytesperline;
+    }
+
+    if (ioctl (enc->v4l_fd, VIDIOC_S_FMT, fmt) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_S_FMT %.4s failed: %s\n", __FILE__, __LINE__, (char *)&fourcc, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+static int
+request_buffers (m2m_enc_t *enc, unsigned int buftype, unsigned int memtype, int count)
+{
+    struct v4l2_requestbuffers rqbufs = {0};
+
+    rqbufs.type   = buftype;
+    rqbufs.count  = count;
+    rqbufs.memory = memtype;
+
+    if (ioctl (enc->v4l_fd, VIDIOC_REQBUFS, &rqbufs) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_REQBUFS (memory %d) failed: %s\n", __FILE__, __LINE__, memtype, ERRSTR);
+        return -1;
+    }
+    return rqbufs.count;
+}
+
+static int
+queue_bitstream (m2m_enc_t *enc, m2m_bitstream_t *bs)
+{
+    struct v4l2_buffer buf = {0};
+    struct v4l2_plane plane = {0};
+
+    buf.index  = bs->index;
+    buf.type   = enc->cap_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (enc->mplane)
+    {
+        buf.m.planes = &plane;
+        buf.length   = 1;
+    }
+
+    return ioctl (enc->v4l_fd, VIDIOC_QBUF, &buf);
+}
+
+static int
+alloc_bitstream_buffers (m2m_enc_t *enc)
+{
+    int i, num;
+
+    num = request_buffers (enc, enc->cap_type, V4L2_MEMORY_MMAP, BITSTREAM_BUFFER_COUNT);
+    if (num <= 0)
+        return -1;
+
+    enc->bits = (m2m_bitstream_t *)calloc (num, sizeof (m2m_bitstream_t));
+    DBG_ASSERT (enc->bits, "alloc failed");
+    enc->bits_num = num;
+
+    for (i = 0; i < num; i ++)
+    {
+        struct v4l2_buffer buf = {0};
+        struct v4l2_plane plane = {0};
+        unsigned int length, offset;
+
+        buf.index  = i;
+        buf.type   = enc->cap_type;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (enc->mplane)
+        {
+            buf.m.planes = &plane;
+            buf.length   = 1;
+        }
+        DBG_ASSERT (ioctl (enc->v4l_fd, VIDIOC_QUERYBUF, &buf) == 0, "VIDIOC_QUERYBUF: %s\n", ERRSTR);
+
+        length = enc->mplane ? plane.length : buf.length;
+        offset = enc->mplane ? plane.m.mem_offset : buf.m.offset;
+
+        enc->bits[i].index  = i;
+        enc->bits[i].length = length;
+        enc->bits[i].vaddr  = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, enc->v4l_fd, offset);
+        DBG_ASSERT (enc->bits[i].vaddr != MAP_FAILED, "mmap");
+
+        DBG_ASSERT (queue_bitstream (enc, &enc->bits[i]) == 0, "VIDIOC_QBUF: %s\n", ERRSTR);
+    }
+    return 0;
+}
+
+static int
+stream_on (m2m_enc_t *enc, unsigned int buftype)
+{
+    int type = buftype;
+
+    if (ioctl (enc->v4l_fd, VIDIOC_STREAMON, &type) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): STREAMON failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+/*
+ *  in_fourcc/w/h/bytesperline describe the capture buffers; the encoder
+ *  must accept that exact layout for the DMABUF import to work.
+ *  out_num: number of capture buffers (OUTPUT slots).  devid < 0: search.
+ */
+m2m_enc_t *
+m2m_enc_open (int devid, unsigned int in_fourcc, int w, int h, int bytesperline,
+              int out_num, unsigned int codec)
+{
+    m2m_enc_t *enc;
+    struct v4l2_format fmt;
+    char devname[64];
+    int v4l_fd, type, stride;
+
+    if (devid < 0)
+        devid = m2m_enc_find_device (in_fourcc, codec);
+    if (devid < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): no encoder for %.4s -> %.4s\n", __FILE__, __LINE__,
+                 (char *)&in_fourcc, (char *)&codec);
+        return NULL;
+    }
+
+    snprintf (devname, 64, "/dev/video%d", devid);
+    v4l_fd = open (devname, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (v4l_fd < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): failed to open %s: %s\n", __FILE__, __LINE__, devname, ERRSTR);
+        return NULL;
+    }
+
+    type = get_m2m_type (v4l_fd);
+    if (type == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s is not a mem2mem device\n", __FILE__, __LINE__, devname);
+        close (v4l_fd);
+        return NULL;
+    }
+
+    enc = (m2m_enc_t *)calloc (1, sizeof (m2m_enc_t));
+    DBG_ASSERT (enc, "alloc failed");
+
+    snprintf (enc->dev_name, sizeof (enc->dev_name), "%s", devname);
+    enc->v4l_fd       = v4l_fd;
+    enc->mplane       = (type == 2);
+    enc->out_type     = enc->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE  : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    enc->cap_type     = enc->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    enc->in_fourcc    = in_fourcc;
+    enc->codec        = codec;
+    enc->w            = w;
+    enc->h            = h;
+    enc->bytesperline = bytesperline;
+
+    /* stateful encoder: coded format first, then the raw one */
+    if (set_format (enc, enc->cap_type, codec, 0, &fmt) < 0)
+        goto err;
+    if (set_format (enc, enc->out_type, in_fourcc, bytesperline, &fmt) < 0)
+        goto err;
+
+    stride = enc->mplane ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline : fmt.fmt.pix.bytesperline;
+    if ((enc->mplane ? fmt.fmt.pix_mp.pixelformat : fmt.fmt.pix.pixelformat) != in_fourcc ||
+        stride != bytesperline)
+    {
+        fprintf (stderr, "ERR: %s(%d): encoder wants %.4s stride %d, capture is %.4s stride %d\n",
+                 __FILE__, __LINE__, (char *)&fmt.fmt.pix.pixelformat, stride, (char *)&in_fourcc, bytesperline);
+        goto err;
+    }
+
+    if (request_buffers (enc, enc->out_type, V4L2_MEMORY_DMABUF, out_num) < out_num)
+        goto err;
+    enc->out_num    = out_num;
+    enc->out_frames = (capture_frame_t **)calloc (out_num, sizeof (capture_frame_t *));
+    DBG_ASSERT (enc->out_frames, "alloc failed");
+
+    if (alloc_bitstream_buffers (enc) < 0)
+        goto err;
+
+    if (stream_on (enc, enc->out_type) < 0 || stream_on (enc, enc->cap_type) < 0)
+        goto err;
+
+    fprintf (stderr, "encoder: %s, %.4s %dx%d -> %.4s\n", devname,
+             (char *)&in_fourcc, w, h, (char *)&codec);
+    return enc;
+
+err:
+    m2m_enc_close (enc);
+    return NULL;
+}
+
+void
+m2m_enc_close (m2m_enc_t *enc)
+{
+    int i, type;
+
+    type = enc->out_type;
+    ioctl (enc->v4l_fd, VIDIOC_STREAMOFF, &type);
+    type = enc->cap_type;
+    ioctl (enc->v4l_fd, VIDIOC_STREAMOFF, &type);
+
+    for (i = 0; i < enc->bits_num; i ++)
+    {
+        if (enc->bits[i].vaddr && enc->bits[i].vaddr != MAP_FAILED)
+            munmap (enc->bits[i].vaddr, enc->bits[i].length);
+    }
+
+    close (enc->v4l_fd);
+    free (enc->bits);
+    free (enc->out_frames);
+    free (enc);
+}
+
+/* key frame interval. not every encoder has the control */
+int
+m2m_enc_set_keyint (m2m_enc_t *enc, int keyint)
+{
+    struct v4l2_control ctrl = {0};
+
+    ctrl.id    = V4L2_CID_MPEG_VIDEO_GOP_SIZE;
+    ctrl.value = keyint;
+    return ioctl (enc->v4l_fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+/* make the next frame a key frame, e.g. where a recording starts */
+int
+m2m_enc_force_key (m2m_enc_t *enc)
+{
+    struct v4l2_control ctrl = {0};
+
+    ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    return ioctl (enc->v4l_fd, VIDIOC_S_CTRL, &ctrl);
+}
+
+/*
+ *  hand a capture frame to the encoder, by its exported dmabuf
+ *  (v4l2_export_capture_frame()). no copy is made.
+ */
+int
+m2m_enc_queue (m2m_enc_t *enc, capture_frame_t *frame)
+{
+    struct v4l2_buffer buf = {0};
+    struct v4l2_plane plane = {0};
+    int index = frame->v4l_buf.index;
+    unsigned int bytesused = frame->v4l_buf.bytesused ? frame->v4l_buf.bytesused : frame->length;
+
+    if (frame->prime_fd < 0 || index >= enc->out_num || enc->out_frames[index])
+    {
+        fprintf (stderr, "ERR: %s(%d): can't queue buffer %d\n", __FILE__, __LINE__, index);
+        return -1;
+    }
+
+    buf.index     = index;
+    buf.type      = enc->out_type;
+    buf.memory    = V4L2_MEMORY_DMABUF;
+    buf.field     = V4L2_FIELD_NONE;
+    buf.timestamp = frame->v4l_buf.timestamp;
+    if (enc->mplane)
+    {
+        plane.m.fd      = frame->prime_fd;
+        plane.length    = frame->length;
+        plane.bytesused = bytesused;
+        buf.m.planes    = &plane;
+        buf.length      = 1;
+    }
+    else
+    {
+        buf.m.fd      = frame->prime_fd;
+        buf.length    = frame->length;
+        buf.bytesused = bytesused;
+    }
+
+    TRACE_BEGIN ("m2m_enc_queue");
+    if (ioctl (enc->v4l_fd, VIDIOC_QBUF, &buf) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_QBUF (OUTPUT) failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        TRACE_END ("m2m_enc_queue");
+        return -1;
+    }
+    TRACE_END ("m2m_enc_queue");
+
+    enc->out_frames[index] = frame;
+    enc->inflight ++;
+
+    enc->pending[enc->pending_pos].ts_ns    = timeval_to_ns (frame->v4l_buf.timestamp);
+    enc->pending[enc->pending_pos].sequence = frame->v4l_buf.sequence;
+    enc->pending_pos = (enc->pending_pos + 1) % M2M_MAX_PENDING;
+
+    return 0;
+}
+
+/* capture frames the encoder has consumed, without waiting */
+int
+m2m_enc_reclaim (m2m_enc_t *enc, capture_frame_t **frames, int max)
+{
+    int num = 0;
+
+    while (num < max && enc->inflight > 0)
+    {
+        struct v4l2_buffer buf = {0};
+        struct v4l2_plane plane = {0};
+
+        buf.type   = enc->out_type;
+        buf.memory = V4L2_MEMORY_DMABUF;
+        if (enc->mplane)
+        {
+            buf.m.planes = &plane;
+            buf.length   = 1;
+        }
+        if (ioctl (enc->v4l_fd, VIDIOC_DQBUF, &buf) < 0)
+        {
+            DBG_ASSERT (errno == EAGAIN || errno == EPIPE, "VIDIOC_DQBUF (OUTPUT) failed: %s\n", ERRSTR);
+            break;
+        }
+
+        frames[num ++] = enc->out_frames[buf.index];
+        enc->out_frames[buf.index] = NULL;
+        enc->inflight --;
+    }
+
+    return num;
+}
+
+/*
+ *  next compressed frame, waiting up to timeout_ms (-1: forever).
+ *  NULL: none ready, or the end of stream after m2m_enc_stop().
+ */
+m2m_bitstream_t *
+m2m_enc_dequeue (m2m_enc_t *enc, int timeout_ms)
+{
+    struct v4l2_buffer buf = {0};
+    struct v4l2_plane plane = {0};
+    struct pollfd fds[1] = {0};
+    m2m_bitstream_t *bs;
+    uint64_t ts_ns;
+    int i, ret;
+
+    if (enc->eos)
+        return NULL;
+
+    fds[0].fd     = enc->v4l_fd;
+    fds[0].events = POLLIN;
+
+    TRACE_BEGIN ("m2m_enc_dequeue");
+    do {
+        ret = poll (fds, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret <= 0)
+    {
+        TRACE_END ("m2m_enc_dequeue");
+        return NULL;
+    }
+
+    buf.type   = enc->cap_type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (enc->mplane)
+    {
+        buf.m.planes = &plane;
+        buf.length   = 1;
+    }
+    ret = ioctl (enc->v4l_fd, VIDIOC_DQBUF, &buf);
+    TRACE_END ("m2m_enc_dequeue");
+
+    if (ret < 0)
+    {
+        if (errno == EPIPE)     /* already drained */
+            enc->eos = 1;
+        return NULL;
+    }
+
+    bs = &enc->bits[buf.index];
+    bs->bytesused = enc->mplane ? plane.bytesused : buf.bytesused;
+    bs->key       = (buf.flags & V4L2_BUF_FLAG_KEYFRAME) ||
+                    enc->codec == V4L2_PIX_FMT_JPEG || enc->codec == V4L2_PIX_FMT_MJPEG;
+
+    ts_ns = timeval_to_ns (buf.timestamp);
+    bs->ts_ns    = ts_ns;
+    bs->sequence = buf.sequence;
+    for (i = 0; i < M2M_MAX_PENDING; i ++)
+    {
+        if (enc->pending[i].ts_ns == ts_ns)
+        {
+            bs->sequence = enc->pending[i].sequence;
+            break;
+        }
+    }
+
+    if (buf.flags & V4L2_BUF_FLAG_LAST)
+    {
+        enc->eos = 1;
+        if (bs->bytesused == 0)
+            return NULL;
+    }
+
+    return bs;
+}
+
+int
+m2m_enc_release (m2m_enc_t *enc, m2m_bitstream_t *bs)
+{
+    int ret = queue_bitstream (enc, bs);
+
+    if (ret < 0 && !enc->eos)
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_QBUF (CAPTURE) failed: %s\n", __FILE__, __LINE__, ERRSTR);
+    return ret;
+}
+
+/* drain: the frames already queued still come out, the last one flagged */
+int
+m2m_enc_stop (m2m_enc_t *enc)
+{
+    struct v4l2_encoder_cmd cmd = {0};
+
+    cmd.cmd = V4L2_ENC_CMD_STOP;
+    if (ioctl (enc->v4l_fd, VIDIOC_ENCODER_CMD, &cmd) < 0)
+    {
+        /* no drain support: whatever is left is dropped */
+        enc->eos = 1;
+        return -1;
+    }
+    return 0;
+}
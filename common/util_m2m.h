@@ -0,0 +1,78 @@
+#ifndef _UTIL_M2M_H_
+#define _UTIL_M2M_H_
+
+#include <stdint.h>
+#include "util_v4l2.h"
+
+/*
+ *  Hardware encoder offload through a V4L2 mem2mem device
+ *  (stateful encoders: H.264, JPEG, or vicodec's FWHT).
+ *
+ *  Raw frames go in on the OUTPUT queue by DMABUF import of the capture
+ *  buffers, so nothing is copied: OUTPUT slot i always holds capture
+ *  buffer i. Compressed frames come out of the CAPTURE queue (MMAP).
+ *
+ *     capture --EXPBUF--> OUTPUT  [encoder]  CAPTURE --> recorder
+ *        ^                   |
+ *        +---- m2m_enc_reclaim ()
+ *
+ *  The capture frames handed to m2m_enc_queue() belong to the encoder
+ *  until m2m_enc_reclaim() returns them.
+ */
+#define M2M_MAX_PENDING     64
+
+typedef struct _m2m_bitstream_t
+{
+    int             index;
+    void            *vaddr;
+    unsigned int    length;
+
+    unsigned int    bytesused;
+    int             key;        /* decodable on its own */
+    uint32_t        sequence;   /* of the capture frame it was encoded from */
+    uint64_t        ts_ns;
+} m2m_bitstream_t;
+
+typedef struct _m2m_enc_t
+{
+    int             v4l_fd;
+    char            dev_name[64];
+    int             mplane;
+    unsigned int    out_type;   /* raw frames in    */
+    unsigned int    cap_type;   /* bitstream out    */
+
+    unsigned int    in_fourcc;
+    unsigned int    codec;      /* V4L2_PIX_FMT_H264, _JPEG, _FWHT, ... */
+    int             w, h, bytesperline;
+
+    int             out_num;
+    capture_frame_t **out_frames;   /* queued capture frame per OUTPUT slot */
+    int             inflight;
+
+    int             bits_num;
+    m2m_bitstream_t *bits;
+
+    /* capture sequence by timestamp; the driver copies only the timestamp */
+    struct {
+        uint64_t    ts_ns;
+        uint32_t    sequence;
+    } pending[M2M_MAX_PENDING];
+    int             pending_pos;
+
+    int             eos;        /* V4L2_BUF_FLAG_LAST seen */
+} m2m_enc_t;
+
+int              m2m_enc_find_device (unsigned int in_fourcc, unsigned int codec);
+m2m_enc_t       *m2m_enc_open  (int devid, unsigned int in_fourcc, int w, int h, int bytesperline,
+                                int out_num, unsigned int codec);
+void             m2m_enc_close (m2m_enc_t *enc);
+int              m2m_enc_set_keyint (m2m_enc_t *enc, int keyint);
+int              m2m_enc_force_key  (m2m_enc_t *enc);
+
+int              m2m_enc_queue   (m2m_enc_t *enc, capture_frame_t *frame);
+int              m2m_enc_reclaim (m2m_enc_t *enc, capture_frame_t **frames, int max);
+m2m_bitstream_t *m2m_enc_dequeue (m2m_enc_t *enc, int timeout_ms);
+int              m2m_enc_release (m2m_enc_t *enc, m2m_bitstream_t *bs);
+int              m2m_enc_stop    (m2m_enc_t *enc);
+
+#endif /* _UTIL_M2M_H_ */
@@ -0,0 +1,752 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/videodev2.h>
+#include <linux/v4l2-subdev.h>
+#include "util_media.h"
+#include "util_debug.h"
+#include "util_trace.h"
+
+#define ERRSTR strerror(errno)
+
+#define MAX_MEDIA_DEVICES   16
+#define CACHE_VERSION       2
+
+typedef struct _media_path_t
+{
+    int             num;
+    media_hop_t     hop[MEDIA_MAX_HOPS];    /* hop[0] ends at the video node */
+} media_path_t;
+
+typedef struct _pad_fmt_t
+{
+    uint32_t        entity;
+    int             pad;                    /* pad index */
+    struct v4l2_mbus_framefmt fmt;
+} pad_fmt_t;
+
+typedef struct _media_config_t
+{
+    media_path_t    path;
+    int             fmt_num;
+    pad_fmt_t       fmt[MEDIA_MAX_HOPS * 2];
+    int             width, height;          /* of the video node */
+} media_config_t;
+
+
+/* ------------------------------------------------------------------------ *
+ *  graph
+ * ------------------------------------------------------------------------ */
+media_graph_t *
+media_graph_open (const char *devname)
+{
+    media_graph_t *graph;
+    struct media_v2_topology *topo;
+    int fd;
+
+    fd = open (devname, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    graph = (media_graph_t *)calloc (1, sizeof (media_graph_t));
+    DBG_ASSERT (graph, "alloc failed");
+    graph->fd = fd;
+    topo = &graph->topo;
+
+    if (ioctl (fd, MEDIA_IOC_DEVICE_INFO, &graph->info) < 0 ||
+        ioctl (fd, MEDIA_IOC_G_TOPOLOGY, topo) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: %s\n", __FILE__, __LINE__, devname, ERRSTR);
+        media_graph_close (graph);
+        return NULL;
+    }
+
+    /* first call counts, second one fills */
+    graph->entities   = calloc (topo->num_entities + 1,   sizeof (struct media_v2_entity));
+    graph->interfaces = calloc (topo->num_interfaces + 1, sizeof (struct media_v2_interface));
+    graph->pads       = calloc (topo->num_pads + 1,       sizeof (struct media_v2_pad));
+    graph->links      = calloc (topo->num_links + 1,      sizeof (struct media_v2_link));
+    DBG_ASSERT (graph->entities && graph->interfaces && graph->pads && graph->links, "alloc failed");
+
+    topo->ptr_entities   = (uintptr_t)graph->entities;
+    topo->ptr_interfaces = (uintptr_t)graph->interfaces;
+    topo->ptr_pads       = (uintptr_t)graph->pads;
+    topo->ptr_links      = (uintptr_t)graph->links;
+    if (ioctl (fd, MEDIA_IOC_G_TOPOLOGY, topo) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): MEDIA_IOC_G_TOPOLOGY: %s\n", __FILE__, __LINE__, ERRSTR);
+        media_graph_close (graph);
+        return NULL;
+    }
+
+    return graph;
+}
+
+void
+media_graph_close (media_graph_t *graph)
+{
+    close (graph->fd);
+    free (graph->entities);
+    free (graph->interfaces);
+    free (graph->pads);
+    free (graph->links);
+    free (graph);
+}
+
+static struct media_v2_entity *
+find_entity (media_graph_t *graph, uint32_t id)
+{
+    uint32_t i;
+
+    for (i = 0; i < graph->topo.num_entities; i ++)
+    {
+        if (graph->entities[i].id == id)
+            return &graph->entities[i];
+    }
+    return NULL;
+}
+
+static struct media_v2_entity *
+find_entity_by_name (media_graph_t *graph, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < graph->topo.num_entities; i ++)
+    {
+        if (strcmp (graph->entities[i].name, name) == 0)
+            return &graph->entities[i];
+    }
+    return NULL;
+}
+
+static struct media_v2_pad *
+find_pad (media_graph_t *graph, uint32_t id)
+{
+    uint32_t i;
+
+    for (i = 0; i < graph->topo.num_pads; i ++)
+    {
+        if (graph->pads[i].id == id)
+            return &graph->pads[i];
+    }
+    return NULL;
+}
+
+/* pad index within its entity. before 4.19 only the order tells */
+static int
+pad_index (media_graph_t *graph, struct media_v2_pad *pad)
+{
+    uint32_t i;
+    int index = 0;
+
+    if (MEDIA_V2_PAD_HAS_INDEX (graph->info.media_version))
+        return pad->index;
+
+    for (i = 0; &graph->pads[i] != pad; i ++)
+    {
+        if (graph->pads[i].entity_id == pad->entity_id)
+            index ++;
+    }
+    return index;
+}
+
+static struct media_v2_pad *
+find_pad_by_index (media_graph_t *graph, uint32_t entity, int index)
+{
+    uint32_t i;
+
+    for (i = 0; i < graph->topo.num_pads; i ++)
+    {
+        if (graph->pads[i].entity_id == entity && pad_index (graph, &graph->pads[i]) == index)
+            return &graph->pads[i];
+    }
+    return NULL;
+}
+
+static int
+is_data_link (struct media_v2_link *link)
+{
+    return (link->flags & MEDIA_LNK_FL_LINK_TYPE) == MEDIA_LNK_FL_DATA_LINK;
+}
+
+static struct media_v2_link *
+find_link (media_graph_t *graph, uint32_t src_pad, uint32_t sink_pad)
+{
+    uint32_t i;
+
+    for (i = 0; i < graph->topo.num_links; i ++)
+    {
+        struct media_v2_link *link = &graph->links[i];
+        if (is_data_link (link) && link->source_id == src_pad && link->sink_id == sink_pad)
+            return link;
+    }
+    return NULL;
+}
+
+/* the device node interface of an entity */
+static struct media_v2_interface *
+find_interface (media_graph_t *graph, uint32_t entity)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < graph->topo.num_links; i ++)
+    {
+        struct media_v2_link *link = &graph->links[i];
+        if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_INTERFACE_LINK || link->sink_id != entity)
+            continue;
+
+        for (j = 0; j < graph->topo.num_interfaces; j ++)
+        {
+            if (graph->interfaces[j].id == link->source_id)
+                return &graph->interfaces[j];
+        }
+    }
+    return NULL;
+}
+
+/* /dev node of a char device, from sysfs */
+static int
+open_devnode (uint32_t major, uint32_t minor)
+{
+    char path[64], line[128], devname[160];
+    FILE *fp;
+    int fd = -1;
+
+    snprintf (path, sizeof (path), "/sys/dev/char/%u:%u/uevent", major, minor);
+    fp = fopen (path, "r");
+    if (fp == NULL)
+        return -1;
+
+    while (fgets (line, sizeof (line), fp))
+    {
+        if (strncmp (line, "DEVNAME=", 8) == 0)
+        {
+            line[strcspn (line, "\n")] = 0;
+            snprintf (devname, sizeof (devname), "/dev/%s", line + 8);
+            fd = open (devname, O_RDWR | O_CLOEXEC);
+            break;
+        }
+    }
+    fclose (fp);
+    return fd;
+}
+
+static int
+subdev_fmt (media_graph_t *graph, uint32_t entity, int pad, struct v4l2_mbus_framefmt *fmt, int set)
+{
+    struct media_v2_interface *intf = find_interface (graph, entity);
+    struct v4l2_subdev_format sfmt = {0};
+    int fd, ret;
+
+    if (intf == NULL || intf->intf_type != MEDIA_INTF_T_V4L_SUBDEV)
+        return -1;
+
+    fd = open_devnode (intf->devnode.major, intf->devnode.minor);
+    if (fd < 0)
+        return -1;
+
+    sfmt.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+    sfmt.pad   = pad;
+    if (set)
+    {
+        sfmt.format = *fmt;
+        ret = ioctl (fd, VIDIOC_SUBDEV_S_FMT, &sfmt);
+    }
+    else
+    {
+        ret = ioctl (fd, VIDIOC_SUBDEV_G_FMT, &sfmt);
+    }
+    close (fd);
+
+    if (ret < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s pad %d: %s\n", __FILE__, __LINE__,
+                 find_entity (graph, entity)->name, pad, ERRSTR);
+        return -1;
+    }
+    *fmt = sfmt.format;
+    return 0;
+}
+
+static int
+setup_link (media_graph_t *graph, struct media_v2_link *link, int enable)
+{
+    struct media_v2_pad *src  = find_pad (graph, link->source_id);
+    struct media_v2_pad *sink = find_pad (graph, link->sink_id);
+    struct media_link_desc desc = {0};
+
+    if (link->flags & MEDIA_LNK_FL_IMMUTABLE)
+        return 0;
+    if (!!(link->flags & MEDIA_LNK_FL_ENABLED) == !!enable)
+        return 0;
+
+    desc.source.entity = src->entity_id;
+    desc.source.index  = pad_index (graph, src);
+    desc.sink.entity   = sink->entity_id;
+    desc.sink.index    = pad_index (graph, sink);
+    desc.flags         = enable ? MEDIA_LNK_FL_ENABLED : 0;
+
+    if (ioctl (graph->fd, MEDIA_IOC_SETUP_LINK, &desc) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): link %s -> %s: %s\n", __FILE__, __LINE__,
+                 find_entity (graph, src->entity_id)->name, find_entity (graph, sink->entity_id)->name, ERRSTR);
+        return -1;
+    }
+
+    link->flags = (link->flags & ~MEDIA_LNK_FL_ENABLED) | desc.flags;
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  path search: walk upstream from the video node to every source entity
+ * ------------------------------------------------------------------------ */
+static int
+path_has_entity (media_graph_t *graph, media_path_t *path, uint32_t entity)
+{
+    int i;
+
+    for (i = 0; i < path->num; i ++)
+    {
+        if (find_pad (graph, path->hop[i].sink_pad)->entity_id == entity)
+            return 1;
+    }
+    return 0;
+}
+
+/* sensor area first, then links that are already enabled, then short paths */
+static int64_t
+score_path (media_graph_t *graph, media_path_t *path)
+{
+    media_hop_t *first = &path->hop[path->num - 1];
+    struct media_v2_pad *src = find_pad (graph, first->src_pad);
+    struct v4l2_mbus_framefmt fmt = {0};
+    int64_t area = 0;
+    int i, enabled = 0;
+
+    if (subdev_fmt (graph, src->entity_id, pad_index (graph, src), &fmt, 0) == 0)
+        area = (int64_t)fmt.width * fmt.height;
+
+    for (i = 0; i < path->num; i ++)
+    {
+        if (find_link (graph, path->hop[i].src_pad, path->hop[i].sink_pad)->flags & MEDIA_LNK_FL_ENABLED)
+            enabled ++;
+    }
+
+    return (area << 16) | (enabled << 8) | (255 - path->num);
+}
+
+static void
+search_path (media_graph_t *graph, uint32_t entity, media_path_t *cur, media_path_t *best, int64_t *best_score)
+{
+    uint32_t i, j;
+    int has_sink = 0;
+
+    for (i = 0; i < graph->topo.num_pads; i ++)
+    {
+        struct media_v2_pad *pad = &graph->pads[i];
+        if (pad->entity_id != entity || !(pad->flags & MEDIA_PAD_FL_SINK))
+            continue;
+        has_sink = 1;
+
+        for (j = 0; j < graph->topo.num_links; j ++)
+        {
+            struct media_v2_link *link = &graph->links[j];
+            if (!is_data_link (link) || link->sink_id != pad->id || cur->num == MEDIA_MAX_HOPS)
+                continue;
+
+            struct media_v2_pad *src = find_pad (graph, link->source_id);
+            if (src == NULL || path_has_entity (graph, cur, src->entity_id))
+                continue;
+
+            cur->hop[cur->num].src_pad  = link->source_id;
+            cur->hop[cur->num].sink_pad = link->sink_id;
+            cur->num ++;
+            search_path (graph, src->entity_id, cur, best, best_score);
+            cur->num --;
+        }
+    }
+
+    /* reached a source (sensor, pattern generator) */
+    if (!has_sink && cur->num > 0)
+    {
+        int64_t score = score_path (graph, cur);
+        if (score > *best_score)
+        {
+            *best_score = score;
+            *best = *cur;
+        }
+    }
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  apply
+ * ------------------------------------------------------------------------ */
+static int
+apply_links (media_graph_t *graph, media_path_t *path)
+{
+    uint32_t j;
+    int i;
+
+    for (i = 0; i < path->num; i ++)
+    {
+        struct media_v2_link *link = find_link (graph, path->hop[i].src_pad, path->hop[i].sink_pad);
+        if (link == NULL)
+            return -1;
+
+        /* a sink pad takes one stream: drop the competing links first */
+        for (j = 0; j < graph->topo.num_links; j ++)
+        {
+            struct media_v2_link *other = &graph->links[j];
+            if (other != link && is_data_link (other) && other->sink_id == link->sink_id)
+                setup_link (graph, other, 0);
+        }
+
+        if (setup_link (graph, link, 1) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int
+set_video_size (int v4l_fd, int w, int h)
+{
+    struct v4l2_capability caps = {0};
+    struct v4l2_format fmt = {0};
+    unsigned int caps_flag;
+
+    /* ISP video nodes (rkisp1, i.MX) are usually multi-planar */
+    if (ioctl (v4l_fd, VIDIOC_QUERYCAP, &caps) < 0)
+        return -1;
+    caps_flag = (caps.capabilities & V4L2_CAP_DEVICE_CAPS) ? caps.device_caps : caps.capabilities;
+
+    fmt.type = (caps_flag & V4L2_CAP_VIDEO_CAPTURE_MPLANE) ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+                                                           : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (ioctl (v4l_fd, VIDIOC_G_FMT, &fmt) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_G_FMT: %s\n", __FILE__, __LINE__, ERRSTR);
+        return -1;
+    }
+
+    if (fmt.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+    {
+        fmt.fmt.pix_mp.width  = w;
+        fmt.fmt.pix_mp.height = h;
+    }
+    else
+    {
+        fmt.fmt.pix.width  = w;
+        fmt.fmt.pix.height = h;
+    }
+    if (ioctl (v4l_fd, VIDIOC_S_FMT, &fmt) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_S_FMT %dx%d: %s\n", __FILE__, __LINE__, w, h, ERRSTR);
+        return -1;
+    }
+    return 0;
+}
+
+/* sensor format downstream, pad by pad; records what each pad took */
+static int
+propagate_formats (media_graph_t *graph, media_config_t *cfg)
+{
+    media_path_t *path = &cfg->path;
+    struct media_v2_pad *src = find_pad (graph, path->hop[path->num - 1].src_pad);
+    struct v4l2_mbus_framefmt fmt;
+    pad_fmt_t *pf;
+    int i;
+
+    cfg->fmt_num = 0;
+    if (subdev_fmt (graph, src->entity_id, pad_index (graph, src), &fmt, 0) < 0)
+        return -1;
+
+    pf = &cfg->fmt[cfg->fmt_num ++];
+    pf->entity = src->entity_id;
+    pf->pad    = pad_index (graph, src);
+    pf->fmt    = fmt;
+
+    /* hop[0] ends at the video node, which is not a subdev */
+    for (i = path->num - 1; i > 0; i --)
+    {
+        struct media_v2_pad *sink = find_pad (graph, path->hop[i].sink_pad);
+        struct media_v2_pad *out  = find_pad (graph, path->hop[i - 1].src_pad);
+        struct v4l2_mbus_framefmt ofmt;
+
+        if (subdev_fmt (graph, sink->entity_id, pad_index (graph, sink), &fmt, 1) < 0)
+            return -1;
+        pf = &cfg->fmt[cfg->fmt_num ++];
+        pf->entity = sink->entity_id;
+        pf->pad    = pad_index (graph, sink);
+        pf->fmt    = fmt;
+
+        /* the entity may convert the code (debayer) or scale: start from
+         * what it proposes for its source pad, at the incoming size */
+        if (subdev_fmt (graph, out->entity_id, pad_index (graph, out), &ofmt, 0) < 0)
+            return -1;
+        ofmt.width  = fmt.width;
+        ofmt.height = fmt.height;
+        if (subdev_fmt (graph, out->entity_id, pad_index (graph, out), &ofmt, 1) < 0)
+            return -1;
+        pf = &cfg->fmt[cfg->fmt_num ++];
+        pf->entity = out->entity_id;
+        pf->pad    = pad_index (graph, out);
+        pf->fmt    = ofmt;
+
+        fmt = ofmt;
+    }
+
+    cfg->width  = fmt.width;
+    cfg->height = fmt.height;
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  cache: the chosen links and pad formats, by entity name
+ * ------------------------------------------------------------------------ */
+static void
+save_cache (media_graph_t *graph, media_config_t *cfg, const char *cache_path)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen (cache_path, "w");
+    if (fp == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: %s\n", __FILE__, __LINE__, cache_path, ERRSTR);
+        return;
+    }
+
+    fprintf (fp, "v4l2_app media %d\n", CACHE_VERSION);
+    fprintf (fp, "device \"%s\" \"%s\" %u %u %u\n", graph->info.model, graph->info.bus_info,
+             graph->info.driver_version, graph->topo.num_entities, graph->topo.num_links);
+
+    /* one graph, several capture nodes (mainpath, selfpath): each its own path */
+    fprintf (fp, "node \"%s\"\n",
+             find_entity (graph, find_pad (graph, cfg->path.hop[0].sink_pad)->entity_id)->name);
+
+    for (i = 0; i < cfg->path.num; i ++)
+    {
+        struct media_v2_pad *src  = find_pad (graph, cfg->path.hop[i].src_pad);
+        struct media_v2_pad *sink = find_pad (graph, cfg->path.hop[i].sink_pad);
+        fprintf (fp, "link \"%s\" %d \"%s\" %d\n",
+                 find_entity (graph, src->entity_id)->name,  pad_index (graph, src),
+                 find_entity (graph, sink->entity_id)->name, pad_index (graph, sink));
+    }
+
+    for (i = 0; i < cfg->fmt_num; i ++)
+    {
+        pad_fmt_t *pf = &cfg->fmt[i];
+        fprintf (fp, "fmt \"%s\" %d %u %u 0x%04x %u %u\n", find_entity (graph, pf->entity)->name,
+                 pf->pad, pf->fmt.width, pf->fmt.height, pf->fmt.code, pf->fmt.field, pf->fmt.colorspace);
+    }
+
+    fprintf (fp, "video %d %d\n", cfg->width, cfg->height);
+    fclose (fp);
+}
+
+/* 0: cfg filled from a cache made for this very graph and video node */
+static int
+load_cache (media_graph_t *graph, uint32_t video_entity, media_config_t *cfg, const char *cache_path)
+{
+    FILE *fp;
+    char line[512], name0[64], name1[64], model[64], bus[64];
+    unsigned int version, drv, nent, nlink;
+    int ok = 0, node_ok = 0;
+
+    fp = fopen (cache_path, "r");
+    if (fp == NULL)
+        return -1;
+
+    memset (cfg, 0, sizeof (*cfg));
+    while (fgets (line, sizeof (line), fp))
+    {
+        int p0, p1;
+        pad_fmt_t pf = {0};
+        struct v4l2_mbus_framefmt *f = &pf.fmt;
+
+        if (sscanf (line, "v4l2_app media %u", &version) == 1)
+        {
+            if (version != CACHE_VERSION)
+                goto err;
+        }
+        else if (sscanf (line, "device \"%63[^\"]\" \"%63[^\"]\" %u %u %u", model, bus, &drv, &nent, &nlink) == 5)
+        {
+            if (strcmp (model, graph->info.model) || strcmp (bus, graph->info.bus_info) ||
+                drv != graph->info.driver_version || nent != graph->topo.num_entities ||
+                nlink != graph->topo.num_links)
+                goto err;
+            ok = 1;
+        }
+        else if (sscanf (line, "node \"%63[^\"]\"", name0) == 1)
+        {
+            if (strcmp (name0, find_entity (graph, video_entity)->name))
+                goto err;
+            node_ok = 1;
+        }
+        else if (sscanf (line, "link \"%63[^\"]\" %d \"%63[^\"]\" %d", name0, &p0, name1, &p1) == 4)
+        {
+            struct media_v2_entity *e0 = find_entity_by_name (graph, name0);
+            struct media_v2_entity *e1 = find_entity_by_name (graph, name1);
+            struct media_v2_pad *src   = e0 ? find_pad_by_index (graph, e0->id, p0) : NULL;
+            struct media_v2_pad *sink  = e1 ? find_pad_by_index (graph, e1->id, p1) : NULL;
+
+            if (src == NULL || sink == NULL || cfg->path.num == MEDIA_MAX_HOPS)
+                goto err;
+            cfg->path.hop[cfg->path.num].src_pad  = src->id;
+            cfg->path.hop[cfg->path.num].sink_pad = sink->id;
+            cfg->path.num ++;
+        }
+        else if (sscanf (line, "fmt \"%63[^\"]\" %d %u %u %x %u %u", name0, &pf.pad,
+                         &f->width, &f->height, &f->code, &f->field, &f->colorspace) == 7)
+        {
+            struct media_v2_entity *e = find_entity_by_name (graph, name0);
+            if (e == NULL || cfg->fmt_num == MEDIA_MAX_HOPS * 2)
+                goto err;
+            pf.entity = e->id;
+            cfg->fmt[cfg->fmt_num ++] = pf;
+        }
+        else if (sscanf (line, "video %d %d", &cfg->width, &cfg->height) == 2)
+        {
+        }
+    }
+    fclose (fp);
+
+    return (ok && node_ok && cfg->path.num > 0 && cfg->width > 0) ? 0 : -1;
+
+err:
+    fclose (fp);
+    return -1;
+}
+
+static int
+apply_cache (media_graph_t *graph, media_config_t *cfg)
+{
+    int i;
+
+    if (apply_links (graph, &cfg->path) < 0)
+        return -1;
+
+    for (i = 0; i < cfg->fmt_num; i ++)
+    {
+        struct v4l2_mbus_framefmt fmt = cfg->fmt[i].fmt;
+        if (subdev_fmt (graph, cfg->fmt[i].entity, cfg->fmt[i].pad, &fmt, 1) < 0)
+            return -1;
+        if (fmt.width != cfg->fmt[i].fmt.width || fmt.height != cfg->fmt[i].fmt.height ||
+            fmt.code != cfg->fmt[i].fmt.code)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+/* the media device and entity behind a video node. NULL: not in a graph */
+media_graph_t *
+media_graph_find (int v4l_fd, uint32_t *entity)
+{
+    struct stat st;
+    char devname[64];
+    int i;
+    uint32_t j;
+
+    if (fstat (v4l_fd, &st) < 0)
+        return NULL;
+
+    for (i = 0; i < MAX_MEDIA_DEVICES; i ++)
+    {
+        snprintf (devname, sizeof (devname), "/dev/media%d", i);
+        media_graph_t *graph = media_graph_open (devname);
+        if (graph == NULL)
+            continue;
+
+        for (j = 0; j < graph->topo.num_interfaces; j ++)
+        {
+            struct media_v2_interface *intf = &graph->interfaces[j];
+            if (intf->intf_type != MEDIA_INTF_T_V4L_VIDEO ||
+                intf->devnode.major != major (st.st_rdev) || intf->devnode.minor != minor (st.st_rdev))
+                continue;
+
+            uint32_t k;
+            for (k = 0; k < graph->topo.num_links; k ++)
+            {
+                struct media_v2_link *link = &graph->links[k];
+                if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) == MEDIA_LNK_FL_INTERFACE_LINK &&
+                    link->source_id == intf->id)
+                {
+                    *entity = link->sink_id;
+                    return graph;
+                }
+            }
+        }
+        media_graph_close (graph);
+    }
+    return NULL;
+}
+
+/*
+ *  returns 0 once the pipeline feeding v4l_fd is set up, -1 if the node
+ *  is not part of a media graph or no working path was found.
+ */
+int
+media_setup_pipeline (int v4l_fd, const char *cache_path)
+{
+    media_graph_t *graph;
+    media_config_t cfg;
+    media_path_t cur = {0};
+    int64_t best_score = -1;
+    uint32_t video_entity;
+    int ret = -1;
+
+    TRACE_BEGIN ("media_setup_pipeline");
+
+    graph = media_graph_find (v4l_fd, &video_entity);
+    if (graph == NULL)
+        goto out;
+
+    /* fast path: the same graph as last time */
+    if (cache_path && load_cache (graph, video_entity, &cfg, cache_path) == 0 &&
+        apply_cache (graph, &cfg) == 0 && set_video_size (v4l_fd, cfg.width, cfg.height) == 0)
+    {
+        fprintf (stderr, "media: %s, cached pipeline (%d links), %dx%d\n",
+                 graph->info.model, cfg.path.num, cfg.width, cfg.height);
+        ret = 0;
+        goto out;
+    }
+
+    memset (&cfg, 0, sizeof (cfg));
+    search_path (graph, video_entity, &cur, &cfg.path, &best_score);
+    if (cfg.path.num == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): no source reaches %s\n", __FILE__, __LINE__,
+                 find_entity (graph, video_entity)->name);
+        goto out;
+    }
+
+    if (apply_links (graph, &cfg.path) < 0 || propagate_formats (graph, &cfg) < 0 ||
+        set_video_size (v4l_fd, cfg.width, cfg.height) < 0)
+        goto out;
+
+    fprintf (stderr, "media: %s, %s -> %s (%d links), %dx%d\n", graph->info.model,
+             find_entity (graph, find_pad (graph, cfg.path.hop[cfg.path.num - 1].src_pad)->entity_id)->name,
+             find_entity (graph, video_entity)->name, cfg.path.num, cfg.width, cfg.height);
+
+    if (cache_path)
+        save_cache (graph, &cfg, cache_path);
+    ret = 0;
+
+out:
+    if (graph)
+        media_graph_close (graph);
+    TRACE_END ("media_setup_pipeline");
+    return ret;
+}
@@ -0,0 +1,51 @@
+#ifndef _UTIL_MEDIA_H_
+#define _UTIL_MEDIA_H_
+
+#include <stdint.h>
+#include <linux/media.h>
+
+/*
+ *  Media controller pipeline setup for ISP based cameras (i.MX, Rockchip,
+ *  vimc), where /dev/videoN only streams once the links of the media
+ *  graph are enabled and the subdev formats agree along the path.
+ *
+ *  media_setup_pipeline() finds the /dev/mediaN that owns the video node,
+ *  picks the path from a sensor to it (largest sensor format, then
+ *  already enabled links, then fewest hops), enables its links, disables
+ *  competing links into the same pads, and propagates the sensor format
+ *  pad by pad. The video node gets the resulting size.
+ *
+ *  The path and formats are saved to cache_path; when the graph and the
+ *  video node are the same on the next start they are applied without
+ *  searching.
+ *
+ *     [sensor]:0 -> 0:[csi]:1 -> 0:[isp]:1 -> [video node]
+ */
+#define MEDIA_MAX_HOPS      16
+
+typedef struct _media_hop_t
+{
+    uint32_t    src_pad;        /* pad ids in the topology */
+    uint32_t    sink_pad;
+} media_hop_t;
+
+typedef struct _media_graph_t
+{
+    int         fd;
+    struct media_device_info info;
+    struct media_v2_topology topo;
+
+    struct media_v2_entity    *entities;
+    struct media_v2_interface *interfaces;
+    struct media_v2_pad       *pads;
+    struct media_v2_link      *links;
+} media_graph_t;
+
+/* v4l_fd: the capture video node. cache_path NULL: no cache */
+int            media_setup_pipeline (int v4l_fd, const char *cache_path);
+
+media_graph_t *media_graph_open  (const char *devname);
+void           media_graph_close (media_graph_t *graph);
+media_graph_t *media_graph_find  (int v4l_fd, uint32_t *entity);
+
+#endif /* _UTIL_MEDIA_H_ */
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "util_mempool.h"
+#include "util_debug.h"
+
+#define HUGEPAGE_SIZE   (2 * 1024 * 1024)
+
+static size_t
+round_up (size_t v, size_t align)
+{
+    return (v + align - 1) & ~(align - 1);
+}
+
+mempool_t *
+mempool_create (size_t slot_size, int slot_num, int flags)
+{
+    mempool_t *pool;
+    size_t page = sysconf (_SC_PAGESIZE);
+    int populate = (flags & MEMPOOL_POPULATE) ? MAP_POPULATE : 0;
+
+    pool = (mempool_t *)calloc (1, sizeof (mempool_t));
+    DBG_ASSERT (pool, "alloc failed");
+
+    pool->slot_size = round_up (slot_size, page);
+    pool->slot_num  = slot_num;
+    pool->map_size  = pool->slot_size * slot_num;
+    pool->base      = MAP_FAILED;
+
+    if (flags & MEMPOOL_HUGEPAGE)
+    {
+        pool->map_size = round_up (pool->map_size, HUGEPAGE_SIZE);
+        pool->base = mmap (NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+        if (pool->base != MAP_FAILED)
+            pool->hugetlb = 1;
+        else
+            fprintf (stderr, "no hugetlb pages (%s), using transparent huge pages.\n", strerror (errno));
+    }
+
+    if (pool->base == MAP_FAILED)
+    {
+        pool->base = mmap (NULL, pool->map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool->base == MAP_FAILED)
+        {
+            fprintf (stderr, "ERR: %s(%d): mmap %zu bytes: %s\n", __FILE__, __LINE__, pool->map_size, strerror (errno));
+            free (pool);
+            return NULL;
+        }
+
+        /* must be advised before the first touch */
+        if (flags & MEMPOOL_HUGEPAGE)
+            madvise (pool->base, pool->map_size, MADV_HUGEPAGE);
+        if (populate)
+            memset (pool->base, 0, pool->map_size);
+    }
+
+    return pool;
+}
+
+mempool_t *
+mempool_wrap (void *base, size_t slot_size, int slot_num)
+{
+    mempool_t *pool;
+    size_t page = sysconf (_SC_PAGESIZE);
+
+    if ((uintptr_t)base & (page - 1))
+    {
+        fprintf (stderr, "ERR: %s(%d): arena %p is not page aligned\n", __FILE__, __LINE__, base);
+        return NULL;
+    }
+
+    /* every slot after the first starts at base + n * slot_size */
+    if (slot_size == 0 || (slot_size & (page - 1)))
+    {
+        fprintf (stderr, "ERR: %s(%d): slot size %zu is not a multiple of the page size (%zu)\n",
+                 __FILE__, __LINE__, slot_size, page);
+        return NULL;
+    }
+
+    pool = (mempool_t *)calloc (1, sizeof (mempool_t));
+    DBG_ASSERT (pool, "alloc failed");
+
+    pool->base      = base;
+    pool->slot_size = slot_size;
+    pool->slot_num  = slot_num;
+
+    return pool;
+}
+
+void
+mempool_destroy (mempool_t *pool)
+{
+    if (pool->map_size)
+        munmap (pool->base, pool->map_size);
+    free (pool);
+}
+
+void *
+mempool_slot (mempool_t *pool, int index)
+{
+    if (index < 0 || index >= pool->slot_num)
+        return NULL;
+
+    return (char *)pool->base + pool->slot_size * index;
+}
@@ -0,0 +1,38 @@
+#ifndef _UTIL_MEMPOOL_H_
+#define _UTIL_MEMPOOL_H_
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Fixed-size frame slots in one contiguous arena, for V4L2_MEMORY_USERPTR.
+ *
+ *  Slots are page aligned. With MEMPOOL_HUGEPAGE the arena is taken from
+ *  hugetlbfs (MAP_HUGETLB), falling back to transparent huge pages when no
+ *  huge pages are reserved. An application can also wrap its own arena.
+ */
+#define MEMPOOL_HUGEPAGE    (1 << 0)
+#define MEMPOOL_POPULATE    (1 << 1)    /* prefault at creation */
+
+typedef struct _mempool_t
+{
+    void        *base;
+    size_t      map_size;       /* 0: wrapped, not owned */
+    size_t      slot_size;
+    int         slot_num;
+    int         hugetlb;        /* backed by MAP_HUGETLB */
+} mempool_t;
+
+mempool_t *mempool_create  (size_t slot_size, int slot_num, int flags);
+mempool_t *mempool_wrap    (void *base, size_t slot_size, int slot_num);
+void       mempool_destroy (mempool_t *pool);
+void      *mempool_slot    (mempool_t *pool, int index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_MEMPOOL_H_ */
@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "util_metrics.h"
+#include "util_debug.h"
+#include "util_time.h"
+
+#define ATOMIC_ADD(p, v)    __atomic_fetch_add (p, v, __ATOMIC_RELAXED)
+#define ATOMIC_GET(p)       __atomic_load_n (p, __ATOMIC_RELAXED)
+#define ATOMIC_SET(p, v)    __atomic_store_n (p, v, __ATOMIC_RELAXED)
+
+static metrics_dev_t   *s_dev_list = NULL;
+static pthread_mutex_t s_dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_hist_t  s_drm_commit;
+
+
+/* ------------------------------------------------------------------------ *
+ *  update (hot path)
+ * ------------------------------------------------------------------------ */
+metrics_dev_t *
+metrics_register_device (const char *name)
+{
+    metrics_dev_t *mdev;
+
+    mdev = (metrics_dev_t *)calloc (1, sizeof (metrics_dev_t));
+    DBG_ASSERT (mdev, "alloc failed");
+
+    snprintf (mdev->name, sizeof (mdev->name), "%s", name);
+
+    pthread_mutex_lock (&s_dev_mutex);
+    mdev->next = s_dev_list;
+    s_dev_list = mdev;
+    pthread_mutex_unlock (&s_dev_mutex);
+
+    return mdev;
+}
+
+/* no more updates may come for mdev: it is freed here */
+void
+metrics_unregister_device (metrics_dev_t *mdev)
+{
+    metrics_dev_t **pp;
+
+    pthread_mutex_lock (&s_dev_mutex);
+    for (pp = &s_dev_list; *pp; pp = &(*pp)->next)
+    {
+        if (*pp == mdev)
+        {
+            *pp = mdev->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock (&s_dev_mutex);
+
+    free (mdev);
+}
+
+void
+metrics_hist_observe (metrics_hist_t *hist, uint64_t ns)
+{
+    int idx = ns ? 63 - __builtin_clzll (ns) : 0;
+    if (idx >= METRICS_HIST_BUCKETS)
+        idx = METRICS_HIST_BUCKETS - 1;
+
+    ATOMIC_ADD (&hist->bucket[idx], 1);
+    ATOMIC_ADD (&hist->sum_ns, ns);
+    ATOMIC_ADD (&hist->count, 1);
+
+    uint64_t max = ATOMIC_GET (&hist->max_ns);
+    while (ns > max &&
+           !__atomic_compare_exchange_n (&hist->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+uint64_t
+metrics_hist_quantile_ns (metrics_hist_t *hist, double q)
+{
+    uint64_t count = ATOMIC_GET (&hist->count);
+    uint64_t rank  = (uint64_t)(q * count);
+    uint64_t acc   = 0;
+    int i;
+
+    if (count == 0)
+        return 0;
+
+    for (i = 0; i < METRICS_HIST_BUCKETS; i ++)
+    {
+        uint64_t n = ATOMIC_GET (&hist->bucket[i]);
+        if (acc + n > rank)
+        {
+            /* interpolate linearly inside [2^i, 2^(i+1)) */
+            uint64_t lo = 1ULL << i;
+            return lo + (uint64_t)(lo * ((double)(rank - acc) / (double)n));
+        }
+        acc += n;
+    }
+    return 1ULL << (METRICS_HIST_BUCKETS - 1);
+}
+
+void
+metrics_count_frame (metrics_dev_t *mdev, uint32_t sequence, uint64_t dq_latency_ns, int error)
+{
+    uint64_t now = get_monotonic_ns ();
+
+    if (mdev == NULL)
+        return;
+
+    ATOMIC_ADD (&mdev->frames, 1);
+    ATOMIC_ADD (&mdev->queued, -1);
+
+    if (error)
+        ATOMIC_ADD (&mdev->err_frames, 1);
+
+    /* last_seq / last_frame_ns are touched by the capture thread only */
+    if (mdev->has_seq && sequence != mdev->last_seq + 1)
+    {
+        uint32_t lost = sequence - mdev->last_seq - 1;
+        ATOMIC_ADD (&mdev->seq_gaps, 1);
+        ATOMIC_ADD (&mdev->drops, lost);
+    }
+    mdev->last_seq = sequence;
+    mdev->has_seq  = 1;
+
+    if (mdev->last_frame_ns)
+    {
+        uint64_t interval = now - mdev->last_frame_ns;
+        uint32_t fps_x1000 = interval ? (uint32_t)(1000000000000ULL / interval) : 0;
+        uint32_t old = ATOMIC_GET (&mdev->fps_x1000);
+
+        /* exponential moving average, 1/8 weight */
+        if (old)
+            fps_x1000 = old - (old >> 3) + (fps_x1000 >> 3);
+        ATOMIC_SET (&mdev->fps_x1000, fps_x1000);
+    }
+    mdev->last_frame_ns = now;
+
+    if (dq_latency_ns)
+        metrics_hist_observe (&mdev->dq_latency, dq_latency_ns);
+}
+
+void
+metrics_add_queued (metrics_dev_t *mdev, int n)
+{
+    if (mdev)
+        ATOMIC_ADD (&mdev->queued, n);
+}
+
+void
+metrics_add_written (metrics_dev_t *mdev, uint64_t bytes)
+{
+    if (mdev)
+        ATOMIC_ADD (&mdev->bytes_written, bytes);
+}
+
+void
+metrics_add_reconnect (metrics_dev_t *mdev)
+{
+    if (mdev)
+        ATOMIC_ADD (&mdev->reconnects, 1);
+}
+
+void
+metrics_add_skipped (metrics_dev_t *mdev, int n)
+{
+    if (mdev)
+        ATOMIC_ADD (&mdev->skipped, n);
+}
+
+void
+metrics_observe_drm_commit (uint64_t ns)
+{
+    metrics_hist_observe (&s_drm_commit, ns);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  Prometheus text exposition
+ * ------------------------------------------------------------------------ */
+static void
+write_summary (FILE *fp, const char *name, const char *label, metrics_hist_t *hist)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    int i;
+
+    for (i = 0; i < sizeof (quantiles) / sizeof (quantiles[0]); i ++)
+    {
+        fprintf (fp, "%s{%s%squantile=\"%g\"} %.9f\n", name, label, *label ? "," : "",
+                 quantiles[i], metrics_hist_quantile_ns (hist, quantiles[i]) / 1e9);
+    }
+    fprintf (fp, "%s_sum%s%s%s %.9f\n", name, *label ? "{" : "", label, *label ? "}" : "",
+             ATOMIC_GET (&hist->sum_ns) / 1e9);
+    fprintf (fp, "%s_count%s%s%s %" PRIu64 "\n", name, *label ? "{" : "", label, *label ? "}" : "",
+             ATOMIC_GET (&hist->count));
+}
+
+#define WRITE_DEV_METRIC(fp, mname, mtype, mhelp, fmt, expr) do {          \
+    metrics_dev_t *mdev;                                                    \
+    fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n", mname, mhelp, mname, mtype);\
+    for (mdev = s_dev_list; mdev; mdev = mdev->next)                        \
+        fprintf (fp, "%s{device=\"%s\"} " fmt "\n", mname, mdev->name, expr);\
+} while (0)
+
+int
+metrics_write_prometheus (FILE *fp)
+{
+    metrics_dev_t *mdev;
+    char label[96];
+
+    pthread_mutex_lock (&s_dev_mutex);
+
+    WRITE_DEV_METRIC (fp, "v4l2_capture_frames_total", "counter", "Frames dequeued from the driver.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->frames));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_fps", "gauge", "Smoothed capture frame rate.",
+                      "%.3f", ATOMIC_GET (&mdev->fps_x1000) / 1000.0);
+    WRITE_DEV_METRIC (fp, "v4l2_capture_dropped_frames_total", "counter", "Frames missing from the sequence.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->drops));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_sequence_gaps_total", "counter", "Sequence number discontinuities.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->seq_gaps));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_error_frames_total", "counter", "Frames flagged V4L2_BUF_FLAG_ERROR.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->err_frames));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_skipped_frames_total", "counter", "Stale frames requeued by latest-frame acquire.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->skipped));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_queued_buffers", "gauge", "Buffers currently queued to the driver.",
+                      "%" PRId64, ATOMIC_GET (&mdev->queued));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_written_bytes_total", "counter", "Bytes written to storage.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->bytes_written));
+    WRITE_DEV_METRIC (fp, "v4l2_capture_reconnects_total", "counter", "Device reconnections.",
+                      "%" PRIu64, ATOMIC_GET (&mdev->reconnects));
+
+    fprintf (fp, "# HELP v4l2_capture_dequeue_latency_seconds Driver timestamp to DQBUF latency.\n");
+    fprintf (fp, "# TYPE v4l2_capture_dequeue_latency_seconds summary\n");
+    for (mdev = s_dev_list; mdev; mdev = mdev->next)
+    {
+        snprintf (label, sizeof (label), "device=\"%s\"", mdev->name);
+        write_summary (fp, "v4l2_capture_dequeue_latency_seconds", label, &mdev->dq_latency);
+    }
+    WRITE_DEV_METRIC (fp, "v4l2_capture_dequeue_latency_max_seconds", "gauge", "Worst driver timestamp to DQBUF latency.",
+                      "%.9f", ATOMIC_GET (&mdev->dq_latency.max_ns) / 1e9);
+
+    pthread_mutex_unlock (&s_dev_mutex);
+
+    fprintf (fp, "# HELP drm_atomic_commit_latency_seconds drmModeAtomicCommit duration.\n");
+    fprintf (fp, "# TYPE drm_atomic_commit_latency_seconds summary\n");
+    write_summary (fp, "drm_atomic_commit_latency_seconds", "", &s_drm_commit);
+
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  HTTP endpoint
+ *    addr: "9100"             --> http://127.0.0.1:9100/
+ *          "/tmp/cap.sock"    --> curl --unix-socket /tmp/cap.sock http:/
+ * ------------------------------------------------------------------------ */
+static void
+serve_client (int fd)
+{
+    char    reqbuf[1024];
+    char    *body = NULL;
+    size_t  body_len = 0;
+    char    header[128];
+    int     header_len;
+    struct pollfd pfd = {0};
+
+    /* consume the request (if any). we answer every request the same way. */
+    pfd.fd     = fd;
+    pfd.events = POLLIN;
+    if (poll (&pfd, 1, 100) > 0)
+    {
+        if (read (fd, reqbuf, sizeof (reqbuf)) < 0)
+            return;
+    }
+
+    FILE *fp = open_memstream (&body, &body_len);
+    if (fp == NULL)
+        return;
+    metrics_write_prometheus (fp);
+    fclose (fp);
+
+    header_len = snprintf (header, sizeof (header),
+                           "HTTP/1.0 200 OK\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: %zu\r\n\r\n", body_len);
+
+    send (fd, header, header_len, MSG_NOSIGNAL);
+    send (fd, body,   body_len,   MSG_NOSIGNAL);
+    free (body);
+}
+
+static void *
+metrics_server_thread (void *arg)
+{
+    int listen_fd = (int)(intptr_t)arg;
+
+    while (1)
+    {
+        int fd = accept (listen_fd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf (stderr, "ERR: %s(%d): accept: %s\n", __FILE__, __LINE__, strerror (errno));
+            break;
+        }
+
+        serve_client (fd);
+        close (fd);
+    }
+
+    close (listen_fd);
+    return NULL;
+}
+
+int
+metrics_start_server (const char *addr)
+{
+    int fd, ret;
+    pthread_t thread;
+
+    if (strchr (addr, '/'))
+    {
+        struct sockaddr_un sun = {0};
+
+        fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sun.sun_family = AF_UNIX;
+        snprintf (sun.sun_path, sizeof (sun.sun_path), "%s", addr);
+        unlink (addr);
+        ret = bind (fd, (struct sockaddr *)&sun, sizeof (sun));
+    }
+    else
+    {
+        struct sockaddr_in sin = {0};
+        int one = 1;
+
+        fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+        sin.sin_family      = AF_INET;
+        sin.sin_port        = htons (atoi (addr));
+        sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+        ret = bind (fd, (struct sockaddr *)&sin, sizeof (sin));
+    }
+
+    if (fd < 0 || ret < 0 || listen (fd, 4) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't listen on %s: %s\n", __FILE__, __LINE__, addr, strerror (errno));
+        if (fd >= 0)
+            close (fd);
+        return -1;
+    }
+
+    ret = pthread_create (&thread, NULL, metrics_server_thread, (void *)(intptr_t)fd);
+    DBG_ASSERT (ret == 0, "pthread_create failed\n");
+    pthread_detach (thread);
+
+    fprintf (stderr, "metrics endpoint: %s\n", addr);
+    return 0;
+}
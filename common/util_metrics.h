@@ -0,0 +1,71 @@
+#ifndef _UTIL_METRICS_H_
+#define _UTIL_METRICS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ *  Runtime metrics.
+ *
+ *  Counters are updated with relaxed atomics from the capture loop and
+ *  exported in Prometheus text format through a local HTTP endpoint
+ *  (TCP on 127.0.0.1 or a Unix socket).
+ */
+#define METRICS_HIST_BUCKETS    40      /* log2(ns) buckets: [2^i, 2^(i+1)) */
+
+typedef struct _metrics_hist_t
+{
+    uint64_t bucket[METRICS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} metrics_hist_t;
+
+typedef struct _metrics_dev_t
+{
+    char            name[64];
+
+    uint64_t        frames;         /* frames dequeued              */
+    uint64_t        drops;          /* frames lost in sequence gaps */
+    uint64_t        seq_gaps;       /* sequence discontinuities     */
+    uint64_t        err_frames;     /* V4L2_BUF_FLAG_ERROR          */
+    uint64_t        skipped;        /* stale frames requeued unseen */
+    uint64_t        bytes_written;
+    uint64_t        reconnects;
+    int64_t         queued;         /* buffers owned by the driver  */
+    uint32_t        fps_x1000;
+
+    uint64_t        last_frame_ns;
+    uint32_t        last_seq;
+    int             has_seq;
+
+    metrics_hist_t  dq_latency;     /* driver timestamp -> DQBUF    */
+
+    struct _metrics_dev_t *next;
+} metrics_dev_t;
+
+
+metrics_dev_t *metrics_register_device   (const char *name);
+void           metrics_unregister_device (metrics_dev_t *mdev);
+
+void     metrics_hist_observe (metrics_hist_t *hist, uint64_t ns);
+uint64_t metrics_hist_quantile_ns (metrics_hist_t *hist, double q);
+void metrics_count_frame  (metrics_dev_t *mdev, uint32_t sequence, uint64_t dq_latency_ns, int error);
+void metrics_add_queued   (metrics_dev_t *mdev, int n);
+void metrics_add_written  (metrics_dev_t *mdev, uint64_t bytes);
+void metrics_add_reconnect(metrics_dev_t *mdev);
+void metrics_add_skipped  (metrics_dev_t *mdev, int n);
+void metrics_observe_drm_commit (uint64_t ns);
+
+int  metrics_write_prometheus (FILE *fp);
+int  metrics_start_server (const char *addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_METRICS_H_ */
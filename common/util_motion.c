@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "util_motion.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_format.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+/* sum |a - b| and move bg a quarter of the way towards cur */
+static uint32_t
+sad_and_update (uint8_t *bg, const uint8_t *cur, int len)
+{
+    uint32_t sad = 0;
+    int i = 0;
+
+#if defined (__SSE2__)
+    __m128i acc = _mm_setzero_si128 ();
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i vb = _mm_loadu_si128 ((const __m128i *)(bg  + i));
+        __m128i vc = _mm_loadu_si128 ((const __m128i *)(cur + i));
+        acc = _mm_add_epi64 (acc, _mm_sad_epu8 (vb, vc));
+        _mm_storeu_si128 ((__m128i *)(bg + i), _mm_avg_epu8 (vb, _mm_avg_epu8 (vb, vc)));
+    }
+    sad = _mm_cvtsi128_si32 (acc) + _mm_cvtsi128_si32 (_mm_srli_si128 (acc, 8));
+#elif defined (__ARM_NEON)
+    uint32x4_t acc = vdupq_n_u32 (0);
+    for (; i + 16 <= len; i += 16)
+    {
+        uint8x16_t vb = vld1q_u8 (bg  + i);
+        uint8x16_t vc = vld1q_u8 (cur + i);
+        acc = vpadalq_u16 (acc, vpaddlq_u8 (vabdq_u8 (vb, vc)));
+        vst1q_u8 (bg + i, vrhaddq_u8 (vb, vrhaddq_u8 (vb, vc)));
+    }
+    sad = vgetq_lane_u32 (acc, 0) + vgetq_lane_u32 (acc, 1) +
+          vgetq_lane_u32 (acc, 2) + vgetq_lane_u32 (acc, 3);
+#endif
+
+    for (; i < len; i ++)
+    {
+        int b = bg[i];
+        int c = cur[i];
+        sad += (b > c) ? b - c : c - b;
+        bg[i] = (b + ((b + c + 1) >> 1) + 1) >> 1;
+    }
+
+    return sad;
+}
+
+motion_detector_t *
+motion_create (unsigned int fourcc, int w, int h, int stride, int subsample)
+{
+    motion_detector_t *md;
+    const format_info_t *fi;
+
+    md = (motion_detector_t *)calloc (1, sizeof (motion_detector_t));
+    DBG_ASSERT (md, "alloc failed");
+
+    fi = format_from_v4l2 (fourcc);
+    md->pixstep = fi ? fi->luma_step : 0;
+    md->pixoff  = fi ? fi->luma_offset : 0;
+    if (md->pixstep == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): unsupported format %.4s\n", __FILE__, __LINE__, (char *)&fourcc);
+        free (md);
+        return NULL;
+    }
+
+    if (subsample < 1)
+        subsample = 1;
+
+    md->w         = w;
+    md->h         = h;
+    md->stride    = stride;
+    md->subsample = subsample;
+    md->bw        = w / subsample;
+    md->bh        = h / subsample;
+    md->len       = md->bw * md->bh;
+
+    /* padding is zero in both buffers, so it never adds to the SAD */
+    md->bg  = (uint8_t *)calloc (1, md->len + 16);
+    md->cur = (uint8_t *)calloc (1, md->len + 16);
+    DBG_ASSERT (md->bg && md->cur, "alloc failed");
+
+    return md;
+}
+
+void
+motion_destroy (motion_detector_t *md)
+{
+    free (md->bg);
+    free (md->cur);
+    free (md);
+}
+
+int
+motion_update (motion_detector_t *md, const void *img)
+{
+    const uint8_t *src = (const uint8_t *)img;
+    int x, y, step = md->subsample * md->pixstep;
+    uint8_t *dst = md->cur;
+    uint32_t sad;
+
+    TRACE_BEGIN ("motion_update");
+
+    for (y = 0; y < md->bh; y ++)
+    {
+        const uint8_t *row = src + (y * md->subsample) * md->stride + md->pixoff;
+        for (x = 0; x < md->bw; x ++)
+            *dst ++ = row[x * step];
+    }
+
+    if (!md->initialized)
+    {
+        memcpy (md->bg, md->cur, md->len);
+        md->initialized = 1;
+    }
+
+    sad = sad_and_update (md->bg, md->cur, md->len);
+    md->last_score = (int)(((uint64_t)sad * MOTION_SCORE_ONE) / md->len);
+
+    TRACE_END ("motion_update");
+    return md->last_score;
+}
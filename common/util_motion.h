@@ -0,0 +1,34 @@
+#ifndef _UTIL_MOTION_H_
+#define _UTIL_MOTION_H_
+
+#include <stdint.h>
+
+/*
+ *  Frame-difference motion detector.
+ *
+ *  Luma is subsampled on a sparse grid and compared (SAD) against a running
+ *  background, which then moves a quarter of the way towards the frame.
+ *  The score is the mean absolute luma difference in 1/256 grey levels.
+ */
+#define MOTION_SCORE_ONE    256     /* score of a 1 grey level mean difference */
+
+typedef struct _motion_detector_t
+{
+    int         w, h, stride;
+    int         pixstep;        /* bytes between luma samples (GREY, NV12:1, YUYV:2) */
+    int         pixoff;         /* byte of the first luma sample (UYVY:1) */
+    int         subsample;      /* grid step in pixels */
+    int         bw, bh;         /* grid size */
+    int         len;            /* bw * bh. bg and cur have 16 spare bytes */
+
+    uint8_t     *bg;
+    uint8_t     *cur;
+    int         initialized;
+    int         last_score;
+} motion_detector_t;
+
+motion_detector_t *motion_create  (unsigned int fourcc, int w, int h, int stride, int subsample);
+void               motion_destroy (motion_detector_t *md);
+int                motion_update  (motion_detector_t *md, const void *img);
+
+#endif /* _UTIL_MOTION_H_ */
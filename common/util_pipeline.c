@@ -0,0 +1,670 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "util_pipeline.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+#include "util_rt.h"
+
+#define ERRSTR strerror(errno)
+
+
+/* ------------------------------------------------------------------------ *
+ *  options
+ * ------------------------------------------------------------------------ */
+const char *
+pipe_opt_str (pipe_stage_t *st, const char *key, const char *def)
+{
+    int i;
+
+    for (i = 0; i < st->opt_num; i ++)
+    {
+        if (strcmp (st->opt_key[i], key) == 0)
+            return st->opt_val[i];
+    }
+    return def;
+}
+
+int
+pipe_opt_int (pipe_stage_t *st, const char *key, int def)
+{
+    const char *val = pipe_opt_str (st, key, NULL);
+    return val ? (int)strtol (val, NULL, 0) : def;
+}
+
+double
+pipe_opt_num (pipe_stage_t *st, const char *key, double def)
+{
+    const char *val = pipe_opt_str (st, key, NULL);
+    return val ? atof (val) : def;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  buffers
+ * ------------------------------------------------------------------------ */
+/* num buffers of size bytes each, filled by the stage itself */
+int
+pipe_pool_alloc (pipe_stage_t *st, int num, size_t size)
+{
+    int i;
+
+    st->pool = (pipe_buf_t *)calloc (num, sizeof (pipe_buf_t));
+    DBG_ASSERT (st->pool, "alloc failed");
+    st->pool_num = num;
+
+    for (i = 0; i < num; i ++)
+    {
+        pipe_buf_t *buf = &st->pool[i];
+
+        buf->own.vaddr = aligned_alloc (64, (size + 63) & ~(size_t)63);
+        if (buf->own.vaddr == NULL)
+        {
+            fprintf (stderr, "ERR: %s(%d): %s: can't allocate %d x %zu bytes\n",
+                     __FILE__, __LINE__, st->name, num, size);
+            return -1;
+        }
+        buf->own.length        = size;
+        buf->own.bo_handle     = -1;
+        buf->own.prime_fd      = -1;
+        buf->own.v4l_buf.index = i;
+        buf->frame     = &buf->own;
+        buf->owner     = st;
+        buf->next_free = st->free_list;
+        st->free_list  = buf;
+    }
+    return 0;
+}
+
+/* a free pool buffer, holding one reference. waits until one comes back */
+pipe_buf_t *
+pipe_buf_get (pipe_stage_t *st)
+{
+    pipeline_t *pipe = st->pipe;
+    pipe_buf_t *buf;
+    uint64_t t0 = 0;
+
+    pthread_mutex_lock (&pipe->mutex);
+    if (st->free_list == NULL)
+    {
+        t0 = get_monotonic_ns ();
+        TRACE_BEGIN ("pipe_wait_buffer");
+        while (st->free_list == NULL)
+            pthread_cond_wait (&st->cond, &pipe->mutex);
+        TRACE_END ("pipe_wait_buffer");
+        st->waited_ns += get_monotonic_ns () - t0;
+    }
+    buf = st->free_list;
+    st->free_list  = buf->next_free;
+    buf->next_free = NULL;
+    buf->refcnt    = 1;
+    pthread_mutex_unlock (&pipe->mutex);
+
+    return buf;
+}
+
+void
+pipe_buf_ref (pipe_buf_t *buf)
+{
+    __atomic_add_fetch (&buf->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void
+pipe_buf_unref (pipe_buf_t *buf)
+{
+    pipe_stage_t *owner = buf->owner;
+    int cnt = __atomic_sub_fetch (&buf->refcnt, 1, __ATOMIC_ACQ_REL);
+    DBG_ASSERT (cnt >= 0, "refcount underflow (%s buf %d)\n", owner->name, buf->frame->v4l_buf.index);
+
+    if (cnt > 0)
+        return;
+
+    if (owner->ops->recycle)
+    {
+        owner->ops->recycle (owner, buf);
+        return;
+    }
+
+    pthread_mutex_lock (&owner->pipe->mutex);
+    buf->next_free   = owner->free_list;
+    owner->free_list = buf;
+    pthread_cond_broadcast (&owner->cond);
+    pthread_mutex_unlock (&owner->pipe->mutex);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  queues
+ *    all under pipe->mutex. a stage waits on its own cond: for input,
+ *    for space in its consumers' queues, or for a free pool buffer.
+ * ------------------------------------------------------------------------ */
+/* hand buf to every consumer; the caller keeps its own reference */
+void
+pipe_emit (pipe_stage_t *st, pipe_buf_t *buf)
+{
+    pipeline_t *pipe = st->pipe;
+    pipe_buf_t *dropped[PIPE_MAX_OUTPUTS];
+    int i, drop_num = 0;
+
+    pthread_mutex_lock (&pipe->mutex);
+    for (i = 0; i < st->output_num; i ++)
+    {
+        pipe_stage_t *con = st->output[i];
+        pipe_queue_t *q = &con->queue;
+
+        if (q->count == q->depth)
+        {
+            if (q->policy == PIPE_POLICY_WAIT)
+            {
+                uint64_t t0 = get_monotonic_ns ();
+                TRACE_BEGIN ("pipe_wait_space");
+                while (q->count == q->depth)
+                    pthread_cond_wait (&st->cond, &pipe->mutex);
+                TRACE_END ("pipe_wait_space");
+                st->waited_ns += get_monotonic_ns () - t0;
+            }
+            else
+            {
+                dropped[drop_num ++] = q->buf[q->head];
+                q->head = (q->head + 1) % q->depth;
+                q->count --;
+                con->stat.dropped ++;
+            }
+        }
+
+        pipe_buf_ref (buf);
+        q->buf[(q->head + q->count) % q->depth] = buf;
+        q->count ++;
+        pthread_cond_broadcast (&con->cond);
+    }
+    st->stat.frames_out ++;
+    st->stat.bytes_out += buf->frame->v4l_buf.bytesused;
+    pthread_mutex_unlock (&pipe->mutex);
+
+    /* recycling may QBUF: outside the lock */
+    for (i = 0; i < drop_num; i ++)
+        pipe_buf_unref (dropped[i]);
+}
+
+/* next input buffer, with the reference it had in the queue. NULL: end of stream */
+static pipe_buf_t *
+queue_pop (pipe_stage_t *st)
+{
+    pipeline_t *pipe = st->pipe;
+    pipe_queue_t *q = &st->queue;
+    pipe_buf_t *buf = NULL;
+
+    pthread_mutex_lock (&pipe->mutex);
+    if (q->count == 0 && !q->eos)
+    {
+        uint64_t t0 = get_monotonic_ns ();
+        while (q->count == 0 && !q->eos)
+            pthread_cond_wait (&st->cond, &pipe->mutex);
+        st->waited_ns += get_monotonic_ns () - t0;
+    }
+
+    if (q->count > 0)
+    {
+        buf = q->buf[q->head];
+        q->head = (q->head + 1) % q->depth;
+        q->count --;
+        pthread_cond_broadcast (&st->input->cond);
+    }
+    pthread_mutex_unlock (&pipe->mutex);
+
+    return buf;
+}
+
+static void
+send_eos (pipe_stage_t *st)
+{
+    pipeline_t *pipe = st->pipe;
+    int i;
+
+    pthread_mutex_lock (&pipe->mutex);
+    for (i = 0; i < st->output_num; i ++)
+    {
+        st->output[i]->queue.eos = 1;
+        pthread_cond_broadcast (&st->output[i]->cond);
+    }
+    pthread_mutex_unlock (&pipe->mutex);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  scheduler: one thread per stage
+ * ------------------------------------------------------------------------ */
+/* t0: start of the work on this frame; input_wait: blocked before it */
+static void
+count_frame (pipe_stage_t *st, uint64_t t0, uint64_t input_wait)
+{
+    uint64_t total = get_monotonic_ns () - t0;
+    uint64_t wait  = st->waited_ns < total ? st->waited_ns : total;
+
+    metrics_hist_observe (&st->stat.busy, total - wait);
+    metrics_hist_observe (&st->stat.wait, input_wait + wait);
+    st->waited_ns = 0;
+}
+
+static void *
+stage_thread (void *arg)
+{
+    pipe_stage_t *st = (pipe_stage_t *)arg;
+    pipeline_t *pipe = st->pipe;
+    pipe_buf_t *buf;
+    uint64_t t0;
+    int ret;
+
+    if (st->ops->kind == PIPE_SOURCE)
+    {
+        uint64_t limit = pipe_opt_int (st, "frames", 0);
+
+        while (!pipe->quit && (limit == 0 || st->stat.frames_in < limit))
+        {
+            t0 = get_monotonic_ns ();
+            TRACE_BEGIN (st->ops->type);
+            ret = st->ops->produce (st, &buf);
+            TRACE_END (st->ops->type);
+            if (ret < 0)
+                break;
+            if (ret == 0)
+            {
+                st->waited_ns = 0;
+                continue;
+            }
+
+            st->stat.frames_in ++;
+            pipe_emit (st, buf);
+            pipe_buf_unref (buf);
+            count_frame (st, t0, 0);
+        }
+    }
+    else
+    {
+        /* a failed stage keeps draining its input, so nothing upstream stalls */
+        while (1)
+        {
+            st->waited_ns = 0;
+            buf = queue_pop (st);
+            if (buf == NULL)
+                break;
+
+            uint64_t input_wait = st->waited_ns;
+            st->waited_ns = 0;
+            t0 = get_monotonic_ns ();
+            st->stat.frames_in ++;
+            if (!st->failed)
+            {
+                TRACE_BEGIN (st->ops->type);
+                ret = st->ops->process (st, buf);
+                TRACE_END (st->ops->type);
+                if (ret < 0)
+                {
+                    fprintf (stderr, "ERR: %s(%d): stage %s failed, stopping\n", __FILE__, __LINE__, st->name);
+                    st->failed = 1;
+                    pipeline_stop (pipe);
+                }
+                else if (st->ops->kind == PIPE_SINK)
+                    st->stat.frames_out ++;
+            }
+            pipe_buf_unref (buf);
+            count_frame (st, t0, input_wait);
+        }
+    }
+
+    if (st->ops->flush && !st->failed)
+        st->ops->flush (st);
+    send_eos (st);
+
+    pthread_mutex_lock (&pipe->mutex);
+    pipe->running --;
+    pthread_mutex_unlock (&pipe->mutex);
+
+    return NULL;
+}
+
+int
+pipeline_start (pipeline_t *pipe)
+{
+    int i, ret;
+
+    pipe->start_ns = get_monotonic_ns ();
+
+    /* sinks first, so nothing is produced before it can be consumed */
+    for (i = pipe->stage_num - 1; i >= 0; i --)
+    {
+        pipe_stage_t *st = &pipe->stage[i];
+        const char *cpus = pipe_opt_str (st, "cpus", NULL);
+        int prio = pipe_opt_int (st, "prio", 0);
+
+        pthread_mutex_lock (&pipe->mutex);
+        pipe->running ++;
+        pthread_mutex_unlock (&pipe->mutex);
+
+        ret = pthread_create (&st->thread, NULL, stage_thread, st);
+        DBG_ASSERT (ret == 0, "pthread_create failed\n");
+
+        if (cpus && rt_set_affinity (st->thread, cpus) < 0)
+            fprintf (stderr, "%s: can't pin to cpus %s\n", st->name, cpus);
+        if (prio > 0 && rt_set_fifo (st->thread, prio) < 0)
+            fprintf (stderr, "%s: can't set SCHED_FIFO %d\n", st->name, prio);
+    }
+
+    return 0;
+}
+
+/* sources stop; everything already produced still flows to the sinks */
+void
+pipeline_stop (pipeline_t *pipe)
+{
+    pipe->quit = 1;
+}
+
+/* all stages have seen the end of stream */
+int
+pipeline_done (pipeline_t *pipe)
+{
+    int running;
+
+    pthread_mutex_lock (&pipe->mutex);
+    running = pipe->running;
+    pthread_mutex_unlock (&pipe->mutex);
+
+    return running == 0;
+}
+
+int
+pipeline_wait (pipeline_t *pipe)
+{
+    int i, failed = 0;
+
+    for (i = 0; i < pipe->stage_num; i ++)
+    {
+        if (pipe->stage[i].thread)
+        {
+            pthread_join (pipe->stage[i].thread, NULL);
+            pipe->stage[i].thread = 0;
+        }
+        failed |= pipe->stage[i].failed;
+    }
+    return failed ? -1 : 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  report
+ * ------------------------------------------------------------------------ */
+/* bucket bounds are powers of two: never above the largest value seen */
+static double
+hist_quantile_ms (metrics_hist_t *hist, double q)
+{
+    uint64_t ns = metrics_hist_quantile_ns (hist, q);
+    return (ns < hist->max_ns ? ns : hist->max_ns) / 1e6;
+}
+
+void
+pipeline_report (pipeline_t *pipe, FILE *fp)
+{
+    double sec = (get_monotonic_ns () - pipe->start_ns) / 1e9;
+    int i;
+
+    fprintf (fp, "%-12s %-8s %8s %8s %6s %7s  %-22s %8s %5s\n", "stage", "type", "in", "out", "drop",
+             "fps", "busy p50/p99/max (ms)", "wait p50", "load");
+
+    for (i = 0; i < pipe->stage_num; i ++)
+    {
+        pipe_stage_t *st = &pipe->stage[i];
+        pipe_stage_stat_t *stat = &st->stat;
+        char busy[32];
+
+        snprintf (busy, sizeof (busy), "%.2f/%.2f/%.2f", hist_quantile_ms (&stat->busy, 0.50),
+                  hist_quantile_ms (&stat->busy, 0.99), stat->busy.max_ns / 1e6);
+
+        /* load: share of the wall clock the stage was busy */
+        fprintf (fp, "%-12s %-8s %8llu %8llu %6llu %7.1f  %-22s %8.2f %4.0f%%\n", st->name, st->ops->type,
+                 (unsigned long long)stat->frames_in, (unsigned long long)stat->frames_out,
+                 (unsigned long long)stat->dropped, sec > 0 ? stat->frames_out / sec : 0.0, busy,
+                 hist_quantile_ms (&stat->wait, 0.50),
+                 sec > 0 ? stat->busy.sum_ns / 1e9 / sec * 100 : 0.0);
+    }
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  graph
+ * ------------------------------------------------------------------------ */
+static pipe_stage_t *
+find_stage (pipeline_t *pipe, const char *name)
+{
+    int i;
+
+    for (i = 0; i < pipe->stage_num; i ++)
+    {
+        if (strcmp (pipe->stage[i].name, name) == 0)
+            return &pipe->stage[i];
+    }
+    return NULL;
+}
+
+/* "name type key=value ...". 0: ok or blank line */
+static int
+parse_line (pipeline_t *pipe, char *line, int lineno)
+{
+    char *tok[2 + PIPE_MAX_OPTS];
+    char *p, *save;
+    int i, num = 0;
+
+    if ((p = strchr (line, '#')) != NULL)
+        *p = '\0';
+
+    for (p = strtok_r (line, " \t\r", &save); p; p = strtok_r (NULL, " \t\r", &save))
+    {
+        if (num == 2 + PIPE_MAX_OPTS)
+        {
+            fprintf (stderr, "ERR: %s(%d): line %d: too many options\n", __FILE__, __LINE__, lineno);
+            return -1;
+        }
+        tok[num ++] = p;
+    }
+    if (num == 0)
+        return 0;
+
+    if (num < 2 || pipe->stage_num == PIPE_MAX_STAGES)
+    {
+        fprintf (stderr, "ERR: %s(%d): line %d: %s\n", __FILE__, __LINE__, lineno,
+                 num < 2 ? "expected \"name type [key=value ...]\"" : "too many stages");
+        return -1;
+    }
+
+    pipe_stage_t *st = &pipe->stage[pipe->stage_num];
+    pipe_stage_t *prev = pipe->stage_num ? &pipe->stage[pipe->stage_num - 1] : NULL;
+
+    if (find_stage (pipe, tok[0]))
+    {
+        fprintf (stderr, "ERR: %s(%d): line %d: stage %s defined twice\n", __FILE__, __LINE__, lineno, tok[0]);
+        return -1;
+    }
+    snprintf (st->name, sizeof (st->name), "%s", tok[0]);
+
+    st->ops = pipe_find_stage_ops (tok[1]);
+    if (st->ops == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): line %d: unknown stage type %s\n", __FILE__, __LINE__, lineno, tok[1]);
+        return -1;
+    }
+    st->pipe = pipe;
+    pthread_cond_init (&st->cond, NULL);
+    pipe->stage_num ++;
+
+    for (i = 2; i < num; i ++)
+    {
+        char *eq = strchr (tok[i], '=');
+        if (eq == NULL || eq == tok[i])
+        {
+            fprintf (stderr, "ERR: %s(%d): line %d: expected key=value, got %s\n", __FILE__, __LINE__, lineno, tok[i]);
+            return -1;
+        }
+        *eq = '\0';
+        st->opt_key[st->opt_num] = strdup (tok[i]);
+        st->opt_val[st->opt_num] = strdup (eq + 1);
+        st->opt_num ++;
+    }
+
+    /* wire it up */
+    if (st->ops->kind == PIPE_SOURCE)
+    {
+        if (pipe_opt_str (st, "in", NULL))
+        {
+            fprintf (stderr, "ERR: %s(%d): line %d: source %s takes no input\n", __FILE__, __LINE__, lineno, st->name);
+            return -1;
+        }
+        return 0;
+    }
+
+    const char *in = pipe_opt_str (st, "in", NULL);
+    st->input = in ? find_stage (pipe, in) : prev;
+    if (st->input == NULL || st->input == st || st->input->ops->kind == PIPE_SINK ||
+        st->input->output_num == PIPE_MAX_OUTPUTS)
+    {
+        fprintf (stderr, "ERR: %s(%d): line %d: %s: no usable input %s\n", __FILE__, __LINE__, lineno,
+                 st->name, in ? in : "(first stage must be a source)");
+        return -1;
+    }
+    st->input->output[st->input->output_num ++] = st;
+
+    const char *policy = pipe_opt_str (st, "policy", "wait");
+    st->queue.depth  = pipe_opt_int (st, "queue", PIPE_DEFAULT_DEPTH);
+    st->queue.policy = strcmp (policy, "drop") == 0 ? PIPE_POLICY_DROP_OLDEST : PIPE_POLICY_WAIT;
+    if (st->queue.depth < 1 || st->queue.depth > PIPE_MAX_DEPTH)
+        st->queue.depth = PIPE_DEFAULT_DEPTH;
+
+    return 0;
+}
+
+pipeline_t *
+pipeline_parse (const char *text)
+{
+    pipeline_t *pipe;
+    char *buf, *line, *save;
+    int i, lineno = 0, opened = 0, ret = 0;
+
+    pipe = (pipeline_t *)calloc (1, sizeof (pipeline_t));
+    DBG_ASSERT (pipe, "alloc failed");
+    pthread_mutex_init (&pipe->mutex, NULL);
+
+    buf = strdup (text);
+    DBG_ASSERT (buf, "alloc failed");
+
+    /* strtok_r would merge blank lines and throw the numbering off */
+    for (line = buf; line && ret == 0; line = save)
+    {
+        save = strchr (line, '\n');
+        if (save)
+            *save ++ = '\0';
+        ret = parse_line (pipe, line, ++ lineno);
+    }
+    free (buf);
+
+    if (ret == 0 && pipe->stage_num == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): empty pipeline\n", __FILE__, __LINE__);
+        ret = -1;
+    }
+
+    /* in file order: every input is open (and its fmt known) first */
+    for (i = 0; i < pipe->stage_num && ret == 0; i ++)
+    {
+        pipe_stage_t *st = &pipe->stage[i];
+
+        if (st->input)
+            st->fmt = st->input->fmt;
+        ret = st->ops->open (st);
+        if (ret < 0)
+            fprintf (stderr, "ERR: %s(%d): can't open stage %s (%s)\n", __FILE__, __LINE__, st->name, st->ops->type);
+        else
+            opened ++;
+    }
+
+    if (ret < 0)
+    {
+        /* only the stages opened so far get closed */
+        pipe->stage_num = opened;
+        pipeline_destroy (pipe);
+        return NULL;
+    }
+
+    return pipe;
+}
+
+pipeline_t *
+pipeline_load (const char *fname)
+{
+    pipeline_t *pipe;
+    FILE *fp;
+    char *text;
+    long size;
+
+    fp = fopen (fname, "r");
+    if (fp == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't open %s: %s\n", __FILE__, __LINE__, fname, ERRSTR);
+        return NULL;
+    }
+
+    fseek (fp, 0, SEEK_END);
+    size = ftell (fp);
+    fseek (fp, 0, SEEK_SET);
+
+    text = (char *)calloc (1, size + 1);
+    DBG_ASSERT (text, "alloc failed");
+    if (size > 0 && fread (text, 1, size, fp) != (size_t)size)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't read %s\n", __FILE__, __LINE__, fname);
+        free (text);
+        fclose (fp);
+        return NULL;
+    }
+    fclose (fp);
+
+    pipe = pipeline_parse (text);
+    free (text);
+    return pipe;
+}
+
+void
+pipeline_destroy (pipeline_t *pipe)
+{
+    int i, j;
+
+    pipeline_stop (pipe);
+    pipeline_wait (pipe);
+
+    /* sinks first: they may still hold buffers of the stages above */
+    for (i = pipe->stage_num - 1; i >= 0; i --)
+    {
+        pipe_stage_t *st = &pipe->stage[i];
+        if (st->ops->close)
+            st->ops->close (st);
+    }
+
+    for (i = 0; i < PIPE_MAX_STAGES; i ++)
+    {
+        pipe_stage_t *st = &pipe->stage[i];
+
+        for (j = 0; j < st->opt_num; j ++)
+        {
+            free (st->opt_key[j]);
+            free (st->opt_val[j]);
+        }
+        for (j = 0; j < st->pool_num; j ++)
+            free (st->pool[j].own.vaddr);
+        free (st->pool);
+        if (st->ops)
+            pthread_cond_destroy (&st->cond);
+    }
+
+    pthread_mutex_destroy (&pipe->mutex);
+    free (pipe);
+}
@@ -0,0 +1,197 @@
+#ifndef _UTIL_PIPELINE_H_
+#define _UTIL_PIPELINE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "util_v4l2.h"
+#include "util_metrics.h"
+
+/*
+ *  Capture pipelines as a graph of stages, built from a config file.
+ *
+ *  A source (v4l2, replay) produces buffers; transforms (convert, scale,
+ *  stats, motion, encode) and sinks (file, drm, shm) each take their
+ *  input from one earlier stage. A stage with several consumers hands
+ *  the same buffer to all of them (reference counted, no copy).
+ *
+ *     cam (v4l2) --+--> small (scale) --> st (stats)
+ *                  +--> rec (file)
+ *
+ *  Every stage runs on its own thread and reads a bounded input queue,
+ *  so consecutive stages work on consecutive frames at the same time.
+ *  A full queue either holds its producer back (wait) or discards its
+ *  oldest buffer (drop). Buffers go back to the stage that made them
+ *  when the last reference is dropped: V4L2 buffers are requeued, the
+ *  others return to the stage's fixed pool. Nothing is allocated per
+ *  frame.
+ *
+ *  Config file: one stage per line, '#' starts a comment.
+ *
+ *     # name  type    options
+ *     cam     v4l2    dev=0 buffers=6
+ *     small   scale   size=640x360
+ *     st      stats   in=small
+ *     rec     file    in=cam prefix=/tmp/rec seg=60
+ *
+ *  Options every stage takes:
+ *     in=<name>          input stage. default: the line above
+ *     queue=<n>          input queue depth (default 4). fed by a v4l2 source:
+ *                        at most its buffers - 2 (default: clamped to that)
+ *     policy=wait|drop   full input queue: stall the producer / drop the oldest
+ *     cpus=<list>        pin the stage thread (taskset -c syntax)
+ *     prio=<n>           SCHED_FIFO priority of the stage thread
+ *  and sources:
+ *     frames=<n>         stop after n frames
+ *
+ *  The stage types and their options are listed in util_pipeline_stages.c.
+ */
+#define PIPE_MAX_STAGES     16
+#define PIPE_MAX_OUTPUTS    8       /* consumers per stage */
+#define PIPE_MAX_DEPTH      16      /* input queue */
+#define PIPE_MAX_OPTS       16
+#define PIPE_DEFAULT_DEPTH  4
+
+enum pipe_kind {
+    PIPE_SOURCE = 0,
+    PIPE_TRANSFORM,
+    PIPE_SINK,
+};
+
+enum pipe_policy {
+    PIPE_POLICY_WAIT = 0,           /* full queue: producer waits for space */
+    PIPE_POLICY_DROP_OLDEST,        /* full queue: discard the oldest buffer */
+};
+
+struct _pipe_stage_t;
+struct _pipeline_t;
+
+/* what a stage emits; all its buffers share it */
+typedef struct _pipe_fmt_t
+{
+    unsigned int    fourcc;         /* V4L2_PIX_FMT_xxx, or the codec when coded */
+    int             w, h;
+    int             stride;
+    int             coded;          /* compressed: bytesused is all there is */
+} pipe_fmt_t;
+
+typedef struct _pipe_buf_t
+{
+    capture_frame_t *frame;         /* image and metadata: sequence, timestamp, bytesused */
+    capture_frame_t own;            /* frame storage of pool buffers */
+    int             refcnt;
+    struct _pipe_stage_t *owner;    /* gets it back when refcnt drops to 0 */
+    struct _pipe_buf_t   *next_free;
+} pipe_buf_t;
+
+typedef struct _pipe_queue_t
+{
+    int             policy;
+    int             depth;
+    int             head;
+    int             count;
+    int             eos;            /* the producer is done */
+    pipe_buf_t      *buf[PIPE_MAX_DEPTH];
+} pipe_queue_t;
+
+typedef struct _pipe_stage_stat_t
+{
+    uint64_t        frames_in;
+    uint64_t        frames_out;
+    uint64_t        dropped;        /* discarded from the full input queue */
+    uint64_t        bytes_out;
+    metrics_hist_t  busy;           /* per frame, in the stage itself */
+    metrics_hist_t  wait;           /* per frame, blocked on input, queue space or buffers */
+} pipe_stage_stat_t;
+
+typedef struct _pipe_stage_ops_t
+{
+    const char      *type;          /* config name; also the trace point name */
+    int             kind;           /* PIPE_SOURCE, _TRANSFORM or _SINK */
+
+    /* parse options, set up fmt (the input's fmt is set by now) */
+    int  (*open)    (struct _pipe_stage_t *st);
+
+    /* sources: 1: *buf produced, 0: nothing yet, -1: end of stream */
+    int  (*produce) (struct _pipe_stage_t *st, pipe_buf_t **buf);
+
+    /* transforms, sinks: one input buffer, owned by the caller. -1: failed */
+    int  (*process) (struct _pipe_stage_t *st, pipe_buf_t *in);
+
+    /* end of stream: emit what is still held back. optional */
+    void (*flush)   (struct _pipe_stage_t *st);
+
+    /* a buffer not from the pool is free again. optional */
+    void (*recycle) (struct _pipe_stage_t *st, pipe_buf_t *buf);
+
+    void (*close)   (struct _pipe_stage_t *st);
+} pipe_stage_ops_t;
+
+typedef struct _pipe_stage_t
+{
+    char            name[32];
+    const pipe_stage_ops_t *ops;
+    struct _pipeline_t *pipe;
+
+    int             opt_num;
+    char            *opt_key[PIPE_MAX_OPTS];
+    char            *opt_val[PIPE_MAX_OPTS];
+
+    struct _pipe_stage_t *input;    /* NULL: source */
+    struct _pipe_stage_t *output[PIPE_MAX_OUTPUTS];
+    int             output_num;
+    pipe_queue_t    queue;          /* from input */
+    pipe_fmt_t      fmt;
+
+    /* buffers this stage fills itself */
+    pipe_buf_t      *pool;
+    int             pool_num;
+    pipe_buf_t      *free_list;
+
+    pthread_cond_t  cond;           /* input, queue space or a free buffer */
+    pthread_t       thread;
+    int             failed;
+    uint64_t        waited_ns;      /* blocked during the current frame */
+    void            *priv;
+
+    pipe_stage_stat_t stat;
+} pipe_stage_t;
+
+typedef struct _pipeline_t
+{
+    pipe_stage_t    stage[PIPE_MAX_STAGES];
+    int             stage_num;
+
+    pthread_mutex_t mutex;          /* queues and pools of all stages */
+    volatile int    quit;
+    int             running;        /* stage threads not finished yet */
+    uint64_t        start_ns;
+} pipeline_t;
+
+
+/* graph */
+pipeline_t  *pipeline_load    (const char *fname);
+pipeline_t  *pipeline_parse   (const char *text);
+void         pipeline_destroy (pipeline_t *pipe);
+
+/* scheduler */
+int          pipeline_start   (pipeline_t *pipe);
+void         pipeline_stop    (pipeline_t *pipe);
+int          pipeline_wait    (pipeline_t *pipe);
+int          pipeline_done    (pipeline_t *pipe);
+void         pipeline_report  (pipeline_t *pipe, FILE *fp);
+
+/* for stage implementations */
+const char  *pipe_opt_str (pipe_stage_t *st, const char *key, const char *def);
+int          pipe_opt_int (pipe_stage_t *st, const char *key, int def);
+double       pipe_opt_num (pipe_stage_t *st, const char *key, double def);
+
+int          pipe_pool_alloc (pipe_stage_t *st, int num, size_t size);
+pipe_buf_t  *pipe_buf_get    (pipe_stage_t *st);
+void         pipe_buf_ref    (pipe_buf_t *buf);
+void         pipe_buf_unref  (pipe_buf_t *buf);
+void         pipe_emit       (pipe_stage_t *st, pipe_buf_t *buf);
+
+const pipe_stage_ops_t *pipe_find_stage_ops (const char *type);
+
+#endif /* _UTIL_PIPELINE_H_ */
@@ -0,0 +1,1094 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util_pipeline.h"
+#include "util_debug.h"
+#include "util_time.h"
+#include "util_format.h"
+#include "util_replay.h"
+#include "util_frame_view.h"
+#include "util_stats.h"
+#include "util_motion.h"
+#include "util_m2m.h"
+#include "util_recorder.h"
+#include "util_drm.h"
+#include "util_wcmem.h"
+#include "util_dmabuf.h"
+#include "util_shm.h"
+
+/*
+ *  Stage types of util_pipeline.
+ *
+ *  sources    v4l2     dev=<id> buffers=<n> cached=1 media=1
+ *             replay   file=<prefix|file.v4r> speed=<x, 0: fast> loop=<n> prefetch=<MB>
+ *  transforms convert  fourcc=GREY                 (luma plane only)
+ *             scale    size=<w>x<h> crop=<x>,<y>,<w>,<h>
+ *             stats    every=<n>                   (passes frames on)
+ *             motion   level=<grey levels> hold=<frames>
+ *             encode   codec=h264|jpeg|fwht dev=<id> keyint=<n>   (input: v4l2)
+ *  sinks      file     prefix=<path> seg=<sec> size=<MB> quota=<MB> compress=intra|delta workers=<n>
+ *             drm      (DRM plane of the first display)
+ *             shm      path=<socket>                                (input: v4l2)
+ *
+ *  Stages that fill their own buffers take buffers=<n> as well.
+ */
+
+
+/* ------------------------------------------------------------------------ *
+ *  helpers
+ * ------------------------------------------------------------------------ */
+/* every consumer queue full, plus one buffer in the works each way */
+static int
+default_pool_num (pipe_stage_t *st)
+{
+    int i, num = PIPE_DEFAULT_DEPTH + 2;
+
+    for (i = 0; i < st->output_num; i ++)
+    {
+        if (st->output[i]->queue.depth + 2 > num)
+            num = st->output[i]->queue.depth + 2;
+    }
+    return pipe_opt_int (st, "buffers", num);
+}
+
+static void
+copy_meta (capture_frame_t *dst, const capture_frame_t *src, unsigned int bytesused)
+{
+    dst->v4l_buf.sequence  = src->v4l_buf.sequence;
+    dst->v4l_buf.timestamp = src->v4l_buf.timestamp;
+    dst->v4l_buf.flags     = src->v4l_buf.flags & (V4L2_BUF_FLAG_TIMESTAMP_MASK | V4L2_BUF_FLAG_KEYFRAME);
+    dst->v4l_buf.bytesused = bytesused;
+    dst->ctrl_tag          = src->ctrl_tag;
+}
+
+static int
+need_raw_input (pipe_stage_t *st)
+{
+    if (st->fmt.coded)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: input %s is compressed\n", __FILE__, __LINE__,
+                 st->name, st->input->name);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  v4l2: camera source. buffers are the V4L2 buffers themselves
+ * ------------------------------------------------------------------------ */
+typedef struct _v4l2_src_t
+{
+    capture_dev_t   *dev;
+    pipe_buf_t      *wrap;          /* per V4L2 buffer index */
+    int             started;
+    int             cpu_read;       /* some consumer reads the pixels */
+} v4l2_src_t;
+
+static int
+v4l2_src_open (pipe_stage_t *st)
+{
+    v4l2_src_t *src;
+    capture_opt_t opt = {0};
+    int i;
+
+    opt.bufcount = pipe_opt_int (st, "buffers", 0);
+    opt.cached   = pipe_opt_int (st, "cached", 0);
+    opt.media    = pipe_opt_int (st, "media", 0);
+
+    src = (v4l2_src_t *)calloc (1, sizeof (v4l2_src_t));
+    DBG_ASSERT (src, "alloc failed");
+    st->priv = src;
+
+    src->dev = v4l2_open_capture_device_ex (pipe_opt_int (st, "dev", -1), &opt);
+    if (src->dev == NULL)
+        return -1;
+
+    if (src->dev->stream.buftype == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+    {
+        struct v4l2_pix_format_mplane *pix_mp = &src->dev->stream.format.fmt.pix_mp;
+
+        st->fmt.fourcc = pix_mp->pixelformat;
+        st->fmt.w      = pix_mp->width;
+        st->fmt.h      = pix_mp->height;
+        st->fmt.stride = pix_mp->plane_fmt[0].bytesperline;
+    }
+    else
+    {
+        struct v4l2_pix_format *pix = &src->dev->stream.format.fmt.pix;
+
+        st->fmt.fourcc = pix->pixelformat;
+        st->fmt.w      = pix->width;
+        st->fmt.h      = pix->height;
+        st->fmt.stride = pix->bytesperline;
+    }
+
+    const format_info_t *fi = format_from_v4l2 (st->fmt.fourcc);
+    st->fmt.coded = fi && fi->bpp == 0;
+
+    src->wrap = (pipe_buf_t *)calloc (src->dev->stream.bufcount, sizeof (pipe_buf_t));
+    DBG_ASSERT (src->wrap, "alloc failed");
+    for (i = 0; i < src->dev->stream.bufcount; i ++)
+    {
+        src->wrap[i].frame = &src->dev->stream.frames[i];
+        src->wrap[i].owner = st;
+    }
+
+    /* a queue full of camera buffers leaves the driver none to fill:
+     * keep two out of every input queue fed from here */
+    for (i = 0; i < st->output_num; i ++)
+    {
+        pipe_stage_t *con = st->output[i];
+        int max_depth = src->dev->stream.bufcount - 2;
+
+        if (max_depth < 1)
+            max_depth = 1;
+        if (con->queue.depth <= max_depth)
+            continue;
+        if (pipe_opt_str (con, "queue", NULL))
+        {
+            fprintf (stderr, "ERR: %s(%d): %s: queue=%d holds too many of the %d buffers of %s (max %d)\n",
+                     __FILE__, __LINE__, con->name, con->queue.depth, src->dev->stream.bufcount, st->name,
+                     max_depth);
+            return -1;
+        }
+        con->queue.depth = max_depth;
+    }
+
+    /* the encoder and shm subscribers never touch the pixels on our CPU */
+    for (i = 0; i < st->output_num; i ++)
+    {
+        const char *type = st->output[i]->ops->type;
+        if (strcmp (type, "encode") != 0 && strcmp (type, "shm") != 0)
+            src->cpu_read = 1;
+    }
+    return 0;
+}
+
+static int
+v4l2_src_produce (pipe_stage_t *st, pipe_buf_t **buf)
+{
+    v4l2_src_t *src = (v4l2_src_t *)st->priv;
+    capture_frame_t *frame;
+    uint64_t t0;
+
+    if (!src->started)
+    {
+        v4l2_start_capture (src->dev);
+        src->started = 1;
+    }
+
+    /* short timeout: the source must notice pipeline_stop() */
+    t0 = get_monotonic_ns ();
+    if (v4l2_acquire_capture_frames (src->dev, &frame, 1, 200) <= 0)
+        return 0;
+    st->waited_ns += get_monotonic_ns () - t0;
+
+    if (src->cpu_read)
+        v4l2_begin_cpu_access (src->dev, frame, DMABUF_CPU_READ);
+
+    *buf = &src->wrap[frame->v4l_buf.index];
+    (*buf)->refcnt = 1;
+    return 1;
+}
+
+static void
+v4l2_src_recycle (pipe_stage_t *st, pipe_buf_t *buf)
+{
+    v4l2_src_t *src = (v4l2_src_t *)st->priv;
+
+    v4l2_release_capture_frame (src->dev, buf->frame);
+}
+
+static void
+v4l2_src_close (pipe_stage_t *st)
+{
+    v4l2_src_t *src = (v4l2_src_t *)st->priv;
+
+    /* the sinks are closed by now and have handed every buffer back */
+    if (src->dev)
+        v4l2_close_capture_device (src->dev);
+    free (src->wrap);
+    free (src);
+}
+
+static const pipe_stage_ops_t s_v4l2_ops = {
+    "v4l2", PIPE_SOURCE, v4l2_src_open, v4l2_src_produce, NULL, NULL, v4l2_src_recycle, v4l2_src_close,
+};
+
+/* the camera behind st's input, when the input is a v4l2 source */
+static capture_dev_t *
+input_v4l2_dev (pipe_stage_t *st)
+{
+    if (st->input->ops != &s_v4l2_ops)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s (%s) needs a v4l2 source as input\n", __FILE__, __LINE__,
+                 st->name, st->ops->type);
+        return NULL;
+    }
+    return ((v4l2_src_t *)st->input->priv)->dev;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  replay: recordings. a replayed frame only lives until the next one is
+ *  read, so each is copied into a pool buffer
+ * ------------------------------------------------------------------------ */
+typedef struct _replay_src_t
+{
+    replay_t        *rp;
+    double          speed;
+    int             loops;
+    int             loop;
+    uint64_t        base_wall;
+    uint64_t        base_ts;
+} replay_src_t;
+
+static int
+replay_src_open (pipe_stage_t *st)
+{
+    replay_src_t *src;
+    const char *file = pipe_opt_str (st, "file", NULL);
+
+    if (file == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: file= missing\n", __FILE__, __LINE__, st->name);
+        return -1;
+    }
+
+    src = (replay_src_t *)calloc (1, sizeof (replay_src_t));
+    DBG_ASSERT (src, "alloc failed");
+    st->priv = src;
+
+    src->speed = pipe_opt_num (st, "speed", 1.0);
+    src->loops = pipe_opt_int (st, "loop", 1);
+    src->rp    = replay_open (file, (size_t)pipe_opt_int (st, "prefetch", 0) << 20);
+    if (src->rp == NULL)
+        return -1;
+
+    const format_info_t *fi = format_from_v4l2 (src->rp->hdr.fourcc);
+    st->fmt.fourcc = src->rp->hdr.fourcc;
+    st->fmt.w      = src->rp->hdr.width;
+    st->fmt.h      = src->rp->hdr.height;
+    st->fmt.stride = src->rp->hdr.bytesperline;
+    st->fmt.coded  = fi == NULL || fi->bpp == 0;
+
+    /* coded recordings have no stride: bound a frame by 16 bits per pixel */
+    size_t size = st->fmt.coded ? (size_t)st->fmt.w * st->fmt.h * 2 : (size_t)st->fmt.stride * st->fmt.h;
+    return pipe_pool_alloc (st, default_pool_num (st), size);
+}
+
+static int
+replay_src_produce (pipe_stage_t *st, pipe_buf_t **buf)
+{
+    replay_src_t *src = (replay_src_t *)st->priv;
+    capture_frame_t *frame;
+    pipe_buf_t *out;
+
+    while ((frame = replay_acquire_frame (src->rp)) == NULL)
+    {
+        if (++ src->loop >= src->loops || replay_rewind (src->rp) < 0)
+            return -1;
+        src->base_wall = 0;
+    }
+
+    /* original pace, scaled */
+    uint64_t ts_ns = timeval_to_ns (frame->v4l_buf.timestamp);
+    if (src->speed > 0)
+    {
+        if (src->base_wall == 0)
+        {
+            src->base_wall = get_monotonic_ns ();
+            src->base_ts   = ts_ns;
+        }
+        else if (ts_ns > src->base_ts)
+        {
+            uint64_t t0 = get_monotonic_ns ();
+            uint64_t t  = src->base_wall + (uint64_t)((ts_ns - src->base_ts) / src->speed);
+            struct timespec ts = { t / 1000000000ULL, t % 1000000000ULL };
+
+            while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && !st->pipe->quit)
+                ;
+            st->waited_ns += get_monotonic_ns () - t0;
+        }
+    }
+
+    out = pipe_buf_get (st);
+    if (frame->length > out->own.length)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: frame %u too large (%u bytes)\n", __FILE__, __LINE__,
+                 st->name, frame->v4l_buf.sequence, frame->length);
+        pipe_buf_unref (out);
+        return 0;
+    }
+
+    memcpy (out->own.vaddr, frame->vaddr, frame->length);
+    copy_meta (&out->own, frame, frame->length);
+
+    *buf = out;
+    return 1;
+}
+
+static void
+replay_src_close (pipe_stage_t *st)
+{
+    replay_src_t *src = (replay_src_t *)st->priv;
+
+    if (src->rp)
+        replay_close (src->rp);
+    free (src);
+}
+
+static const pipe_stage_ops_t s_replay_ops = {
+    "replay", PIPE_SOURCE, replay_src_open, replay_src_produce, NULL, NULL, NULL, replay_src_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  convert: only to GREY so far, by taking the luma samples
+ * ------------------------------------------------------------------------ */
+typedef struct _convert_t
+{
+    int             luma_step;
+    int             luma_offset;
+    int             in_stride;
+} convert_t;
+
+static int
+convert_open (pipe_stage_t *st)
+{
+    const char *to = pipe_opt_str (st, "fourcc", "GREY");
+    const format_info_t *fi = format_from_v4l2 (st->fmt.fourcc);
+    convert_t *cv;
+
+    if (need_raw_input (st) < 0)
+        return -1;
+    if (strcmp (to, "GREY") != 0 || fi == NULL || fi->luma_step == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: can't convert %.4s to %s\n", __FILE__, __LINE__,
+                 st->name, (char *)&st->fmt.fourcc, to);
+        return -1;
+    }
+
+    cv = (convert_t *)calloc (1, sizeof (convert_t));
+    DBG_ASSERT (cv, "alloc failed");
+    st->priv = cv;
+
+    cv->luma_step   = fi->luma_step;
+    cv->luma_offset = fi->luma_offset;
+    cv->in_stride = st->fmt.stride;
+    st->fmt.fourcc = V4L2_PIX_FMT_GREY;
+    st->fmt.stride = st->fmt.w;
+
+    return pipe_pool_alloc (st, default_pool_num (st), (size_t)st->fmt.w * st->fmt.h);
+}
+
+static int
+convert_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    convert_t *cv = (convert_t *)st->priv;
+    pipe_buf_t *out = pipe_buf_get (st);
+    int w = st->fmt.w;
+
+    /* DMABUF capture buffers are DRM dumb buffers: read them in bulk */
+    wcmem_luma_rows (out->own.vaddr, w, FRAME_MEM_CACHED,
+                     in->frame->vaddr, cv->in_stride, in->frame->mem, w, cv->luma_step, cv->luma_offset,
+                     st->fmt.h);
+
+    copy_meta (&out->own, in->frame, w * st->fmt.h);
+    pipe_emit (st, out);
+    pipe_buf_unref (out);
+    return 0;
+}
+
+static void
+convert_close (pipe_stage_t *st)
+{
+    free (st->priv);
+}
+
+static const pipe_stage_ops_t s_convert_ops = {
+    "convert", PIPE_TRANSFORM, convert_open, NULL, convert_process, NULL, NULL, convert_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  scale: crop and/or downscale through a frame view
+ * ------------------------------------------------------------------------ */
+static int
+scale_open (pipe_stage_t *st)
+{
+    frame_view_spec_t spec = {0};
+    frame_view_t *view;
+    const char *size = pipe_opt_str (st, "size", NULL);
+    const char *crop = pipe_opt_str (st, "crop", NULL);
+
+    if (need_raw_input (st) < 0)
+        return -1;
+    if (size)
+        sscanf (size, "%dx%d", &spec.out_w, &spec.out_h);
+    if (crop)
+        sscanf (crop, "%d,%d,%d,%d", &spec.crop_x, &spec.crop_y, &spec.crop_w, &spec.crop_h);
+    spec.packed = 1;
+
+    view = frame_view_create (st->fmt.fourcc, st->fmt.w, st->fmt.h, st->fmt.stride, &spec);
+    if (view == NULL)
+        return -1;
+    st->priv = view;
+
+    st->fmt.w      = view->spec.out_w;
+    st->fmt.h      = view->spec.out_h;
+    st->fmt.stride = view->spec.out_w * view->bpp;
+
+    return pipe_pool_alloc (st, default_pool_num (st), (size_t)st->fmt.stride * st->fmt.h);
+}
+
+static int
+scale_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    frame_view_t *view = (frame_view_t *)st->priv;
+    pipe_buf_t *out = pipe_buf_get (st);
+    int stride, y;
+    const uint8_t *src = (const uint8_t *)frame_view_get (view, in->frame, &stride);
+    uint8_t *dst = (uint8_t *)out->own.vaddr;
+
+    for (y = 0; y < st->fmt.h; y ++, src += stride, dst += st->fmt.stride)
+        memcpy (dst, src, st->fmt.stride);
+
+    copy_meta (&out->own, in->frame, st->fmt.stride * st->fmt.h);
+    pipe_emit (st, out);
+    pipe_buf_unref (out);
+    return 0;
+}
+
+static void
+scale_close (pipe_stage_t *st)
+{
+    if (st->priv)
+        frame_view_destroy ((frame_view_t *)st->priv);
+}
+
+static const pipe_stage_ops_t s_scale_ops = {
+    "scale", PIPE_TRANSFORM, scale_open, NULL, scale_process, NULL, NULL, scale_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  stats: luma statistics, printed every n frames. frames pass through
+ * ------------------------------------------------------------------------ */
+typedef struct _stats_stage_t
+{
+    stats_ctx_t     *ctx;
+    frame_stats_t   stats;
+    int             every;
+    uint64_t        count;
+} stats_stage_t;
+
+static int
+stats_open (pipe_stage_t *st)
+{
+    stats_stage_t *ss;
+
+    if (need_raw_input (st) < 0)
+        return -1;
+
+    ss = (stats_stage_t *)calloc (1, sizeof (stats_stage_t));
+    DBG_ASSERT (ss, "alloc failed");
+    st->priv = ss;
+
+    ss->every = pipe_opt_int (st, "every", 30);
+    ss->ctx   = frame_stats_create (st->fmt.fourcc, st->fmt.w, st->fmt.h, st->fmt.stride, NULL);
+    return ss->ctx ? 0 : -1;
+}
+
+static int
+stats_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    stats_stage_t *ss = (stats_stage_t *)st->priv;
+
+    frame_stats_compute (ss->ctx, in->frame->vaddr, &ss->stats);
+    if (ss->every > 0 && ++ ss->count % ss->every == 0)
+        fprintf (stderr, "%s: seq %u mean %.1f variance %.1f sharpness %.1f\n", st->name,
+                 in->frame->v4l_buf.sequence, ss->stats.mean, ss->stats.variance, ss->stats.sharpness);
+
+    pipe_emit (st, in);
+    return 0;
+}
+
+static void
+stats_close (pipe_stage_t *st)
+{
+    stats_stage_t *ss = (stats_stage_t *)st->priv;
+
+    if (ss->ctx)
+        frame_stats_destroy (ss->ctx);
+    free (ss);
+}
+
+static const pipe_stage_ops_t s_stats_ops = {
+    "stats", PIPE_TRANSFORM, stats_open, NULL, stats_process, NULL, NULL, stats_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  motion: passes frames on only while there is motion, and `hold`
+ *  frames after it
+ * ------------------------------------------------------------------------ */
+typedef struct _motion_stage_t
+{
+    motion_detector_t *md;
+    int             threshold;
+    int             hold;
+    int             hold_left;
+} motion_stage_t;
+
+static int
+motion_open (pipe_stage_t *st)
+{
+    motion_stage_t *ms;
+
+    if (need_raw_input (st) < 0)
+        return -1;
+
+    ms = (motion_stage_t *)calloc (1, sizeof (motion_stage_t));
+    DBG_ASSERT (ms, "alloc failed");
+    st->priv = ms;
+
+    ms->threshold = (int)(pipe_opt_num (st, "level", 2.0) * MOTION_SCORE_ONE);
+    ms->hold      = pipe_opt_int (st, "hold", 30);
+    ms->md        = motion_create (st->fmt.fourcc, st->fmt.w, st->fmt.h, st->fmt.stride, 8);
+    return ms->md ? 0 : -1;
+}
+
+static int
+motion_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    motion_stage_t *ms = (motion_stage_t *)st->priv;
+
+    if (motion_update (ms->md, in->frame->vaddr) >= ms->threshold)
+        ms->hold_left = ms->hold + 1;
+
+    if (ms->hold_left > 0)
+    {
+        ms->hold_left --;
+        pipe_emit (st, in);
+    }
+    return 0;
+}
+
+static void
+motion_close (pipe_stage_t *st)
+{
+    motion_stage_t *ms = (motion_stage_t *)st->priv;
+
+    if (ms->md)
+        motion_destroy (ms->md);
+    free (ms);
+}
+
+static const pipe_stage_ops_t s_motion_ops = {
+    "motion", PIPE_TRANSFORM, motion_open, NULL, motion_process, NULL, NULL, motion_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  encode: V4L2 M2M encoder reading the capture buffers in place.
+ *  the bitstream is copied out, so the encoder gets its buffer back at once
+ * ------------------------------------------------------------------------ */
+#define ENC_MAX_STALL   20      /* x 100ms without progress: encoder is stuck */
+
+typedef struct _encode_stage_t
+{
+    m2m_enc_t       *enc;
+    capture_dev_t   *dev;
+    pipe_buf_t      **held;     /* per capture buffer index, while the encoder has it */
+    int             held_num;
+} encode_stage_t;
+
+static int
+encode_open (pipe_stage_t *st)
+{
+    const char *codec = pipe_opt_str (st, "codec", "h264");
+    encode_stage_t *es;
+    unsigned int fourcc;
+    int i;
+
+    if      (strcmp (codec, "h264") == 0) fourcc = V4L2_PIX_FMT_H264;
+    else if (strcmp (codec, "jpeg") == 0) fourcc = V4L2_PIX_FMT_JPEG;
+    else if (strcmp (codec, "fwht") == 0) fourcc = V4L2_PIX_FMT_FWHT;
+    else
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: unknown codec %s\n", __FILE__, __LINE__, st->name, codec);
+        return -1;
+    }
+
+    es = (encode_stage_t *)calloc (1, sizeof (encode_stage_t));
+    DBG_ASSERT (es, "alloc failed");
+    st->priv = es;
+
+    es->dev = input_v4l2_dev (st);
+    if (es->dev == NULL || need_raw_input (st) < 0)
+        return -1;
+    if (es->dev->stream.memtype != V4L2_MEMORY_MMAP)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: needs MMAP capture buffers\n", __FILE__, __LINE__, st->name);
+        return -1;
+    }
+
+    for (i = 0; i < es->dev->stream.bufcount; i ++)
+    {
+        if (v4l2_export_capture_frame (es->dev, &es->dev->stream.frames[i]) < 0)
+            return -1;
+    }
+
+    es->held = (pipe_buf_t **)calloc (es->dev->stream.bufcount, sizeof (pipe_buf_t *));
+    DBG_ASSERT (es->held, "alloc failed");
+
+    es->enc = m2m_enc_open (pipe_opt_int (st, "dev", -1), st->fmt.fourcc, st->fmt.w, st->fmt.h,
+                            st->fmt.stride, es->dev->stream.bufcount, fourcc);
+    if (es->enc == NULL)
+        return -1;
+    m2m_enc_set_keyint (es->enc, pipe_opt_int (st, "keyint", 30));
+
+    st->fmt.fourcc = fourcc;
+    st->fmt.coded  = 1;
+
+    return pipe_pool_alloc (st, default_pool_num (st), (size_t)st->fmt.stride * st->fmt.h);
+}
+
+/* capture buffers the encoder is done with go back upstream */
+static int
+encode_reclaim (encode_stage_t *es)
+{
+    capture_frame_t *done[16];
+    int i, num, total = 0;
+
+    while ((num = m2m_enc_reclaim (es->enc, done, 16)) > 0)
+    {
+        for (i = 0; i < num; i ++)
+        {
+            int idx = done[i]->v4l_buf.index;
+            pipe_buf_t *buf = es->held[idx];
+
+            es->held[idx] = NULL;
+            es->held_num --;
+            if (buf)
+                pipe_buf_unref (buf);
+        }
+        total += num;
+    }
+    return total;
+}
+
+/* pass on the coded frames that are ready, waiting up to timeout_ms for the first */
+static int
+encode_drain (pipe_stage_t *st, int timeout_ms)
+{
+    encode_stage_t *es = (encode_stage_t *)st->priv;
+    m2m_bitstream_t *bs;
+    int num = 0;
+
+    while ((bs = m2m_enc_dequeue (es->enc, timeout_ms)) != NULL)
+    {
+        pipe_buf_t *out = pipe_buf_get (st);
+        unsigned int size = bs->bytesused;
+
+        if (size > out->own.length)
+        {
+            fprintf (stderr, "ERR: %s(%d): %s: %u byte frame truncated\n", __FILE__, __LINE__, st->name, size);
+            size = out->own.length;
+        }
+        memcpy (out->own.vaddr, bs->vaddr, size);
+
+        out->own.v4l_buf.sequence  = bs->sequence;
+        out->own.v4l_buf.timestamp.tv_sec  = bs->ts_ns / 1000000000ULL;
+        out->own.v4l_buf.timestamp.tv_usec = bs->ts_ns % 1000000000ULL / 1000;
+        out->own.v4l_buf.flags     = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC | (bs->key ? V4L2_BUF_FLAG_KEYFRAME : 0);
+        out->own.v4l_buf.bytesused = size;
+        m2m_enc_release (es->enc, bs);
+
+        pipe_emit (st, out);
+        pipe_buf_unref (out);
+        num ++;
+        timeout_ms = 0;
+    }
+    return num;
+}
+
+static int
+encode_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    encode_stage_t *es = (encode_stage_t *)st->priv;
+    int idx = in->frame->v4l_buf.index;
+    int stall = 0;
+
+    pipe_buf_ref (in);
+    es->held[idx] = in;
+    es->held_num ++;
+    if (m2m_enc_queue (es->enc, in->frame) < 0)
+    {
+        es->held[idx] = NULL;
+        es->held_num --;
+        pipe_buf_unref (in);
+        return -1;
+    }
+
+    encode_reclaim (es);
+    encode_drain (st, 0);
+
+    /* leave the camera two buffers, or no new frame would come to unblock us */
+    while (es->held_num > es->dev->stream.bufcount - 2)
+    {
+        int progress = encode_drain (st, 100);
+        progress += encode_reclaim (es);
+
+        if (progress == 0 && ++ stall == ENC_MAX_STALL)
+        {
+            fprintf (stderr, "ERR: %s(%d): %s: encoder stalled\n", __FILE__, __LINE__, st->name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+encode_flush (pipe_stage_t *st)
+{
+    encode_stage_t *es = (encode_stage_t *)st->priv;
+
+    if (m2m_enc_stop (es->enc) == 0)
+    {
+        while (!es->enc->eos && encode_drain (st, 1000) > 0)
+            ;
+    }
+    encode_reclaim (es);
+}
+
+static void
+encode_close (pipe_stage_t *st)
+{
+    encode_stage_t *es = (encode_stage_t *)st->priv;
+    int i;
+
+    if (es->held)
+    {
+        for (i = 0; i < es->dev->stream.bufcount; i ++)
+        {
+            if (es->held[i])
+                pipe_buf_unref (es->held[i]);
+        }
+    }
+    if (es->enc)
+        m2m_enc_close (es->enc);
+    free (es->held);
+    free (es);
+}
+
+static const pipe_stage_ops_t s_encode_ops = {
+    "encode", PIPE_TRANSFORM, encode_open, NULL, encode_process, encode_flush, NULL, encode_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  file: segmented recordings (util_recorder)
+ * ------------------------------------------------------------------------ */
+static int
+file_open (pipe_stage_t *st)
+{
+    recorder_opt_t opt = {0};
+    const char *compress = pipe_opt_str (st, "compress", NULL);
+
+    opt.prefix      = pipe_opt_str (st, "prefix", NULL);
+    opt.seg_sec     = pipe_opt_int (st, "seg", 0);
+    opt.seg_bytes   = (uint64_t)pipe_opt_int (st, "size", 0) << 20;
+    opt.quota_bytes = (uint64_t)pipe_opt_int (st, "quota", 0) << 20;
+    opt.workers     = pipe_opt_int (st, "workers", 0);
+    opt.worker_cpus = pipe_opt_str (st, "worker_cpus", NULL);
+    if (opt.prefix == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: prefix= missing\n", __FILE__, __LINE__, st->name);
+        return -1;
+    }
+
+    /* intra: every frame standalone, delta: against the previous frame */
+    if (compress && !st->fmt.coded)
+    {
+        opt.codec  = CODEC_PACK;
+        opt.keyint = strcmp (compress, "intra") == 0 ? 1 : 30;
+    }
+
+    st->priv = recorder_open (&opt, st->fmt.fourcc, st->fmt.w, st->fmt.h, st->fmt.coded ? 0 : st->fmt.stride);
+    return st->priv ? 0 : -1;
+}
+
+static int
+file_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    recorder_t *rec = (recorder_t *)st->priv;
+    struct v4l2_buffer *vb = &in->frame->v4l_buf;
+    uint64_t ts_ns = timeval_to_ns (vb->timestamp);
+    int written;
+
+    if (st->fmt.coded)
+        written = recorder_write_stream (rec, in->frame->vaddr, vb->bytesused, vb->sequence, ts_ns,
+                                         (vb->flags & V4L2_BUF_FLAG_KEYFRAME) != 0);
+    else
+        written = recorder_write (rec, in->frame->vaddr, (uint32_t)st->fmt.stride * st->fmt.h,
+                                  vb->sequence, ts_ns);
+    if (written < 0)
+        return -1;
+
+    st->stat.bytes_out += written;
+    return 0;
+}
+
+static void
+file_close (pipe_stage_t *st)
+{
+    if (st->priv)
+        recorder_close ((recorder_t *)st->priv);
+}
+
+static const pipe_stage_ops_t s_file_ops = {
+    "file", PIPE_SINK, file_open, NULL, file_process, NULL, NULL, file_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  drm: double buffered plane on the first display
+ * ------------------------------------------------------------------------ */
+typedef struct _drm_sink_t
+{
+    drm_obj_t       dobj;
+    drm_fb_t        fb[2];
+    int             fb_num;
+    int             cur;
+    const format_info_t *fi;
+} drm_sink_t;
+
+static int
+drm_sink_open (pipe_stage_t *st)
+{
+    drm_sink_t *ds;
+
+    if (need_raw_input (st) < 0)
+        return -1;
+
+    ds = (drm_sink_t *)calloc (1, sizeof (drm_sink_t));
+    DBG_ASSERT (ds, "alloc failed");
+    ds->dobj.fd = -1;
+    st->priv = ds;
+
+    ds->fi = format_from_v4l2 (st->fmt.fourcc);
+    if (ds->fi == NULL || ds->fi->drm == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: %.4s can't be displayed\n", __FILE__, __LINE__,
+                 st->name, (char *)&st->fmt.fourcc);
+        return -1;
+    }
+
+    if (drm_initialize (&ds->dobj) < 0)
+        return -1;
+
+    for (ds->fb_num = 0; ds->fb_num < 2; ds->fb_num ++)
+    {
+        if (drm_alloc_fb (ds->dobj.fd, st->fmt.w, st->fmt.h, ds->fi->drm, &ds->fb[ds->fb_num]) < 0)
+            return -1;
+        if (drm_add_fb (ds->dobj.fd, &ds->fb[ds->fb_num]) < 0)
+        {
+            drm_free_fb (ds->dobj.fd, &ds->fb[ds->fb_num]);
+            return -1;
+        }
+    }
+
+    drm_atomic_set_mode (&ds->dobj, 0, 1);
+    return 0;
+}
+
+static int
+drm_sink_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    drm_sink_t *ds = (drm_sink_t *)st->priv;
+    const format_info_t *fi = ds->fi;
+    drm_fb_t *fb = &ds->fb[ds->cur];
+    const uint8_t *img = (const uint8_t *)in->frame->vaddr;
+    unsigned int planes = (1u << fi->planes) - 1;
+    int p;
+
+    drm_fb_begin_cpu_access (fb, planes, DMABUF_CPU_WRITE);
+    for (p = 0; p < fi->planes; p ++)
+    {
+        int rows   = p == 0 ? fb->height : fb->height / fi->vsub;
+        int len    = p == 0 ? fb->width * fi->cpp : fb->width * fi->cpp * 2 / fi->hsub;
+        int stride = st->fmt.stride;
+
+        /* I420: two half width chroma planes */
+        if (fi->planes == 3 && p > 0)
+        {
+            len    = fb->width / fi->hsub;
+            stride = st->fmt.stride / fi->hsub;
+        }
+
+        /* dumb buffers are write-combined */
+        wcmem_copy_rows ((uint8_t *)fb->map_buf + fb->offset[p], fb->pitch[p], FRAME_MEM_WC,
+                         img, stride, FRAME_MEM_CACHED, len, rows);
+        img += (size_t)rows * stride;
+    }
+    drm_fb_end_cpu_access (fb, planes, DMABUF_CPU_WRITE);
+
+    drm_atomic_set_plane (&ds->dobj, fb, 0, 0, 0, 0);
+    ds->cur ^= 1;
+    return drm_atomic_flush (&ds->dobj, 1);
+}
+
+static void
+drm_sink_close (pipe_stage_t *st)
+{
+    drm_sink_t *ds = (drm_sink_t *)st->priv;
+    int i;
+
+    for (i = 0; i < ds->fb_num; i ++)
+    {
+        drm_remove_fb (ds->dobj.fd, &ds->fb[i]);
+        drm_free_fb (ds->dobj.fd, &ds->fb[i]);
+    }
+    if (ds->dobj.fd >= 0)
+        drm_terminate (&ds->dobj);
+    free (ds);
+}
+
+static const pipe_stage_ops_t s_drm_ops = {
+    "drm", PIPE_SINK, drm_sink_open, NULL, drm_sink_process, NULL, NULL, drm_sink_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  shm: shared memory publisher (util_shm). subscribers map the capture
+ *  buffers, so a frame is held until every subscriber has let go of it
+ * ------------------------------------------------------------------------ */
+typedef struct _shm_sink_t
+{
+    shm_pub_t       *pub;
+    pipe_buf_t      **held;     /* per capture buffer index */
+    int             bufcount;
+} shm_sink_t;
+
+static void
+shm_sink_release (void *arg, capture_frame_t *frame)
+{
+    shm_sink_t *ss = (shm_sink_t *)arg;
+    pipe_buf_t *buf = ss->held[frame->v4l_buf.index];
+
+    ss->held[frame->v4l_buf.index] = NULL;
+    if (buf)
+        pipe_buf_unref (buf);
+}
+
+static int
+shm_sink_open (pipe_stage_t *st)
+{
+    capture_dev_t *dev = input_v4l2_dev (st);
+    shm_sink_t *ss;
+
+    if (dev == NULL)
+        return -1;
+
+    ss = (shm_sink_t *)calloc (1, sizeof (shm_sink_t));
+    DBG_ASSERT (ss, "alloc failed");
+    st->priv = ss;
+
+    ss->bufcount = dev->stream.bufcount;
+    ss->held = (pipe_buf_t **)calloc (ss->bufcount, sizeof (pipe_buf_t *));
+    DBG_ASSERT (ss->held, "alloc failed");
+
+    ss->pub = shm_pub_create (dev, pipe_opt_str (st, "path", "/tmp/v4l2_app.sock"));
+    if (ss->pub == NULL)
+        return -1;
+    ss->pub->release     = shm_sink_release;
+    ss->pub->release_arg = ss;
+
+    return 0;
+}
+
+static int
+shm_sink_process (pipe_stage_t *st, pipe_buf_t *in)
+{
+    shm_sink_t *ss = (shm_sink_t *)st->priv;
+
+    pipe_buf_ref (in);
+    ss->held[in->frame->v4l_buf.index] = in;
+
+    shm_pub_publish (ss->pub, in->frame);
+
+    /* leave the camera two buffers, or no new frame would come to call
+     * us again and take back what the subscribers have let go of.
+     * short waits, to notice pipeline_stop() while they hold on */
+    do
+        shm_pub_reclaim_wait (ss->pub, ss->bufcount - 2, 100);
+    while (ss->pub->inflight_num > ss->bufcount - 2 && !st->pipe->quit);
+    return 0;
+}
+
+/* the pipeline is going down: take the frames back from slow subscribers */
+static void
+shm_sink_flush (pipe_stage_t *st)
+{
+    shm_sink_t *ss = (shm_sink_t *)st->priv;
+    int i;
+
+    for (i = 0; i < ss->pub->bufcount; i ++)
+    {
+        if (ss->pub->inflight[i])
+        {
+            shm_sink_release (ss, ss->pub->inflight[i]);
+            ss->pub->inflight[i] = NULL;
+            ss->pub->inflight_num --;
+        }
+    }
+}
+
+static void
+shm_sink_close (pipe_stage_t *st)
+{
+    shm_sink_t *ss = (shm_sink_t *)st->priv;
+
+    if (ss->pub)
+        shm_pub_destroy (ss->pub);
+    free (ss->held);
+    free (ss);
+}
+
+static const pipe_stage_ops_t s_shm_ops = {
+    "shm", PIPE_SINK, shm_sink_open, NULL, shm_sink_process, shm_sink_flush, NULL, shm_sink_close,
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  registry
+ * ------------------------------------------------------------------------ */
+static const pipe_stage_ops_t *s_stage_ops[] = {
+    &s_v4l2_ops,
+    &s_replay_ops,
+    &s_convert_ops,
+    &s_scale_ops,
+    &s_stats_ops,
+    &s_motion_ops,
+    &s_encode_ops,
+    &s_file_ops,
+    &s_drm_ops,
+    &s_shm_ops,
+};
+
+const pipe_stage_ops_t *
+pipe_find_stage_ops (const char *type)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof (s_stage_ops) / sizeof (s_stage_ops[0]); i ++)
+    {
+        if (strcmp (s_stage_ops[i]->type, type) == 0)
+            return s_stage_ops[i];
+    }
+    return NULL;
+}
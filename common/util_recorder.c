@@ -0,0 +1,570 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "util_recorder.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+#include "util_rt.h"
+
+#define PREALLOC_MAX        (1024ULL * 1024 * 1024)
+#define PREALLOC_CHUNK      (64ULL * 1024 * 1024)   /* growth when the estimate was short */
+#define WRITE_BEHIND        (8ULL * 1024 * 1024)    /* flush + drop page cache granularity */
+#define EXPECTED_FPS        30
+
+
+/* ------------------------------------------------------------------------ *
+ *  background deleter
+ * ------------------------------------------------------------------------ */
+static void *
+deleter_thread (void *arg)
+{
+    recorder_t *rec = (recorder_t *)arg;
+
+    pthread_mutex_lock (&rec->mutex);
+    while (1)
+    {
+        /* keep room for the segment being written */
+        while (rec->seg_head && rec->total_bytes + rec->prealloc > rec->opt.quota_bytes)
+        {
+            rec_segment_t *seg = rec->seg_head;
+            rec->seg_head = seg->next;
+            if (rec->seg_head == NULL)
+                rec->seg_tail = NULL;
+            rec->total_bytes -= seg->size;
+
+            /* unlink of a large file may block for a while */
+            pthread_mutex_unlock (&rec->mutex);
+            if (unlink (seg->fname) < 0)
+                fprintf (stderr, "ERR: %s(%d): unlink %s: %s\n", __FILE__, __LINE__, seg->fname, strerror (errno));
+            else
+                fprintf (stderr, "quota: deleted %s\n", seg->fname);
+            free (seg);
+            pthread_mutex_lock (&rec->mutex);
+        }
+
+        if (rec->quit)
+            break;
+        pthread_cond_wait (&rec->cond, &rec->mutex);
+    }
+    pthread_mutex_unlock (&rec->mutex);
+
+    return NULL;
+}
+
+static void
+push_closed_segment (recorder_t *rec, const char *fname, uint64_t size)
+{
+    rec_segment_t *seg;
+
+    if (rec->opt.quota_bytes == 0)
+        return;
+
+    seg = (rec_segment_t *)calloc (1, sizeof (rec_segment_t));
+    DBG_ASSERT (seg, "alloc failed");
+    snprintf (seg->fname, sizeof (seg->fname), "%s", fname);
+    seg->size = size;
+
+    pthread_mutex_lock (&rec->mutex);
+    if (rec->seg_tail)
+        rec->seg_tail->next = seg;
+    else
+        rec->seg_head = seg;
+    rec->seg_tail = seg;
+    rec->total_bytes += size;
+    pthread_cond_signal (&rec->cond);
+    pthread_mutex_unlock (&rec->mutex);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  segment file
+ * ------------------------------------------------------------------------ */
+static void
+preallocate (recorder_t *rec, uint64_t len)
+{
+    /* not supported everywhere (tmpfs, NFS); then just grow as we go */
+    if (fallocate (rec->fd, 0, 0, len) == 0)
+        rec->allocated = len;
+}
+
+static int
+open_segment (recorder_t *rec)
+{
+    rec_file_header_t hdr = {0};
+
+    snprintf (rec->fname, sizeof (rec->fname), "%s_%05d.v4r", rec->prefix, rec->segno);
+
+    rec->fd = open (rec->fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (rec->fd < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): open %s: %s\n", __FILE__, __LINE__, rec->fname, strerror (errno));
+        return -1;
+    }
+
+    rec->allocated = 0;
+    if (rec->prealloc)
+        preallocate (rec, rec->prealloc);
+
+    rec->seg_start_ns = get_monotonic_ns ();
+    rec->index_num    = 0;
+    rec->synced       = 0;
+
+    hdr.magic        = REC_FILE_MAGIC;
+    hdr.version      = REC_VERSION;
+    hdr.fourcc       = rec->fourcc;
+    hdr.width        = rec->width;
+    hdr.height       = rec->height;
+    hdr.bytesperline = rec->bytesperline;
+    hdr.segment      = rec->segno;
+    hdr.start_ns     = rec->seg_start_ns;
+
+    if (write (rec->fd, &hdr, sizeof (hdr)) != sizeof (hdr))
+    {
+        fprintf (stderr, "ERR: %s(%d): write %s: %s\n", __FILE__, __LINE__, rec->fname, strerror (errno));
+        close (rec->fd);
+        rec->fd = -1;
+        return -1;
+    }
+    rec->offset = sizeof (hdr);
+
+    return 0;
+}
+
+static void
+close_segment (recorder_t *rec)
+{
+    rec_trailer_t trailer;
+    size_t index_len = sizeof (rec_index_entry_t) * rec->index_num;
+
+    if (rec->fd < 0)
+        return;
+
+    TRACE_BEGIN ("close_segment");
+
+    trailer.magic        = REC_INDEX_MAGIC;
+    trailer.count        = rec->index_num;
+    trailer.index_offset = rec->offset;
+
+    if (write (rec->fd, rec->index, index_len) != (ssize_t)index_len ||
+        write (rec->fd, &trailer, sizeof (trailer)) != sizeof (trailer))
+    {
+        fprintf (stderr, "ERR: %s(%d): write index %s: %s\n", __FILE__, __LINE__, rec->fname, strerror (errno));
+    }
+    rec->offset += index_len + sizeof (trailer);
+
+    /* give back the unused part of the preallocation */
+    if (ftruncate (rec->fd, rec->offset) < 0)
+        fprintf (stderr, "ERR: %s(%d): ftruncate %s: %s\n", __FILE__, __LINE__, rec->fname, strerror (errno));
+
+    close (rec->fd);
+    rec->fd = -1;
+
+    fprintf (stderr, "segment: %s (%d frames, %llu bytes)\n", rec->fname,
+             rec->index_num, (unsigned long long)rec->offset);
+    push_closed_segment (rec, rec->fname, rec->offset);
+    rec->segno ++;
+
+    TRACE_END ("close_segment");
+}
+
+/*
+ *  write-behind: start writeback of the last window and drop the one
+ *  before it from the page cache, so a long recording neither builds up
+ *  a burst of dirty pages nor evicts everything else from memory.
+ */
+static void
+write_behind (recorder_t *rec)
+{
+    while (rec->offset - rec->synced >= WRITE_BEHIND)
+    {
+        sync_file_range (rec->fd, rec->synced, WRITE_BEHIND, SYNC_FILE_RANGE_WRITE);
+        if (rec->synced >= WRITE_BEHIND)
+        {
+            uint64_t prev = rec->synced - WRITE_BEHIND;
+            sync_file_range (rec->fd, prev, WRITE_BEHIND,
+                             SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise (rec->fd, prev, WRITE_BEHIND, POSIX_FADV_DONTNEED);
+        }
+        rec->synced += WRITE_BEHIND;
+    }
+}
+
+static int
+need_rotate (recorder_t *rec, uint64_t len, uint32_t flags)
+{
+    if (rec->index_num == 0 || !(flags & REC_FLAG_KEY))
+        return 0;
+
+    if (rec->opt.seg_bytes && rec->offset + len > rec->opt.seg_bytes)
+        return 1;
+
+    if (rec->opt.seg_sec && get_monotonic_ns () - rec->seg_start_ns >= rec->opt.seg_sec * 1000000000ULL)
+        return 1;
+
+    return 0;
+}
+
+
+static int
+write_frame (recorder_t *rec, const void *data, uint32_t size, uint32_t sequence, uint32_t flags, uint64_t ts_ns)
+{
+    rec_frame_header_t hdr;
+    struct iovec iov[2];
+    uint64_t len = sizeof (hdr) + size;
+
+    TRACE_BEGIN ("write_frame");
+
+    if (need_rotate (rec, len, flags))
+    {
+        close_segment (rec);
+        if (open_segment (rec) < 0)
+            goto err;
+    }
+
+    if (rec->offset + len > rec->allocated && rec->allocated)
+        preallocate (rec, rec->offset + len + PREALLOC_CHUNK);
+
+    hdr.magic    = REC_FRAME_MAGIC;
+    hdr.size     = size;
+    hdr.sequence = sequence;
+    hdr.flags    = flags;
+    hdr.ts_ns    = ts_ns;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof (hdr);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = size;
+    if (writev (rec->fd, iov, 2) != (ssize_t)len)
+    {
+        fprintf (stderr, "ERR: %s(%d): write %s: %s\n", __FILE__, __LINE__, rec->fname, strerror (errno));
+        goto err;
+    }
+
+    if (rec->index_num == rec->index_max)
+    {
+        rec->index_max *= 2;
+        rec->index = (rec_index_entry_t *)realloc (rec->index, sizeof (rec_index_entry_t) * rec->index_max);
+        DBG_ASSERT (rec->index, "alloc failed");
+    }
+    rec->index[rec->index_num].offset = rec->offset;
+    rec->index[rec->index_num].ts_ns  = ts_ns;
+    rec->index_num ++;
+
+    rec->offset += len;
+    rec->disk_bytes += len;
+    write_behind (rec);
+
+    TRACE_END ("write_frame");
+    return len;
+
+err:
+    TRACE_END ("write_frame");
+    return -1;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  compression pool
+ * ------------------------------------------------------------------------ */
+static void *
+worker_thread (void *arg)
+{
+    recorder_t *rec = (recorder_t *)arg;
+    codec_t *codec = codec_create (rec->fourcc, rec->width, rec->height);
+    DBG_ASSERT (codec, "failed to create codec\n");
+
+    if (rec->opt.worker_cpus)
+        rt_set_affinity (pthread_self (), rec->opt.worker_cpus);
+
+    pthread_mutex_lock (&rec->job_mutex);
+    while (1)
+    {
+        while (rec->job_take == rec->job_next && !rec->job_quit)
+            pthread_cond_wait (&rec->job_cond, &rec->job_mutex);
+        if (rec->job_take == rec->job_next)
+            break;
+
+        rec_job_t *job = &rec->jobs[rec->job_take % rec->job_num];
+        rec->job_take ++;
+        pthread_mutex_unlock (&rec->job_mutex);
+
+        int len = codec_encode (codec, job->raw, job->ref, rec->bytesperline, job->out);
+        job->flags    = CODEC_PACK | (job->ref ? 0 : REC_FLAG_KEY);
+        job->out_size = len;
+
+        /* not worth it: keep the frame as is */
+        if ((uint32_t)len >= rec->raw_size)
+        {
+            job->flags    = CODEC_RAW | REC_FLAG_KEY;
+            job->out_size = rec->raw_size;
+        }
+
+        pthread_mutex_lock (&rec->job_mutex);
+        job->done = 1;
+        pthread_cond_broadcast (&rec->done_cond);
+    }
+    pthread_mutex_unlock (&rec->job_mutex);
+
+    codec_destroy (codec);
+    return NULL;
+}
+
+/* wait for the oldest job and append it to the segment */
+static int
+flush_job (recorder_t *rec)
+{
+    rec_job_t *job = &rec->jobs[rec->job_write % rec->job_num];
+    const void *data;
+
+    pthread_mutex_lock (&rec->job_mutex);
+    while (!job->done)
+        pthread_cond_wait (&rec->done_cond, &rec->job_mutex);
+    pthread_mutex_unlock (&rec->job_mutex);
+
+    rec->job_write ++;
+    data = (job->flags & REC_FLAG_CODEC_MASK) == CODEC_RAW ? job->raw : job->out;
+
+    return write_frame (rec, data, job->out_size, job->sequence, job->flags, job->ts_ns);
+}
+
+static void
+create_pool (recorder_t *rec)
+{
+    codec_t *codec;
+    int max_size, i;
+
+    /* a format the codec doesn't know is recorded as it is */
+    codec = codec_create (rec->fourcc, rec->width, rec->height);
+    if (codec == NULL)
+    {
+        fprintf (stderr, "compression unavailable for %.4s, recording uncompressed.\n", (char *)&rec->fourcc);
+        rec->opt.codec = CODEC_RAW;
+        return;
+    }
+    max_size = codec_max_size (codec);
+    codec_destroy (codec);
+
+    if (rec->opt.workers <= 0)
+        rec->opt.workers = 1;
+    if (rec->opt.keyint <= 0)
+        rec->opt.keyint = 30;
+
+    /* at most job_num - 1 jobs are outstanding, so the previous slot
+     * (a job's reference) is never reused while it is being encoded */
+    rec->job_num = rec->opt.workers + 2;
+    rec->jobs = (rec_job_t *)calloc (rec->job_num, sizeof (rec_job_t));
+    DBG_ASSERT (rec->jobs, "alloc failed");
+    for (i = 0; i < rec->job_num; i ++)
+    {
+        rec->jobs[i].raw = (uint8_t *)malloc (rec->raw_size);
+        rec->jobs[i].out = (uint8_t *)malloc (max_size);
+        DBG_ASSERT (rec->jobs[i].raw && rec->jobs[i].out, "alloc failed");
+    }
+
+    pthread_mutex_init (&rec->job_mutex, NULL);
+    pthread_cond_init  (&rec->job_cond, NULL);
+    pthread_cond_init  (&rec->done_cond, NULL);
+
+    rec->workers = (pthread_t *)calloc (rec->opt.workers, sizeof (pthread_t));
+    DBG_ASSERT (rec->workers, "alloc failed");
+    for (i = 0; i < rec->opt.workers; i ++)
+        pthread_create (&rec->workers[i], NULL, worker_thread, rec);
+}
+
+static void
+destroy_pool (recorder_t *rec)
+{
+    int i;
+
+    pthread_mutex_lock (&rec->job_mutex);
+    rec->job_quit = 1;
+    pthread_cond_broadcast (&rec->job_cond);
+    pthread_mutex_unlock (&rec->job_mutex);
+
+    for (i = 0; i < rec->opt.workers; i ++)
+        pthread_join (rec->workers[i], NULL);
+
+    for (i = 0; i < rec->job_num; i ++)
+    {
+        free (rec->jobs[i].raw);
+        free (rec->jobs[i].out);
+    }
+    free (rec->jobs);
+    free (rec->workers);
+
+    pthread_cond_destroy  (&rec->done_cond);
+    pthread_cond_destroy  (&rec->job_cond);
+    pthread_mutex_destroy (&rec->job_mutex);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+recorder_t *
+recorder_open (recorder_opt_t *opt, uint32_t fourcc, int w, int h, int bytesperline)
+{
+    recorder_t *rec;
+    uint64_t frame_size = (uint64_t)bytesperline * h;
+
+    rec = (recorder_t *)calloc (1, sizeof (recorder_t));
+    DBG_ASSERT (rec, "alloc failed");
+
+    rec->opt = *opt;
+    snprintf (rec->prefix, sizeof (rec->prefix), "%s", opt->prefix ? opt->prefix : "cap");
+    rec->opt.prefix    = rec->prefix;
+    rec->fourcc        = fourcc;
+    rec->width         = w;
+    rec->height        = h;
+    rec->bytesperline  = bytesperline;
+    rec->raw_size      = frame_size;
+    rec->fd            = -1;
+
+    /* size the preallocation to the expected segment length */
+    if (opt->seg_bytes)
+        rec->prealloc = opt->seg_bytes;
+    else if (opt->seg_sec && frame_size)
+        rec->prealloc = frame_size * EXPECTED_FPS * opt->seg_sec;
+    else
+        rec->prealloc = PREALLOC_CHUNK;
+    if (rec->prealloc > PREALLOC_MAX)
+        rec->prealloc = PREALLOC_MAX;
+
+    rec->index_max = 1024;
+    rec->index = (rec_index_entry_t *)malloc (sizeof (rec_index_entry_t) * rec->index_max);
+    DBG_ASSERT (rec->index, "alloc failed");
+
+    pthread_mutex_init (&rec->mutex, NULL);
+    pthread_cond_init  (&rec->cond, NULL);
+    if (opt->quota_bytes)
+        pthread_create (&rec->deleter, NULL, deleter_thread, rec);
+
+    if (opt->codec != CODEC_RAW)
+        create_pool (rec);
+
+    if (open_segment (rec) < 0)
+    {
+        recorder_close (rec);
+        return NULL;
+    }
+
+    return rec;
+}
+
+/*
+ *  returns the number of bytes written to disk by this call, which
+ *  with a codec are those of earlier frames, or -1 on error.
+ */
+int
+recorder_write (recorder_t *rec, const void *data, uint32_t size, uint32_t sequence, uint64_t ts_ns)
+{
+    rec_job_t *job;
+    int written = 0;
+
+    rec->raw_bytes += size;
+
+    if (rec->opt.codec == CODEC_RAW)
+        return write_frame (rec, data, size, sequence, REC_FLAG_KEY, ts_ns);
+
+    if (size != rec->raw_size)
+    {
+        fprintf (stderr, "ERR: %s(%d): frame size %u (expected %u)\n", __FILE__, __LINE__, size, rec->raw_size);
+        return -1;
+    }
+
+    /* keep the slot that the new job refers to out of reuse */
+    while (rec->job_next - rec->job_write >= (uint64_t)rec->job_num - 1)
+    {
+        int len = flush_job (rec);
+        if (len < 0)
+            return -1;
+        written += len;
+    }
+
+    job = &rec->jobs[rec->job_next % rec->job_num];
+    memcpy (job->raw, data, size);
+    job->sequence = sequence;
+    job->ts_ns    = ts_ns;
+    job->done     = 0;
+
+    if (rec->since_key == 0 || rec->opt.keyint == 1)
+        job->ref = NULL;
+    else
+        job->ref = rec->jobs[(rec->job_next - 1) % rec->job_num].raw;
+    rec->since_key = (rec->since_key + 1) % rec->opt.keyint;
+
+    pthread_mutex_lock (&rec->job_mutex);
+    rec->job_next ++;
+    pthread_cond_signal (&rec->job_cond);
+    pthread_mutex_unlock (&rec->job_mutex);
+
+    return written;
+}
+
+/* an already coded frame. key: starts a decodable run (segments rotate there) */
+int
+recorder_write_stream (recorder_t *rec, const void *data, uint32_t size, uint32_t sequence,
+                       uint64_t ts_ns, int key)
+{
+    if (rec->opt.codec != CODEC_RAW)
+    {
+        fprintf (stderr, "ERR: %s(%d): coded frames can't be compressed again\n", __FILE__, __LINE__);
+        return -1;
+    }
+
+    return write_frame (rec, data, size, sequence, CODEC_STREAM | (key ? REC_FLAG_KEY : 0), ts_ns);
+}
+
+void
+recorder_close (recorder_t *rec)
+{
+    if (rec->opt.codec != CODEC_RAW)
+    {
+        while (rec->job_write < rec->job_next)
+            flush_job (rec);
+        destroy_pool (rec);
+    }
+
+    if (rec->raw_bytes)
+    {
+        fprintf (stderr, "recorder: %llu bytes raw, %llu bytes written",
+                 (unsigned long long)rec->raw_bytes, (unsigned long long)rec->disk_bytes);
+        if (rec->disk_bytes > 0)
+            fprintf (stderr, " (%.2fx)", (double)rec->raw_bytes / rec->disk_bytes);
+        fprintf (stderr, "\n");
+    }
+
+    /* the last segment needs no room reserved for a successor */
+    pthread_mutex_lock (&rec->mutex);
+    rec->prealloc = 0;
+    pthread_mutex_unlock (&rec->mutex);
+
+    close_segment (rec);
+
+    if (rec->opt.quota_bytes)
+    {
+        pthread_mutex_lock (&rec->mutex);
+        rec->quit = 1;
+        pthread_cond_signal (&rec->cond);
+        pthread_mutex_unlock (&rec->mutex);
+        pthread_join (rec->deleter, NULL);
+    }
+
+    while (rec->seg_head)
+    {
+        rec_segment_t *seg = rec->seg_head;
+        rec->seg_head = seg->next;
+        free (seg);
+    }
+
+    pthread_cond_destroy  (&rec->cond);
+    pthread_mutex_destroy (&rec->mutex);
+    free (rec->index);
+    free (rec);
+}
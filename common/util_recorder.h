@@ -0,0 +1,164 @@
+#ifndef _UTIL_RECORDER_H_
+#define _UTIL_RECORDER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "util_codec.h"
+
+/*
+ *  Segmented frame recorder.
+ *
+ *  Frames are appended to segment files "<prefix>_<NNNNN>.v4r"; a new
+ *  segment is started every seg_sec seconds and/or seg_bytes bytes.
+ *  Each segment is preallocated with fallocate() and trimmed on close.
+ *  When the recorded segments exceed quota_bytes, the oldest ones are
+ *  deleted by a background thread.
+ *
+ *  With a codec, frames are compressed by a pool of worker threads and
+ *  written in order by the caller of recorder_write(). Inter coded
+ *  frames refer to the previous frame, so every keyint-th frame is a
+ *  key frame and segments are only rotated at key frames.
+ *
+ *  Frames compressed elsewhere (V4L2 M2M encoder) are stored as they
+ *  are with recorder_write_stream(); open the recorder with the coded
+ *  fourcc (V4L2_PIX_FMT_H264, ...) and bytesperline 0 for those.
+ *
+ *  Segment layout:
+ *      rec_file_header_t
+ *      { rec_frame_header_t, payload } * N
+ *      rec_index_entry_t * N
+ *      rec_trailer_t
+ */
+#define REC_FILE_MAGIC      0x52344c56      /* "VL4R" */
+#define REC_FRAME_MAGIC     0x46344c56      /* "VL4F" */
+#define REC_INDEX_MAGIC     0x49344c56      /* "VL4I" */
+#define REC_VERSION         1
+
+/* rec_frame_header_t.flags */
+#define REC_FLAG_CODEC_MASK 0x00ff      /* CODEC_RAW, CODEC_PACK, CODEC_STREAM */
+#define REC_FLAG_KEY        0x0100      /* decodable without the previous frame */
+
+typedef struct _rec_file_header_t
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    fourcc;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    bytesperline;
+    uint32_t    segment;        /* segment number */
+    uint32_t    reserved;
+    uint64_t    start_ns;       /* CLOCK_MONOTONIC at segment open */
+} rec_file_header_t;
+
+typedef struct _rec_frame_header_t
+{
+    uint32_t    magic;
+    uint32_t    size;           /* payload bytes that follow */
+    uint32_t    sequence;
+    uint32_t    flags;
+    uint64_t    ts_ns;
+} rec_frame_header_t;
+
+typedef struct _rec_index_entry_t
+{
+    uint64_t    offset;         /* of the rec_frame_header_t */
+    uint64_t    ts_ns;
+} rec_index_entry_t;
+
+typedef struct _rec_trailer_t
+{
+    uint32_t    magic;
+    uint32_t    count;
+    uint64_t    index_offset;
+} rec_trailer_t;
+
+
+typedef struct _recorder_opt_t
+{
+    const char  *prefix;
+    int         seg_sec;        /* 0: no time based rotation */
+    uint64_t    seg_bytes;      /* 0: no size based rotation */
+    uint64_t    quota_bytes;    /* 0: keep all segments      */
+
+    int         codec;          /* CODEC_RAW: store as is */
+    int         workers;        /* compression threads    */
+    int         keyint;         /* key frame interval (1: intra only) */
+    const char  *worker_cpus;   /* cpu list to pin the workers to. NULL: any */
+} recorder_opt_t;
+
+typedef struct _rec_job_t
+{
+    uint8_t     *raw;           /* copy of the input frame */
+    uint8_t     *out;
+    uint32_t    out_size;
+    uint32_t    flags;
+    uint32_t    sequence;
+    uint64_t    ts_ns;
+    const uint8_t *ref;         /* raw of the previous job, NULL for key frames */
+    int         done;
+} rec_job_t;
+
+typedef struct _rec_segment_t
+{
+    char        fname[256];
+    uint64_t    size;
+    struct _rec_segment_t *next;
+} rec_segment_t;
+
+typedef struct _recorder_t
+{
+    recorder_opt_t opt;
+    char        prefix[200];
+    uint32_t    fourcc;
+    uint32_t    width, height, bytesperline;
+    uint64_t    prealloc;       /* bytes to fallocate per segment */
+
+    /* current segment */
+    int         fd;
+    int         segno;
+    char        fname[256];
+    uint64_t    offset;
+    uint64_t    allocated;
+    uint64_t    seg_start_ns;
+    uint64_t    synced;         /* write-behind position */
+    rec_index_entry_t *index;
+    int         index_num;
+    int         index_max;
+
+    /* closed segments, oldest first; owned by the deleter */
+    rec_segment_t *seg_head;
+    rec_segment_t *seg_tail;
+    uint64_t    total_bytes;
+
+    pthread_t   deleter;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int         quit;
+
+    /* compression pool: jobs [job_write, job_take) are being encoded,
+     * [job_take, job_next) wait for a worker. */
+    uint32_t    raw_size;
+    rec_job_t   *jobs;
+    int         job_num;
+    uint64_t    job_next;
+    uint64_t    job_take;
+    uint64_t    job_write;
+    int         since_key;
+    pthread_t   *workers;
+    pthread_mutex_t job_mutex;
+    pthread_cond_t  job_cond;
+    pthread_cond_t  done_cond;
+    int         job_quit;
+
+    uint64_t    raw_bytes;
+    uint64_t    disk_bytes;
+} recorder_t;
+
+recorder_t *recorder_open  (recorder_opt_t *opt, uint32_t fourcc, int w, int h, int bytesperline);
+int         recorder_write (recorder_t *rec, const void *data, uint32_t size, uint32_t sequence, uint64_t ts_ns);
+int         recorder_write_stream (recorder_t *rec, const void *data, uint32_t size, uint32_t sequence,
+                                   uint64_t ts_ns, int key);
+void        recorder_close (recorder_t *rec);
+
+#endif /* _UTIL_RECORDER_H_ */
@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "util_replay.h"
+#include "util_debug.h"
+#include "util_trace.h"
+
+#define ERRSTR strerror(errno)
+
+
+/* ------------------------------------------------------------------------ *
+ *  segments
+ * ------------------------------------------------------------------------ */
+static void
+close_segment (replay_t *rp)
+{
+    if (rp->map)
+        munmap (rp->map, rp->map_size);
+    if (rp->fd >= 0)
+        close (rp->fd);
+    rp->map = NULL;
+    rp->fd  = -1;
+}
+
+/* keep the next `prefetch` bytes on their way in, in steps of a quarter */
+static void
+prefetch_ahead (replay_t *rp)
+{
+    uint64_t want = rp->pos + rp->prefetch;
+
+    if (want > rp->map_size)
+        want = rp->map_size;
+    if (want <= rp->advised || (want < rp->map_size && want - rp->advised < rp->prefetch / 4))
+        return;
+
+    uint64_t from = rp->advised & ~(uint64_t)(rp->page_size - 1);
+    madvise (rp->map + from, want - from, MADV_WILLNEED);
+    rp->advised = want;
+}
+
+/* everything below upto has been played */
+static void
+release_behind (replay_t *rp, uint64_t upto)
+{
+    upto &= ~(uint64_t)(rp->page_size - 1);
+    if (upto <= rp->released || upto - rp->released < rp->prefetch / 4)
+        return;
+
+    madvise (rp->map + rp->released, upto - rp->released, MADV_DONTNEED);
+    rp->released = upto;
+}
+
+static int
+open_segment (replay_t *rp, int idx)
+{
+    const char *fname = rp->fnames[idx];
+    rec_file_header_t hdr;
+    rec_trailer_t trailer;
+    struct stat st;
+
+    close_segment (rp);
+
+    rp->fd = open (fname, O_RDONLY | O_CLOEXEC);
+    if (rp->fd < 0 || fstat (rp->fd, &st) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): open %s: %s\n", __FILE__, __LINE__, fname, ERRSTR);
+        close_segment (rp);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof (hdr))
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: too short\n", __FILE__, __LINE__, fname);
+        close_segment (rp);
+        return -1;
+    }
+
+    rp->map_size = st.st_size;
+    rp->map = mmap (NULL, rp->map_size, PROT_READ, MAP_SHARED, rp->fd, 0);
+    if (rp->map == MAP_FAILED)
+    {
+        fprintf (stderr, "ERR: %s(%d): mmap %s: %s\n", __FILE__, __LINE__, fname, ERRSTR);
+        rp->map = NULL;
+        close_segment (rp);
+        return -1;
+    }
+    madvise (rp->map, rp->map_size, MADV_SEQUENTIAL);
+
+    memcpy (&hdr, rp->map, sizeof (hdr));
+    if (hdr.magic != REC_FILE_MAGIC || hdr.version != REC_VERSION)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: not a recording\n", __FILE__, __LINE__, fname);
+        close_segment (rp);
+        return -1;
+    }
+
+    /* all segments of a recording share one format */
+    if (rp->hdr.magic &&
+        (hdr.fourcc != rp->hdr.fourcc || hdr.width != rp->hdr.width || hdr.height != rp->hdr.height))
+    {
+        fprintf (stderr, "ERR: %s(%d): %s: format differs from the first segment\n",
+                 __FILE__, __LINE__, fname);
+        close_segment (rp);
+        return -1;
+    }
+    rp->hdr = hdr;
+
+    /* a segment that was never closed has no index: scan to the first gap */
+    rp->end = rp->map_size;
+    if (rp->map_size >= sizeof (hdr) + sizeof (trailer))
+    {
+        memcpy (&trailer, rp->map + rp->map_size - sizeof (trailer), sizeof (trailer));
+        if (trailer.magic == REC_INDEX_MAGIC && trailer.index_offset >= sizeof (hdr) &&
+            trailer.index_offset + (uint64_t)trailer.count * sizeof (rec_index_entry_t) + sizeof (trailer) == rp->map_size)
+            rp->end = trailer.index_offset;
+    }
+
+    rp->seg_cur  = idx;
+    rp->pos      = sizeof (hdr);
+    rp->advised  = 0;
+    rp->released = 0;
+    rp->have_ref = 0;
+    rp->raw_prev = NULL;
+    prefetch_ahead (rp);
+
+    return 0;
+}
+
+/* collect "<prefix>_NNNNN.v4r", or take path as the only segment */
+static int
+find_segments (replay_t *rp, const char *path)
+{
+    size_t len = strlen (path);
+    glob_t gl;
+    char pattern[256];
+    size_t i;
+
+    if (len > 4 && strcmp (path + len - 4, ".v4r") == 0)
+    {
+        rp->fnames = (char **)calloc (1, sizeof (char *));
+        DBG_ASSERT (rp->fnames, "alloc failed");
+        rp->fnames[0] = strdup (path);
+        rp->seg_num   = 1;
+        return 0;
+    }
+
+    snprintf (pattern, sizeof (pattern), "%s_[0-9]*.v4r", path);
+    if (glob (pattern, 0, NULL, &gl) != 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): no segments match %s\n", __FILE__, __LINE__, pattern);
+        return -1;
+    }
+
+    /* glob() sorts, and the numbers are zero padded */
+    rp->fnames = (char **)calloc (gl.gl_pathc, sizeof (char *));
+    DBG_ASSERT (rp->fnames, "alloc failed");
+    for (i = 0; i < gl.gl_pathc; i ++)
+        rp->fnames[i] = strdup (gl.gl_pathv[i]);
+    rp->seg_num = gl.gl_pathc;
+    globfree (&gl);
+
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+/* path: a recording prefix (all its segments) or one .v4r file */
+replay_t *
+replay_open (const char *path, size_t prefetch)
+{
+    replay_t *rp;
+
+    rp = (replay_t *)calloc (1, sizeof (replay_t));
+    DBG_ASSERT (rp, "alloc failed");
+
+    rp->fd        = -1;
+    rp->page_size = sysconf (_SC_PAGESIZE);
+    rp->prefetch  = prefetch ? prefetch : REPLAY_PREFETCH_DEFAULT;
+
+    if (find_segments (rp, path) < 0 || open_segment (rp, 0) < 0)
+    {
+        replay_close (rp);
+        return NULL;
+    }
+
+    rp->frame.bo_handle = -1;
+    rp->frame.prime_fd  = -1;
+
+    return rp;
+}
+
+void
+replay_close (replay_t *rp)
+{
+    int i;
+
+    close_segment (rp);
+
+    for (i = 0; i < rp->seg_num; i ++)
+        free (rp->fnames[i]);
+    free (rp->fnames);
+
+    if (rp->codec)
+        codec_destroy (rp->codec);
+    free (rp->dec[0]);
+    free (rp->dec[1]);
+    free (rp);
+}
+
+int
+replay_rewind (replay_t *rp)
+{
+    return open_segment (rp, 0);
+}
+
+/* NULL at the end of the recording */
+capture_frame_t *
+replay_acquire_frame (replay_t *rp)
+{
+    rec_frame_header_t fh;
+    uint8_t *payload;
+
+    TRACE_BEGIN ("replay_acquire_frame");
+
+    while (1)
+    {
+        if (rp->map == NULL)
+            goto end;
+
+        if (rp->pos + sizeof (fh) <= rp->end)
+            memcpy (&fh, rp->map + rp->pos, sizeof (fh));
+
+        if (rp->pos + sizeof (fh) > rp->end || fh.magic != REC_FRAME_MAGIC ||
+            rp->pos + sizeof (fh) + fh.size > rp->end)
+        {
+            if (rp->pos + sizeof (fh) <= rp->end && rp->end != rp->map_size)
+                fprintf (stderr, "ERR: %s(%d): %s: broken frame at %llu\n", __FILE__, __LINE__,
+                         rp->fnames[rp->seg_cur], (unsigned long long)rp->pos);
+
+            if (rp->seg_cur + 1 >= rp->seg_num || open_segment (rp, rp->seg_cur + 1) < 0)
+                goto end;
+            continue;
+        }
+
+        /* the caller is done with the previous frame */
+        release_behind (rp, rp->pos);
+
+        payload  = rp->map + rp->pos + sizeof (fh);
+        rp->pos += sizeof (fh) + fh.size;
+        rp->bytes += sizeof (fh) + fh.size;
+        prefetch_ahead (rp);
+
+        rp->coded = 0;
+        size_t dec_size = (size_t)rp->hdr.bytesperline * rp->hdr.height;
+        const uint8_t *raw_prev = rp->raw_prev;
+        rp->raw_prev = NULL;
+
+        switch (fh.flags & REC_FLAG_CODEC_MASK)
+        {
+        case CODEC_RAW:
+            rp->frame.vaddr  = payload;
+            rp->frame.length = fh.size;
+
+            /*
+             * the recorder stores a frame raw when packing doesn't pay off,
+             * and predicts the next one from it. once decoding, keep it as
+             * the reference; before that, only remember where it is.
+             */
+            if (fh.size < dec_size)
+                rp->have_ref = 0;
+            else if (rp->codec)
+            {
+                memcpy (rp->dec[rp->dec_cur], payload, dec_size);
+                rp->frame.vaddr  = rp->dec[rp->dec_cur];
+                rp->frame.length = dec_size;
+                rp->dec_cur ^= 1;
+                rp->have_ref = 1;
+            }
+            else
+                rp->raw_prev = payload;
+            break;
+
+        case CODEC_PACK:
+        {
+            int key = fh.flags & REC_FLAG_KEY;
+
+            if (rp->codec == NULL)
+            {
+                rp->codec  = codec_create (rp->hdr.fourcc, rp->hdr.width, rp->hdr.height);
+                rp->dec[0] = (uint8_t *)malloc (dec_size);
+                rp->dec[1] = (uint8_t *)malloc (dec_size);
+                DBG_ASSERT (rp->codec && rp->dec[0] && rp->dec[1], "failed to create decoder\n");
+            }
+
+            /* first delta after a raw frame: that frame is the reference */
+            if (!key && !rp->have_ref && raw_prev)
+            {
+                memcpy (rp->dec[rp->dec_cur ^ 1], raw_prev, dec_size);
+                rp->have_ref = 1;
+            }
+
+            /* nothing to predict from until the next key frame */
+            if (!key && !rp->have_ref)
+                continue;
+
+            uint8_t *dst = rp->dec[rp->dec_cur];
+            uint8_t *ref = key ? NULL : rp->dec[rp->dec_cur ^ 1];
+            if (codec_decode (rp->codec, payload, fh.size, ref, rp->hdr.bytesperline, dst) < 0)
+            {
+                fprintf (stderr, "ERR: %s(%d): decode failed (seq %u)\n", __FILE__, __LINE__, fh.sequence);
+                rp->have_ref = 0;
+                continue;
+            }
+            rp->dec_cur ^= 1;
+            rp->have_ref = 1;
+            rp->frame.vaddr  = dst;
+            rp->frame.length = dec_size;
+            break;
+        }
+
+        case CODEC_STREAM:
+            rp->frame.vaddr  = payload;
+            rp->frame.length = fh.size;
+            rp->coded = 1;
+            break;
+
+        default:
+            continue;
+        }
+
+        memset (&rp->frame.v4l_buf, 0, sizeof (rp->frame.v4l_buf));
+        rp->frame.v4l_buf.type      = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        rp->frame.v4l_buf.memory    = V4L2_MEMORY_MMAP;
+        rp->frame.v4l_buf.bytesused = rp->frame.length;
+        rp->frame.v4l_buf.sequence  = fh.sequence;
+        rp->frame.v4l_buf.timestamp.tv_sec  = fh.ts_ns / 1000000000ULL;
+        rp->frame.v4l_buf.timestamp.tv_usec = fh.ts_ns % 1000000000ULL / 1000;
+        rp->frame.v4l_buf.flags     = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC |
+                                      ((fh.flags & REC_FLAG_KEY) ? V4L2_BUF_FLAG_KEYFRAME : 0);
+        rp->frames ++;
+
+        TRACE_END ("replay_acquire_frame");
+        return &rp->frame;
+    }
+
+end:
+    TRACE_END ("replay_acquire_frame");
+    return NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef _UTIL_REPLAY_H_
+#define _UTIL_REPLAY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util_recorder.h"
+#include "util_v4l2.h"
+#include "util_codec.h"
+
+/*
+ *  Replay source for recordings made by util_recorder.
+ *
+ *  Segments are mmap()ed one at a time and read front to back: the
+ *  kernel is told the access is sequential, the next `prefetch` bytes
+ *  are requested ahead with MADV_WILLNEED, and pages already played are
+ *  unmapped behind us, so memory use stays at the prefetch window.
+ *
+ *  Frames come out as capture_frame_t, like frames from the camera, so
+ *  they can be fed to the same stages (stats, motion, recorder, ...).
+ *  Raw frames point straight into the mapping; CODEC_PACK frames are
+ *  decoded into an internal buffer. CODEC_STREAM frames stay coded
+ *  (coded is set; the recording's fourcc names the format).
+ *
+ *  A frame stays valid until the next replay_acquire_frame().
+ */
+#define REPLAY_PREFETCH_DEFAULT     (32 * 1024 * 1024)
+
+typedef struct _replay_t
+{
+    /* segments, in order */
+    char            **fnames;
+    int             seg_num;
+    int             seg_cur;
+
+    /* current segment */
+    int             fd;
+    uint8_t         *map;
+    size_t          map_size;
+    uint64_t        pos;            /* next frame header */
+    uint64_t        end;            /* start of the index, or the file end */
+    uint64_t        advised;        /* MADV_WILLNEED up to here */
+    uint64_t        released;       /* unmapped below here */
+    rec_file_header_t hdr;
+
+    size_t          prefetch;
+    size_t          page_size;
+
+    codec_t         *codec;         /* CODEC_PACK recordings */
+    uint8_t         *dec[2];        /* decoded frame, and the previous one as reference */
+    int             dec_cur;
+    int             have_ref;
+    const uint8_t   *raw_prev;      /* previous frame, when stored raw before any decode */
+
+    capture_frame_t frame;
+    int             coded;          /* frame holds a CODEC_STREAM payload */
+
+    uint64_t        frames;
+    uint64_t        bytes;          /* read from the recording */
+} replay_t;
+
+replay_t        *replay_open  (const char *path, size_t prefetch);
+void             replay_close (replay_t *rp);
+int              replay_rewind (replay_t *rp);
+capture_frame_t *replay_acquire_frame (replay_t *rp);
+
+#endif /* _UTIL_REPLAY_H_ */
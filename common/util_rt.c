@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include "util_rt.h"
+
+static int
+parse_cpulist (const char *cpulist, cpu_set_t *set)
+{
+    const char *p = cpulist;
+
+    CPU_ZERO (set);
+    while (*p)
+    {
+        char *end;
+        long lo = strtol (p, &end, 10);
+        long hi = lo;
+
+        if (end == p || lo < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p  = end + 1;
+            hi = strtol (p, &end, 10);
+            if (end == p || hi < lo)
+                return -1;
+        }
+        for (; lo <= hi && lo < CPU_SETSIZE; lo ++)
+            CPU_SET (lo, set);
+
+        p = end;
+        if (*p == ',')
+            p ++;
+        else if (*p)
+            return -1;
+    }
+
+    return CPU_COUNT (set) > 0 ? 0 : -1;
+}
+
+int
+rt_set_affinity (pthread_t thread, const char *cpulist)
+{
+    cpu_set_t set;
+    int ret;
+
+    if (parse_cpulist (cpulist, &set) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): bad cpu list \"%s\"\n", __FILE__, __LINE__, cpulist);
+        return -1;
+    }
+
+    ret = pthread_setaffinity_np (thread, sizeof (set), &set);
+    if (ret != 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): pthread_setaffinity_np: %s\n", __FILE__, __LINE__, strerror (ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+rt_set_fifo (pthread_t thread, int priority)
+{
+    struct sched_param param = {0};
+    int ret;
+
+    param.sched_priority = priority;
+    ret = pthread_setschedparam (thread, SCHED_FIFO, &param);
+    if (ret != 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): SCHED_FIFO %d: %s (needs CAP_SYS_NICE or RLIMIT_RTPRIO)\n",
+                 __FILE__, __LINE__, priority, strerror (ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* lock current and future mappings, so no page fault hits the capture path */
+int
+rt_lock_memory (void)
+{
+    if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): mlockall: %s (check RLIMIT_MEMLOCK)\n", __FILE__, __LINE__, strerror (errno));
+        return -1;
+    }
+
+    return 0;
+}
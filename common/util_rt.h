@@ -0,0 +1,16 @@
+#ifndef _UTIL_RT_H_
+#define _UTIL_RT_H_
+
+#include <pthread.h>
+
+/*
+ *  Real-time setup for capture and writer threads:
+ *  CPU pinning, SCHED_FIFO priority and memory locking.
+ *
+ *  cpulist: "2", "2,3", "0-3" (same syntax as taskset -c).
+ */
+int rt_set_affinity (pthread_t thread, const char *cpulist);
+int rt_set_fifo     (pthread_t thread, int priority);
+int rt_lock_memory  (void);
+
+#endif /* _UTIL_RT_H_ */
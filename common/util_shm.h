@@ -0,0 +1,157 @@
+#ifndef _UTIL_SHM_H_
+#define _UTIL_SHM_H_
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include "util_v4l2.h"
+
+/*
+ *  Shared-memory frame distribution to other processes.
+ *
+ *  The publisher exports every capture buffer as a file descriptor
+ *  (V4L2 EXPBUF dmabuf, or a memfd copy when the driver can't export) and
+ *  passes them with SCM_RIGHTS to each subscriber connecting on a Unix
+ *  socket. Frame-ready notifications go through a ring in a shared memfd
+ *  control block, woken with a futex.
+ *
+ *  Every buffer carries a bitmask of the subscribers still reading it.
+ *  A subscriber clears its bit on release. The publisher requeues the
+ *  buffer to the driver when the mask reaches zero.
+ */
+#define SHM_MAGIC           0x56344c53      /* "SL4V" */
+#define SHM_MAX_BUFFERS     32
+#define SHM_MAX_SUBSCRIBERS 32
+#define SHM_RING_SIZE       64              /* must be power of 2, >= SHM_MAX_BUFFERS */
+
+typedef struct _shm_ring_entry_t
+{
+    uint32_t    seq;
+    uint32_t    index;          /* buffer index             */
+    uint32_t    mask;           /* subscribers it was sent to */
+    uint32_t    bytesused;
+    uint32_t    sequence;       /* V4L2 sequence            */
+    uint32_t    reserved;
+    uint64_t    ts_ns;          /* driver timestamp         */
+    uint64_t    publish_ns;     /* CLOCK_MONOTONIC          */
+} shm_ring_entry_t;
+
+typedef struct _shm_ctrl_t
+{
+    uint32_t    magic;
+    uint32_t    bufcount;
+    uint32_t    width;
+    uint32_t    height;
+    uint32_t    pixelformat;
+    uint32_t    bytesperline;
+    uint32_t    sizeimage;
+
+    uint32_t    write_seq;                  /* futex word                   */
+    uint32_t    release_seq;                /* futex word, bumped on release */
+    uint32_t    active_mask;                /* connected subscribers        */
+    uint32_t    holders[SHM_MAX_BUFFERS];   /* subscribers reading buffer i */
+
+    shm_ring_entry_t ring[SHM_RING_SIZE];
+} shm_ctrl_t;
+
+/* sent once per connection, together with (1 + bufcount) fds */
+typedef struct _shm_hello_t
+{
+    uint32_t    magic;
+    uint32_t    slot;
+    uint32_t    start_seq;
+    uint32_t    bufcount;
+    uint32_t    buf_size[SHM_MAX_BUFFERS];
+} shm_hello_t;
+
+
+static inline int
+shm_futex_wait (uint32_t *addr, uint32_t val, int timeout_ms)
+{
+    struct timespec ts;
+    ts.tv_sec  = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+    return syscall (SYS_futex, addr, FUTEX_WAIT, val, timeout_ms < 0 ? NULL : &ts, NULL, 0);
+}
+
+static inline void
+shm_futex_wake (uint32_t *addr)
+{
+    syscall (SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  publisher (capture process)
+ * ------------------------------------------------------------------------ */
+typedef struct _shm_pub_t
+{
+    capture_dev_t    *cap_dev;
+    int              listen_fd;
+    int              ctrl_fd;
+    shm_ctrl_t       *ctrl;
+
+    int              bufcount;
+    int              buf_fd  [SHM_MAX_BUFFERS];
+    void             *buf_map[SHM_MAX_BUFFERS];   /* memfd fallback only */
+    unsigned int     buf_size[SHM_MAX_BUFFERS];
+    int              use_memfd;
+
+    capture_frame_t  *inflight[SHM_MAX_BUFFERS];
+    int              inflight_num;
+
+    /* where reclaimed frames go. NULL: requeued to cap_dev */
+    void             (*release) (void *arg, capture_frame_t *frame);
+    void             *release_arg;
+
+    uint32_t         free_mask;                  /* unused subscriber slots            */
+    uint32_t         dead_mask;                  /* set by server, reaped by publisher */
+    int              sub_fd[SHM_MAX_SUBSCRIBERS];
+
+    char             sock_path[108];
+    pthread_t        thread;                     /* server */
+    int              wake_fd[2];                 /* pipe: stops the server */
+} shm_pub_t;
+
+shm_pub_t *shm_pub_create  (capture_dev_t *cap_dev, const char *sock_path);
+void       shm_pub_destroy (shm_pub_t *pub);
+int        shm_pub_publish (shm_pub_t *pub, capture_frame_t *frame);
+int        shm_pub_reclaim (shm_pub_t *pub);
+int        shm_pub_reclaim_wait (shm_pub_t *pub, int max_inflight, int timeout_ms);
+
+
+/* ------------------------------------------------------------------------ *
+ *  subscriber (consumer process)
+ * ------------------------------------------------------------------------ */
+typedef struct _shm_frame_t
+{
+    int         index;
+    void        *vaddr;
+    uint32_t    bytesused;
+    uint32_t    sequence;
+    uint64_t    ts_ns;
+    uint64_t    publish_ns;
+} shm_frame_t;
+
+typedef struct _shm_sub_t
+{
+    int          sock_fd;
+    shm_ctrl_t   *ctrl;
+    uint32_t     slot_bit;
+    uint32_t     read_seq;
+    int          bufcount;
+    void         *buf_map [SHM_MAX_BUFFERS];
+    unsigned int buf_size[SHM_MAX_BUFFERS];
+    uint64_t     skipped;
+} shm_sub_t;
+
+shm_sub_t *shm_sub_connect (const char *sock_path);
+void       shm_sub_close   (shm_sub_t *sub);
+int        shm_sub_acquire (shm_sub_t *sub, shm_frame_t *frame, int latest, int timeout_ms);
+void       shm_sub_release (shm_sub_t *sub, shm_frame_t *frame);
+
+#endif /* _UTIL_SHM_H_ */
@@ -0,0 +1,494 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "util_shm.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+
+#define ATOMIC_GET(p)       __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define ATOMIC_SET(p, v)    __atomic_store_n (p, v, __ATOMIC_RELEASE)
+#define ATOMIC_OR(p, v)     __atomic_fetch_or (p, v, __ATOMIC_ACQ_REL)
+#define ATOMIC_AND(p, v)    __atomic_fetch_and (p, v, __ATOMIC_ACQ_REL)
+
+
+/* ------------------------------------------------------------------------ *
+ *  connection handling (server thread)
+ * ------------------------------------------------------------------------ */
+static int
+alloc_slot (shm_pub_t *pub)
+{
+    uint32_t mask = ATOMIC_GET (&pub->free_mask);
+
+    while (mask)
+    {
+        int slot = __builtin_ctz (mask);
+        if (__atomic_compare_exchange_n (&pub->free_mask, &mask, mask & ~(1u << slot),
+                                         0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return slot;
+    }
+    return -1;
+}
+
+static void
+drop_subscriber (shm_pub_t *pub, int slot)
+{
+    close (pub->sub_fd[slot]);
+    pub->sub_fd[slot] = -1;
+
+    /* the publisher thread clears the holder bits and frees the slot */
+    ATOMIC_OR (&pub->dead_mask, 1u << slot);
+    __atomic_add_fetch (&pub->ctrl->release_seq, 1, __ATOMIC_RELEASE);
+    shm_futex_wake (&pub->ctrl->release_seq);
+}
+
+static int
+send_hello (shm_pub_t *pub, int fd, int slot)
+{
+    shm_hello_t     hello = {0};
+    struct msghdr   msg   = {0};
+    struct iovec    iov;
+    char            cmsg_buf[CMSG_SPACE (sizeof (int) * (1 + SHM_MAX_BUFFERS))];
+    struct cmsghdr  *cmsg;
+    int             *fds;
+    int             i, nfds = 1 + pub->bufcount;
+
+    hello.magic     = SHM_MAGIC;
+    hello.slot      = slot;
+    hello.start_seq = ATOMIC_GET (&pub->ctrl->write_seq);
+    hello.bufcount  = pub->bufcount;
+    for (i = 0; i < pub->bufcount; i ++)
+        hello.buf_size[i] = pub->buf_size[i];
+
+    iov.iov_base       = &hello;
+    iov.iov_len        = sizeof (hello);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cmsg_buf;
+    msg.msg_controllen = CMSG_SPACE (sizeof (int) * nfds);
+
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN (sizeof (int) * nfds);
+
+    fds = (int *)CMSG_DATA (cmsg);
+    fds[0] = pub->ctrl_fd;
+    for (i = 0; i < pub->bufcount; i ++)
+        fds[1 + i] = pub->buf_fd[i];
+
+    if (sendmsg (fd, &msg, MSG_NOSIGNAL) != sizeof (hello))
+        return -1;
+
+    /*
+     * frames published from now on include this slot.
+     * start_seq was sampled before, so no frame holding our bit is missed.
+     */
+    ATOMIC_OR (&pub->ctrl->active_mask, 1u << slot);
+    return 0;
+}
+
+static void *
+shm_server_thread (void *arg)
+{
+    shm_pub_t *pub = (shm_pub_t *)arg;
+    struct pollfd pfd[2 + SHM_MAX_SUBSCRIBERS];
+    int slot_of[2 + SHM_MAX_SUBSCRIBERS];
+    int i, nfds;
+
+    while (1)
+    {
+        pfd[0].fd     = pub->listen_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd     = pub->wake_fd[0];
+        pfd[1].events = POLLIN;
+        nfds = 2;
+        for (i = 0; i < SHM_MAX_SUBSCRIBERS; i ++)
+        {
+            if (pub->sub_fd[i] < 0)
+                continue;
+            pfd[nfds].fd     = pub->sub_fd[i];
+            pfd[nfds].events = POLLIN;
+            slot_of[nfds]    = i;
+            nfds ++;
+        }
+
+        if (poll (pfd, nfds, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        /* shm_pub_destroy() */
+        if (pfd[1].revents)
+            break;
+
+        /* subscriber hung up (subscribers never send anything) */
+        for (i = 2; i < nfds; i ++)
+        {
+            if (pfd[i].revents)
+            {
+                fprintf (stderr, "shm: subscriber %d disconnected\n", slot_of[i]);
+                drop_subscriber (pub, slot_of[i]);
+            }
+        }
+
+        if (pfd[0].revents & POLLIN)
+        {
+            int fd = accept4 (pub->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+
+            int slot = alloc_slot (pub);
+            if (slot < 0)
+            {
+                fprintf (stderr, "ERR: %s(%d): too many subscribers\n", __FILE__, __LINE__);
+                close (fd);
+                continue;
+            }
+
+            pub->sub_fd[slot] = fd;
+            if (send_hello (pub, fd, slot) < 0)
+            {
+                drop_subscriber (pub, slot);
+                continue;
+            }
+            fprintf (stderr, "shm: subscriber %d connected\n", slot);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  setup
+ * ------------------------------------------------------------------------ */
+static int
+create_memfd (const char *name, size_t size, void **map)
+{
+    int fd = memfd_create (name, MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate (fd, size) < 0)
+    {
+        close (fd);
+        return -1;
+    }
+
+    *map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED)
+    {
+        close (fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int
+export_buffers (shm_pub_t *pub)
+{
+    capture_stream_t *cap_stream = &pub->cap_dev->stream;
+    int i;
+
+    for (i = 0; i < pub->bufcount; i ++)
+        pub->buf_size[i] = cap_stream->frames[i].length;
+
+    for (i = 0; i < pub->bufcount; i ++)
+    {
+        pub->buf_fd[i] = v4l2_export_capture_frame (pub->cap_dev, &cap_stream->frames[i]);
+        if (pub->buf_fd[i] < 0)
+            break;
+    }
+    if (i == pub->bufcount)
+        return 0;
+
+    /* driver can't export: publish through memfd copies instead */
+    fprintf (stderr, "shm: EXPBUF unsupported, falling back to memfd copy\n");
+    pub->use_memfd = 1;
+    for (i = 0; i < pub->bufcount; i ++)
+    {
+        pub->buf_fd[i] = create_memfd ("v4l2_shm_buf", pub->buf_size[i], &pub->buf_map[i]);
+        if (pub->buf_fd[i] < 0)
+        {
+            fprintf (stderr, "ERR: %s(%d): memfd: %s\n", __FILE__, __LINE__, strerror (errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* everything but the server thread */
+static void
+close_publisher (shm_pub_t *pub)
+{
+    int i;
+
+    for (i = 0; i < SHM_MAX_SUBSCRIBERS; i ++)
+    {
+        if (pub->sub_fd[i] >= 0)
+            close (pub->sub_fd[i]);
+    }
+    if (pub->listen_fd >= 0)
+    {
+        close (pub->listen_fd);
+        unlink (pub->sock_path);
+    }
+    for (i = 0; i < 2; i ++)
+    {
+        if (pub->wake_fd[i] >= 0)
+            close (pub->wake_fd[i]);
+    }
+
+    /* exported dmabuf fds belong to the capture frames */
+    if (pub->use_memfd)
+    {
+        for (i = 0; i < pub->bufcount; i ++)
+        {
+            if (pub->buf_fd[i] < 0)
+                continue;
+            munmap (pub->buf_map[i], pub->buf_size[i]);
+            close (pub->buf_fd[i]);
+        }
+    }
+
+    if (pub->ctrl_fd >= 0)
+    {
+        munmap (pub->ctrl, sizeof (shm_ctrl_t));
+        close (pub->ctrl_fd);
+    }
+    free (pub);
+}
+
+shm_pub_t *
+shm_pub_create (capture_dev_t *cap_dev, const char *sock_path)
+{
+    shm_pub_t *pub;
+    struct sockaddr_un sun = {0};
+    struct v4l2_pix_format *pix = &cap_dev->stream.format.fmt.pix;
+    int i, ret;
+
+    if (cap_dev->stream.bufcount > SHM_MAX_BUFFERS)
+    {
+        fprintf (stderr, "ERR: %s(%d): too many buffers\n", __FILE__, __LINE__);
+        return NULL;
+    }
+
+    pub = (shm_pub_t *)calloc (1, sizeof (shm_pub_t));
+    DBG_ASSERT (pub, "alloc failed");
+
+    pub->cap_dev   = cap_dev;
+    pub->bufcount  = cap_dev->stream.bufcount;
+    pub->free_mask = 0xFFFFFFFF;
+    pub->listen_fd = -1;
+    pub->ctrl_fd   = -1;
+    pub->wake_fd[0] = pub->wake_fd[1] = -1;
+    for (i = 0; i < SHM_MAX_SUBSCRIBERS; i ++)
+        pub->sub_fd[i] = -1;
+    for (i = 0; i < SHM_MAX_BUFFERS; i ++)
+        pub->buf_fd[i] = -1;
+    snprintf (pub->sock_path, sizeof (pub->sock_path), "%s", sock_path);
+
+    if (export_buffers (pub) < 0)
+        goto err;
+
+    pub->ctrl_fd = create_memfd ("v4l2_shm_ctrl", sizeof (shm_ctrl_t), (void **)&pub->ctrl);
+    if (pub->ctrl_fd < 0)
+        goto err;
+
+    pub->ctrl->magic        = SHM_MAGIC;
+    pub->ctrl->bufcount     = pub->bufcount;
+    pub->ctrl->width        = pix->width;
+    pub->ctrl->height       = pix->height;
+    pub->ctrl->pixelformat  = pix->pixelformat;
+    pub->ctrl->bytesperline = pix->bytesperline;
+    pub->ctrl->sizeimage    = pix->sizeimage;
+
+    if (pipe2 (pub->wake_fd, O_CLOEXEC) < 0)
+        goto err;
+
+    /* a stale socket left by a crashed run would fail the bind */
+    unlink (sock_path);
+    sun.sun_family = AF_UNIX;
+    snprintf (sun.sun_path, sizeof (sun.sun_path), "%s", sock_path);
+    pub->listen_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (pub->listen_fd < 0 ||
+        bind (pub->listen_fd, (struct sockaddr *)&sun, sizeof (sun)) < 0 ||
+        listen (pub->listen_fd, 4) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't listen on %s: %s\n", __FILE__, __LINE__, sock_path, strerror (errno));
+        goto err;
+    }
+
+    ret = pthread_create (&pub->thread, NULL, shm_server_thread, pub);
+    DBG_ASSERT (ret == 0, "pthread_create failed\n");
+
+    fprintf (stderr, "shm: publishing %d buffers on %s (%s)\n", pub->bufcount, sock_path,
+             pub->use_memfd ? "memfd" : "dmabuf");
+    return pub;
+
+err:
+    close_publisher (pub);
+    return NULL;
+}
+
+/*
+ *  stop serving, give back the frames still out with subscribers and
+ *  remove the socket. the capture device is left alone.
+ */
+void
+shm_pub_destroy (shm_pub_t *pub)
+{
+    int i;
+
+    if (write (pub->wake_fd[1], "q", 1) != 1)
+        fprintf (stderr, "ERR: %s(%d): can't stop the shm server: %s\n", __FILE__, __LINE__, strerror (errno));
+    pthread_join (pub->thread, NULL);
+
+    for (i = 0; i < pub->bufcount; i ++)
+    {
+        if (pub->inflight[i] == NULL)
+            continue;
+        if (pub->release)
+            pub->release (pub->release_arg, pub->inflight[i]);
+        else
+            v4l2_release_capture_frame (pub->cap_dev, pub->inflight[i]);
+        pub->inflight[i] = NULL;
+    }
+    pub->inflight_num = 0;
+
+    close_publisher (pub);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  publish / reclaim (capture thread)
+ * ------------------------------------------------------------------------ */
+static void
+reap_dead_subscribers (shm_pub_t *pub)
+{
+    uint32_t dead = __atomic_exchange_n (&pub->dead_mask, 0, __ATOMIC_ACQ_REL);
+    int i;
+
+    if (dead == 0)
+        return;
+
+    ATOMIC_AND (&pub->ctrl->active_mask, ~dead);
+    for (i = 0; i < pub->bufcount; i ++)
+        ATOMIC_AND (&pub->ctrl->holders[i], ~dead);
+
+    ATOMIC_OR (&pub->free_mask, dead);
+}
+
+/*
+ *  requeue every buffer all subscribers are done with. while more than
+ *  max_inflight are still out, wait for releases, up to timeout_ms
+ *  (-1: for good). returns the number of buffers requeued.
+ */
+int
+shm_pub_reclaim_wait (shm_pub_t *pub, int max_inflight, int timeout_ms)
+{
+    uint64_t deadline = get_monotonic_ns () + (uint64_t)timeout_ms * 1000000;
+    int i, reclaimed = 0;
+
+    while (1)
+    {
+        uint32_t release_seq = ATOMIC_GET (&pub->ctrl->release_seq);
+
+        reap_dead_subscribers (pub);
+
+        for (i = 0; i < pub->bufcount; i ++)
+        {
+            if (pub->inflight[i] && ATOMIC_GET (&pub->ctrl->holders[i]) == 0)
+            {
+                if (pub->release)
+                    pub->release (pub->release_arg, pub->inflight[i]);
+                else
+                    v4l2_release_capture_frame (pub->cap_dev, pub->inflight[i]);
+                pub->inflight[i] = NULL;
+                pub->inflight_num --;
+                reclaimed ++;
+            }
+        }
+
+        if (pub->inflight_num <= max_inflight)
+            break;
+
+        int wait_ms = 100;
+        if (timeout_ms >= 0)
+        {
+            uint64_t now = get_monotonic_ns ();
+            if (now >= deadline)
+                break;
+            if (deadline - now < wait_ms * 1000000ULL)
+                wait_ms = (deadline - now + 999999) / 1000000;
+        }
+
+        TRACE_BEGIN ("shm_pub_wait_release");
+        shm_futex_wait (&pub->ctrl->release_seq, release_seq, wait_ms);
+        TRACE_END ("shm_pub_wait_release");
+    }
+
+    return reclaimed;
+}
+
+/* blocks while the driver would be left with less than two buffers */
+int
+shm_pub_reclaim (shm_pub_t *pub)
+{
+    return shm_pub_reclaim_wait (pub, pub->bufcount - 2, -1);
+}
+
+/*
+ *  hand the frame to all connected subscribers.
+ *  the frame is owned by the publisher until shm_pub_reclaim() requeues it.
+ */
+int
+shm_pub_publish (shm_pub_t *pub, capture_frame_t *frame)
+{
+    shm_ctrl_t *ctrl = pub->ctrl;
+    int idx = frame->v4l_buf.index;
+    uint32_t mask = ATOMIC_GET (&ctrl->active_mask);
+
+    pub->inflight[idx] = frame;
+    pub->inflight_num ++;
+    ATOMIC_SET (&ctrl->holders[idx], mask);
+
+    /* nobody listening: the next shm_pub_reclaim() requeues it */
+    if (mask == 0)
+        return 0;
+
+    TRACE_BEGIN ("shm_pub_publish");
+
+    if (pub->use_memfd)
+        memcpy (pub->buf_map[idx], frame->vaddr, frame->v4l_buf.bytesused);
+
+    uint32_t seq = ctrl->write_seq;
+    shm_ring_entry_t *ent = &ctrl->ring[seq & (SHM_RING_SIZE - 1)];
+
+    ATOMIC_SET (&ent->seq, ~seq);       /* mark the slot as being written */
+    ent->index      = idx;
+    ent->mask       = mask;
+    ent->bytesused  = frame->v4l_buf.bytesused;
+    ent->sequence   = frame->v4l_buf.sequence;
+    ent->ts_ns      = timeval_to_ns (frame->v4l_buf.timestamp);
+    ent->publish_ns = get_monotonic_ns ();
+    ATOMIC_SET (&ent->seq, seq);
+
+    ATOMIC_SET (&ctrl->write_seq, seq + 1);
+    shm_futex_wake (&ctrl->write_seq);
+
+    TRACE_END ("shm_pub_publish");
+    return 0;
+}
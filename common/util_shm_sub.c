@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "util_shm.h"
+#include "util_debug.h"
+
+#define ATOMIC_GET(p)       __atomic_load_n (p, __ATOMIC_ACQUIRE)
+
+#define SPIN_COUNT          2000    /* busy-poll before sleeping on the futex */
+
+
+static int
+recv_hello (int fd, shm_hello_t *hello, int *fds, int max_fds)
+{
+    struct msghdr   msg = {0};
+    struct iovec    iov;
+    char            cmsg_buf[CMSG_SPACE (sizeof (int) * (1 + SHM_MAX_BUFFERS))];
+    struct cmsghdr  *cmsg;
+    int             nfds = 0;
+
+    iov.iov_base       = hello;
+    iov.iov_len        = sizeof (*hello);
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = cmsg_buf;
+    msg.msg_controllen = sizeof (cmsg_buf);
+
+    if (recvmsg (fd, &msg, MSG_CMSG_CLOEXEC) != sizeof (*hello))
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            nfds = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+            if (nfds > max_fds)
+                nfds = max_fds;
+            memcpy (fds, CMSG_DATA (cmsg), sizeof (int) * nfds);
+        }
+    }
+
+    return nfds;
+}
+
+shm_sub_t *
+shm_sub_connect (const char *sock_path)
+{
+    shm_sub_t *sub;
+    shm_hello_t hello;
+    struct sockaddr_un sun = {0};
+    int fds[1 + SHM_MAX_BUFFERS];
+    int i, nfds;
+
+    sub = (shm_sub_t *)calloc (1, sizeof (shm_sub_t));
+    DBG_ASSERT (sub, "alloc failed");
+
+    sub->sock_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sun.sun_family = AF_UNIX;
+    snprintf (sun.sun_path, sizeof (sun.sun_path), "%s", sock_path);
+    if (connect (sub->sock_fd, (struct sockaddr *)&sun, sizeof (sun)) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't connect %s: %s\n", __FILE__, __LINE__, sock_path, strerror (errno));
+        goto err;
+    }
+
+    nfds = recv_hello (sub->sock_fd, &hello, fds, 1 + SHM_MAX_BUFFERS);
+    if (nfds < 1 || hello.magic != SHM_MAGIC || nfds != 1 + (int)hello.bufcount)
+    {
+        fprintf (stderr, "ERR: %s(%d): bad hello from publisher\n", __FILE__, __LINE__);
+        goto err;
+    }
+
+    sub->ctrl = (shm_ctrl_t *)mmap (NULL, sizeof (shm_ctrl_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    DBG_ASSERT (sub->ctrl != MAP_FAILED, "mmap ctrl: %s\n", strerror (errno));
+    close (fds[0]);
+
+    sub->bufcount = hello.bufcount;
+    for (i = 0; i < sub->bufcount; i ++)
+    {
+        sub->buf_size[i] = hello.buf_size[i];
+        sub->buf_map[i]  = mmap (NULL, sub->buf_size[i], PROT_READ, MAP_SHARED, fds[1 + i], 0);
+        DBG_ASSERT (sub->buf_map[i] != MAP_FAILED, "mmap buffer %d: %s\n", i, strerror (errno));
+        close (fds[1 + i]);
+    }
+
+    sub->slot_bit = 1u << hello.slot;
+    sub->read_seq = hello.start_seq;
+
+    return sub;
+
+err:
+    close (sub->sock_fd);
+    free (sub);
+    return NULL;
+}
+
+void
+shm_sub_close (shm_sub_t *sub)
+{
+    int i;
+
+    /* the publisher drops our outstanding references on hangup */
+    close (sub->sock_fd);
+
+    for (i = 0; i < sub->bufcount; i ++)
+        munmap (sub->buf_map[i], sub->buf_size[i]);
+    munmap (sub->ctrl, sizeof (shm_ctrl_t));
+    free (sub);
+}
+
+static void
+release_index (shm_sub_t *sub, int index)
+{
+    shm_ctrl_t *ctrl = sub->ctrl;
+    uint32_t old = __atomic_fetch_and (&ctrl->holders[index], ~sub->slot_bit, __ATOMIC_ACQ_REL);
+
+    /* last reader: let the publisher requeue the buffer */
+    if ((old & ~sub->slot_bit) == 0)
+    {
+        __atomic_add_fetch (&ctrl->release_seq, 1, __ATOMIC_RELEASE);
+        shm_futex_wake (&ctrl->release_seq);
+    }
+}
+
+void
+shm_sub_release (shm_sub_t *sub, shm_frame_t *frame)
+{
+    release_index (sub, frame->index);
+}
+
+/*
+ *  wait for the next frame addressed to us.
+ *    latest: skip (and release) older pending frames, return the newest.
+ *    returns 0 on success, -1 on timeout.
+ */
+int
+shm_sub_acquire (shm_sub_t *sub, shm_frame_t *frame, int latest, int timeout_ms)
+{
+    shm_ctrl_t *ctrl = sub->ctrl;
+    shm_ring_entry_t ent;
+    int found = 0;
+    int spin  = 0;
+
+    while (1)
+    {
+        uint32_t write_seq = ATOMIC_GET (&ctrl->write_seq);
+
+        while (sub->read_seq != write_seq)
+        {
+            shm_ring_entry_t *src = &ctrl->ring[sub->read_seq & (SHM_RING_SIZE - 1)];
+            uint32_t seq0 = ATOMIC_GET (&src->seq);
+            ent = *src;
+            __atomic_thread_fence (__ATOMIC_ACQUIRE);
+            uint32_t seq1 = __atomic_load_n (&src->seq, __ATOMIC_RELAXED);
+
+            sub->read_seq ++;
+
+            /* overwritten, or not addressed to us */
+            if (seq0 != seq1 || seq0 != sub->read_seq - 1 || !(ent.mask & sub->slot_bit))
+                continue;
+
+            if (found)
+            {
+                release_index (sub, frame->index);
+                sub->skipped ++;
+            }
+
+            frame->index      = ent.index;
+            frame->vaddr      = sub->buf_map[ent.index];
+            frame->bytesused  = ent.bytesused;
+            frame->sequence   = ent.sequence;
+            frame->ts_ns      = ent.ts_ns;
+            frame->publish_ns = ent.publish_ns;
+            found = 1;
+
+            if (!latest)
+                return 0;
+        }
+
+        if (found)
+            return 0;
+
+        if (spin < SPIN_COUNT)
+        {
+            spin ++;
+            continue;
+        }
+
+        if (shm_futex_wait (&ctrl->write_seq, write_seq, timeout_ms) < 0 && errno == ETIMEDOUT)
+            return -1;
+    }
+}
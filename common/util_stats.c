@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+#include "util_stats.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_format.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined (__ARM_NEON) && !defined (__SSE2__)
+static inline uint32_t
+hsum_u32 (uint32x4_t v)
+{
+    return vgetq_lane_u32 (v, 0) + vgetq_lane_u32 (v, 1) +
+           vgetq_lane_u32 (v, 2) + vgetq_lane_u32 (v, 3);
+}
+#endif
+
+#define PARALLEL_MIN_PIXELS (1920 * 1080)   /* below this, dispatch costs more than it saves */
+
+typedef void (*stats_row_fn) (const uint8_t *cur, const uint8_t *above, int w,
+                              uint32_t (*hist)[256], frame_stats_t *st);
+
+/* per-slot partial results, merged in frame_stats_wait() */
+typedef struct _stats_part_t
+{
+    frame_stats_t   part;
+    uint32_t        hist4[4][256];  /* 4 interleaved histograms: repeated values
+                                     * don't serialize on one counter */
+} stats_part_t;
+
+struct _stats_ctx_t
+{
+    stats_row_fn    row;
+    int             w, h, stride;
+    stripe_pool_t   *pool;          /* NULL: small frames, run inline */
+
+    const uint8_t   *img;
+    frame_stats_t   *out;
+    stripe_task_t   task;
+    stats_part_t    part[STRIPE_MAX_THREADS + 1];
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  one row: histogram, sum, sum of squares, gradient energy
+ *    cur, above: row start; pixstep: bytes between luma samples,
+ *    pixoff: byte of the first one (UYVY: 1).
+ *    always inlined into the per-format instances below so that pixstep
+ *    and pixoff are constants and the layout branches fold away.
+ * ------------------------------------------------------------------------ */
+static inline __attribute__((always_inline)) void
+stats_row (const uint8_t *cur, const uint8_t *above, int w, int pixstep, int pixoff,
+           uint32_t (*hist)[256], frame_stats_t *st)
+{
+    uint64_t sum = 0, sum_sq = 0, grad = 0;
+    int x = 0;
+
+#if defined (__SSE2__)
+    const __m128i zero  = _mm_setzero_si128 ();
+    const __m128i lmask = _mm_set1_epi16 (0x00ff);
+    __m128i acc_sum  = zero;
+    __m128i acc_sq   = zero;
+    __m128i acc_grad = zero;
+
+    /* 8 pixels per step; x + 8 must stay inside the row for the right neighbour */
+    for (; x + 8 < w; x += 8)
+    {
+        __m128i c, r, a;
+        if (pixstep == 2 && pixoff == 1)
+        {
+            c = _mm_srli_epi16 (_mm_loadu_si128 ((const __m128i *)(cur   + 2 * x)),     8);
+            r = _mm_srli_epi16 (_mm_loadu_si128 ((const __m128i *)(cur   + 2 * x + 2)), 8);
+            a = _mm_srli_epi16 (_mm_loadu_si128 ((const __m128i *)(above + 2 * x)),     8);
+        }
+        else if (pixstep == 2)
+        {
+            c = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *)(cur   + 2 * x)),     lmask);
+            r = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *)(cur   + 2 * x + 2)), lmask);
+            a = _mm_and_si128 (_mm_loadu_si128 ((const __m128i *)(above + 2 * x)),     lmask);
+        }
+        else
+        {
+            c = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)(cur   + x)),     zero);
+            r = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)(cur   + x + 1)), zero);
+            a = _mm_unpacklo_epi8 (_mm_loadl_epi64 ((const __m128i *)(above + x)),     zero);
+        }
+        __m128i dx = _mm_sub_epi16 (r, c);
+        __m128i dy = _mm_sub_epi16 (c, a);
+
+        acc_sum  = _mm_add_epi32 (acc_sum,  _mm_madd_epi16 (c, _mm_set1_epi16 (1)));
+        acc_sq   = _mm_add_epi32 (acc_sq,   _mm_madd_epi16 (c, c));
+        acc_grad = _mm_add_epi32 (acc_grad, _mm_add_epi32 (_mm_madd_epi16 (dx, dx), _mm_madd_epi16 (dy, dy)));
+
+        /* histogram while the samples are in registers / L1 */
+        uint16_t v[8];
+        _mm_storeu_si128 ((__m128i *)v, c);
+        hist[0][v[0]] ++; hist[1][v[1]] ++; hist[2][v[2]] ++; hist[3][v[3]] ++;
+        hist[0][v[4]] ++; hist[1][v[5]] ++; hist[2][v[6]] ++; hist[3][v[7]] ++;
+
+        /* 32bit lanes: flush before they can overflow (8192 px rows) */
+        if ((x & 4095) == 4088)
+        {
+            uint32_t t[4];
+            _mm_storeu_si128 ((__m128i *)t, acc_sq);   sum_sq += (uint64_t)t[0] + t[1] + t[2] + t[3];
+            _mm_storeu_si128 ((__m128i *)t, acc_grad); grad   += (uint64_t)t[0] + t[1] + t[2] + t[3];
+            acc_sq = acc_grad = zero;
+        }
+    }
+    {
+        uint32_t t[4];
+        _mm_storeu_si128 ((__m128i *)t, acc_sum);  sum    += (uint64_t)t[0] + t[1] + t[2] + t[3];
+        _mm_storeu_si128 ((__m128i *)t, acc_sq);   sum_sq += (uint64_t)t[0] + t[1] + t[2] + t[3];
+        _mm_storeu_si128 ((__m128i *)t, acc_grad); grad   += (uint64_t)t[0] + t[1] + t[2] + t[3];
+    }
+#elif defined (__ARM_NEON)
+    uint32x4_t acc_sum  = vdupq_n_u32 (0);
+    uint32x4_t acc_sq   = vdupq_n_u32 (0);
+    uint32x4_t acc_grad = vdupq_n_u32 (0);
+
+    /* 16 pixels per step */
+    for (; x + 16 < w; x += 16)
+    {
+        uint8x16_t c, r, a;
+        if (pixstep == 2)
+        {
+            c = vld2q_u8 (cur   + 2 * x).val[pixoff];
+            r = vld2q_u8 (cur   + 2 * x + 2).val[pixoff];
+            a = vld2q_u8 (above + 2 * x).val[pixoff];
+        }
+        else
+        {
+            c = vld1q_u8 (cur   + x);
+            r = vld1q_u8 (cur   + x + 1);
+            a = vld1q_u8 (above + x);
+        }
+        uint8x16_t dx = vabdq_u8 (r, c);
+        uint8x16_t dy = vabdq_u8 (c, a);
+
+        acc_sum  = vpadalq_u16 (acc_sum, vpaddlq_u8 (c));
+        acc_sq   = vpadalq_u16 (acc_sq, vmull_u8 (vget_low_u8 (c), vget_low_u8 (c)));
+        acc_sq   = vpadalq_u16 (acc_sq, vmull_u8 (vget_high_u8 (c), vget_high_u8 (c)));
+        acc_grad = vpadalq_u16 (acc_grad, vmull_u8 (vget_low_u8 (dx),  vget_low_u8 (dx)));
+        acc_grad = vpadalq_u16 (acc_grad, vmull_u8 (vget_high_u8 (dx), vget_high_u8 (dx)));
+        acc_grad = vpadalq_u16 (acc_grad, vmull_u8 (vget_low_u8 (dy),  vget_low_u8 (dy)));
+        acc_grad = vpadalq_u16 (acc_grad, vmull_u8 (vget_high_u8 (dy), vget_high_u8 (dy)));
+
+        uint8_t v[16];
+        int i;
+        vst1q_u8 (v, c);
+        for (i = 0; i < 16; i += 4)
+        {
+            hist[0][v[i + 0]] ++; hist[1][v[i + 1]] ++;
+            hist[2][v[i + 2]] ++; hist[3][v[i + 3]] ++;
+        }
+
+        if ((x & 4095) == 4080)
+        {
+            sum_sq += hsum_u32 (acc_sq);
+            grad   += hsum_u32 (acc_grad);
+            acc_sq = acc_grad = vdupq_n_u32 (0);
+        }
+    }
+    sum    += hsum_u32 (acc_sum);
+    sum_sq += hsum_u32 (acc_sq);
+    grad   += hsum_u32 (acc_grad);
+#endif
+
+    for (; x < w; x ++)
+    {
+        int c  = cur[x * pixstep + pixoff];
+        int a  = above[x * pixstep + pixoff];
+        int dx = (x + 1 < w) ? cur[(x + 1) * pixstep + pixoff] - c : 0;
+        int dy = c - a;
+
+        hist[x & 3][c] ++;
+        sum    += c;
+        sum_sq += c * c;
+        grad   += dx * dx + dy * dy;
+    }
+
+    st->sum     += sum;
+    st->sum_sq  += sum_sq;
+    st->grad_sq += grad;
+    st->count   += w;
+}
+
+static void
+stats_row_step1 (const uint8_t *cur, const uint8_t *above, int w,
+                 uint32_t (*hist)[256], frame_stats_t *st)
+{
+    stats_row (cur, above, w, 1, 0, hist, st);
+}
+
+static void
+stats_row_step2 (const uint8_t *cur, const uint8_t *above, int w,
+                 uint32_t (*hist)[256], frame_stats_t *st)
+{
+    stats_row (cur, above, w, 2, 0, hist, st);
+}
+
+static void
+stats_row_step2_odd (const uint8_t *cur, const uint8_t *above, int w,
+                     uint32_t (*hist)[256], frame_stats_t *st)
+{
+    stats_row (cur, above, w, 2, 1, hist, st);
+}
+
+static void
+stats_stripe (void *arg, int y0, int y1, int slot)
+{
+    stats_ctx_t  *ctx = (stats_ctx_t *)arg;
+    stats_part_t *p   = &ctx->part[slot];
+    int y;
+
+    for (y = y0; y < y1; y ++)
+    {
+        const uint8_t *cur   = ctx->img + (size_t)y * ctx->stride;
+        const uint8_t *above = (y > 0) ? cur - ctx->stride : cur;
+        ctx->row (cur, above, ctx->w, p->hist4, &p->part);
+    }
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+stats_ctx_t *
+frame_stats_create (unsigned int fourcc, int w, int h, int stride, stripe_pool_t *pool)
+{
+    const format_info_t *fi = format_from_v4l2 (fourcc);
+    stats_ctx_t *ctx;
+    stats_row_fn row;
+
+    /* pick the row kernel once, not per pixel */
+    switch (fi ? fi->luma_step : 0)
+    {
+    case 1: row = stats_row_step1; break;
+    case 2: row = fi->luma_offset ? stats_row_step2_odd : stats_row_step2; break;
+    default:
+        fprintf (stderr, "ERR: %s(%d): unsupported format %.4s\n", __FILE__, __LINE__, (char *)&fourcc);
+        return NULL;
+    }
+
+    ctx = (stats_ctx_t *)calloc (1, sizeof (stats_ctx_t));
+    DBG_ASSERT (ctx, "alloc failed");
+
+    ctx->row    = row;
+    ctx->w      = w;
+    ctx->h      = h;
+    ctx->stride = stride;
+    ctx->pool   = (w * h >= PARALLEL_MIN_PIXELS) ? pool : NULL;
+
+    return ctx;
+}
+
+void
+frame_stats_destroy (stats_ctx_t *ctx)
+{
+    free (ctx);
+}
+
+/* start on img; stats are valid after frame_stats_wait() */
+int
+frame_stats_submit (stats_ctx_t *ctx, const void *img, frame_stats_t *stats)
+{
+    int nslot = stripe_pool_slots (ctx->pool);
+
+    TRACE_BEGIN ("frame_stats_submit");
+
+    ctx->img = (const uint8_t *)img;
+    ctx->out = stats;
+    memset (ctx->part, 0, sizeof (stats_part_t) * nslot);
+
+    stripe_submit (ctx->pool, &ctx->task, stats_stripe, ctx,
+                   ctx->h, stripe_rows_for (ctx->stride));
+
+    TRACE_END ("frame_stats_submit");
+    return 0;
+}
+
+void
+frame_stats_wait (stats_ctx_t *ctx)
+{
+    frame_stats_t *stats = ctx->out;
+    int nslot = stripe_pool_slots (ctx->pool);
+    int i, j;
+
+    stripe_wait (ctx->pool, &ctx->task);
+
+    TRACE_BEGIN ("frame_stats_merge");
+    memset (stats->hist, 0, sizeof (stats->hist));
+    stats->count = stats->sum = stats->sum_sq = stats->grad_sq = 0;
+
+    for (i = 0; i < nslot; i ++)
+    {
+        stats_part_t *p = &ctx->part[i];
+        for (j = 0; j < 256; j ++)
+            stats->hist[j] += p->hist4[0][j] + p->hist4[1][j] + p->hist4[2][j] + p->hist4[3][j];
+        stats->count   += p->part.count;
+        stats->sum     += p->part.sum;
+        stats->sum_sq  += p->part.sum_sq;
+        stats->grad_sq += p->part.grad_sq;
+    }
+
+    stats->mean = stats->variance = stats->sharpness = 0;
+    if (stats->count)
+    {
+        double mean = (double)stats->sum / stats->count;
+        stats->mean      = mean;
+        stats->variance  = (double)stats->sum_sq / stats->count - mean * mean;
+        stats->sharpness = (double)stats->grad_sq / stats->count;
+    }
+    TRACE_END ("frame_stats_merge");
+}
+
+int
+frame_stats_compute (stats_ctx_t *ctx, const void *img, frame_stats_t *stats)
+{
+    frame_stats_submit (ctx, img, stats);
+    frame_stats_wait (ctx);
+    return 0;
+}
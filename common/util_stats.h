@@ -0,0 +1,38 @@
+#ifndef _UTIL_STATS_H_
+#define _UTIL_STATS_H_
+
+#include <stdint.h>
+#include "util_stripe.h"
+
+/*
+ *  Per-frame luma statistics, computed in one fused pass:
+ *  256-bin histogram, mean/variance and a gradient energy sharpness
+ *  score (mean of squared horizontal + vertical luma differences).
+ *
+ *  Supports GREY, YUYV and NV12 (luma plane). Large frames are split
+ *  into cache-sized stripes run on a stripe pool; submit/wait let the
+ *  caller overlap a frame's analysis with dequeuing the next one.
+ */
+typedef struct _frame_stats_t
+{
+    uint32_t    hist[256];
+    uint64_t    count;          /* pixels */
+    uint64_t    sum;
+    uint64_t    sum_sq;
+    uint64_t    grad_sq;        /* sum of dx^2 + dy^2 */
+
+    float       mean;
+    float       variance;
+    float       sharpness;
+    uint32_t    sequence;       /* of the frame these belong to */
+} frame_stats_t;
+
+typedef struct _stats_ctx_t stats_ctx_t;
+
+stats_ctx_t *frame_stats_create  (unsigned int fourcc, int w, int h, int stride, stripe_pool_t *pool);
+void         frame_stats_destroy (stats_ctx_t *ctx);
+int          frame_stats_submit  (stats_ctx_t *ctx, const void *img, frame_stats_t *stats);
+void         frame_stats_wait    (stats_ctx_t *ctx);
+int          frame_stats_compute (stats_ctx_t *ctx, const void *img, frame_stats_t *stats);
+
+#endif /* _UTIL_STATS_H_ */
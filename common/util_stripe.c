@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "util_stripe.h"
+#include "util_debug.h"
+#include "util_trace.h"
+
+
+/* ------------------------------------------------------------------------ *
+ *  stripes
+ * ------------------------------------------------------------------------ */
+
+/* own run first, then steal from the neighbours. -1: nothing left */
+static int
+take_stripe (stripe_task_t *task, int slot)
+{
+    int i;
+
+    for (i = 0; i < task->nslot; i ++)
+    {
+        stripe_range_t *r = &task->range[(slot + i) % task->nslot];
+
+        if (__atomic_load_n (&r->next, __ATOMIC_RELAXED) >= r->end)
+            continue;
+
+        int s = __atomic_fetch_add (&r->next, 1, __ATOMIC_RELAXED);
+        if (s < r->end)
+            return s;
+    }
+    return -1;
+}
+
+static void
+run_task (stripe_pool_t *pool, stripe_task_t *task, int slot)
+{
+    int s;
+
+    while ((s = take_stripe (task, slot)) >= 0)
+    {
+        int y0 = s * task->stripe_rows;
+        int y1 = y0 + task->stripe_rows;
+        if (y1 > task->rows)
+            y1 = task->rows;
+
+        task->fn (task->arg, y0, y1, slot);
+
+        if (__atomic_add_fetch (&task->done, 1, __ATOMIC_ACQ_REL) == task->nstripe && pool)
+        {
+            pthread_mutex_lock (&pool->mutex);
+            pthread_cond_broadcast (&pool->cond_done);
+            pthread_mutex_unlock (&pool->mutex);
+        }
+    }
+}
+
+/* called with the mutex held, once every stripe of the task is claimed */
+static void
+unlink_task (stripe_pool_t *pool, stripe_task_t *task)
+{
+    stripe_task_t **p;
+
+    for (p = &pool->head; *p; p = &(*p)->next)
+    {
+        if (*p == task)
+        {
+            *p = task->next;
+            break;
+        }
+    }
+}
+
+static void *
+stripe_worker (void *arg)
+{
+    stripe_pool_t *pool = (stripe_pool_t *)arg;
+    int slot;
+
+    pthread_mutex_lock (&pool->mutex);
+    slot = ++ pool->started;
+
+    while (1)
+    {
+        while (!pool->quit && pool->head == NULL)
+            pthread_cond_wait (&pool->cond_work, &pool->mutex);
+        if (pool->quit)
+            break;
+
+        stripe_task_t *task = pool->head;
+        task->refs ++;
+        pthread_mutex_unlock (&pool->mutex);
+
+        run_task (pool, task, slot);
+
+        pthread_mutex_lock (&pool->mutex);
+        unlink_task (pool, task);
+        if (-- task->refs == 0 && __atomic_load_n (&task->done, __ATOMIC_ACQUIRE) == task->nstripe)
+            pthread_cond_broadcast (&pool->cond_done);
+    }
+
+    pthread_mutex_unlock (&pool->mutex);
+    return NULL;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+stripe_pool_t *
+stripe_pool_create (int nthreads)
+{
+    stripe_pool_t *pool;
+    int i;
+
+    if (nthreads > STRIPE_MAX_THREADS)
+        nthreads = STRIPE_MAX_THREADS;
+    if (nthreads < 1)
+        return NULL;
+
+    pool = (stripe_pool_t *)calloc (1, sizeof (stripe_pool_t));
+    DBG_ASSERT (pool, "alloc failed");
+
+    pthread_mutex_init (&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond_work, NULL);
+    pthread_cond_init (&pool->cond_done, NULL);
+
+    for (i = 0; i < nthreads; i ++)
+    {
+        if (pthread_create (&pool->thread[i], NULL, stripe_worker, pool) != 0)
+            break;
+    }
+    pool->nthreads = i;
+
+    if (pool->nthreads == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): failed to start stripe workers\n", __FILE__, __LINE__);
+        free (pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+void
+stripe_pool_destroy (stripe_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock (&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast (&pool->cond_work);
+    pthread_mutex_unlock (&pool->mutex);
+
+    for (i = 0; i < pool->nthreads; i ++)
+        pthread_join (pool->thread[i], NULL);
+
+    pthread_cond_destroy (&pool->cond_work);
+    pthread_cond_destroy (&pool->cond_done);
+    pthread_mutex_destroy (&pool->mutex);
+    free (pool);
+}
+
+int
+stripe_pool_slots (stripe_pool_t *pool)
+{
+    return pool ? pool->nthreads + 1 : 1;
+}
+
+/* rows of row_bytes that fit one cache-sized stripe */
+int
+stripe_rows_for (size_t row_bytes)
+{
+    int rows = row_bytes ? STRIPE_BYTES / row_bytes : 1;
+
+    return rows > 0 ? rows : 1;
+}
+
+void
+stripe_submit (stripe_pool_t *pool, stripe_task_t *task,
+               stripe_fn_t fn, void *arg, int rows, int stripe_rows)
+{
+    int i;
+
+    if (stripe_rows < 1)
+        stripe_rows = 1;
+
+    task->fn          = fn;
+    task->arg         = arg;
+    task->rows        = rows;
+    task->stripe_rows = stripe_rows;
+    task->nstripe     = (rows + stripe_rows - 1) / stripe_rows;
+    task->nslot       = stripe_pool_slots (pool);
+    task->done        = 0;
+    task->refs        = 0;
+    task->next        = NULL;
+
+    /* contiguous runs keep each slot walking down adjacent rows */
+    for (i = 0; i < task->nslot; i ++)
+    {
+        task->range[i].next = task->nstripe *  i      / task->nslot;
+        task->range[i].end  = task->nstripe * (i + 1) / task->nslot;
+    }
+
+    /* nothing to share */
+    if (pool == NULL || task->nstripe <= 1)
+    {
+        run_task (NULL, task, 0);
+        return;
+    }
+
+    pthread_mutex_lock (&pool->mutex);
+    stripe_task_t **p = &pool->head;
+    while (*p)
+        p = &(*p)->next;
+    *p = task;
+    pthread_cond_broadcast (&pool->cond_work);
+    pthread_mutex_unlock (&pool->mutex);
+}
+
+void
+stripe_wait (stripe_pool_t *pool, stripe_task_t *task)
+{
+    TRACE_BEGIN ("stripe_wait");
+
+    /* help with whatever nobody has claimed yet */
+    run_task (pool, task, 0);
+
+    if (pool)
+    {
+        pthread_mutex_lock (&pool->mutex);
+        unlink_task (pool, task);
+        while (task->refs > 0 ||
+               __atomic_load_n (&task->done, __ATOMIC_ACQUIRE) < task->nstripe)
+            pthread_cond_wait (&pool->cond_done, &pool->mutex);
+        pthread_mutex_unlock (&pool->mutex);
+    }
+
+    TRACE_END ("stripe_wait");
+}
+
+void
+stripe_run (stripe_pool_t *pool, stripe_task_t *task,
+            stripe_fn_t fn, void *arg, int rows, int stripe_rows)
+{
+    stripe_submit (pool, task, fn, arg, rows, stripe_rows);
+    stripe_wait (pool, task);
+}
@@ -0,0 +1,76 @@
+#ifndef _UTIL_STRIPE_H_
+#define _UTIL_STRIPE_H_
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ *  Parallel stripe engine for per-frame work.
+ *
+ *  A task splits a frame into horizontal stripes of stripe_rows rows and
+ *  runs fn(arg, y0, y1, slot) once per stripe. Stripes are dealt out in
+ *  contiguous runs, one run per slot; a slot that finishes its own run
+ *  steals stripes from the others.
+ *
+ *  slot 0 is the thread calling stripe_wait(), slots 1..nthreads are the
+ *  pool workers, so per-slot scratch needs stripe_pool_slots() entries.
+ *
+ *  stripe_submit() returns at once: the capture thread can go back to
+ *  DQBUF for frame N+1 while the workers process frame N, then collect
+ *  the result with stripe_wait() (which also helps with what is left).
+ *
+ *     submit(N) --> DQBUF(N+1) --> wait(N) --> submit(N+1) --> ...
+ *                   [ workers: stripes of N ]
+ */
+#define STRIPE_MAX_THREADS  16
+#define STRIPE_BYTES        (128 * 1024)    /* stripe working set: fits L2 */
+
+typedef void (*stripe_fn_t) (void *arg, int y0, int y1, int slot);
+
+typedef struct _stripe_range_t
+{
+    int             next;       /* next stripe to take */
+    int             end;
+} __attribute__ ((aligned (64))) stripe_range_t;
+
+typedef struct _stripe_task_t
+{
+    stripe_fn_t     fn;
+    void            *arg;
+    int             rows;
+    int             stripe_rows;
+    int             nstripe;
+    int             nslot;
+    stripe_range_t  range[STRIPE_MAX_THREADS + 1];
+
+    int             done;       /* finished stripes   */
+    int             refs;       /* workers inside it  */
+    struct _stripe_task_t *next;
+} stripe_task_t;
+
+typedef struct _stripe_pool_t
+{
+    int             nthreads;
+    int             started;
+    pthread_t       thread[STRIPE_MAX_THREADS];
+
+    stripe_task_t   *head;      /* tasks with unclaimed stripes */
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond_work;
+    pthread_cond_t  cond_done;
+    int             quit;
+} stripe_pool_t;
+
+stripe_pool_t *stripe_pool_create  (int nthreads);
+void           stripe_pool_destroy (stripe_pool_t *pool);
+int            stripe_pool_slots   (stripe_pool_t *pool);
+int            stripe_rows_for     (size_t row_bytes);
+
+/* pool == NULL: runs the whole task on the caller, before returning */
+void           stripe_submit (stripe_pool_t *pool, stripe_task_t *task,
+                              stripe_fn_t fn, void *arg, int rows, int stripe_rows);
+void           stripe_wait   (stripe_pool_t *pool, stripe_task_t *task);
+void           stripe_run    (stripe_pool_t *pool, stripe_task_t *task,
+                              stripe_fn_t fn, void *arg, int rows, int stripe_rows);
+
+#endif /* _UTIL_STRIPE_H_ */
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include "util_sync.h"
+#include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+
+
+/* ------------------------------------------------------------------------ *
+ *  per device window
+ * ------------------------------------------------------------------------ */
+static capture_frame_t *
+queue_pop (sync_queue_t *q)
+{
+    capture_frame_t *frame = q->frame[q->head];
+
+    q->head = (q->head + 1) % SYNC_MAX_WINDOW;
+    q->count --;
+    return frame;
+}
+
+static void
+drop_head (frame_sync_t *sync, int dev)
+{
+    v4l2_release_capture_frame (sync->dev[dev], queue_pop (&sync->queue[dev]));
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+/* window: frames held per device; each needs a capture buffer of its own */
+frame_sync_t *
+frame_sync_create (capture_dev_t **devs, int num_dev, int window, uint64_t tolerance_ns)
+{
+    frame_sync_t *sync;
+    int i;
+
+    if (num_dev < 1 || num_dev > SYNC_MAX_DEVICES)
+    {
+        fprintf (stderr, "ERR: %s(%d): %d devices (max %d)\n", __FILE__, __LINE__,
+                 num_dev, SYNC_MAX_DEVICES);
+        return NULL;
+    }
+
+    if (window > SYNC_MAX_WINDOW)
+        window = SYNC_MAX_WINDOW;
+    if (window < 1)
+        window = 1;
+
+    /* leave the driver at least two buffers to fill */
+    for (i = 0; i < num_dev; i ++)
+    {
+        if (window > devs[i]->stream.bufcount - 2)
+            window = devs[i]->stream.bufcount - 2;
+    }
+    if (window < 1)
+    {
+        fprintf (stderr, "ERR: %s(%d): too few capture buffers to sync\n", __FILE__, __LINE__);
+        return NULL;
+    }
+
+    sync = (frame_sync_t *)calloc (1, sizeof (frame_sync_t));
+    DBG_ASSERT (sync, "alloc failed");
+
+    sync->num_dev      = num_dev;
+    sync->window       = window;
+    sync->tolerance_ns = tolerance_ns;
+    for (i = 0; i < num_dev; i ++)
+        sync->dev[i] = devs[i];
+
+    return sync;
+}
+
+/* hands every frame still waiting back to its driver */
+void
+frame_sync_destroy (frame_sync_t *sync)
+{
+    int i;
+
+    for (i = 0; i < sync->num_dev; i ++)
+    {
+        while (sync->queue[i].count > 0)
+            drop_head (sync, i);
+    }
+    free (sync);
+}
+
+/* frames of one device must come in capture order */
+int
+frame_sync_push (frame_sync_t *sync, int dev, capture_frame_t *frame)
+{
+    sync_queue_t *q = &sync->queue[dev];
+    int pos;
+
+    /* all devices have to stamp on the same clock */
+    if (sync->stat[dev].frames == 0 &&
+        (frame->v4l_buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        fprintf (stderr, "sync: %s has no monotonic timestamps, sets may not match\n",
+                 sync->dev[dev]->dev_name);
+
+    if (q->count >= sync->window)
+    {
+        drop_head (sync, dev);
+        sync->stat[dev].overflow ++;
+    }
+
+    pos = (q->head + q->count) % SYNC_MAX_WINDOW;
+    q->frame[pos] = frame;
+    q->ts_ns[pos] = timeval_to_ns (frame->v4l_buf.timestamp);
+    q->count ++;
+    sync->stat[dev].frames ++;
+
+    return 0;
+}
+
+/*
+ *  1: set[0 .. num_dev-1] holds a matched set, owned by the caller until
+ *  frame_sync_release(). 0: no set yet.
+ */
+int
+frame_sync_match (frame_sync_t *sync, capture_frame_t **set)
+{
+    int i;
+
+    while (1)
+    {
+        int imin = 0, imax = 0;
+
+        for (i = 0; i < sync->num_dev; i ++)
+        {
+            sync_queue_t *q = &sync->queue[i];
+            if (q->count == 0)
+                return 0;
+
+            if (q->ts_ns[q->head] < sync->queue[imin].ts_ns[sync->queue[imin].head])
+                imin = i;
+            if (q->ts_ns[q->head] > sync->queue[imax].ts_ns[sync->queue[imax].head])
+                imax = i;
+        }
+
+        uint64_t ts_min = sync->queue[imin].ts_ns[sync->queue[imin].head];
+        uint64_t ts_max = sync->queue[imax].ts_ns[sync->queue[imax].head];
+        if (ts_max - ts_min <= sync->tolerance_ns)
+            break;
+
+        /* everything else is later than it already */
+        drop_head (sync, imin);
+        sync->stat[imin].unmatched ++;
+    }
+
+    uint64_t ts_ref = sync->queue[0].ts_ns[sync->queue[0].head];
+    for (i = 0; i < sync->num_dev; i ++)
+    {
+        sync_dev_stat_t *st = &sync->stat[i];
+        sync_queue_t *q = &sync->queue[i];
+        int64_t skew = (int64_t)(q->ts_ns[q->head] - ts_ref);
+
+        if (st->matched == 0 || skew < st->skew_min)
+            st->skew_min = skew;
+        if (st->matched == 0 || skew > st->skew_max)
+            st->skew_max = skew;
+        st->skew_sum  += skew;
+        st->skew_last  = skew;
+        st->matched ++;
+
+        set[i] = queue_pop (q);
+    }
+    sync->sets ++;
+    TRACE_INSTANT ("sync set", set[0]->v4l_buf.sequence);
+
+    return 1;
+}
+
+/* dequeue from every device until a set matches or timeout_ms (-1: forever) */
+int
+frame_sync_acquire (frame_sync_t *sync, capture_frame_t **set, int timeout_ms)
+{
+    struct pollfd fds[SYNC_MAX_DEVICES];
+    capture_frame_t *batch[SYNC_MAX_WINDOW];
+    uint64_t deadline = get_monotonic_ns () + (uint64_t)timeout_ms * 1000000;
+    int i, j, num, ret;
+
+    TRACE_BEGIN ("frame_sync_acquire");
+
+    while ((ret = frame_sync_match (sync, set)) == 0)
+    {
+        int wait_ms = -1;
+        if (timeout_ms >= 0)
+        {
+            uint64_t now = get_monotonic_ns ();
+            if (now >= deadline)
+                break;
+            wait_ms = (deadline - now + 999999) / 1000000;
+        }
+
+        for (i = 0; i < sync->num_dev; i ++)
+        {
+            fds[i].fd      = sync->dev[i]->v4l_fd;
+            fds[i].events  = POLLIN | POLLERR;
+            fds[i].revents = 0;
+        }
+
+        num = poll (fds, sync->num_dev, wait_ms);
+        if (num < 0 && errno == EINTR)
+            continue;
+        if (num <= 0)
+            break;
+
+        for (i = 0; i < sync->num_dev; i ++)
+        {
+            if (fds[i].revents == 0)
+                continue;
+
+            num = v4l2_acquire_capture_frames (sync->dev[i], batch, sync->window, 0);
+            for (j = 0; j < num; j ++)
+                frame_sync_push (sync, i, batch[j]);
+        }
+    }
+
+    TRACE_END ("frame_sync_acquire");
+    return ret;
+}
+
+void
+frame_sync_release (frame_sync_t *sync, capture_frame_t **set)
+{
+    int i;
+
+    for (i = 0; i < sync->num_dev; i ++)
+        v4l2_release_capture_frame (sync->dev[i], set[i]);
+}
+
+void
+frame_sync_report (frame_sync_t *sync)
+{
+    int i;
+
+    fprintf (stderr, "sync: %llu sets, window %d, tolerance %.2f ms\n",
+             (unsigned long long)sync->sets, sync->window, sync->tolerance_ns / 1e6);
+
+    for (i = 0; i < sync->num_dev; i ++)
+    {
+        sync_dev_stat_t *st = &sync->stat[i];
+
+        fprintf (stderr, "  %-12s frames %llu, matched %llu, unmatched %llu, overflow %llu",
+                 sync->dev[i]->dev_name, (unsigned long long)st->frames, (unsigned long long)st->matched,
+                 (unsigned long long)st->unmatched, (unsigned long long)st->overflow);
+        if (i > 0 && st->matched > 0)
+            fprintf (stderr, ", skew %+.3f ms (min %+.3f, max %+.3f, last %+.3f)",
+                     (double)st->skew_sum / st->matched / 1e6, st->skew_min / 1e6,
+                     st->skew_max / 1e6, st->skew_last / 1e6);
+        fprintf (stderr, "\n");
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef _UTIL_SYNC_H_
+#define _UTIL_SYNC_H_
+
+#include <stdint.h>
+#include "util_v4l2.h"
+
+/*
+ *  Frame sets across cameras (stereo, multi-view), matched by driver
+ *  timestamp.
+ *
+ *  Each device keeps a window of its newest frames, oldest first. A set
+ *  is emitted when the head frames of all devices lie within tolerance
+ *  of each other; otherwise the earliest head can't match anything any
+ *  more and is dropped. A window that overflows drops its oldest frame,
+ *  so a stalled camera costs at most `window` frames of latency on the
+ *  others, not its whole backlog.
+ *
+ *     cam0  [ 0.0  33.3  66.7 ]      set: 33.3 / 34.1
+ *     cam1  [ 34.1  67.5 ]           cam0 0.0 dropped (unmatched)
+ */
+#define SYNC_MAX_DEVICES    8
+#define SYNC_MAX_WINDOW     16
+
+typedef struct _sync_dev_stat_t
+{
+    uint64_t    frames;         /* dequeued */
+    uint64_t    matched;
+    uint64_t    unmatched;      /* dropped: no partner within tolerance */
+    uint64_t    overflow;       /* dropped: window full */
+
+    /* timestamp - device 0 timestamp in matched sets */
+    int64_t     skew_sum;
+    int64_t     skew_min;
+    int64_t     skew_max;
+    int64_t     skew_last;
+} sync_dev_stat_t;
+
+typedef struct _sync_queue_t
+{
+    capture_frame_t *frame[SYNC_MAX_WINDOW];
+    uint64_t        ts_ns[SYNC_MAX_WINDOW];
+    int             head;
+    int             count;
+} sync_queue_t;
+
+typedef struct _frame_sync_t
+{
+    int             num_dev;
+    capture_dev_t   *dev[SYNC_MAX_DEVICES];
+    int             window;
+    uint64_t        tolerance_ns;
+
+    sync_queue_t    queue[SYNC_MAX_DEVICES];
+    sync_dev_stat_t stat[SYNC_MAX_DEVICES];
+    uint64_t        sets;
+} frame_sync_t;
+
+frame_sync_t *frame_sync_create  (capture_dev_t **devs, int num_dev, int window, uint64_t tolerance_ns);
+void          frame_sync_destroy (frame_sync_t *sync);
+
+int  frame_sync_push    (frame_sync_t *sync, int dev, capture_frame_t *frame);
+int  frame_sync_match   (frame_sync_t *sync, capture_frame_t **set);
+int  frame_sync_acquire (frame_sync_t *sync, capture_frame_t **set, int timeout_ms);
+void frame_sync_release (frame_sync_t *sync, capture_frame_t **set);
+void frame_sync_report  (frame_sync_t *sync);
+
+#endif /* _UTIL_SYNC_H_ */
@@ -0,0 +1,22 @@
+#ifndef _UTIL_TIME_H_
+#define _UTIL_TIME_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+static inline uint64_t
+get_monotonic_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t
+timeval_to_ns (struct timeval tv)
+{
+    return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000;
+}
+
+#endif /* _UTIL_TIME_H_ */
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "util_trace.h"
+#include "util_debug.h"
+#include "util_time.h"
+
+typedef struct _trace_ring_t
+{
+    trace_event_t         ev[TRACE_RING_SIZE];
+    uint64_t              wpos;     /* written by owner thread only */
+    int                   tid;
+    struct _trace_ring_t  *next;
+} trace_ring_t;
+
+volatile int g_trace_enable = 0;
+
+static __thread trace_ring_t *s_ring = NULL;
+static trace_ring_t          *s_ring_list = NULL;
+static pthread_mutex_t       s_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static trace_ring_t *
+create_ring ()
+{
+    trace_ring_t *ring;
+
+    ring = (trace_ring_t *)calloc (1, sizeof (trace_ring_t));
+    DBG_ASSERT (ring, "alloc failed");
+
+    ring->tid = (int)syscall (SYS_gettid);
+
+    /* registration happens once per thread, so the lock is off the hot path */
+    pthread_mutex_lock (&s_ring_mutex);
+    ring->next  = s_ring_list;
+    s_ring_list = ring;
+    pthread_mutex_unlock (&s_ring_mutex);
+
+    return ring;
+}
+
+void
+trace_enable (int enable)
+{
+    g_trace_enable = enable;
+}
+
+void
+trace_event (const char *name, int phase, int arg)
+{
+    trace_ring_t *ring = s_ring;
+
+    if (ring == NULL)
+        ring = s_ring = create_ring ();
+
+    uint64_t wpos = ring->wpos;
+    trace_event_t *ev = &ring->ev[wpos & (TRACE_RING_SIZE - 1)];
+    ev->ts_ns = get_monotonic_ns ();
+    ev->name  = name;
+    ev->phase = phase;
+    ev->arg   = arg;
+
+    __atomic_store_n (&ring->wpos, wpos + 1, __ATOMIC_RELEASE);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  export as Chrome trace / Perfetto JSON.
+ *    events recorded while exporting may be torn. stop tracing first.
+ * ------------------------------------------------------------------------ */
+int
+trace_export_json (const char *fname)
+{
+    FILE *fp;
+    trace_ring_t *ring;
+    int pid = getpid ();
+    int first = 1;
+
+    fp = fopen (fname, "w");
+    if (fp == NULL)
+    {
+        fprintf (stderr, "ERR: %s(%d): can't open %s\n", __FILE__, __LINE__, fname);
+        return -1;
+    }
+
+    fprintf (fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock (&s_ring_mutex);
+    for (ring = s_ring_list; ring; ring = ring->next)
+    {
+        uint64_t wpos = __atomic_load_n (&ring->wpos, __ATOMIC_ACQUIRE);
+        uint64_t rpos = (wpos > TRACE_RING_SIZE) ? wpos - TRACE_RING_SIZE : 0;
+
+        for (; rpos < wpos; rpos ++)
+        {
+            trace_event_t *ev = &ring->ev[rpos & (TRACE_RING_SIZE - 1)];
+            double ts_us = ev->ts_ns / 1000.0;
+
+            fprintf (fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d",
+                     first ? "" : ",\n", ev->name, ev->phase, ts_us, pid, ring->tid);
+
+            if (ev->phase == 'C')
+                fprintf (fp, ",\"args\":{\"value\":%d}}", ev->arg);
+            else if (ev->phase == 'i')
+                fprintf (fp, ",\"s\":\"t\",\"args\":{\"arg\":%d}}", ev->arg);
+            else
+                fprintf (fp, "}");
+
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock (&s_ring_mutex);
+
+    fprintf (fp, "\n]}\n");
+    fclose (fp);
+
+    return 0;
+}
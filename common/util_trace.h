@@ -0,0 +1,44 @@
+#ifndef _UTIL_TRACE_H_
+#define _UTIL_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ *  Low overhead trace points.
+ *
+ *  Each thread records into its own ring buffer (single writer, no lock),
+ *  and the rings are exported as Chrome trace / Perfetto JSON.
+ *  When tracing is disabled, a trace point costs one predicted branch.
+ *  Build with -DDISABLE_TRACE to compile all trace points out.
+ */
+#define TRACE_RING_SIZE     (1 << 14)   /* events per thread. must be power of 2 */
+
+typedef struct _trace_event_t
+{
+    uint64_t    ts_ns;      /* CLOCK_MONOTONIC */
+    const char  *name;      /* must be a string literal */
+    int32_t     phase;      /* 'B', 'E', 'i', 'C' */
+    int32_t     arg;
+} trace_event_t;
+
+extern volatile int g_trace_enable;
+
+void trace_enable      (int enable);
+void trace_event       (const char *name, int phase, int arg);
+int  trace_export_json (const char *fname);
+
+#if defined (DISABLE_TRACE)
+#define TRACE_EVENT(name, phase, arg)   do { } while (0)
+#else
+#define TRACE_EVENT(name, phase, arg) do {                          \
+    if (__builtin_expect (g_trace_enable, 0))                       \
+        trace_event (name, phase, arg);                             \
+} while (0)
+#endif
+
+#define TRACE_BEGIN(name)           TRACE_EVENT (name, 'B', 0)
+#define TRACE_END(name)             TRACE_EVENT (name, 'E', 0)
+#define TRACE_INSTANT(name, arg)    TRACE_EVENT (name, 'i', arg)
+#define TRACE_COUNTER(name, val)    TRACE_EVENT (name, 'C', val)
+
+#endif /* _UTIL_TRACE_H_ */
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
@@ -10,9 +11,17 @@
 #include "util_v4l2.h"
 #include "util_drm.h"
 #include "util_debug.h"
+#include "util_trace.h"
+#include "util_time.h"
+#include "util_media.h"
+#include "util_ctrl.h"
+#include "util_wcmem.h"
+#include "util_dmabuf.h"
 
 #define ERRSTR strerror(errno)
 
+#define DEFAULT_BUFFER_COUNT    3
+
 
 static unsigned int
 get_capture_device_type (int v4l_fd)
@@ -22,8 +31,10 @@ get_capture_device_type (int v4l_fd)
     unsigned int dev_type = 0;
     struct v4l2_capability caps = {0};
 
+    /* not a V4L2 node at all */
     ret = ioctl (v4l_fd, VIDIOC_QUERYCAP, &caps);
-    DBG_ASSERT (ret == 0, "VIDIOC_QUERYCAP failed: %s\n", ERRSTR);
+    if (ret < 0)
+        return 0;
 
     /* if DEVICE_CAPS is enabled, used it */
     if (caps.capabilities & V4L2_CAP_DEVICE_CAPS)
@@ -57,6 +68,7 @@ get_capture_buftype (unsigned int capture_type)
     {
     case V4L2_CAP_VIDEO_CAPTURE_MPLANE: return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
     case V4L2_CAP_VIDEO_CAPTURE:        return V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    case V4L2_CAP_VIDEO_OUTPUT:         return V4L2_BUF_TYPE_VIDEO_OUTPUT;
     default:
         DBG_ASSERT (0, "unknown capture_type");
         return 0;
@@ -91,14 +103,18 @@ alloc_buffer_drm (capture_dev_t *cap_dev)
     int w = fmt.fmt.pix_mp.width;
     int h = fmt.fmt.pix_mp.height;
 
+    DBG_ASSERT (drm_fd >= 0, "can't open DRM for DMABUF capture buffers\n");
+
     for (i = 0; i < buffer_count; i ++)
     {
         drm_fb_t dfb;
         capture_frame_t *cap_frame = &(cap_dev->stream.frames[i]);
 
-        drm_alloc_fb (drm_fd, w, h, DRM_FORMAT_ARGB8888, &dfb);
+        DBG_ASSERT (drm_alloc_fb (drm_fd, w, h, DRM_FORMAT_ARGB8888, &dfb) == 0, "drm_alloc_fb failed\n");
 
         cap_frame->vaddr          = dfb.map_buf;
+        cap_frame->length         = dfb.map_size;
+        cap_frame->mem            = FRAME_MEM_WC;
         cap_frame->prime_fd       = dfb.fds[0];
         cap_frame->v4l_buf.index  = i;
         cap_frame->v4l_buf.type   = buffer_type;
@@ -109,12 +125,14 @@ alloc_buffer_drm (capture_dev_t *cap_dev)
 }
 
 static int
-alloc_buffer_mmap (capture_dev_t *cap_dev)
+alloc_buffer_mmap (capture_dev_t *cap_dev, capture_opt_t *opt)
 {
     int i, ret;
     int v4l_fd = cap_dev->v4l_fd;
     int buffer_count = cap_dev->stream.bufcount;
     int buffer_type  = cap_dev->stream.buftype;
+    int prefault = opt && opt->prefault;
+    long page = sysconf (_SC_PAGESIZE);
     
     for (i = 0; i < buffer_count; i ++)
     {
@@ -129,34 +147,91 @@ alloc_buffer_mmap (capture_dev_t *cap_dev)
         DBG_ASSERT (ret == 0, "VIDIOC_QUERYBUF");
 
         cap_frame->vaddr = mmap (NULL, buf.length, PROT_WRITE|PROT_READ, 
-                                 MAP_SHARED, v4l_fd, buf.m.offset);
+                                 MAP_SHARED | (prefault ? MAP_POPULATE : 0), v4l_fd, buf.m.offset);
+        cap_frame->length   = buf.length;
+        cap_frame->prime_fd = -1;
         
         cap_frame->v4l_buf.index  = i;
         cap_frame->v4l_buf.type   = buffer_type;
         cap_frame->v4l_buf.memory = V4L2_MEMORY_MMAP;
 
         DBG_ASSERT (cap_frame->vaddr != MAP_FAILED, "mmap");
+
+        /* not every driver honours MAP_POPULATE: touch each page as well */
+        if (prefault)
+        {
+            volatile char *p = (volatile char *)cap_frame->vaddr;
+            unsigned int off;
+            for (off = 0; off < buf.length; off += page)
+                (void)p[off];
+        }
+    }
+    return 0;
+}
+
+static int
+alloc_buffer_userptr (capture_dev_t *cap_dev, capture_opt_t *opt)
+{
+    int i;
+    capture_stream_t *cap_stream = &cap_dev->stream;
+    unsigned int sizeimage;
+
+    if (cap_stream->buftype == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        sizeimage = cap_stream->format.fmt.pix_mp.plane_fmt[0].sizeimage;
+    else
+        sizeimage = cap_stream->format.fmt.pix.sizeimage;
+
+    if (opt && opt->pool)
+    {
+        cap_stream->pool = opt->pool;
+    }
+    else
+    {
+        cap_stream->pool = mempool_create (sizeimage, cap_stream->bufcount,
+                                           (opt ? opt->pool_flags : 0) | MEMPOOL_POPULATE);
+        DBG_ASSERT (cap_stream->pool, "failed to allocate USERPTR buffers\n");
+        cap_stream->own_pool = 1;
+    }
+    DBG_ASSERT (cap_stream->pool->slot_num >= cap_stream->bufcount &&
+                cap_stream->pool->slot_size >= sizeimage, "USERPTR pool too small\n");
+
+    for (i = 0; i < cap_stream->bufcount; i ++)
+    {
+        capture_frame_t *cap_frame = &(cap_stream->frames[i]);
+
+        cap_frame->vaddr          = mempool_slot (cap_stream->pool, i);
+        cap_frame->length         = cap_stream->pool->slot_size;
+        cap_frame->prime_fd       = -1;
+        cap_frame->v4l_buf.index  = i;
+        cap_frame->v4l_buf.type   = cap_stream->buftype;
+        cap_frame->v4l_buf.memory = V4L2_MEMORY_USERPTR;
     }
+
     return 0;
 }
 
 static int
-alloc_buffer (capture_dev_t *cap_dev)
+alloc_buffer (capture_dev_t *cap_dev, capture_opt_t *opt)
 {
     capture_stream_t *cap_stream = &(cap_dev->stream);
     int buf_count = cap_stream->bufcount;
 
     capture_frame_t *cap_frame;
-    cap_frame = (capture_frame_t *)malloc (sizeof (capture_frame_t) * buf_count);
+
+    TRACE_BEGIN ("alloc_buffer");
+    cap_frame = (capture_frame_t *)calloc (buf_count, sizeof (capture_frame_t));
     DBG_ASSERT (cap_frame, "alloc failed");
 
     cap_stream->frames = cap_frame;
 
     if (cap_stream->memtype == V4L2_MEMORY_DMABUF)
         alloc_buffer_drm (cap_dev);
+    else if (cap_stream->memtype == V4L2_MEMORY_USERPTR)
+        alloc_buffer_userptr (cap_dev, opt);
     else
-        alloc_buffer_mmap (cap_dev);
+        alloc_buffer_mmap (cap_dev, opt);
 
+    TRACE_END ("alloc_buffer");
     return 0;
 }
 
@@ -175,10 +250,30 @@ init_capture_stream (capture_dev_t *cap_dev, unsigned int buf_memtype, int buf_c
     rqbufs.count  = buf_count;
     rqbufs.memory = buf_memtype;
 
+    /* cached MMAP buffers: vb2 maps them cacheable and leaves the cache
+     * maintenance to us, instead of handing out coherent (uncached) memory */
+    if (cap_stream->cached && buf_memtype == V4L2_MEMORY_MMAP)
+        rqbufs.flags = V4L2_MEMORY_FLAG_NON_COHERENT;
+
     ret = ioctl (cap_dev->v4l_fd, VIDIOC_REQBUFS, &rqbufs);
+    if (ret < 0 && buf_memtype != V4L2_MEMORY_MMAP)
+    {
+        /* I/O method not supported by the driver: let the caller fall back */
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_REQBUFS (memory %d) failed: %s\n", __FILE__, __LINE__, buf_memtype, ERRSTR);
+        return -1;
+    }
     DBG_ASSERT (ret == 0, "VIDIOC_REQBUFS failed: %s\n", ERRSTR);
     DBG_ASSERT (rqbufs.count >= buf_count, "VIDIOC_REQBUFS failed");
 
+    if (buf_memtype != V4L2_MEMORY_MMAP ||
+        !(rqbufs.capabilities & V4L2_BUF_CAP_SUPPORTS_MMAP_CACHE_HINTS) ||
+        !(rqbufs.flags & V4L2_MEMORY_FLAG_NON_COHERENT))
+    {
+        if (cap_stream->cached)
+            fprintf (stderr, "cached MMAP buffers unavailable.\n");
+        cap_stream->cached = 0;
+    }
+
     cap_stream->memtype  = buf_memtype;
     cap_stream->bufcount = buf_count;
     cap_stream->buftype  = capture_buftype;
@@ -220,8 +315,15 @@ v4l2_get_capture_device ()
 
 capture_dev_t *
 v4l2_open_capture_device (int devid)
+{
+    return v4l2_open_capture_device_ex (devid, NULL);
+}
+
+capture_dev_t *
+v4l2_open_capture_device_ex (int devid, capture_opt_t *opt)
 {
     int v4l_fd;
+    int buf_count = DEFAULT_BUFFER_COUNT;
     char devname[64];
     unsigned int dev_type;
     capture_dev_t *cap_dev;
@@ -235,29 +337,223 @@ v4l2_open_capture_device (int devid)
         return NULL;
 
     snprintf (devname, 64, "/dev/video%d", devid);
-    v4l_fd = open (devname, O_RDWR | O_CLOEXEC);
-    DBG_ASSERT (v4l_fd >= 0, "failed to open %s\n", devname);
+    /* non-blocking: DQBUF returns EAGAIN instead of waiting when drained */
+    v4l_fd = open (devname, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (v4l_fd < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): failed to open %s: %s\n", __FILE__, __LINE__, devname, ERRSTR);
+        return NULL;
+    }
 
     dev_type = get_capture_device_type (v4l_fd);
-    DBG_ASSERT (dev_type, "not a capture device.\n");
+    if (dev_type == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s is not a capture device\n", __FILE__, __LINE__, devname);
+        close (v4l_fd);
+        return NULL;
+    }
 
-    cap_dev = (capture_dev_t *)malloc (sizeof (capture_dev_t));
+    cap_dev = (capture_dev_t *)calloc (1, sizeof (capture_dev_t));
     DBG_ASSERT (cap_dev, "alloc error.\n");
 
     snprintf (cap_dev->dev_name, sizeof (cap_dev->dev_name), "%s", devname);
     cap_dev->v4l_fd   = v4l_fd;
     cap_dev->dev_type = dev_type;
+    cap_dev->metrics  = metrics_register_device (devname);
+
+    if (opt && opt->bufcount > 0)
+        buf_count = opt->bufcount;
+
+    /* ISP based SoCs: nothing streams until the media graph is linked */
+    if (opt && opt->media)
+    {
+        if (media_setup_pipeline (v4l_fd, opt->media_cache) < 0)
+            fprintf (stderr, "no media pipeline set up for %s.\n", devname);
+    }
 
-    init_capture_stream (cap_dev, V4L2_MEMORY_MMAP, 3);
-    alloc_buffer (cap_dev);
+    /* crop before REQBUFS: most drivers refuse it once buffers exist */
+    memset (&cap_dev->stream, 0, sizeof (cap_dev->stream));
+    if (opt && opt->crop.width > 0)
+    {
+        cap_dev->stream.buftype = get_capture_buftype (dev_type);
+        if (v4l2_set_capture_crop (cap_dev, opt->crop.left, opt->crop.top,
+                                   opt->crop.width, opt->crop.height) < 0)
+            fprintf (stderr, "hardware crop unavailable.\n");
+    }
+
+    if (opt && opt->cached)
+        cap_dev->stream.cached = 1;
+
+    if (opt && opt->memtype == V4L2_MEMORY_USERPTR)
+    {
+        if (opt->pool && opt->pool->slot_num < buf_count)
+            buf_count = opt->pool->slot_num;
+        if (init_capture_stream (cap_dev, V4L2_MEMORY_USERPTR, buf_count) < 0)
+        {
+            fprintf (stderr, "USERPTR unavailable, using MMAP.\n");
+            init_capture_stream (cap_dev, V4L2_MEMORY_MMAP, buf_count);
+        }
+    }
+    else if (opt && opt->memtype == V4L2_MEMORY_DMABUF)
+    {
+        if (init_capture_stream (cap_dev, V4L2_MEMORY_DMABUF, buf_count) < 0)
+        {
+            fprintf (stderr, "DMABUF unavailable, using MMAP.\n");
+            init_capture_stream (cap_dev, V4L2_MEMORY_MMAP, buf_count);
+        }
+    }
+    else
+    {
+        init_capture_stream (cap_dev, V4L2_MEMORY_MMAP, buf_count);
+    }
+    alloc_buffer (cap_dev, opt);
+
+    /* cache maintenance on cached buffers goes through their dmabuf */
+    if (cap_dev->stream.cached)
+    {
+        int i;
+        for (i = 0; i < cap_dev->stream.bufcount; i ++)
+        {
+            if (v4l2_export_capture_frame (cap_dev, &cap_dev->stream.frames[i]) < 0)
+            {
+                fprintf (stderr, "can't export buffers, cached MMAP buffers disabled.\n");
+                cap_dev->stream.cached = 0;
+                break;
+            }
+        }
+    }
 
     return cap_dev;
 }
 
+/*
+ *  stop streaming and give back everything the device holds. frames
+ *  still acquired are invalid afterwards.
+ *  DMABUF capture: the DRM dumb buffers themselves live until exit.
+ */
+void
+v4l2_close_capture_device (capture_dev_t *cap_dev)
+{
+    capture_stream_t *cap_stream = &cap_dev->stream;
+    struct v4l2_requestbuffers rqbufs = {0};
+    int i;
+
+    v4l2_stop_capture (cap_dev);
+
+    for (i = 0; i < cap_stream->bufcount && cap_stream->frames; i ++)
+    {
+        capture_frame_t *cap_frame = &cap_stream->frames[i];
+
+        v4l2_end_cpu_access (cap_dev, cap_frame);
+        if (cap_stream->memtype != V4L2_MEMORY_USERPTR && cap_frame->vaddr)
+            munmap (cap_frame->vaddr, cap_frame->length);
+        if (cap_frame->prime_fd >= 0)
+            close (cap_frame->prime_fd);
+    }
+    free (cap_stream->frames);
+
+    /* free the driver's buffers before the memory behind USERPTR ones */
+    rqbufs.type   = cap_stream->buftype;
+    rqbufs.memory = cap_stream->memtype;
+    rqbufs.count  = 0;
+    if (ioctl (cap_dev->v4l_fd, VIDIOC_REQBUFS, &rqbufs) < 0)
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_REQBUFS (free) failed: %s\n", __FILE__, __LINE__, ERRSTR);
+
+    if (cap_stream->own_pool)
+        mempool_destroy (cap_stream->pool);
+
+    if (cap_dev->requests)
+    {
+        ctrl_requests_t *reqs = cap_dev->requests;
+
+        for (i = 0; i < reqs->num; i ++)
+            close (reqs->req_fd[i]);
+        close (reqs->media_fd);
+        free (reqs->req_fd);
+        free (reqs->used);
+        free (reqs);
+    }
+
+    if (cap_dev->metrics)
+        metrics_unregister_device (cap_dev->metrics);
+    close (cap_dev->v4l_fd);
+    free (cap_dev);
+}
+
 
 /* ------------------------------------------------------------------------ *
  *  start/stop capture
  * ------------------------------------------------------------------------ */
+static int
+queue_capture_buffer (capture_dev_t *cap_dev, capture_frame_t *cap_frame)
+{
+    int ret;
+    struct v4l2_buffer buf = {0};
+    struct v4l2_plane plane = {0};
+
+    buf.index  = cap_frame->v4l_buf.index;
+    buf.type   = cap_frame->v4l_buf.type;
+    buf.memory = cap_frame->v4l_buf.memory;
+
+    /* a CPU access still open ends here: the buffer goes back to the device */
+    if (cap_frame->cpu_access)
+        v4l2_end_cpu_access (cap_dev, cap_frame);
+
+    /* cached buffers: no cache maintenance on QBUF/DQBUF. frames the CPU
+     * never looks at (dropped, or encoded in place) skip it altogether */
+    if (cap_dev->stream.cached)
+        buf.flags = V4L2_BUF_FLAG_NO_CACHE_INVALIDATE | V4L2_BUF_FLAG_NO_CACHE_CLEAN;
+
+    /* output (sink) queues: the payload comes from us */
+    if (V4L2_TYPE_IS_OUTPUT (buf.type))
+    {
+        buf.bytesused = cap_frame->v4l_buf.bytesused;
+        buf.timestamp = cap_frame->v4l_buf.timestamp;
+        buf.field     = V4L2_FIELD_NONE;
+    }
+
+    if (buf.memory == V4L2_MEMORY_DMABUF)
+    {
+        if (buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        {
+            plane.m.fd = cap_frame->prime_fd;
+            buf.m.planes = &plane;
+            buf.length   = 1;
+        }
+        else
+        {
+            buf.m.fd = cap_frame->prime_fd;
+        }
+    }
+    else if (buf.memory == V4L2_MEMORY_USERPTR)
+    {
+        if (buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+        {
+            plane.m.userptr = (unsigned long)cap_frame->vaddr;
+            plane.length    = cap_frame->length;
+            buf.m.planes    = &plane;
+            buf.length      = 1;
+        }
+        else
+        {
+            buf.m.userptr = (unsigned long)cap_frame->vaddr;
+            buf.length    = cap_frame->length;
+        }
+    }
+
+    if (cap_dev->requests &&
+        ctrl_request_attach (cap_dev->requests, cap_dev->v4l_fd, cap_frame, &buf) < 0)
+        return -1;
+
+    ret = ioctl (cap_dev->v4l_fd, VIDIOC_QBUF, &buf);
+    if (ret == 0 && cap_dev->requests)
+        ret = ctrl_request_queue (cap_dev->requests, &buf);
+    if (ret == 0)
+        metrics_add_queued (cap_dev->metrics, 1);
+
+    return ret;
+}
+
 int
 v4l2_start_capture (capture_dev_t *cap_dev)
 {
@@ -265,31 +561,9 @@ v4l2_start_capture (capture_dev_t *cap_dev)
     int v4l_fd = cap_dev->v4l_fd;
     capture_stream_t *cap_stream = &cap_dev->stream;
 
-    for (i = 1; i < cap_stream->bufcount; i ++)
+    for (i = 0; i < cap_stream->bufcount; i ++)
     {
-        struct v4l2_buffer buf = {0};
-        capture_frame_t *cap_frame = &(cap_stream->frames[i]);
-
-        buf.index  = i;
-        buf.type   = cap_stream->buftype;
-        buf.memory = cap_stream->memtype;
-
-        if (buf.memory == V4L2_MEMORY_DMABUF)
-        {
-            if (buf.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
-            {
-                struct v4l2_plane plane = {0};
-                plane.m.fd = cap_frame->prime_fd;
-                buf.m.planes = &plane;
-                buf.length   = 1;
-            }
-            else
-            {
-                buf.m.fd = cap_frame->prime_fd;
-            }
-        }
-        
-        ret = ioctl (v4l_fd, VIDIOC_QBUF, &buf);
+        ret = queue_capture_buffer (cap_dev, &(cap_stream->frames[i]));
         DBG_ASSERT (ret == 0, "VIDIOC_QBUF for buffer %d failed: %s\n", i, ERRSTR);
     }
 
@@ -301,53 +575,423 @@ v4l2_start_capture (capture_dev_t *cap_dev)
     return 0;
 }
 
+/*
+ *  STREAMOFF hands every buffer back, queued or not: frames still
+ *  acquired must not be released afterwards. v4l2_start_capture()
+ *  queues them all again.
+ */
+int
+v4l2_stop_capture (capture_dev_t *cap_dev)
+{
+    capture_stream_t *cap_stream = &cap_dev->stream;
+    int type = cap_stream->buftype;
+    int i;
+
+    if (ioctl (cap_dev->v4l_fd, VIDIOC_STREAMOFF, &type) < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): STREAMOFF failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        return -1;
+    }
+
+    for (i = 0; i < cap_stream->bufcount; i ++)
+        v4l2_end_cpu_access (cap_dev, &cap_stream->frames[i]);
+
+    return 0;
+}
+
 
 /* ------------------------------------------------------------------------ *
  *  acquire/release capture buffer
  * ------------------------------------------------------------------------ */
-capture_frame_t *
-v4l2_acquire_capture_frame (capture_dev_t *cap_dev)
+/* DQBUF one buffer. returns NULL when none is ready (EAGAIN) */
+static capture_frame_t *
+dequeue_buffer (capture_dev_t *cap_dev)
 {
     int ret;
-    int v4l_fd = cap_dev->v4l_fd;
     capture_stream_t *cap_stream = &cap_dev->stream;
+    struct v4l2_buffer buf = {0};
+
+    buf.type   = cap_stream->buftype;
+    buf.memory = cap_stream->memtype;
+    TRACE_BEGIN ("VIDIOC_DQBUF");
+    ret = ioctl (cap_dev->v4l_fd, VIDIOC_DQBUF, &buf);
+    TRACE_END ("VIDIOC_DQBUF");
+    if (ret < 0 && errno == EAGAIN)
+        return NULL;
+    DBG_ASSERT (ret == 0, "VIDIOC_DQBUF failed: %s\n", ERRSTR);
+
+    uint64_t dq_latency = 0;
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        dq_latency = get_monotonic_ns () - timeval_to_ns (buf.timestamp);
+    metrics_count_frame (cap_dev->metrics, buf.sequence, dq_latency,
+                         buf.flags & V4L2_BUF_FLAG_ERROR);
 
+    capture_frame_t *frame = &(cap_stream->frames[buf.index]);
+    frame->v4l_buf = buf;
+    frame->refcnt  = 1;
+    TRACE_INSTANT ("frame", buf.sequence);
+
+    return frame;
+}
+
+static int
+wait_capture_ready (capture_dev_t *cap_dev, int timeout_ms)
+{
+    int ret;
     struct pollfd fds[1] = {0};
-    fds[0].fd     = v4l_fd;
+    fds[0].fd     = cap_dev->v4l_fd;
     fds[0].events = POLLIN | POLLERR;
 
+    TRACE_BEGIN ("poll");
+    do {
+        ret = poll (fds, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    TRACE_END ("poll");
+
+    return (ret > 0 && (fds[0].revents & POLLIN)) ? 0 : -1;
+}
+
+capture_frame_t *
+v4l2_acquire_capture_frame (capture_dev_t *cap_dev)
+{
+    capture_frame_t *frame = NULL;
+
+    TRACE_BEGIN ("v4l2_acquire_capture_frame");
+
     /* Wait & Dequeue buffer */
-    while ((ret = poll (fds, 1, -1)) > 0)
+    while (wait_capture_ready (cap_dev, -1) == 0)
+    {
+        frame = dequeue_buffer (cap_dev);
+        if (frame)
+            break;
+    }
+
+    TRACE_END ("v4l2_acquire_capture_frame");
+    return frame;
+}
+
+/*
+ *  wait up to timeout_ms (-1: forever) for the first frame, then take
+ *  every other buffer already filled, without waiting.
+ *  frames[] is returned oldest first. returns the number of frames.
+ */
+int
+v4l2_acquire_capture_frames (capture_dev_t *cap_dev, capture_frame_t **frames, int max, int timeout_ms)
+{
+    int num = 0;
+    int i;
+
+    TRACE_BEGIN ("v4l2_acquire_capture_frames");
+
+    if (wait_capture_ready (cap_dev, timeout_ms) == 0)
     {
-        if (fds[0].revents & POLLIN) 
+        while (num < max)
         {
-            struct v4l2_buffer buf = {0};
-            buf.type   = cap_stream->buftype;
-            buf.memory = cap_stream->memtype;
-            ret = ioctl (v4l_fd, VIDIOC_DQBUF, &buf);
-            DBG_ASSERT (ret == 0, "VIDIOC_DQBUF failed: %s\n", ERRSTR);
-
-            capture_frame_t *frame = &(cap_stream->frames[buf.index]);
-            return frame;
+            capture_frame_t *frame = dequeue_buffer (cap_dev);
+            if (frame == NULL)
+                break;
+
+            /* insertion sort by sequence; normally already in order */
+            for (i = num; i > 0; i --)
+            {
+                if ((int32_t)(frames[i - 1]->v4l_buf.sequence - frame->v4l_buf.sequence) <= 0)
+                    break;
+                frames[i] = frames[i - 1];
+            }
+            frames[i] = frame;
+            num ++;
         }
     }
 
-    return 0;
+    TRACE_COUNTER ("batch", num);
+    TRACE_END ("v4l2_acquire_capture_frames");
+    return num;
+}
+
+/*
+ *  low-latency acquire: drain the queue, hand stale buffers straight
+ *  back to the driver and return only the newest frame.
+ *  age_ns: now - driver timestamp (0 if the timestamp isn't monotonic).
+ */
+capture_frame_t *
+v4l2_acquire_latest_frame (capture_dev_t *cap_dev, int timeout_ms, uint64_t *age_ns)
+{
+    capture_frame_t *frame = NULL;
+    capture_frame_t *next;
+    int skipped = 0;
+
+    TRACE_BEGIN ("v4l2_acquire_latest_frame");
+
+    if (wait_capture_ready (cap_dev, timeout_ms) == 0)
+        frame = dequeue_buffer (cap_dev);
+
+    while (frame && (next = dequeue_buffer (cap_dev)) != NULL)
+    {
+        v4l2_release_capture_frame (cap_dev, frame);
+        frame = next;
+        skipped ++;
+    }
+
+    if (skipped)
+        metrics_add_skipped (cap_dev->metrics, skipped);
+
+    if (frame && age_ns)
+    {
+        struct v4l2_buffer *buf = &frame->v4l_buf;
+        *age_ns = 0;
+        if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+            *age_ns = get_monotonic_ns () - timeval_to_ns (buf->timestamp);
+    }
+
+    TRACE_END ("v4l2_acquire_latest_frame");
+    return frame;
 }
 
 int
 v4l2_release_capture_frame (capture_dev_t *cap_dev, capture_frame_t *cap_frame)
 {
     int ret;
-    int v4l_fd = cap_dev->v4l_fd;
 
-    struct v4l2_buffer buf = cap_frame->v4l_buf;
-    ret = ioctl (v4l_fd, VIDIOC_QBUF, &buf);
+    TRACE_BEGIN ("v4l2_release_capture_frame");
+
+    cap_frame->refcnt = 0;
+    ret = queue_capture_buffer (cap_dev, cap_frame);
     DBG_ASSERT (ret == 0, "VIDIOC_QBUF failed: %s\n", ERRSTR);
 
+    TRACE_END ("v4l2_release_capture_frame");
+
     return 0;
 }
 
+int
+v4l2_release_capture_frames (capture_dev_t *cap_dev, capture_frame_t **frames, int num)
+{
+    int i;
+
+    for (i = 0; i < num; i ++)
+        v4l2_release_capture_frame (cap_dev, frames[i]);
+
+    return 0;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  shared frames
+ *    an acquired frame carries one reference. every further consumer
+ *    takes its own with v4l2_ref_capture_frame(); the buffer goes back
+ *    to the driver when the last one is dropped. the last unref does the
+ *    QBUF, so it must come from a thread that may queue buffers.
+ * ------------------------------------------------------------------------ */
+void
+v4l2_ref_capture_frame (capture_frame_t *cap_frame)
+{
+    __atomic_add_fetch (&cap_frame->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+int
+v4l2_unref_capture_frame (capture_dev_t *cap_dev, capture_frame_t *cap_frame)
+{
+    int cnt = __atomic_sub_fetch (&cap_frame->refcnt, 1, __ATOMIC_ACQ_REL);
+    DBG_ASSERT (cnt >= 0, "refcount underflow (buf %d)\n", cap_frame->v4l_buf.index);
+
+    if (cnt > 0)
+        return 0;
+    return v4l2_release_capture_frame (cap_dev, cap_frame);
+}
+
+/* export the buffer as a dmabuf fd (cached in cap_frame->prime_fd) */
+int
+v4l2_export_capture_frame (capture_dev_t *cap_dev, capture_frame_t *cap_frame)
+{
+    int ret;
+    struct v4l2_exportbuffer expbuf = {0};
+
+    if (cap_frame->prime_fd >= 0)
+        return cap_frame->prime_fd;
+
+    expbuf.type  = cap_dev->stream.buftype;
+    expbuf.index = cap_frame->v4l_buf.index;
+    expbuf.flags = O_RDWR | O_CLOEXEC;
+
+    ret = ioctl (cap_dev->v4l_fd, VIDIOC_EXPBUF, &expbuf);
+    if (ret < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_EXPBUF failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        return -1;
+    }
+
+    cap_frame->prime_fd = expbuf.fd;
+    return expbuf.fd;
+}
+
+/*
+ *  bracket CPU access to a dequeued frame (access: DMABUF_CPU_xxx).
+ *  syncs the CPU cache for dmabuf and cached MMAP buffers; a no-op for
+ *  the others, which vb2 keeps in sync on QBUF/DQBUF itself.
+ *  an access still open when the frame is released is ended there.
+ */
+int
+v4l2_begin_cpu_access (capture_dev_t *cap_dev, capture_frame_t *cap_frame, unsigned int access)
+{
+    if (cap_frame->prime_fd < 0 || (cap_frame->cpu_access & access) == access ||
+        (cap_dev->stream.memtype == V4L2_MEMORY_MMAP && !cap_dev->stream.cached))
+        return 0;
+
+    /* widening, e.g. READ then WRITE: one RW access */
+    if (cap_frame->cpu_access)
+    {
+        access |= cap_frame->cpu_access;
+        v4l2_end_cpu_access (cap_dev, cap_frame);
+    }
+
+    if (dmabuf_begin_cpu_access (cap_frame->prime_fd, access) < 0)
+        return -1;
+
+    cap_frame->cpu_access = access;
+    return 0;
+}
+
+int
+v4l2_end_cpu_access (capture_dev_t *cap_dev, capture_frame_t *cap_frame)
+{
+    unsigned int access = cap_frame->cpu_access;
+
+    if (access == 0)
+        return 0;
+
+    cap_frame->cpu_access = 0;
+    return dmabuf_end_cpu_access (cap_frame->prime_fd, access);
+}
+
+
+
+/* ------------------------------------------------------------------------ *
+ *  output (sink) device, e.g. v4l2loopback
+ *    uses the same stream/buffer machinery as capture, on an OUTPUT queue.
+ *    buffers are filled by the application and queued to the driver;
+ *    readers of the device then see them as a camera.
+ * ------------------------------------------------------------------------ */
+capture_dev_t *
+v4l2_open_output_device (int devid, unsigned int fourcc, int w, int h, unsigned int memtype)
+{
+    int v4l_fd, ret;
+    char devname[64];
+    struct v4l2_capability caps = {0};
+    struct v4l2_format fmt = {0};
+    unsigned int caps_flag;
+    capture_dev_t *out_dev;
+
+    snprintf (devname, 64, "/dev/video%d", devid);
+    v4l_fd = open (devname, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+    if (v4l_fd < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): failed to open %s: %s\n", __FILE__, __LINE__, devname, ERRSTR);
+        return NULL;
+    }
+
+    ret = ioctl (v4l_fd, VIDIOC_QUERYCAP, &caps);
+    caps_flag = (caps.capabilities & V4L2_CAP_DEVICE_CAPS) ? caps.device_caps : caps.capabilities;
+    if (ret < 0 || !(caps_flag & V4L2_CAP_VIDEO_OUTPUT))
+    {
+        fprintf (stderr, "ERR: %s(%d): %s is not a video output device\n", __FILE__, __LINE__, devname);
+        close (v4l_fd);
+        return NULL;
+    }
+
+    fmt.type                = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    fmt.fmt.pix.width       = w;
+    fmt.fmt.pix.height      = h;
+    fmt.fmt.pix.pixelformat = fourcc;
+    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+    ret = ioctl (v4l_fd, VIDIOC_S_FMT, &fmt);
+    if (ret < 0 || fmt.fmt.pix.pixelformat != fourcc ||
+        fmt.fmt.pix.width != (unsigned int)w || fmt.fmt.pix.height != (unsigned int)h)
+    {
+        fprintf (stderr, "ERR: %s(%d): %s can't take %.4s %dx%d\n", __FILE__, __LINE__, devname,
+                 (char *)&fourcc, w, h);
+        close (v4l_fd);
+        return NULL;
+    }
+
+    out_dev = (capture_dev_t *)calloc (1, sizeof (capture_dev_t));
+    DBG_ASSERT (out_dev, "alloc error.\n");
+
+    snprintf (out_dev->dev_name, sizeof (out_dev->dev_name), "%s", devname);
+    out_dev->v4l_fd   = v4l_fd;
+    out_dev->dev_type = V4L2_CAP_VIDEO_OUTPUT;
+
+    if (init_capture_stream (out_dev, memtype ? memtype : V4L2_MEMORY_MMAP, DEFAULT_BUFFER_COUNT) < 0)
+    {
+        fprintf (stderr, "falling back to MMAP.\n");
+        init_capture_stream (out_dev, V4L2_MEMORY_MMAP, DEFAULT_BUFFER_COUNT);
+    }
+    alloc_buffer (out_dev, NULL);
+
+    return out_dev;
+}
+
+/*
+ *  a buffer to fill: one never queued yet, or one the driver is done
+ *  with, waiting up to timeout_ms. NULL: all still with the driver.
+ */
+capture_frame_t *
+v4l2_acquire_output_frame (capture_dev_t *out_dev, int timeout_ms)
+{
+    int ret;
+    capture_stream_t *out_stream = &out_dev->stream;
+    struct v4l2_buffer buf = {0};
+    struct pollfd fds[1] = {0};
+
+    if (out_stream->fresh < out_stream->bufcount)
+        return &out_stream->frames[out_stream->fresh ++];
+
+    fds[0].fd     = out_dev->v4l_fd;
+    fds[0].events = POLLOUT;
+    do {
+        ret = poll (fds, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    buf.type   = out_stream->buftype;
+    buf.memory = out_stream->memtype;
+    if (ret <= 0 || ioctl (out_dev->v4l_fd, VIDIOC_DQBUF, &buf) < 0)
+        return NULL;
+
+    return &out_stream->frames[buf.index];
+}
+
+/* hand a filled buffer to the driver. the stream starts with the first one */
+int
+v4l2_queue_output_frame (capture_dev_t *out_dev, capture_frame_t *out_frame,
+                         unsigned int bytesused, struct timeval timestamp)
+{
+    int ret;
+
+    out_frame->v4l_buf.bytesused = bytesused;
+    out_frame->v4l_buf.timestamp = timestamp;
+
+    TRACE_BEGIN ("v4l2_queue_output_frame");
+    ret = queue_capture_buffer (out_dev, out_frame);
+    if (ret < 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): VIDIOC_QBUF (OUTPUT) failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        TRACE_END ("v4l2_queue_output_frame");
+        return -1;
+    }
+
+    if (!out_dev->stream.streaming)
+    {
+        int type = out_dev->stream.buftype;
+        /* on failure the next frame tries again */
+        ret = ioctl (out_dev->v4l_fd, VIDIOC_STREAMON, &type);
+        if (ret < 0)
+            fprintf (stderr, "ERR: %s(%d): STREAMON (OUTPUT) failed: %s\n", __FILE__, __LINE__, ERRSTR);
+        else
+            out_dev->stream.streaming = 1;
+    }
+    TRACE_END ("v4l2_queue_output_frame");
+
+    return ret;
+}
 
 
 /* ------------------------------------------------------------------------ *
@@ -392,6 +1036,53 @@ v4l2_get_capture_wh (capture_dev_t *cap_dev, int *w, int *h)
     return 0;
 }
 
+/*
+ *  hardware crop (VIDIOC_S_SELECTION). call before v4l2_start_capture().
+ *  returns -1 if the driver can't crop; use a software frame view instead.
+ */
+int
+v4l2_set_capture_crop (capture_dev_t *cap_dev, int x, int y, int w, int h)
+{
+    int ret;
+    struct v4l2_selection sel = {0};
+    capture_stream_t *cap_stream = &cap_dev->stream;
+
+    sel.type     = (cap_stream->buftype == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) ?
+                   V4L2_BUF_TYPE_VIDEO_CAPTURE : cap_stream->buftype;
+    sel.target   = V4L2_SEL_TGT_CROP;
+    sel.r.left   = x;
+    sel.r.top    = y;
+    sel.r.width  = w;
+    sel.r.height = h;
+
+    ret = ioctl (cap_dev->v4l_fd, VIDIOC_S_SELECTION, &sel);
+    if (ret < 0)
+        return -1;
+    cap_stream->crop = sel.r;
+
+    /* the driver may adjust the rectangle; only an exact match is usable */
+    cap_stream->format = get_capture_format (cap_dev, cap_stream->buftype);
+    if (sel.r.left != x || sel.r.top != y || sel.r.width != w || sel.r.height != h ||
+        cap_stream->format.fmt.pix.width != w || cap_stream->format.fmt.pix.height != h)
+    {
+        fprintf (stderr, "ERR: %s(%d): crop adjusted by driver to (%d, %d, %u, %u)\n", __FILE__, __LINE__,
+                 sel.r.left, sel.r.top, sel.r.width, sel.r.height);
+
+        /* restore the default crop so the software path sees the full frame */
+        sel.target = V4L2_SEL_TGT_CROP_DEFAULT;
+        if (ioctl (cap_dev->v4l_fd, VIDIOC_G_SELECTION, &sel) == 0)
+        {
+            sel.target = V4L2_SEL_TGT_CROP;
+            ioctl (cap_dev->v4l_fd, VIDIOC_S_SELECTION, &sel);
+        }
+        memset (&cap_stream->crop, 0, sizeof (cap_stream->crop));
+        cap_stream->format = get_capture_format (cap_dev, cap_stream->buftype);
+        return -1;
+    }
+
+    return 0;
+}
+
 
 void
 v4l2_show_current_capture_settings (capture_dev_t *cap_dev)
@@ -424,6 +1115,9 @@ v4l2_show_current_capture_settings (capture_dev_t *cap_dev)
         fprintf (stderr, "V4L2_MEMORY_DMABUF\n");
     else if (capture_memtype == V4L2_MEMORY_MMAP)
         fprintf (stderr, "V4L2_MEMORY_MMAP\n");
+    else if (capture_memtype == V4L2_MEMORY_USERPTR)
+        fprintf (stderr, "V4L2_MEMORY_USERPTR%s\n",
+                 cap_stream->pool && cap_stream->pool->hugetlb ? " (hugetlb)" : "");
     else    
         fprintf (stderr, "UNKNOWN\n");
     
@@ -2,6 +2,12 @@
 #define _UTIL_V4L2_H_
 
 #include <linux/videodev2.h>
+#include "util_metrics.h"
+#include "util_mempool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 typedef struct _capture_frame_t
@@ -9,9 +15,15 @@ typedef struct _capture_frame_t
     int     bo_handle;
     int     prime_fd;
     void    *vaddr;
+    unsigned int length;
+    int     mem;            /* FRAME_MEM_xxx: how vaddr is cached (util_wcmem.h) */
     
     struct v4l2_buffer v4l_buf;
-    
+
+    struct _frame_stats_t *stats;   /* per-frame analysis results. NULL: none */
+    uint32_t ctrl_tag;              /* control batch this frame was captured with (requests) */
+    unsigned int cpu_access;        /* DMABUF_CPU_xxx held through v4l2_begin_cpu_access. 0: none */
+    int     refcnt;                 /* consumers holding it. 0: with the driver */
 } capture_frame_t;
 
 typedef struct _capture_stream_t
@@ -21,15 +33,36 @@ typedef struct _capture_stream_t
     int             bufcount;
     capture_frame_t *frames;
     struct v4l2_format format;
+    struct v4l2_rect   crop;        /* hardware crop in effect. width 0: none */
+    mempool_t       *pool;          /* USERPTR backing */
+    int             own_pool;
+    int             fresh;          /* output: buffers handed out before the first DQBUF */
+    int             streaming;      /* output: STREAMON done */
+    int             cached;         /* MMAP buffers are CPU cached: synced only through v4l2_begin/end_cpu_access */
 } capture_stream_t;
 
 
+typedef struct _capture_opt_t
+{
+    int              bufcount;      /* number of V4L2 buffers. 0: default */
+    struct v4l2_rect crop;          /* hardware crop request. width 0: none */
+    unsigned int     memtype;       /* V4L2_MEMORY_MMAP (0: default), _USERPTR or _DMABUF (DRM dumb buffers) */
+    mempool_t        *pool;         /* USERPTR: caller's slots. NULL: allocated here */
+    int              pool_flags;    /* USERPTR: MEMPOOL_xxx for the built-in pool */
+    int              prefault;      /* fault in MMAP buffers at allocation */
+    int              cached;        /* ask for CPU cached (non-coherent) MMAP buffers, if the driver can */
+    int              media;         /* set up the media controller pipeline first */
+    const char       *media_cache;  /* media: where to keep the pipeline. NULL: none */
+} capture_opt_t;
+
 typedef struct _capture_dev_t
 {
     int              v4l_fd;
     char             dev_name[64];
     unsigned int     dev_type;
     capture_stream_t stream;
+    metrics_dev_t    *metrics;
+    struct _ctrl_requests_t *requests;  /* buffers queued through requests. NULL: plain QBUF */
 } capture_dev_t;
 
 
@@ -37,14 +70,36 @@ typedef struct _capture_dev_t
 
 int              v4l2_get_capture_device ();
 capture_dev_t   *v4l2_open_capture_device (int devid);
+capture_dev_t   *v4l2_open_capture_device_ex (int devid, capture_opt_t *opt);
+void             v4l2_close_capture_device (capture_dev_t *cap_dev);
 int              v4l2_start_capture (capture_dev_t *cap_dev);
+int              v4l2_stop_capture  (capture_dev_t *cap_dev);
 capture_frame_t *v4l2_acquire_capture_frame (capture_dev_t *cap_dev);
 int              v4l2_release_capture_frame (capture_dev_t *cap_dev, capture_frame_t *cap_frame);
+int              v4l2_acquire_capture_frames (capture_dev_t *cap_dev, capture_frame_t **frames, int max, int timeout_ms);
+int              v4l2_release_capture_frames (capture_dev_t *cap_dev, capture_frame_t **frames, int num);
+void             v4l2_ref_capture_frame      (capture_frame_t *cap_frame);
+int              v4l2_unref_capture_frame    (capture_dev_t *cap_dev, capture_frame_t *cap_frame);
+capture_frame_t *v4l2_acquire_latest_frame  (capture_dev_t *cap_dev, int timeout_ms, uint64_t *age_ns);
+int              v4l2_export_capture_frame  (capture_dev_t *cap_dev, capture_frame_t *cap_frame);
+int              v4l2_begin_cpu_access      (capture_dev_t *cap_dev, capture_frame_t *cap_frame, unsigned int access);
+int              v4l2_end_cpu_access        (capture_dev_t *cap_dev, capture_frame_t *cap_frame);
+
+/* output (sink) device: capture_dev_t on a V4L2_BUF_TYPE_VIDEO_OUTPUT queue */
+capture_dev_t   *v4l2_open_output_device   (int devid, unsigned int fourcc, int w, int h, unsigned int memtype);
+capture_frame_t *v4l2_acquire_output_frame (capture_dev_t *out_dev, int timeout_ms);
+int              v4l2_queue_output_frame   (capture_dev_t *out_dev, capture_frame_t *out_frame,
+                                            unsigned int bytesused, struct timeval timestamp);
 
 
 int v4l2_get_capture_pixelformat (capture_dev_t *cap_dev, unsigned int *pixfmt);
 int v4l2_get_capture_wh (capture_dev_t *cap_dev, int *w, int *h);
+int v4l2_set_capture_crop (capture_dev_t *cap_dev, int x, int y, int w, int h);
 
 void v4l2_show_current_capture_settings (capture_dev_t *cap_dev);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* _UTIL_V4L2_H_ */
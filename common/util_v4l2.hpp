@@ -0,0 +1,401 @@
+#ifndef _UTIL_V4L2_HPP_
+#define _UTIL_V4L2_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include "util_v4l2.h"
+#include "util_format.h"
+#include "util_dmabuf.h"
+#include "util_debug.h"
+
+/*
+ *  C++17 interface to the capture API, header only, on top of the C
+ *  functions in util_v4l2.h.
+ *
+ *     v4l2app::Device dev (0);             // v4l2_open_capture_device_ex
+ *     v4l2app::Stream stream (dev);        // v4l2_start_capture
+ *     while (auto frame = stream.acquire (1000))
+ *     {
+ *         auto y = frame.plane (0);
+ *         for (int row = 0; row < y.rows; row ++)
+ *             use (y.row (row));
+ *     }                                    // frame requeued here
+ *
+ *  Device and Stream close/stop in their destructors. A Frame is a
+ *  move-only handle on one dequeued buffer: the buffer goes back to the
+ *  driver when the handle is destroyed or reset, so a frame can't be
+ *  leaked by an early return. A Frame is two pointers and the plane
+ *  layout is worked out once per Stream: nothing is allocated per frame.
+ *
+ *  Frames must not outlive their Stream (checked when it stops). Like
+ *  the C API, a Stream and its Frames belong to one thread.
+ */
+namespace v4l2app {
+
+class Error : public std::runtime_error
+{
+public:
+    explicit Error (const std::string &what) : std::runtime_error (what) {}
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  Span: pointer + length (std::span is C++20)
+ * ------------------------------------------------------------------------ */
+template <typename T>
+class Span
+{
+public:
+    constexpr Span () noexcept = default;
+    constexpr Span (T *data, std::size_t size) noexcept : data_ (data), size_ (size) {}
+
+    constexpr T          *data  () const noexcept { return data_; }
+    constexpr std::size_t size  () const noexcept { return size_; }
+    constexpr bool        empty () const noexcept { return size_ == 0; }
+    constexpr T          *begin () const noexcept { return data_; }
+    constexpr T          *end   () const noexcept { return data_ + size_; }
+    constexpr T &operator[] (std::size_t i) const noexcept { return data_[i]; }
+
+    constexpr Span subspan (std::size_t offset, std::size_t count) const noexcept
+    {
+        return Span (data_ + offset, count);
+    }
+
+private:
+    T           *data_ = nullptr;
+    std::size_t size_  = 0;
+};
+
+
+/* one plane of a frame: rows of 'width' bytes, 'stride' bytes apart */
+struct Plane
+{
+    Span<const std::uint8_t> bytes;     /* first row to the end of the last one */
+    int width  = 0;                     /* bytes of pixels per row */
+    int rows   = 0;
+    int stride = 0;
+
+    Span<const std::uint8_t> row (int y) const noexcept
+    {
+        return bytes.subspan ((std::size_t)y * stride, width);
+    }
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  Device
+ * ------------------------------------------------------------------------ */
+class Device
+{
+public:
+    /* devid -1: the first capture device */
+    explicit Device (int devid = -1, capture_opt_t opt = capture_opt_t ())
+        : dev_ (v4l2_open_capture_device_ex (devid, &opt))
+    {
+        if (dev_ == nullptr)
+            throw Error (devid < 0 ? std::string ("no capture device found") :
+                                     "can't open /dev/video" + std::to_string (devid));
+    }
+
+    ~Device () { if (dev_) v4l2_close_capture_device (dev_); }
+
+    Device (Device &&o) noexcept : dev_ (o.dev_) { o.dev_ = nullptr; }
+    Device &operator= (Device &&o) noexcept
+    {
+        if (this != &o)
+        {
+            if (dev_)
+                v4l2_close_capture_device (dev_);
+            dev_   = o.dev_;
+            o.dev_ = nullptr;
+        }
+        return *this;
+    }
+    Device (const Device &) = delete;
+    Device &operator= (const Device &) = delete;
+
+    int          fd           () const { return dev_->v4l_fd; }
+    const char  *name         () const { return dev_->dev_name; }
+    int          buffer_count () const { return dev_->stream.bufcount; }
+    bool         cached       () const { return dev_->stream.cached != 0; }
+    unsigned int fourcc       () const { return mplane () ? fmt ().pix_mp.pixelformat : fmt ().pix.pixelformat; }
+    int          width        () const { return mplane () ? fmt ().pix_mp.width  : fmt ().pix.width; }
+    int          height       () const { return mplane () ? fmt ().pix_mp.height : fmt ().pix.height; }
+    int          stride       () const
+    {
+        return mplane () ? fmt ().pix_mp.plane_fmt[0].bytesperline : fmt ().pix.bytesperline;
+    }
+
+    /* the C handle, for everything not wrapped here */
+    capture_dev_t *native () const { return dev_; }
+
+private:
+    bool mplane () const { return dev_->stream.buftype == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; }
+    const decltype (v4l2_format::fmt) &fmt () const { return dev_->stream.format.fmt; }
+
+    capture_dev_t *dev_ = nullptr;
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  Frame
+ * ------------------------------------------------------------------------ */
+class Stream;
+
+class Frame
+{
+public:
+    Frame () noexcept = default;
+    ~Frame () { reset (); }
+
+    Frame (Frame &&o) noexcept : stream_ (o.stream_), frame_ (o.frame_) { o.frame_ = nullptr; }
+    Frame &operator= (Frame &&o) noexcept
+    {
+        if (this != &o)
+        {
+            reset ();
+            stream_  = o.stream_;
+            frame_   = o.frame_;
+            o.frame_ = nullptr;
+        }
+        return *this;
+    }
+    Frame (const Frame &) = delete;
+    Frame &operator= (const Frame &) = delete;
+
+    /* false: empty handle (timeout, moved from, reset) */
+    explicit operator bool () const noexcept { return frame_ != nullptr; }
+
+    std::uint32_t sequence () const { return frame_->v4l_buf.sequence; }
+    int           index    () const { return frame_->v4l_buf.index; }
+    bool          error    () const { return (frame_->v4l_buf.flags & V4L2_BUF_FLAG_ERROR) != 0; }
+    std::uint64_t timestamp_ns () const
+    {
+        const struct timeval &tv = frame_->v4l_buf.timestamp;
+        return (std::uint64_t)tv.tv_sec * 1000000000ULL + (std::uint64_t)tv.tv_usec * 1000;
+    }
+
+    /* the payload. bytesused isn't reported on multi-planar queues: whole buffer */
+    Span<const std::uint8_t> data () const
+    {
+        std::size_t len = frame_->v4l_buf.bytesused ? frame_->v4l_buf.bytesused : frame_->length;
+        return Span<const std::uint8_t> ((const std::uint8_t *)frame_->vaddr, len);
+    }
+
+    inline int   plane_count () const;
+    inline Plane plane (int i) const;
+
+    /* bracket CPU access: DMABUF_CPU_READ, _WRITE or _RW. ended on requeue anyway */
+    inline int begin_cpu_access (unsigned int access = DMABUF_CPU_READ);
+    inline int end_cpu_access   ();
+
+    /* dmabuf fd of the buffer, exported on first use. -1: can't */
+    inline int dmabuf_fd ();
+
+    capture_frame_t *native () const noexcept { return frame_; }
+
+    /* requeue now */
+    inline void reset () noexcept;
+
+private:
+    friend class Stream;
+    Frame (Stream *stream, capture_frame_t *frame) noexcept : stream_ (stream), frame_ (frame) {}
+
+    Stream          *stream_ = nullptr;
+    capture_frame_t *frame_  = nullptr;
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  Stream
+ * ------------------------------------------------------------------------ */
+class Stream
+{
+public:
+    explicit Stream (Device &dev) : dev_ (dev.native ())
+    {
+        layout (dev);
+        v4l2_start_capture (dev_);
+    }
+
+    ~Stream ()
+    {
+        DBG_ASSERT (outstanding_ == 0, "%d frames still held when %s stops\n", outstanding_, dev_->dev_name);
+        v4l2_stop_capture (dev_);
+    }
+
+    /* Frames point back here: not movable */
+    Stream (const Stream &) = delete;
+    Stream &operator= (const Stream &) = delete;
+
+    /* next frame. timeout_ms -1: forever. empty on timeout */
+    Frame acquire (int timeout_ms = -1)
+    {
+        capture_frame_t *frame;
+
+        if (v4l2_acquire_capture_frames (dev_, &frame, 1, timeout_ms) != 1)
+            return Frame ();
+        return adopt (frame);
+    }
+
+    /* newest frame; older ones are requeued unseen */
+    Frame acquire_latest (int timeout_ms = -1, std::uint64_t *age_ns = nullptr)
+    {
+        capture_frame_t *frame = v4l2_acquire_latest_frame (dev_, timeout_ms, age_ns);
+        return frame ? adopt (frame) : Frame ();
+    }
+
+    /* wait for one frame, then take all that are ready, oldest first.
+     * returns how many were stored to out[] */
+    int acquire (Span<Frame> out, int timeout_ms = -1)
+    {
+        capture_frame_t *frames[max_batch];
+        int max = out.size () < (std::size_t)max_batch ? (int)out.size () : max_batch;
+        int num = v4l2_acquire_capture_frames (dev_, frames, max, timeout_ms);
+
+        for (int i = 0; i < num; i ++)
+            out[i] = adopt (frames[i]);
+        return num;
+    }
+
+    int outstanding () const { return outstanding_; }
+
+    capture_dev_t *native () const { return dev_; }
+
+private:
+    friend class Frame;
+    static constexpr int max_batch  = 32;
+    static constexpr int max_planes = 3;
+
+    struct PlaneLayout
+    {
+        std::size_t offset;
+        int width, rows, stride;
+    };
+
+    Frame adopt (capture_frame_t *frame)
+    {
+        outstanding_ ++;
+        return Frame (this, frame);
+    }
+
+    void release (capture_frame_t *frame) noexcept
+    {
+        outstanding_ --;
+        v4l2_release_capture_frame (dev_, frame);
+    }
+
+    /* planes packed one after the other, as in util_format.h. 0 planes:
+     * compressed or unknown format, the payload is one plane */
+    void layout (const Device &dev)
+    {
+        const format_info_t *fi = format_from_v4l2 (dev.fourcc ());
+        int w = dev.width (), h = dev.height (), stride = dev.stride ();
+        std::size_t offset = 0;
+
+        plane_num_ = 0;
+        if (fi == nullptr || fi->bpp == 0)
+            return;
+
+        for (int p = 0; p < fi->planes && p < max_planes; p ++)
+        {
+            PlaneLayout &pl = planes_[p];
+
+            pl.rows   = p == 0 ? h : h / fi->vsub;
+            pl.width  = p == 0 ? w * fi->cpp : w * fi->cpp * 2 / fi->hsub;
+            pl.stride = stride;
+
+            /* I420: two half width chroma planes */
+            if (fi->planes == 3 && p > 0)
+            {
+                pl.width  = w / fi->hsub;
+                pl.stride = stride / fi->hsub;
+            }
+            pl.offset = offset;
+            offset   += (std::size_t)pl.rows * pl.stride;
+            plane_num_ ++;
+        }
+    }
+
+    capture_dev_t *dev_;
+    PlaneLayout    planes_[max_planes] = {};
+    int            plane_num_   = 0;
+    int            outstanding_ = 0;
+};
+
+
+/* ------------------------------------------------------------------------ *
+ *  Frame, the parts that need Stream
+ * ------------------------------------------------------------------------ */
+inline int
+Frame::plane_count () const
+{
+    return stream_->plane_num_ ? stream_->plane_num_ : 1;
+}
+
+/* empty if i is out of range or the buffer is too short for the format */
+inline Plane
+Frame::plane (int i) const
+{
+    Plane pl;
+    Span<const std::uint8_t> all = data ();
+
+    if (stream_->plane_num_ == 0)
+    {
+        if (i == 0)
+        {
+            pl.bytes  = all;
+            pl.width  = pl.stride = (int)all.size ();
+            pl.rows   = 1;
+        }
+        return pl;
+    }
+    if (i < 0 || i >= stream_->plane_num_)
+        return pl;
+
+    const Stream::PlaneLayout &l = stream_->planes_[i];
+    std::size_t len = (std::size_t)(l.rows - 1) * l.stride + l.width;
+
+    if (l.rows <= 0 || l.offset + len > frame_->length)
+        return pl;
+
+    pl.bytes  = Span<const std::uint8_t> ((const std::uint8_t *)frame_->vaddr + l.offset, len);
+    pl.width  = l.width;
+    pl.rows   = l.rows;
+    pl.stride = l.stride;
+    return pl;
+}
+
+inline int
+Frame::begin_cpu_access (unsigned int access)
+{
+    return v4l2_begin_cpu_access (stream_->dev_, frame_, access);
+}
+
+inline int
+Frame::end_cpu_access ()
+{
+    return v4l2_end_cpu_access (stream_->dev_, frame_);
+}
+
+inline int
+Frame::dmabuf_fd ()
+{
+    return v4l2_export_capture_frame (stream_->dev_, frame_);
+}
+
+inline void
+Frame::reset () noexcept
+{
+    if (frame_ == nullptr)
+        return;
+
+    stream_->release (frame_);
+    frame_ = nullptr;
+}
+
+} /* namespace v4l2app */
+
+#endif /* _UTIL_V4L2_HPP_ */
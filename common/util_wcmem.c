@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "util_wcmem.h"
+#include "util_trace.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#include <smmintrin.h>
+#elif defined (__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define LINE_BYTES      64
+#define BOUNCE_BYTES    4096
+
+
+/* ------------------------------------------------------------------------ *
+ *  WC destination: whole lines, store only
+ * ------------------------------------------------------------------------ */
+/* dst is LINE_BYTES aligned */
+static inline void
+store_line (uint8_t *dst, const uint8_t *src)
+{
+#if defined (__SSE2__)
+    __m128i v0 = _mm_loadu_si128 ((const __m128i *)(src +  0));
+    __m128i v1 = _mm_loadu_si128 ((const __m128i *)(src + 16));
+    __m128i v2 = _mm_loadu_si128 ((const __m128i *)(src + 32));
+    __m128i v3 = _mm_loadu_si128 ((const __m128i *)(src + 48));
+    _mm_stream_si128 ((__m128i *)(dst +  0), v0);
+    _mm_stream_si128 ((__m128i *)(dst + 16), v1);
+    _mm_stream_si128 ((__m128i *)(dst + 32), v2);
+    _mm_stream_si128 ((__m128i *)(dst + 48), v3);
+#elif defined (__ARM_NEON)
+    /* back to back, so the line leaves the WC buffer in one burst */
+    uint8x16_t v0 = vld1q_u8 (src +  0);
+    uint8x16_t v1 = vld1q_u8 (src + 16);
+    uint8x16_t v2 = vld1q_u8 (src + 32);
+    uint8x16_t v3 = vld1q_u8 (src + 48);
+    vst1q_u8 (dst +  0, v0);
+    vst1q_u8 (dst + 16, v1);
+    vst1q_u8 (dst + 32, v2);
+    vst1q_u8 (dst + 48, v3);
+#else
+    memcpy (dst, src, LINE_BYTES);
+#endif
+}
+
+void
+wcmem_copy_to (void *dst, const void *src, size_t len)
+{
+    uint8_t       *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = (LINE_BYTES - ((uintptr_t)d & (LINE_BYTES - 1))) & (LINE_BYTES - 1);
+
+    if (head > len)
+        head = len;
+    memcpy (d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    for (; len >= LINE_BYTES; len -= LINE_BYTES, d += LINE_BYTES, s += LINE_BYTES)
+        store_line (d, s);
+
+    memcpy (d, s, len);
+
+#if defined (__SSE2__)
+    /* streaming stores are weakly ordered */
+    _mm_sfence ();
+#endif
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  WC/UC source: bulk loads into a cached bounce buffer
+ * ------------------------------------------------------------------------ */
+#if defined (__SSE2__)
+__attribute__((target ("sse4.1")))
+static void
+load_chunk_ntdqa (uint8_t *bounce, const uint8_t *src, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i += LINE_BYTES)
+    {
+        __m128i v0 = _mm_stream_load_si128 ((__m128i *)(src + i +  0));
+        __m128i v1 = _mm_stream_load_si128 ((__m128i *)(src + i + 16));
+        __m128i v2 = _mm_stream_load_si128 ((__m128i *)(src + i + 32));
+        __m128i v3 = _mm_stream_load_si128 ((__m128i *)(src + i + 48));
+        _mm_store_si128 ((__m128i *)(bounce + i +  0), v0);
+        _mm_store_si128 ((__m128i *)(bounce + i + 16), v1);
+        _mm_store_si128 ((__m128i *)(bounce + i + 32), v2);
+        _mm_store_si128 ((__m128i *)(bounce + i + 48), v3);
+    }
+}
+#endif
+
+/* src is 16 byte aligned, len a multiple of LINE_BYTES */
+static void
+load_chunk (uint8_t *bounce, const uint8_t *src, size_t len)
+{
+#if defined (__SSE2__)
+    static int s_ntdqa = -1;
+
+    if (s_ntdqa < 0)
+        s_ntdqa = __builtin_cpu_supports ("sse4.1") ? 1 : 0;
+    if (s_ntdqa)
+    {
+        load_chunk_ntdqa (bounce, src, len);
+        return;
+    }
+
+    size_t i;
+    for (i = 0; i < len; i += 16)
+        _mm_store_si128 ((__m128i *)(bounce + i), _mm_load_si128 ((const __m128i *)(src + i)));
+#elif defined (__ARM_NEON)
+    size_t i;
+    for (i = 0; i < len; i += LINE_BYTES)
+    {
+        uint8x16_t v0 = vld1q_u8 (src + i +  0);
+        uint8x16_t v1 = vld1q_u8 (src + i + 16);
+        uint8x16_t v2 = vld1q_u8 (src + i + 32);
+        uint8x16_t v3 = vld1q_u8 (src + i + 48);
+        vst1q_u8 (bounce + i +  0, v0);
+        vst1q_u8 (bounce + i + 16, v1);
+        vst1q_u8 (bounce + i + 32, v2);
+        vst1q_u8 (bounce + i + 48, v3);
+    }
+#else
+    memcpy (bounce, src, len);
+#endif
+}
+
+void
+wcmem_copy_from (void *dst, const void *src, size_t len)
+{
+    uint8_t bounce[BOUNCE_BYTES] __attribute__ ((aligned (LINE_BYTES)));
+    uint8_t       *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+
+    if (head > len)
+        head = len;
+    memcpy (d, s, head);
+    d += head;
+    s += head;
+    len -= head;
+
+    while (len >= LINE_BYTES)
+    {
+        size_t n = len & ~(size_t)(LINE_BYTES - 1);
+        if (n > BOUNCE_BYTES)
+            n = BOUNCE_BYTES;
+
+        load_chunk (bounce, s, n);
+        memcpy (d, bounce, n);
+        d += n;
+        s += n;
+        len -= n;
+    }
+
+    memcpy (d, s, len);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  packed YUV to GREY: every other byte, from the even (YUYV) or the
+ *  odd ones (UYVY, offset 1)
+ * ------------------------------------------------------------------------ */
+static void
+extract_luma2 (uint8_t *dst, const uint8_t *src, int offset, int n)
+{
+    int x = 0;
+
+#if defined (__SSE2__)
+    const __m128i mask = _mm_set1_epi16 (0x00ff);
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i a = _mm_loadu_si128 ((const __m128i *)(src + x * 2     ));
+        __m128i b = _mm_loadu_si128 ((const __m128i *)(src + x * 2 + 16));
+        if (offset)
+        {
+            a = _mm_srli_epi16 (a, 8);
+            b = _mm_srli_epi16 (b, 8);
+        }
+        else
+        {
+            a = _mm_and_si128 (a, mask);
+            b = _mm_and_si128 (b, mask);
+        }
+        _mm_storeu_si128 ((__m128i *)(dst + x), _mm_packus_epi16 (a, b));
+    }
+#elif defined (__ARM_NEON)
+    for (; x + 16 <= n; x += 16)
+        vst1q_u8 (dst + x, vld2q_u8 (src + x * 2).val[offset]);
+#endif
+    for (; x < n; x ++)
+        dst[x] = src[x * 2 + offset];
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  API
+ * ------------------------------------------------------------------------ */
+void
+wcmem_copy_rows (void *dst, int dst_stride, int dst_mem,
+                 const void *src, int src_stride, int src_mem, size_t row_bytes, int rows)
+{
+    uint8_t       *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+    int y;
+
+    TRACE_BEGIN ("wcmem_copy_rows");
+
+    /* one run when both sides are packed */
+    if ((size_t)dst_stride == row_bytes && (size_t)src_stride == row_bytes)
+    {
+        row_bytes *= rows;
+        rows = 1;
+    }
+
+    for (y = 0; y < rows; y ++, d += dst_stride, s += src_stride)
+    {
+        if (src_mem == FRAME_MEM_WC)
+            wcmem_copy_from (d, s, row_bytes);
+        else if (dst_mem == FRAME_MEM_WC)
+            wcmem_copy_to (d, s, row_bytes);
+        else
+            memcpy (d, s, row_bytes);
+    }
+
+    TRACE_END ("wcmem_copy_rows");
+}
+
+/*
+ *  luma of packed YUV (luma_step 2: YUYV, or UYVY with luma_offset 1)
+ *  or a plain copy (1).
+ *  WC source: each chunk is pulled into a cached buffer first.
+ *  WC destination: the chunk is built in a cached buffer, then streamed.
+ */
+void
+wcmem_luma_rows (void *dst, int dst_stride, int dst_mem,
+                 const void *src, int src_stride, int src_mem, int width, int luma_step, int luma_offset,
+                 int rows)
+{
+    uint8_t in [BOUNCE_BYTES] __attribute__ ((aligned (LINE_BYTES)));
+    uint8_t out[BOUNCE_BYTES / 2] __attribute__ ((aligned (LINE_BYTES)));
+    const int chunk = BOUNCE_BYTES / 2;     /* pixels */
+    int x, y;
+
+    if (luma_step == 1)
+    {
+        wcmem_copy_rows (dst, dst_stride, dst_mem, src, src_stride, src_mem, width, rows);
+        return;
+    }
+
+    TRACE_BEGIN ("wcmem_luma_rows");
+
+    for (y = 0; y < rows; y ++)
+    {
+        uint8_t       *d = (uint8_t *)dst + (size_t)y * dst_stride;
+        const uint8_t *s = (const uint8_t *)src + (size_t)y * src_stride;
+
+        if (src_mem != FRAME_MEM_WC && dst_mem != FRAME_MEM_WC)
+        {
+            extract_luma2 (d, s, luma_offset, width);
+            continue;
+        }
+
+        for (x = 0; x < width; x += chunk)
+        {
+            int n = width - x < chunk ? width - x : chunk;
+            const uint8_t *cs = s + (size_t)x * 2;
+
+            if (src_mem == FRAME_MEM_WC)
+            {
+                wcmem_copy_from (in, cs, (size_t)n * 2);
+                cs = in;
+            }
+            if (dst_mem == FRAME_MEM_WC)
+            {
+                extract_luma2 (out, cs, luma_offset, n);
+                wcmem_copy_to (d + x, out, n);
+            }
+            else
+                extract_luma2 (d + x, cs, luma_offset, n);
+        }
+    }
+
+    TRACE_END ("wcmem_luma_rows");
+}
@@ -0,0 +1,33 @@
+#ifndef _UTIL_WCMEM_H_
+#define _UTIL_WCMEM_H_
+
+#include <stddef.h>
+
+/*
+ *  Copies for memory the CPU maps write-combined or uncached, such as
+ *  DRM dumb buffers.
+ *
+ *  Writes to WC memory are only fast when whole cache lines leave the
+ *  write-combining buffer at once: wcmem_copy_to() writes 64 byte lines
+ *  with streaming stores and never reads the destination.
+ *
+ *  Reads from WC/UC memory bypass the cache, each load a bus round trip:
+ *  wcmem_copy_from() pulls 4KB at a time with non-temporal loads
+ *  (MOVNTDQA) into a cached bounce buffer and copies on from there.
+ *
+ *  wcmem_copy_rows() picks the variant from the FRAME_MEM_xxx of each side.
+ *  wcmem_luma_rows() converts packed YUV to GREY the same way, a chunk of
+ *  a row at a time through cached buffers on the WC side(s).
+ */
+#define FRAME_MEM_CACHED    0
+#define FRAME_MEM_WC        1       /* write-combined; reads are uncached */
+
+void wcmem_copy_to   (void *dst, const void *src, size_t len);
+void wcmem_copy_from (void *dst, const void *src, size_t len);
+void wcmem_copy_rows (void *dst, int dst_stride, int dst_mem,
+                      const void *src, int src_stride, int src_mem, size_t row_bytes, int rows);
+void wcmem_luma_rows (void *dst, int dst_stride, int dst_mem,
+                      const void *src, int src_stride, int src_mem, int width, int luma_step, int luma_offset,
+                      int rows);
+
+#endif /* _UTIL_WCMEM_H_ */
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "util_debug.h"
+#include "util_pipeline.h"
+#include "util_trace.h"
+#include "util_time.h"
+#include "util_metrics.h"
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    pipeline_t *pipe;
+    char *config = NULL;
+    char *trace_fname = NULL;
+    char *metrics_addr = NULL;
+    int duration_sec = 0;
+    int report_sec = 5;
+    uint64_t start_ns, report_ns;
+
+    const struct option long_options[] = {
+        {"config",   required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'D'},
+        {"report",   required_argument, NULL, 'r'},
+        {"metrics",  required_argument, NULL, 'm'},
+        {"trace",    required_argument, NULL, 't'},
+        {0, 0, 0, 0},
+    };
+
+    int c, option_index;
+    while ((c = getopt_long (argc, argv, "c:D:r:m:t:",
+                             long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+        case 'c': config       = optarg; break;
+        case 'D': duration_sec = atoi (optarg); break;
+        case 'r': report_sec   = atoi (optarg); break;
+        case 'm': metrics_addr = optarg; break;
+        case 't': trace_fname  = optarg; break;
+        case '?':
+            return -1;
+        }
+    }
+    if (config == NULL && optind < argc)
+        config = argv[optind];
+    if (config == NULL)
+    {
+        fprintf (stderr, "usage: %s [--duration sec] [--report sec] [--metrics addr] [--trace file] "
+                         "<pipeline.conf>\n", argv[0]);
+        return -1;
+    }
+
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    if (trace_fname)
+        trace_enable (1);
+
+    pipe = pipeline_load (config);
+    DBG_ASSERT (pipe, "failed to build the pipeline from %s\n", config);
+
+    if (metrics_addr)
+        metrics_start_server (metrics_addr);
+
+    pipeline_start (pipe);
+    start_ns  = get_monotonic_ns ();
+    report_ns = start_ns;
+
+    /* the stages run on their own; stop the sources when told to, then
+     * let everything already captured drain to the sinks */
+    while (!pipeline_done (pipe))
+    {
+        uint64_t now;
+
+        usleep (100 * 1000);
+        now = get_monotonic_ns ();
+
+        if (s_quit || (duration_sec > 0 && now - start_ns >= duration_sec * 1000000000ULL))
+            pipeline_stop (pipe);
+
+        if (report_sec > 0 && now - report_ns >= report_sec * 1000000000ULL)
+        {
+            pipeline_report (pipe, stderr);
+            report_ns = now;
+        }
+    }
+
+    int ret = pipeline_wait (pipe);
+    pipeline_report (pipe, stderr);
+    pipeline_destroy (pipe);
+
+    if (trace_fname)
+    {
+        trace_enable (0);
+        trace_export_json (trace_fname);
+        fprintf (stderr, "trace saved: %s\n", trace_fname);
+    }
+
+    return ret;
+}
@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include "util_debug.h"
+#include "util_replay.h"
+#include "util_drm.h"
+#include "util_trace.h"
+#include "util_time.h"
+#include "util_format.h"
+#include "util_stats.h"
+#include "util_motion.h"
+#include "util_wcmem.h"
+#include "util_dmabuf.h"
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  DRM output
+ * ------------------------------------------------------------------------ */
+typedef struct _display_t
+{
+    drm_obj_t   dobj;
+    drm_fb_t    fb[2];
+    int         cur;
+    const format_info_t *fi;
+} display_t;
+
+static int
+display_open (display_t *disp, const format_info_t *fi, int w, int h)
+{
+    int i;
+
+    if (fi == NULL || fi->drm == 0)
+    {
+        fprintf (stderr, "ERR: %s(%d): format can't be displayed\n", __FILE__, __LINE__);
+        return -1;
+    }
+    disp->fi = fi;
+
+    if (drm_initialize (&disp->dobj) < 0)
+        return -1;
+
+    for (i = 0; i < 2; i ++)
+    {
+        if (drm_alloc_fb (disp->dobj.fd, w, h, fi->drm, &disp->fb[i]) < 0 ||
+            drm_add_fb (disp->dobj.fd, &disp->fb[i]) < 0)
+            return -1;
+    }
+
+    drm_atomic_set_mode (&disp->dobj, 0, 1);
+    return 0;
+}
+
+/* copy plane by plane into the back buffer, then flip to it */
+static int
+display_frame (display_t *disp, const uint8_t *img, int src_stride)
+{
+    drm_fb_t *fb = &disp->fb[disp->cur];
+    const format_info_t *fi = disp->fi;
+    unsigned int planes = (1u << fi->planes) - 1;
+    int p;
+
+    drm_fb_begin_cpu_access (fb, planes, DMABUF_CPU_WRITE);
+    for (p = 0; p < fi->planes; p ++)
+    {
+        int rows   = p == 0 ? fb->height : fb->height / fi->vsub;
+        int len    = p == 0 ? fb->width * fi->cpp : fb->width * fi->cpp * 2 / fi->hsub;
+        int stride = src_stride;
+
+        /* I420: two half width chroma planes */
+        if (fi->planes == 3 && p > 0)
+        {
+            len    = fb->width / fi->hsub;
+            stride = src_stride / fi->hsub;
+        }
+
+        /* dumb buffers are write-combined */
+        wcmem_copy_rows ((uint8_t *)fb->map_buf + fb->offset[p], fb->pitch[p], FRAME_MEM_WC,
+                         img, stride, FRAME_MEM_CACHED, len, rows);
+        img += (size_t)rows * stride;
+    }
+    drm_fb_end_cpu_access (fb, planes, DMABUF_CPU_WRITE);
+
+    drm_atomic_set_plane (&disp->dobj, fb, 0, 0, 0, 0);
+    disp->cur ^= 1;
+    return drm_atomic_flush (&disp->dobj, 1);
+}
+
+static void
+display_close (display_t *disp)
+{
+    int i;
+
+    for (i = 0; i < 2; i ++)
+    {
+        drm_remove_fb (disp->dobj.fd, &disp->fb[i]);
+        drm_free_fb (disp->dobj.fd, &disp->fb[i]);
+    }
+    drm_terminate (&disp->dobj);
+}
+
+
+/* ------------------------------------------------------------------------ *
+ *  pacing
+ * ------------------------------------------------------------------------ */
+static void
+sleep_until_ns (uint64_t t_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = t_ns / 1000000000ULL;
+    ts.tv_nsec = t_ns % 1000000000ULL;
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 && !s_quit)
+        ;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    replay_t *rp;
+    char *input = NULL;
+    char *trace_fname = NULL;
+    float speed = 1.0f;
+    int loops = 1;
+    int do_display = 0;
+    int do_stats = 0;
+    float motion_level = 0;
+    size_t prefetch = 0;
+    display_t disp = {0};
+    const format_info_t *fi;
+    stats_ctx_t *stats_ctx = NULL;
+    frame_stats_t stats;
+    motion_detector_t *motion = NULL;
+    int w, h, stride;
+    uint64_t t_start, t_report;
+    uint64_t base_wall = 0, base_ts = 0;
+    uint64_t report_bytes = 0, report_frames = 0;
+    double min_mbps = 0;
+    int motion_frames = 0;
+    int loop;
+
+    const struct option long_options[] = {
+        {"input",    required_argument, NULL, 'i'},
+        {"speed",    required_argument, NULL, 's'},
+        {"fast",     no_argument,       NULL, 'f'},
+        {"loop",     required_argument, NULL, 'l'},
+        {"display",  no_argument,       NULL, 'x'},
+        {"stats",    no_argument,       NULL, 'A'},
+        {"motion",   required_argument, NULL, 'M'},
+        {"prefetch", required_argument, NULL, 'P'},
+        {"trace",    required_argument, NULL, 't'},
+        {0, 0, 0, 0},
+    };
+
+    int c, option_index;
+    while ((c = getopt_long (argc, argv, "i:s:fl:xAM:P:t:",
+                             long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+        case 'i': input        = optarg; break;
+        case 's': speed        = atof (optarg); break;
+        case 'f': speed        = 0; break;
+        case 'l': loops        = atoi (optarg); break;
+        case 'x': do_display   = 1; break;
+        case 'A': do_stats     = 1; break;
+        case 'M': motion_level = atof (optarg); break;
+        case 'P': prefetch     = strtoull (optarg, NULL, 10) << 20; break;
+        case 't': trace_fname  = optarg; break;
+        case '?':
+            return -1;
+        }
+    }
+    if (input == NULL && optind < argc)
+        input = argv[optind];
+    if (input == NULL)
+    {
+        fprintf (stderr, "usage: %s [--speed X | --fast] [--loop N] [--display] [--stats] "
+                         "[--motion LEVEL] [--prefetch MB] <prefix | file.v4r>\n", argv[0]);
+        return -1;
+    }
+
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    if (trace_fname)
+        trace_enable (1);
+
+    rp = replay_open (input, prefetch);
+    DBG_ASSERT (rp, "failed to open %s\n", input);
+
+    w      = rp->hdr.width;
+    h      = rp->hdr.height;
+    stride = rp->hdr.bytesperline;
+    fi     = format_from_v4l2 (rp->hdr.fourcc);
+
+    fprintf (stderr, "-------------------------------\n");
+    fprintf (stderr, " recording : %s (%d segments)\n", input, rp->seg_num);
+    fprintf (stderr, " WH(%d, %d), 4CC(%.4s), bpl(%d)\n", w, h, (char *)&rp->hdr.fourcc, stride);
+    fprintf (stderr, " speed     : %s\n", speed > 0 ? "timestamps" : "as fast as possible");
+    fprintf (stderr, "-------------------------------\n");
+
+    /* the same stages as live capture; coded recordings only get read */
+    int raw = fi && fi->bpp > 0;
+    if (do_display && raw)
+        DBG_ASSERT (display_open (&disp, fi, w, h) == 0, "failed to open display\n");
+    if (do_stats && raw)
+    {
+        stats_ctx = frame_stats_create (rp->hdr.fourcc, w, h, stride, NULL);
+        DBG_ASSERT (stats_ctx, "failed to create stats context\n");
+        rp->frame.stats = &stats;
+    }
+    if (motion_level > 0 && raw)
+    {
+        motion = motion_create (rp->hdr.fourcc, w, h, stride, 8);
+        DBG_ASSERT (motion, "failed to create motion detector\n");
+    }
+
+    t_start  = get_monotonic_ns ();
+    t_report = t_start;
+
+    for (loop = 0; loop < loops && !s_quit; loop ++)
+    {
+        capture_frame_t *frame;
+
+        if (loop > 0 && replay_rewind (rp) < 0)
+            break;
+        base_wall = 0;
+
+        while (!s_quit && (frame = replay_acquire_frame (rp)) != NULL)
+        {
+            uint64_t ts_ns = timeval_to_ns (frame->v4l_buf.timestamp);
+
+            /* original pace, scaled */
+            if (speed > 0)
+            {
+                if (base_wall == 0)
+                {
+                    base_wall = get_monotonic_ns ();
+                    base_ts   = ts_ns;
+                }
+                else if (ts_ns > base_ts)
+                    sleep_until_ns (base_wall + (uint64_t)((ts_ns - base_ts) / speed));
+            }
+
+            if (!rp->coded)
+            {
+                if (stats_ctx)
+                    frame_stats_compute (stats_ctx, frame->vaddr, frame->stats);
+                if (motion && motion_update (motion, frame->vaddr) >= motion_level * MOTION_SCORE_ONE)
+                    motion_frames ++;
+                if (disp.fi)
+                    display_frame (&disp, frame->vaddr, stride);
+            }
+
+            uint64_t now = get_monotonic_ns ();
+            if (now - t_report >= 1000000000ULL)
+            {
+                double sec  = (now - t_report) / 1e9;
+                double mbps = (rp->bytes - report_bytes) / sec / 1e6;
+
+                if (min_mbps == 0 || mbps < min_mbps)
+                    min_mbps = mbps;
+                fprintf (stderr, "seq %u: %.1f fps, %.1f MB/s", frame->v4l_buf.sequence,
+                         (rp->frames - report_frames) / sec, mbps);
+                if (stats_ctx)
+                    fprintf (stderr, ", mean %.1f sharpness %.1f", stats.mean, stats.sharpness);
+                fprintf (stderr, "\n");
+
+                report_bytes  = rp->bytes;
+                report_frames = rp->frames;
+                t_report      = now;
+            }
+        }
+    }
+
+    double sec = (get_monotonic_ns () - t_start) / 1e9;
+    fprintf (stderr, "played %llu frames, %llu bytes in %.2f s: %.1f fps, %.1f MB/s",
+             (unsigned long long)rp->frames, (unsigned long long)rp->bytes, sec,
+             rp->frames / sec, rp->bytes / sec / 1e6);
+    if (min_mbps > 0)
+        fprintf (stderr, " (slowest second %.1f MB/s)", min_mbps);
+    fprintf (stderr, "\n");
+    if (motion)
+        fprintf (stderr, "motion in %d frames\n", motion_frames);
+
+    if (motion)
+        motion_destroy (motion);
+    if (stats_ctx)
+        frame_stats_destroy (stats_ctx);
+    if (disp.fi)
+        display_close (&disp);
+    replay_close (rp);
+
+    if (trace_fname)
+    {
+        trace_enable (0);
+        trace_export_json (trace_fname);
+        fprintf (stderr, "trace saved: %s\n", trace_fname);
+    }
+
+    return 0;
+}
@@ -5,6 +5,8 @@
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
+#include "util_format.h"
+#include "util_ctrl.h"
 
 #define test_cap(caps, bit)  do {       \
     if (caps & bit)                     \
@@ -129,39 +131,12 @@ dump_resolution (int v4l_fd, unsigned int format)
     return 0;
 }
 
-static char *
+static const char *
 get_format_name (unsigned int format)
 {
-    switch (format){
-    /* RGB */
-    case V4L2_PIX_FMT_RGB332:  return "V4L2_PIX_FMT_RGB332";
-    case V4L2_PIX_FMT_RGB444:  return "V4L2_PIX_FMT_RGB444";
-    case V4L2_PIX_FMT_RGB555:  return "V4L2_PIX_FMT_RGB555";
-    case V4L2_PIX_FMT_RGB565:  return "V4L2_PIX_FMT_RGB565";
-    case V4L2_PIX_FMT_RGB555X: return "V4L2_PIX_FMT_RGB555X";
-    case V4L2_PIX_FMT_RGB565X: return "V4L2_PIX_FMT_RGB565X";
-    case V4L2_PIX_FMT_BGR666:  return "V4L2_PIX_FMT_BGR666";
-    case V4L2_PIX_FMT_BGR24:   return "V4L2_PIX_FMT_BGR24";
-    case V4L2_PIX_FMT_RGB24:   return "V4L2_PIX_FMT_RGB24";
-    case V4L2_PIX_FMT_BGR32:   return "V4L2_PIX_FMT_BGR32";
-    case V4L2_PIX_FMT_RGB32:   return "V4L2_PIX_FMT_RGB32";
+    const format_info_t *fi = format_from_v4l2 (format);
 
-    /* Grey */
-    case V4L2_PIX_FMT_GREY:    return "V4L2_PIX_FMT_GREY";
-    case V4L2_PIX_FMT_Y4:      return "V4L2_PIX_FMT_Y4";
-    case V4L2_PIX_FMT_Y6:      return "V4L2_PIX_FMT_Y6";
-    case V4L2_PIX_FMT_Y10:     return "V4L2_PIX_FMT_Y10";
-    case V4L2_PIX_FMT_Y12:     return "V4L2_PIX_FMT_Y12";
-    case V4L2_PIX_FMT_Y16:     return "V4L2_PIX_FMT_Y16";
-
-    case V4L2_PIX_FMT_YUYV:    return "V4L2_PIX_FMT_YUYV";
-    case V4L2_PIX_FMT_UYVY:    return "V4L2_PIX_FMT_UYVY";
-    case V4L2_PIX_FMT_H264:    return "V4L2_PIX_FMT_H264";
-    case V4L2_PIX_FMT_JPEG:    return "V4L2_PIX_FMT_JPEG";
-    case V4L2_PIX_FMT_MJPEG:   return "V4L2_PIX_FMT_MJPEG";
-
-    default: return "UNKNOWN";
-    }
+    return fi ? fi->name : "UNKNOWN";
 }
 
 static int
@@ -232,6 +207,8 @@ dump_v4l2_device (char *devname)
         dump_video_capture_format (fd);
     }
 
+    ctrl_dump (fd);
+
     close (fd);
     return 0;
 }
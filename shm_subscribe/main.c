@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <signal.h>
+#include "util_debug.h"
+#include "util_shm.h"
+#include "util_time.h"
+
+static volatile sig_atomic_t s_quit = 0;
+
+static void
+sigint_handler (int sig)
+{
+    s_quit = 1;
+}
+
+
+int
+main (int argc, char *argv[])
+{
+    shm_sub_t *sub;
+    char *sock_path = "/tmp/v4l2_shm.sock";
+    int latest = 0;
+    int dump   = 0;
+    int nframe = 0;
+    uint64_t lat_sum = 0, lat_max = 0;
+    uint64_t t_report;
+
+    const struct option long_options[] = {
+        {"socket", required_argument, NULL, 's'},
+        {"latest", no_argument,       NULL, 'l'},
+        {"dump",   no_argument,       NULL, 'D'},
+        {0, 0, 0, 0},
+    };
+
+    int c, option_index;
+    while ((c = getopt_long (argc, argv, "s:lD",
+                             long_options, &option_index)) != -1)
+    {
+        switch (c)
+        {
+        case 's': sock_path = optarg; break;
+        case 'l': latest = 1;         break;
+        case 'D': dump   = 1;         break;
+        case '?':
+            return -1;
+        }
+    }
+
+    signal (SIGINT,  sigint_handler);
+    signal (SIGTERM, sigint_handler);
+
+    sub = shm_sub_connect (sock_path);
+    DBG_ASSERT (sub, "failed to connect %s\n", sock_path);
+
+    fprintf (stderr, "-------------------------------\n");
+    fprintf (stderr, " publisher : %s\n", sock_path);
+    fprintf (stderr, " WH(%u, %u), 4CC(%.4s), bpl(%u), buffers(%d)\n",
+             sub->ctrl->width, sub->ctrl->height, (char *)&sub->ctrl->pixelformat,
+             sub->ctrl->bytesperline, sub->bufcount);
+    fprintf (stderr, "-------------------------------\n");
+
+    t_report = get_monotonic_ns ();
+    while (!s_quit)
+    {
+        shm_frame_t frame;
+
+        if (shm_sub_acquire (sub, &frame, latest, 1000) < 0)
+            continue;
+
+        uint64_t now = get_monotonic_ns ();
+        uint64_t lat = now - frame.publish_ns;
+        lat_sum += lat;
+        if (lat > lat_max)
+            lat_max = lat;
+        nframe ++;
+
+        if (dump)
+        {
+            char strFName[128];
+            snprintf (strFName, sizeof (strFName), "shm_%05u_%.4s_SIZE%ux%u.img", frame.sequence,
+                      (char *)&sub->ctrl->pixelformat, sub->ctrl->width, sub->ctrl->height);
+            FILE *fp = fopen (strFName, "wb");
+            DBG_ASSERT (fp, "fopen failed");
+            fwrite (frame.vaddr, 1, frame.bytesused, fp);
+            fclose (fp);
+        }
+
+        shm_sub_release (sub, &frame);
+
+        if (now - t_report >= 1000000000ULL)
+        {
+            fprintf (stderr, "%5.1f fps, notify latency avg %6.1f us, max %6.1f us, skipped %llu\n",
+                     nframe * 1e9 / (now - t_report), lat_sum / 1e3 / nframe, lat_max / 1e3,
+                     (unsigned long long)sub->skipped);
+            nframe  = 0;
+            lat_sum = 0;
+            lat_max = 0;
+            t_report = now;
+        }
+    }
+
+    shm_sub_close (sub);
+    return 0;
+}